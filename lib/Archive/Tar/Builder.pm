@@ -58,6 +58,101 @@ Create a new Archive::Tar::Builder object.  The following options are honored:
 Specifies the size of the read and write buffer maintained by
 Archive::Tar::Builder in multiples of 512 bytes.  Default value is 20.
 
+=item C<read_size>
+
+Specifies, in bytes, the size of a separate buffer used for reading file
+contents, independently of C<block_factor>.  Large values, such as several
+megabytes, greatly reduce the number of round trips made when reading from
+network filesystems, while output continues to be written in blocks of
+C<block_factor> records.  The value is rounded up to a multiple of 512 bytes.
+By default, file contents are read directly into the output buffer.
+
+=item C<read_threads>
+
+When set to a value greater than 1, files larger than C<read_chunk_size> are
+read by this many threads at once, each reading separate ranges of the file
+with pread(2).  The ranges are written to the archive strictly in order.  This
+is most useful on striped storage and parallel filesystems, where a single
+reader cannot saturate the available bandwidth.  Note that two chunks per
+thread are held in memory at any given time.
+
+=item C<read_chunk_size>
+
+Specifies, in bytes, the size of the ranges read by each thread when
+C<read_threads> is in effect.  Default value is 8 MiB.  The value is rounded up
+to a multiple of 512 bytes.
+
+=item C<compression>
+
+When set to one of C<gzip>, C<zstd> or C<lz4>, the archive stream is compressed
+in-process with the corresponding codec before being written to the file
+handle, sparing the expense of piping the stream through a separate compressor.
+Each codec is only available if the corresponding library was found at build
+time; Archive::Tar::Builder will die() if an unavailable or unknown codec is
+requested.  Calling C<finish()> ends the current compressed stream; any data
+archived afterwards begins a new gzip member or zstd or lz4 frame, which the
+usual decompressors treat as a continuation of the same stream.
+
+=item C<level>
+
+Specifies the compression level passed to the codec chosen with
+C<compression>.  The codec's own default is used if none is given.
+
+=item C<compression_threads>
+
+When set to a value greater than 1, the archive stream is cut into blocks of
+C<compression_block_size> bytes, which are compressed by this many threads at
+once, and written to the file handle in order.  Each block is compressed as an
+independent gzip member or zstd or lz4 frame, in the manner of pigz(1), so the
+output remains readable by the usual decompressors, at a slight cost in
+compression ratio.
+
+=item C<compression_block_size>
+
+Specifies, in bytes, the size of the blocks compressed by each thread when
+C<compression_threads> is in effect.  Default value is 1 MiB.
+
+=item C<compression_bypass>
+
+When set along with C<compression>, each file of 64 KiB or more is checked
+for contents which are already compressed, going by its file name extension,
+or failing that, by the entropy of its first 4 KiB.  Such files are stored
+within the compressed stream rather than compressed again, or with zstd,
+compressed at the fastest level.  This has no effect with lz4, which already
+passes incompressible data through quickly.
+
+=item C<frame_size>
+
+When set along with C<compression>, a new gzip member or zstd or lz4 frame is
+begun at the first member boundary after each C<frame_size> bytes of archive
+data, so that any member can be extracted by decompressing only the frame
+holding it.  Each frame may be described in an index written to the handle
+given to C<set_frame_index_handle()>.  With zstd, a seek table in the zstd
+seekable format is also appended to the stream upon C<finish()>.
+
+=item C<index_member>
+
+When set to a file name, an index of the members written, in the format
+described under C<set_index_handle()>, is collected in a temporary file as the
+archive is written, and appended to the archive as a final member of this name
+upon C<finish()>.  The index does not list itself.
+
+=item C<snapshot>
+
+When set to a file name, only members which are new, or whose device, inode
+number, size, type, modification or change time differ from those recorded in
+the snapshot file of that name by a previous run, are archived.  Members are
+matched by the names they are archived as.  Directories beneath unchanged
+directories are still descended into.  Upon C<finish()>, the snapshot file is
+replaced with one recording every member archived or found unchanged in this
+run; members which could not be archived are left out, so that they are tried
+again next time.  A missing snapshot file is taken to be empty, so that the
+first run archives everything.
+
+The snapshot is stored sorted by member name, in native byte order, and is
+searched in place once mapped into memory, so that runs over very large trees
+need not read it in full.
+
 =item C<quiet>
 
 When set, warnings encountered when reading individual files are not reported.
@@ -69,13 +164,63 @@ cause Archive::Tar::Builder to die() at the end of the stream.
 
 =item C<follow_symlinks>
 
-When set, symlinks encountered while archiving are followed.
+When set, symlinks encountered while archiving are followed.  Each directory
+is walked only once: symlinks leading to a directory already archived are
+archived as symlinks, and symlinks leading to a directory being walked at the
+time, which would otherwise be walked without end, raise a warning as well.
 
 =item C<preserve_hardlinks>
 
 When set, hardlinks encountered while archiving are preserved, and their
 respective file contents will not be duplicated in the output stream.
 
+=item C<sort_inodes>
+
+When set, each directory is read in full as it is reached and closed straight
+away, and its entries visited in order of inode number rather than in the order
+returned by the filesystem.  On filesystems such as ext4, whose directories
+return entries in hash order, this reads the inode table in order rather than
+at random.  Members are archived in the same order, and the names of the
+entries of each directory being walked are held in memory until visited.
+
+=item C<max_open_dirs>
+
+The most directories to hold open at once while walking the filesystem, which
+otherwise holds one open for each level of the path being walked.  Should a
+tree be deeper than this, the entries left to be read in the shallowest
+directories open are read into memory, and those directories closed, so that
+very deep trees do not run out of file descriptors.  Trees no deeper than this
+are walked as usual.  Unlimited by default.
+
+=item C<one_file_system>
+
+When set, the walk stays on the filesystem of each path given to
+C<archive_as()>.  Directories at which another filesystem is mounted, bind
+mounts included where the kernel reports them, are archived but not descended
+into, and other objects on another device, as may be reached by following
+symlinks, are passed over.
+
+=item C<skip_fstypes>
+
+An array reference of filesystem types, such as C<proc>, C<sysfs>, C<nfs> or
+C<fuse>, by the names given by mount(8).  Directories on filesystems of these
+types are archived but not descended into.  The type of each filesystem is
+looked up only the first time one of its objects is found.  On Linux, types
+sharing a magic number, such as C<tmpfs> and C<devtmpfs>, cannot be told apart,
+and types not known to this module cause new() to die().
+
+=item C<dedupe>
+
+When set, each file and directory is archived only once, however many times
+it is reached, across all the paths given to each call to C<archive_as()> and
+any made before it on the same object.  Paths overlapping those archived
+already, such as C</home/bob> after C</home>, are passed over, as are files
+reached again through other hardlinks.  With C<preserve_hardlinks>, regular
+files reached again are archived as hardlinks to the member first archived for
+them instead; this requires every regular file archived to be remembered in
+the hardlink cache, not only those with more than one link.  Members planned
+by C<plan()> count as archived; those counted by C<estimate_size()> do not.
+
 =item C<gnu_extensions>
 
 When set, support for arbitrarily long pathnames is enabled using the GNU
@@ -140,6 +285,86 @@ file for reading.
 
 =back
 
+=head2 EXCLUSION TAGS
+
+Directories may be marked as not worth archiving by placing a tag file within
+them, as with GNU tar.  Each directory is checked for tags when it is reached
+while walking the filesystem, before any of its entries are read, so that the
+contents of tagged directories cost nothing to pass over.  The tagged directory
+itself is always archived.
+
+=over
+
+=item C<$archive-E<gt>exclude_tag($name)>
+
+Exclude the contents of any directory holding a file named C<$name>, save for
+the tag file itself.  Will die() upon error.
+
+=item C<$archive-E<gt>exclude_tag_under($name)>
+
+Exclude the contents of any directory holding a file named C<$name>, the tag
+file included.  Will die() upon error.
+
+=item C<$archive-E<gt>exclude_caches()>
+
+Exclude the contents of any directory holding a C<CACHEDIR.TAG> file which
+begins with the signature given by the Cache Directory Tagging Specification,
+save for the tag file itself.  Will die() upon error.
+
+=back
+
+=head2 FILE ATTRIBUTE FILTERS
+
+=over
+
+=item C<$archive-E<gt>set_filter(%predicates)>
+
+Exclude items found while walking the filesystem based on their inode
+attributes rather than their paths.  Predicates are evaluated against the
+results of C<stat()> before a file is opened, so filtered items cost only the
+C<stat()> call.  Calling this method again replaces any previous filter.  The
+following predicates are supported:
+
+=over
+
+=item C<min_size>, C<max_size>
+
+Only archive regular files whose size in bytes falls within this range,
+inclusive.
+
+=item C<mtime_after>, C<mtime_before>
+
+Only archive items whose modification time, in seconds since the epoch, is at
+or after C<mtime_after> and before C<mtime_before>.  Either end of the window
+may be omitted.
+
+=item C<ctime_after>, C<ctime_before>
+
+As above, for the inode change time.
+
+=item C<types>
+
+An array reference of the item types to archive, any of C<file>, C<dir>,
+C<symlink>, C<char>, C<block>, C<fifo> and C<socket>.
+
+=item C<uids>, C<exclude_uids>, C<gids>, C<exclude_gids>
+
+An array reference of numeric user or group IDs whose items are to be
+archived, or excluded, respectively.
+
+=item C<nodump>
+
+When true, skip items, and the contents of directories, with the C<nodump>
+attribute set, as per C<chattr +d>.
+
+=back
+
+Size and time predicates never apply to directories.  A directory excluded by
+its type or owner is not archived itself, but its contents are still
+considered; only C<nodump> prunes a directory's contents.
+
+=back
+
 =head2 TESTING EXCLUSIONS
 
 =over
@@ -160,6 +385,67 @@ the given path is to be excluded from the archive upon writing.
 Set the output file handle to C<$handle>.  This method must be called once prior
 to archiving file data.
 
+=item C<$archive-E<gt>open_for_append($handle)>
+
+Use C<$handle>, an existing uncompressed archive file opened for both reading
+and writing, as the output file handle, such that members archived hereafter
+are added after those already present.  The end of the existing archive is
+located by reading member headers only, seeking over their contents, and the
+file is truncated there, so that the cost of appending is proportional to the
+data added rather than to the size of the archive.  Offsets given by
+C<set_index_handle()> continue from those of the existing members.  die()s if
+C<compression> is in effect, or if C<$handle> is not a regular file.
+
+=item C<$archive-E<gt>set_deletions_handle($handle)>
+
+When C<snapshot> is in effect, write the names of the members recorded in the
+previous snapshot but not seen in this run to C<$handle>, one per line, upon
+C<finish()>.
+
+=item C<$archive-E<gt>set_index_handle($handle)>
+
+Write one line of JSON to C<$handle> for each member written, of the form:
+
+    {"name":"foo/bar","offset":1536,"data_offset":2048,"size":4711,
+     "mtime":1571234567,"type":"0","dev":2049,"ino":1234567}
+
+Where C<offset> is the position of the first header block of the member,
+including any GNU or PAX extended headers, and C<data_offset> the position of
+the member's contents, both counted in bytes from the start of the
+uncompressed tar stream.  C<type> is the tar header type flag.  Lines are
+buffered, and written out in full upon C<finish()>.
+
+=item C<$archive-E<gt>reuse_from($handle, $index_handle)>
+
+Copy regular files which have not changed since the previous archive open on
+C<$handle> was written straight from it, headers and all, rather than reading
+them from the filesystem again.  C<$index_handle> is read in full for the
+member index written alongside the previous archive by C<set_index_handle()>.
+A file is taken to be unchanged when its size, modification time, device and
+inode number match those recorded in the index, and the header that would be
+written for it matches that found in the previous archive exactly, so that
+changes of ownership or permissions are still picked up.
+
+The previous archive must be uncompressed, and C<$handle> must remain open
+until C<finish()> is called.  Where the new archive is uncompressed as well,
+members at least as large as the buffer are copied with
+C<copy_file_range()>, so that filesystems supporting reflinks may share their
+extents between both archives.
+
+=item C<$archive-E<gt>set_frame_index_handle($handle)>
+
+When C<frame_size> is in effect, write one line of JSON to C<$handle> as each
+compressed frame is completed, of the form:
+
+    {"frame":0,"offset":0,"size":4711,"raw_offset":0,"raw_size":1049600,
+     "first_member":"foo/bar","members":12}
+
+Where C<offset> and C<size> give the location of the frame within the
+compressed output, C<raw_offset> and C<raw_size> its location within the
+uncompressed tar stream, C<first_member> the name of the first member starting
+within the frame, and C<members> the number of members starting within it.
+Offsets are counted from the first byte written by the archiver.
+
 =item C<$archive-E<gt>archive_as(%files)>
 
 Write a tar stream of ustar format, with GNU tar extensions for supporting long
@@ -172,6 +458,96 @@ Files will be included or excluded based on any possible previous usage of the
 filename inclusion and exclusion calls.
 Returns the total number of bytes written.
 
+=item C<$archive-E<gt>estimate_size(%files)>
+
+Walk the files given in the same manner as C<$archive-E<gt>archive_as()>,
+honoring exclusions, filters, snapshots, hardlink detection and long file name
+extensions, but without reading any file contents or writing anything.
+Returns a hash reference containing the following:
+
+=over
+
+=item C<size>
+
+The number of bytes by which the output would grow should the same files be
+archived and the archive finished, including the padding of the final record.
+For a new archive, this is its exact size.  This does not account for any
+compression, nor for the member index set with C<index_member>.
+
+=item C<files>
+
+The number of members other than directories which would be written.
+
+=item C<dirs>
+
+The number of directory members which would be written.
+
+=back
+
+=item C<$archive-E<gt>archive_journal($journal, %files)>
+
+Like C<archive_as()>, but rather than walking each path in C<%files> in full,
+visit only those paths beneath them listed as changed in the journal file
+C<$journal>, as recorded by L<Archive::Tar::Builder::Journal>.  Paths changed
+in place are archived alone, while directories created or moved into place are
+archived along with their contents.  When C<snapshot> is in effect, members
+not visited are carried over to the next snapshot, and members recorded as
+deleted are removed from it and listed by C<set_deletions_handle()>, such that
+the result is the same as that of a full walk.
+
+Should the journal not exist, or record that events were lost, every path is
+walked as with C<archive_as()>.  The changes read are removed from the journal
+upon C<finish()>, unless any member could not be archived, leaving those
+recorded since in place.  Returns the total number of bytes written.
+
+=item C<$archive-E<gt>plan(%files)>
+
+Walk each path in C<%files> as C<archive_as()> would, honoring inclusions,
+exclusions and filters, but rather than archiving each file found, record its
+path, member name and status in a new L<Archive::Tar::Builder::Manifest>,
+which is returned.  Nothing is read or written.
+
+=item C<$archive-E<gt>archive_manifest($manifest, %opts)>
+
+Archive each member of the L<Archive::Tar::Builder::Manifest> given, in the
+order held therein, without walking the filesystem again.  The contents of
+each regular file are read as they are at the time, while other members are
+archived as they were when planned.  Returns the total number of bytes written.
+The following options are supported:
+
+=over
+
+=item C<prefetch>
+
+Ask the kernel to start reading the contents of this many of the regular files
+coming up next, up to 1MB of each, while earlier ones are being archived.
+
+=item C<progress>
+
+A code reference called after each member is archived with the number of
+members, and the number of bytes of regular file contents, archived thus far,
+to be compared against C<$manifest-E<gt>count()> and
+C<$manifest-E<gt>total_size()>.
+
+=back
+
+=item C<$archive-E<gt>archive_handle($handle, %renames)>
+
+Read the archive from C<$handle>, and add each of its members not excluded to
+the archive being written, returning the total number of bytes written to the
+archive thus far.  Member names are matched against inclusions and exclusions
+as they appear in the archive read.  The optional C<%renames> give pairs of
+member names as read and the names they are to be written as, each applying to
+the member of that name as well as to any members beneath it; the first
+matching pair is used.  The targets of hardlinks are renamed in the same way,
+while those of symlinks are left as they are.
+
+Member headers are written anew, but member contents are passed through as
+they are, copied directly from one file descriptor to the other where no
+compression is in effect.  The end-of-archive marker of the archive read is not
+copied, so that several archives may be merged into one by calling this method
+once for each.
+
 =item C<$archive-E<gt>archive(@files)>
 
 Similar to above, however no filename substitution is performed when archiving
@@ -185,12 +561,14 @@ members.
 
 =item C<$archive-E<gt>flush()>
 
-Flush the output stream.
+Flush the output stream.  When compression is in use, any data held by the
+compressor is written out as well, without ending the compressed stream.
 
 =item C<$archive-E<gt>finish()>
 
-Flush the output stream, and die() if any errors were recorded, and the option
-C<ignore_errors> is not enabled.  Finally, reset any other error data present.
+Flush the output stream, ending the compressed stream if compression is in
+use, and die() if any errors were recorded, and the option C<ignore_errors> is
+not enabled.  Finally, reset any other error data present.
 
 =back
 
@@ -0,0 +1,102 @@
+package Archive::Tar::Builder::Journal;
+
+# Copyright (c) 2019, cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the same
+# terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use Archive::Tar::Builder ();
+
+1;
+
+__END__
+
+=head1 NAME
+
+Archive::Tar::Builder::Journal - Record filesystem changes between archive runs
+
+=head1 SYNOPSIS
+
+    #
+    # In a long running process:
+    #
+    my $journal = Archive::Tar::Builder::Journal->new('/var/lib/backup/journal');
+    $journal->watch('/home');
+
+    $journal->record(1000) while 1;
+
+    #
+    # Then, when archiving:
+    #
+    my $builder = Archive::Tar::Builder->new( 'snapshot' => '/var/lib/backup/snapshot' );
+    $builder->set_handle($fh);
+    $builder->archive_journal( '/var/lib/backup/journal', '/home' => 'home' );
+    $builder->finish;
+
+=head1 DESCRIPTION
+
+Archive::Tar::Builder::Journal watches entire filesystems for changes with
+fanotify(7), and appends the paths changed to a journal file, so that
+L<Archive::Tar::Builder/archive_journal> need only visit those paths, rather
+than walk every directory in search of them.  Paths which were created,
+modified, had their attributes changed, were deleted, or moved, are recorded,
+as are the directories holding them.
+
+Watching a filesystem requires the C<CAP_SYS_ADMIN> capability, and Linux 5.9
+or later.  Should the kernel drop events, the fact is recorded in the journal,
+and the next archive run walks every path as usual.
+
+=head1 CONSTRUCTOR
+
+=over
+
+=item C<Archive::Tar::Builder::Journal-E<gt>new($file)>
+
+Create a new Archive::Tar::Builder::Journal object, appending to the journal
+file C<$file>, which is created if need be.  die() if fanotify is not available.
+
+=back
+
+=head1 RECORDING CHANGES
+
+=over
+
+=item C<$journal-E<gt>watch($path)>
+
+Record changes to paths beneath the directory C<$path>.  The entire filesystem
+holding C<$path> is watched, but changes elsewhere on it are passed over.
+
+=item C<$journal-E<gt>record($timeout)>
+
+Wait up to C<$timeout> milliseconds for changes, or indefinitely when
+C<$timeout> is omitted, and append those found to the journal, returning the
+number of changes recorded.  The journal file is locked with flock(2) while
+being written to, so that it may be safely consumed by an archive run at any
+time.
+
+=back
+
+=head1 JOURNAL FORMAT
+
+Each line of the journal holds a JSON object of the form:
+
+    {"type":"M","path":"/home/foo/bar"}
+
+Where C<type> is C<M> for a path changed in place, C<T> for a directory
+created or moved into place, whose contents must be walked in full, or C<D>
+for a path deleted or moved away.  A line of type C<O>, without a path,
+records that events were lost.
+
+=head1 COPYRIGHT
+
+Copyright (c) 2019, cPanel, L.L.C.
+All rights reserved.
+http://cpanel.net/
+
+This is free software; you can redistribute it and/or modify it under the same
+terms as Perl itself.  See L<perlartistic> for further details.
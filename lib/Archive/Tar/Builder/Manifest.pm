@@ -0,0 +1,111 @@
+package Archive::Tar::Builder::Manifest;
+
+# Copyright (c) 2019, cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the same
+# terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use Archive::Tar::Builder ();
+
+1;
+
+__END__
+
+=head1 NAME
+
+Archive::Tar::Builder::Manifest - The files to be archived, planned ahead
+
+=head1 SYNOPSIS
+
+    my $builder  = Archive::Tar::Builder->new;
+    my $manifest = $builder->plan( '/home' => 'home' );
+
+    printf "%d members, %d bytes\n", $manifest->count, $manifest->total_size;
+
+    $manifest->sort('inode');
+    $manifest->save('/var/lib/backup/manifest');
+
+    $builder->set_handle($fh);
+    $builder->archive_manifest(
+        $manifest,
+        'prefetch' => 16,
+        'progress' => sub {
+            my ( $members, $bytes ) = @_;
+
+            printf "%.1f%%\n", 100 * $bytes / ( $manifest->total_size || 1 );
+        }
+    );
+    $builder->finish;
+
+=head1 DESCRIPTION
+
+Archive::Tar::Builder::Manifest holds the members found by
+L<Archive::Tar::Builder/plan>, to be archived by
+L<Archive::Tar::Builder/archive_manifest>.  Splitting an archive run in two in
+this manner allows the caller to know the full extent of the work ahead before
+any of it is done, to change the order in which members are archived, and to
+repeat a run without walking the filesystem again.
+
+The path, member name, and status of each member are held in parallel arrays,
+and all paths and member names in a single block of memory, so that a manifest
+of millions of members remains compact.
+
+=head1 CONSTRUCTOR
+
+=over
+
+=item C<Archive::Tar::Builder::Manifest-E<gt>load($file)>
+
+Load a manifest previously saved to C<$file>.  die() if the file cannot be
+read, or is not a manifest.
+
+=back
+
+=head1 METHODS
+
+=over
+
+=item C<$manifest-E<gt>count()>
+
+Return the number of members in the manifest.
+
+=item C<$manifest-E<gt>total_size()>
+
+Return the total size of the contents of all regular files in the manifest.
+
+=item C<$manifest-E<gt>sort($order)>
+
+Change the order in which members are to be archived to one of C<walk>, the
+order in which they were found, C<name>, by member name, C<inode>, by device
+and inode number, which on many filesystems approximates the order in which
+file contents are laid out on disk, or C<physical>, by the location on disk of
+the start of the contents of each regular file.
+
+The C<physical> order is found with the C<FS_IOC_FIEMAP> ioctl(2) on Linux,
+opening each regular file once beforehand.  Members whose location cannot be
+known, such as directories, empty files, and files on filesystems lacking
+support, come first, by inode number.  It benefits rotational disks, where
+reading contents in order of location saves a seek between most files, at the
+expense of the archive no longer being in the order of any walk.
+
+=item C<$manifest-E<gt>save($file)>
+
+Save the manifest, including its current order, to C<$file>, which is replaced
+atomically.  Manifest files are stored in native byte order, and are not
+portable between architectures.
+
+=back
+
+=head1 COPYRIGHT
+
+Copyright (c) 2019, cPanel, L.L.C.
+All rights reserved.
+http://cpanel.net/
+
+This is free software; you can redistribute it and/or modify it under the same
+terms as Perl itself.  See L<perlartistic> for further details.
@@ -0,0 +1,150 @@
+package Archive::Tar::Builder::Reader;
+
+# Copyright (c) 2019, cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the same
+# terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use Archive::Tar::Builder ();
+
+1;
+
+__END__
+
+=head1 NAME
+
+Archive::Tar::Builder::Reader - List and extract tarball data from a file handle
+
+=head1 DESCRIPTION
+
+Archive::Tar::Builder::Reader reads ustar, GNU and POSIX pax archives, such as
+those written by Archive::Tar::Builder, from a file handle, and can either list
+their members or extract them beneath a destination directory.  Member data is
+copied into place with C<copy_file_range()> or C<splice()> where possible,
+avoiding a trip through userspace.
+
+Extraction never writes outside of the destination directory: leading slashes
+are stripped from member names, members whose names contain C<..> are refused,
+and symbolic and hard links are only created once all other members have been
+written, so that a link in the archive can not be used to redirect a later
+member elsewhere.
+
+=head1 CONSTRUCTOR
+
+=over
+
+=item C<Archive::Tar::Builder::Reader-E<gt>new(%opts)>
+
+Create a new Archive::Tar::Builder::Reader object.  The following options are
+honored:
+
+=over
+
+=item C<block_factor>
+
+Specifies the size of the read buffer maintained by
+Archive::Tar::Builder::Reader in multiples of 512 bytes.  Default value is 20.
+
+=item C<threads>
+
+When greater than 1, C<extract()> creates and writes members using this many
+threads, while the calling thread reads the archive.  Members of the same name
+are always extracted in archive order; directory permissions and timestamps,
+as well as all links, are seen to only once every other member has been
+written.  Regular files larger than 1 MiB are written by the calling thread.
+Default value is 1.
+
+=item C<quiet>
+
+When set, warnings encountered while extracting members will not be printed to
+standard error.
+
+=item C<ignore_errors>
+
+When set, non-fatal errors encountered while extracting members will not cause
+C<extract()> to die().
+
+=item C<same_owner>
+
+Restore the ownership of extracted members as recorded in the archive.  Enabled
+by default when running as root.
+
+=item C<same_permissions>
+
+Restore the permissions of extracted members exactly as recorded in the
+archive, rather than masking them with the current umask.  Enabled by default
+when running as root.
+
+=back
+
+=back
+
+=head1 FILE PATH MATCHING
+
+Members may be selected for listing and extraction with the same inclusion and
+exclusion patterns used by Archive::Tar::Builder, matched against member names
+as they appear in the archive.
+
+=over
+
+=item C<$reader-E<gt>include($pattern)>
+
+=item C<$reader-E<gt>include_from_file($file)>
+
+=item C<$reader-E<gt>exclude($pattern)>
+
+=item C<$reader-E<gt>exclude_from_file($file)>
+
+=item C<$reader-E<gt>is_excluded($path)>
+
+=back
+
+=head1 READING ARCHIVE DATA
+
+=over
+
+=item C<$reader-E<gt>set_handle($handle)>
+
+Set the file handle archive data is to be read from.  The handle may be a pipe
+or a socket; when it is a regular file, member data which is not needed is
+skipped with C<lseek()> rather than read.
+
+=item C<$reader-E<gt>list()>
+
+Read the remainder of the archive and return a list of hashes, one per member,
+each containing the keys C<name>, C<type>, C<mode>, C<uid>, C<gid>, C<size>,
+C<mtime>, C<offset> and C<data_offset>, as well as C<user>, C<group> and
+C<linkdest> where present.  C<offset> is the position of the first header
+block of the member in the stream, and C<data_offset> that of its data.
+
+=item C<$reader-E<gt>write_index($handle)>
+
+Read the remainder of the archive, writing a member index to C<$handle> in the
+same format as that written by L<Archive::Tar::Builder/set_index_handle>, and
+return the number of members indexed.  Only member headers are read when the
+archive is a regular file; member contents are seeked over, so that indexing
+even a very large archive takes little time.  As no filesystem is consulted,
+the index lines omit C<dev> and C<ino>.
+
+=item C<$reader-E<gt>extract($dest)>
+
+Read the remainder of the archive, extracting its members beneath the existing
+directory C<$dest>, and return the number of members extracted.  die() if the
+archive can not be read, or if any members could not be extracted and the
+option C<ignore_errors> is not enabled.
+
+=back
+
+=head1 COPYRIGHT
+
+Copyright (c) 2019, cPanel, L.L.C.
+All rights reserved.
+http://cpanel.net/
+
+This is free software; you can redistribute it and/or modify it under the same
+terms as Perl itself.  See L<perlartistic> for further details.
@@ -16,11 +16,21 @@
 #include <sys/types.h>
 #include <errno.h>
 #include "b_string.h"
+#include "b_compress.h"
 #include "b_find.h"
 #include "b_error.h"
 #include "b_builder.h"
-
-typedef b_builder * Archive__Tar__Builder;
+#include "b_reader.h"
+#include "b_journal.h"
+#include "b_filter.h"
+#include "b_mount.h"
+#include "b_inode_set.h"
+#include "b_manifest.h"
+
+typedef b_builder *  Archive__Tar__Builder;
+typedef b_reader *   Archive__Tar__Builder__Reader;
+typedef b_journal *  Archive__Tar__Builder__Journal;
+typedef b_manifest * Archive__Tar__Builder__Manifest;
 
 static int user_lookup(SV *cache, uid_t uid, gid_t gid, b_string **user, b_string **group) {
     dSP;
@@ -136,12 +146,201 @@ leave:
     return path;
 }
 
+static void manifest_progress(SV *callback, uint64_t members, uint64_t bytes) {
+    dSP;
+
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    XPUSHs(sv_2mortal(newSVuv(members)));
+    XPUSHs(sv_2mortal(newSVuv(bytes)));
+    PUTBACK;
+
+    call_sv(callback, G_DISCARD);
+
+    FREETMPS;
+    LEAVE;
+}
+
 static void builder_warn(b_error *err) {
     if (err == NULL) return;
 
     warn("%s: %s: %s", b_error_path(err)->str, b_error_message(err)->str, strerror(b_error_errno(err)));
 }
 
+static SV *entry_hash(b_reader_entry *entry) {
+    b_header *header = entry->header;
+    HV *hash = newHV();
+    char type[2] = { header->linktype? header->linktype: '0', '\0' };
+
+    hv_stores(hash, "name",        newSVpvn(entry->path->str, entry->path->len));
+    hv_stores(hash, "type",        newSVpv(type, 1));
+    hv_stores(hash, "mode",        newSVuv(header->mode & 07777));
+    hv_stores(hash, "uid",         newSVuv(header->uid));
+    hv_stores(hash, "gid",         newSVuv(header->gid));
+    hv_stores(hash, "size",        newSVuv(entry->data_size));
+    hv_stores(hash, "mtime",       newSViv(header->mtime));
+    hv_stores(hash, "offset",      newSVuv(entry->offset));
+    hv_stores(hash, "data_offset", newSVuv(entry->data_offset));
+
+    if (header->user && header->user->len) {
+        hv_stores(hash, "user", newSVpvn(header->user->str, header->user->len));
+    }
+
+    if (header->group && header->group->len) {
+        hv_stores(hash, "group", newSVpvn(header->group->str, header->group->len));
+    }
+
+    if (header->linkdest) {
+        hv_stores(hash, "linkdest", newSVpvn(header->linkdest->str, header->linkdest->len));
+    }
+
+    return newRV_noinc((SV *)hash);
+}
+
+/*
+ * Substitute the leading portion of a member name for another, as given by
+ * the first of the 'from' => 'to' pairs given which matches the name as a
+ * whole, or up to a path separator.
+ */
+static b_string *rename_member(b_string *name, SV **renames, I32 count) {
+    size_t len = name->len;
+    I32 i;
+
+    while (len > 1 && name->str[len-1] == '/') {
+        len--;
+    }
+
+    for (i=0; i+1<count; i+=2) {
+        STRLEN from_len, to_len;
+        char *from = SvPV(renames[i],   from_len);
+        char *to   = SvPV(renames[i+1], to_len);
+        b_string *ret;
+
+        if (from_len > len || memcmp(name->str, from, from_len) != 0) continue;
+        if (from_len < len && name->str[from_len] != '/')              continue;
+
+        if ((ret = b_string_new_len(to, to_len)) == NULL) {
+            return NULL;
+        }
+
+        if (from_len < len) {
+            b_string rest;
+
+            rest.str = name->str + from_len;
+            rest.len = len - from_len;
+
+            if (b_string_append(ret, &rest) == NULL) {
+                b_string_free(ret);
+                return NULL;
+            }
+        }
+
+        return ret;
+    }
+
+    return b_string_new_len(name->str, len);
+}
+
+static AV *filter_list(SV *value, const char *key) {
+    if (!SvROK(value) || SvTYPE(SvRV(value)) != SVt_PVAV) {
+        croak("Filter '%s' must be an array reference", key);
+    }
+
+    return (AV *)SvRV(value);
+}
+
+/*
+ * Convert a list of user or group IDs for use in a filter.
+ */
+static unsigned long *filter_ids(AV *list, size_t *count) {
+    unsigned long *ids;
+    I32 i;
+
+    *count = av_len(list) + 1;
+
+    Newx(ids, *count? *count: 1, unsigned long);
+
+    for (i=0; i<(I32)*count; i++) {
+        SV **item = av_fetch(list, i, 0);
+
+        ids[i] = item? SvUV(*item): 0;
+    }
+
+    return ids;
+}
+
+static int filter_types(SV *value) {
+    static const struct {
+        const char * name;
+        int          type;
+    } names[] = {
+        { "file",    B_FILTER_TYPE_FILE    },
+        { "dir",     B_FILTER_TYPE_DIR     },
+        { "symlink", B_FILTER_TYPE_SYMLINK },
+        { "char",    B_FILTER_TYPE_CHR     },
+        { "block",   B_FILTER_TYPE_BLK     },
+        { "fifo",    B_FILTER_TYPE_FIFO    },
+        { "socket",  B_FILTER_TYPE_SOCKET  }
+    };
+
+    AV *list = filter_list(value, "types");
+    I32 i;
+    int types = 0;
+
+    for (i=0; i<=av_len(list); i++) {
+        SV **item = av_fetch(list, i, 0);
+        const char *name = item? SvPV_nolen(*item): "";
+        size_t n;
+
+        for (n=0; n<sizeof(names) / sizeof(names[0]); n++) {
+            if (strcmp(name, names[n].name) == 0) break;
+        }
+
+        if (n == sizeof(names) / sizeof(names[0])) {
+            croak("Unknown file type '%s'", name);
+        }
+
+        types |= names[n].type;
+    }
+
+    return types;
+}
+
+static b_mounts *skip_fstypes(SV *value) {
+    b_mounts *mounts;
+    AV *list;
+    I32 i;
+
+    if (!SvROK(value) || SvTYPE(SvRV(value)) != SVt_PVAV) {
+        croak("Option 'skip_fstypes' must be an array reference");
+    }
+
+    if ((mounts = b_mounts_new()) == NULL) {
+        croak("%s: %s", "b_mounts_new()", strerror(errno));
+    }
+
+    list = (AV *)SvRV(value);
+
+    for (i=0; i<=av_len(list); i++) {
+        SV **item = av_fetch(list, i, 0);
+        const char *type = item? SvPV_nolen(*item): "";
+
+        if (b_mounts_skip_type(mounts, type) < 0) {
+            b_mounts_destroy(mounts);
+
+            if (errno == EINVAL) {
+                croak("Unknown filesystem type '%s'", type);
+            }
+
+            croak("%s: %s", "b_mounts_skip_type()", strerror(errno));
+        }
+    }
+
+    return mounts;
+}
+
 static int find_flags(enum b_builder_options options) {
     int flags = 0;
 
@@ -153,6 +352,14 @@ static int find_flags(enum b_builder_options options) {
         flags |= B_FIND_IGNORE_SOCKETS;
     }
 
+    if (options & B_BUILDER_SORT_INODES) {
+        flags |= B_FIND_SORT_INODES;
+    }
+
+    if (options & B_BUILDER_ONE_FILE_SYSTEM) {
+        flags |= B_FIND_ONE_FILE_SYSTEM;
+    }
+
     return flags;
 }
 
@@ -169,6 +376,21 @@ builder_new(klass, ...)
         I32 i, retc;
         enum b_builder_options options = B_BUILDER_NONE;
         size_t block_factor = B_BUFFER_DEFAULT_FACTOR;
+        size_t read_size = 0;
+        size_t read_threads = 0;
+        size_t read_chunk_size = 0;
+        char *compression = NULL;
+        enum b_compress_codec codec = B_COMPRESS_NONE;
+        int level = B_COMPRESS_DEFAULT_LEVEL;
+        size_t compression_threads = 0;
+        size_t compression_block_size = 0;
+        size_t frame_size = 0;
+        char *index_member = NULL;
+        char *snapshot = NULL;
+        size_t max_open_dirs = 0;
+        int dedupe = 0;
+        SV *fstypes = NULL;
+        b_mounts *mounts = NULL;
 
         if ((items - 1) % 2 != 0) {
             croak("Uneven number of arguments passed; must be in 'key' => 'value' format");
@@ -185,14 +407,105 @@ builder_new(klass, ...)
             if (strcmp(key, "gnu_extensions")     == 0 && SvIV(value)) options |= B_BUILDER_GNU_EXTENSIONS;
             if (strcmp(key, "posix_extensions")   == 0 && SvIV(value)) options |= B_BUILDER_PAX_EXTENSIONS;
             if (strcmp(key, "ignore_sockets")     == 0 && SvIV(value)) options |= B_BUILDER_IGNORE_SOCKETS;
+            if (strcmp(key, "sort_inodes")        == 0 && SvIV(value)) options |= B_BUILDER_SORT_INODES;
+            if (strcmp(key, "one_file_system")    == 0 && SvIV(value)) options |= B_BUILDER_ONE_FILE_SYSTEM;
             if (strcmp(key, "block_factor")       == 0 && SvIV(value)) block_factor = SvIV(value);
+            if (strcmp(key, "read_size")          == 0 && SvIV(value)) read_size = SvIV(value);
+            if (strcmp(key, "read_threads")       == 0 && SvIV(value)) read_threads = SvIV(value);
+            if (strcmp(key, "read_chunk_size")    == 0 && SvIV(value)) read_chunk_size = SvIV(value);
+            if (strcmp(key, "compression")        == 0 && SvOK(value)) compression = SvPV_nolen(value);
+            if (strcmp(key, "level")              == 0 && SvOK(value)) level = SvIV(value);
+            if (strcmp(key, "compression_threads")    == 0 && SvIV(value)) compression_threads = SvIV(value);
+            if (strcmp(key, "compression_block_size") == 0 && SvIV(value)) compression_block_size = SvIV(value);
+            if (strcmp(key, "frame_size")         == 0 && SvIV(value)) frame_size = SvIV(value);
+            if (strcmp(key, "compression_bypass") == 0 && SvIV(value)) options |= B_BUILDER_COMPRESSION_BYPASS;
+            if (strcmp(key, "index_member")       == 0 && SvOK(value)) index_member = SvPV_nolen(value);
+            if (strcmp(key, "snapshot")           == 0 && SvOK(value)) snapshot = SvPV_nolen(value);
+            if (strcmp(key, "max_open_dirs")      == 0 && SvIV(value)) max_open_dirs = SvIV(value);
+            if (strcmp(key, "skip_fstypes")       == 0 && SvOK(value)) fstypes = value;
+            if (strcmp(key, "dedupe")             == 0 && SvIV(value)) dedupe = 1;
+        }
+
+        if (compression && b_compress_codec_by_name(compression, &codec) < 0) {
+            croak("Unknown compression codec '%s'", compression);
+        }
+
+        if (!b_compress_available(codec)) {
+            croak("Compression codec '%s' is not available in this build", compression);
+        }
+
+        if (frame_size && codec == B_COMPRESS_NONE) {
+            croak("Option 'frame_size' requires 'compression'");
+        }
+
+        if (fstypes) {
+            mounts = skip_fstypes(fstypes);
         }
 
         if ((builder = b_builder_new(block_factor)) == NULL) {
+            b_mounts_destroy(mounts);
+
             croak("%s: %s", "b_builder_new()", strerror(errno));
         }
 
         b_builder_set_options(builder, options);
+        b_builder_set_max_open_dirs(builder, max_open_dirs);
+        b_builder_set_mounts(builder, mounts);
+
+        if (dedupe && b_builder_set_dedupe(builder, 1) < 0) {
+            b_builder_destroy(builder);
+
+            croak("%s: %s", "b_builder_set_dedupe()", strerror(errno));
+        }
+
+        if (read_size && b_buffer_set_read_size(b_builder_get_buffer(builder), read_size) < 0) {
+            b_builder_destroy(builder);
+
+            croak("%s: %s", "b_buffer_set_read_size()", strerror(errno));
+        }
+
+        if (read_threads > 1 && b_builder_set_read_threads(builder, read_threads, read_chunk_size) < 0) {
+            b_builder_destroy(builder);
+
+            croak("%s: %s", "b_builder_set_read_threads()", strerror(errno));
+        }
+
+        if (codec != B_COMPRESS_NONE) {
+            b_compress *compress;
+
+            if ((compress = b_compress_new(codec, level)) == NULL) {
+                b_builder_destroy(builder);
+
+                croak("%s: %s", "b_compress_new()", strerror(errno));
+            }
+
+            if (compression_threads > 1 && b_compress_set_threads(compress, compression_threads, compression_block_size) < 0) {
+                b_compress_destroy(compress);
+                b_builder_destroy(builder);
+
+                croak("%s: %s", "b_compress_set_threads()", strerror(errno));
+            }
+
+            b_buffer_set_compress(b_builder_get_buffer(builder), compress);
+
+            if (frame_size && b_builder_set_frame_size(builder, frame_size) < 0) {
+                b_builder_destroy(builder);
+
+                croak("%s: %s", "b_builder_set_frame_size()", strerror(errno));
+            }
+        }
+
+        if (index_member && b_builder_set_index_member(builder, index_member) < 0) {
+            b_builder_destroy(builder);
+
+            croak("%s: %s", "b_builder_set_index_member()", strerror(errno));
+        }
+
+        if (snapshot && b_builder_set_snapshot(builder, snapshot) < 0) {
+            b_builder_destroy(builder);
+
+            croak("Unable to open snapshot %s: %s", snapshot, strerror(errno));
+        }
 
         err = b_builder_get_error(builder);
 
@@ -304,6 +617,131 @@ builder_exclude_from_file(builder, file)
             croak("Cannot add items to exclusion list from file %s: %s", file, strerror(errno));
         }
 
+void
+builder_exclude_tag(builder, name)
+    Archive::Tar::Builder builder
+    const char *name
+
+    CODE:
+        if (b_builder_exclude_tag(builder, name, B_BUILDER_TAG) < 0) {
+            croak("Cannot add exclusion tag '%s': %s", name, strerror(errno));
+        }
+
+void
+builder_exclude_tag_under(builder, name)
+    Archive::Tar::Builder builder
+    const char *name
+
+    CODE:
+        if (b_builder_exclude_tag(builder, name, B_BUILDER_TAG_UNDER) < 0) {
+            croak("Cannot add exclusion tag '%s': %s", name, strerror(errno));
+        }
+
+void
+builder_exclude_caches(builder)
+    Archive::Tar::Builder builder
+
+    CODE:
+        if (b_builder_exclude_tag(builder, B_BUILDER_CACHEDIR_TAG, B_BUILDER_TAG_CACHEDIR) < 0) {
+            croak("Cannot add exclusion tag '%s': %s", B_BUILDER_CACHEDIR_TAG, strerror(errno));
+        }
+
+void
+builder_set_filter(builder, ...)
+    Archive::Tar::Builder builder
+
+    CODE:
+        b_filter *filter;
+        off_t min_size = 0, max_size = -1;
+        time_t mtime_after = 0, mtime_before = 0, ctime_after = 0, ctime_before = 0;
+        int size = 0, mtime = 0, ctime = 0, nodump = 0;
+        int types = -1, uids_exclude = 0, gids_exclude = 0;
+        AV *uids = NULL, *gids = NULL;
+        I32 i;
+
+        if ((items - 1) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'key' => 'value' format");
+        }
+
+        /*
+         * All arguments are checked before the filter is made, so that none
+         * which are refused can leave it behind.
+         */
+        for (i=1; i<items; i+=2) {
+            char *key = SvPV_nolen(ST(i));
+            SV *value = ST(i+1);
+
+            if (strcmp(key, "min_size") == 0) {
+                min_size = SvIV(value);
+                size     = 1;
+            } else if (strcmp(key, "max_size") == 0) {
+                max_size = SvIV(value);
+                size     = 1;
+            } else if (strcmp(key, "mtime_after") == 0) {
+                mtime_after = SvIV(value);
+                mtime       = 1;
+            } else if (strcmp(key, "mtime_before") == 0) {
+                mtime_before = SvIV(value);
+                mtime        = 1;
+            } else if (strcmp(key, "ctime_after") == 0) {
+                ctime_after = SvIV(value);
+                ctime       = 1;
+            } else if (strcmp(key, "ctime_before") == 0) {
+                ctime_before = SvIV(value);
+                ctime        = 1;
+            } else if (strcmp(key, "types") == 0) {
+                types = filter_types(value);
+            } else if (strcmp(key, "nodump") == 0) {
+                if (SvIV(value)) nodump = 1;
+            } else if (strcmp(key, "uids") == 0 || strcmp(key, "exclude_uids") == 0) {
+                uids         = filter_list(value, key);
+                uids_exclude = strncmp(key, "exclude_", 8) == 0;
+            } else if (strcmp(key, "gids") == 0 || strcmp(key, "exclude_gids") == 0) {
+                gids         = filter_list(value, key);
+                gids_exclude = strncmp(key, "exclude_", 8) == 0;
+            } else {
+                croak("Unknown filter '%s'", key);
+            }
+        }
+
+        if ((filter = b_filter_new()) == NULL) {
+            croak("%s: %s", "b_filter_new()", strerror(errno));
+        }
+
+        if (size)       b_filter_set_size(filter, min_size, max_size);
+        if (mtime)      b_filter_set_mtime(filter, mtime_after, mtime_before);
+        if (ctime)      b_filter_set_ctime(filter, ctime_after, ctime_before);
+        if (types >= 0) b_filter_set_types(filter, types);
+        if (nodump)     b_filter_set_nodump(filter);
+
+        if (uids || gids) {
+            unsigned long *ids;
+            size_t count;
+            int ret = 0;
+
+            if (uids) {
+                ids = filter_ids(uids, &count);
+                ret = b_filter_set_uids(filter, ids, count, uids_exclude);
+
+                Safefree(ids);
+            }
+
+            if (ret == 0 && gids) {
+                ids = filter_ids(gids, &count);
+                ret = b_filter_set_gids(filter, ids, count, gids_exclude);
+
+                Safefree(ids);
+            }
+
+            if (ret < 0) {
+                b_filter_destroy(filter);
+
+                croak("%s: %s", "b_filter_set_ids()", strerror(errno));
+            }
+        }
+
+        b_builder_set_filter(builder, filter);
+
 int
 builder_is_excluded(builder, path)
     Archive::Tar::Builder builder
@@ -325,6 +763,63 @@ builder_set_handle(builder, fh)
 
         b_buffer_set_fd(buf, PerlIO_fileno(fh));
 
+void
+builder_open_for_append(builder, fh)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+
+    CODE:
+        if (b_builder_get_buffer(builder)->compress) {
+            croak("Cannot append to a compressed archive");
+        }
+
+        PerlIO_flush(fh);
+
+        if (b_builder_open_for_append(builder, PerlIO_fileno(fh)) < 0) {
+            croak("%s: %s", "b_builder_open_for_append()", strerror(errno));
+        }
+
+void
+builder_reuse_from(builder, fh, index_fh)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+    PerlIO *index_fh
+
+    CODE:
+        if (b_builder_set_previous(builder, PerlIO_fileno(fh), PerlIO_fileno(index_fh)) < 0) {
+            croak("%s: %s", "b_builder_set_previous()", strerror(errno));
+        }
+
+void
+builder_set_frame_index_handle(builder, fh)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+
+    CODE:
+        b_builder_set_frame_index_fd(builder, PerlIO_fileno(fh));
+
+void
+builder_set_deletions_handle(builder, fh)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+
+    CODE:
+        if (builder->snapshot == NULL) {
+            croak("No snapshot set");
+        }
+
+        b_builder_set_deletions_fd(builder, PerlIO_fileno(fh));
+
+void
+builder_set_index_handle(builder, fh)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+
+    CODE:
+        if (b_builder_set_index_fd(builder, PerlIO_fileno(fh)) < 0) {
+            croak("%s: %s", "b_builder_set_index_fd()", strerror(errno));
+        }
+
 size_t
 builder_archive_as(builder, ...)
     Archive::Tar::Builder builder
@@ -349,6 +844,14 @@ builder_archive_as(builder, ...)
             b_string *path        = b_string_new(SvPV_nolen(ST(i)));
             b_string *member_name = b_string_new(SvPV_nolen(ST(i+1)));
 
+            /*
+             * With a snapshot, most files are likely unchanged, and are only
+             * opened once b_builder_write_file() finds otherwise.
+             */
+            if (builder->snapshot) {
+                flags |= B_FIND_STAT_ONLY;
+            }
+
             if (b_find(builder, path, member_name, B_FIND_CALLBACK(b_builder_write_file), flags) < 0) {
                 b_error * err         = b_builder_get_error(builder);
                 b_string * error_path = b_error_path(err);
@@ -366,51 +869,643 @@ builder_archive_as(builder, ...)
     OUTPUT:
         RETVAL
 
-ssize_t
-builder_flush(builder)
+SV *
+builder_estimate_size(builder, ...)
     Archive::Tar::Builder builder
 
     CODE:
-        ssize_t ret;
+        enum b_builder_options options = b_builder_get_options(builder);
+        b_error *err                   = b_builder_get_error(builder);
+        void *hardlink_cache           = builder->hardlink_cache;
+        b_inode_set *archived          = builder->archived;
+        int warned                     = b_error_warn(err);
+        b_builder_estimate estimate;
+        HV *results;
+        off_t size;
 
-        b_buffer *buf = b_builder_get_buffer(builder);
+        size_t i;
 
-        if (b_buffer_get_fd(buf) == 0) {
-            croak("No file handle set");
+        if ((items - 1) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'path' => 'member_name' format");
         }
 
-        if ((ret = b_buffer_flush(buf)) < 0) {
-            croak("%s: %s", "b_buffer_flush()", strerror(errno));
+        /*
+         * Hardlinks seen during the dry run must not be mistaken for ones
+         * already archived by the next real run, so give it a cache of its
+         * own, and likewise a copy of the inodes archived so far.
+         */
+        if (archived && (builder->archived = b_inode_set_dup(archived)) == NULL) {
+            builder->archived = archived;
+
+            croak("%s: %s", "b_inode_set_dup()", strerror(errno));
         }
 
-        RETVAL = ret;
+        if (hardlink_cache) {
+            I32 retc;
 
-    OUTPUT:
-        RETVAL
+            ENTER;
+            SAVETMPS;
 
-ssize_t
-builder_finish(builder)
-    Archive::Tar::Builder builder
+            PUSHMARK(SP);
+            XPUSHs(sv_2mortal(newSVpvf("Archive::Tar::Builder::HardlinkCache")));
+            PUTBACK;
 
-    CODE:
-        ssize_t ret;
+            retc = call_method("new", G_SCALAR);
 
-        b_buffer *buf = b_builder_get_buffer(builder);
-        b_error *err  = b_builder_get_error(builder);
+            SPAGAIN;
 
-        enum b_builder_options options = b_builder_get_options(builder);
+            if (retc == 1) {
+                builder->hardlink_cache = POPs;
+                SvREFCNT_inc((SV *)builder->hardlink_cache);
+            }
 
-        if (b_buffer_get_fd(buf) == 0) {
-            croak("No file handle set");
+            PUTBACK;
+            FREETMPS;
+            LEAVE;
         }
 
-        if ((ret = b_buffer_flush(buf)) < 0) {
-            croak("%s: %s", "b_buffer_flush()", strerror(errno));
-        }
+        b_builder_estimate_begin(builder, &estimate);
 
-        if (b_error_warn(err) && !(options & B_BUILDER_IGNORE_ERRORS)) {
-            croak("Delayed nonzero exit status");
-        }
+        for (i=1; i<items; i+=2) {
+            int flags = find_flags(options) | B_FIND_STAT_ONLY;
+            int ret;
+
+            b_string *path        = b_string_new(SvPV_nolen(ST(i)));
+            b_string *member_name = b_string_new(SvPV_nolen(ST(i+1)));
+
+            ret = b_find(builder, path, member_name, B_FIND_CALLBACK(b_builder_estimate_file), flags);
+
+            if (ret < 0) {
+                b_string *error_path = b_error_path(err);
+
+                if (error_path == NULL) {
+                    error_path = path;
+                }
+
+                b_builder_estimate_end(builder);
+
+                if (builder->hardlink_cache != hardlink_cache) {
+                    SvREFCNT_dec((SV *)builder->hardlink_cache);
+                    builder->hardlink_cache = hardlink_cache;
+                }
+
+                if (builder->archived != archived) {
+                    b_inode_set_destroy(builder->archived);
+                    builder->archived = archived;
+                }
+
+                croak("%s: %s: %s\n", "b_find()", error_path->str, strerror(errno));
+            }
+
+            b_string_free(path);
+            b_string_free(member_name);
+        }
+
+        size = b_builder_estimate_end(builder);
+
+        if (builder->hardlink_cache != hardlink_cache) {
+            SvREFCNT_dec((SV *)builder->hardlink_cache);
+            builder->hardlink_cache = hardlink_cache;
+        }
+
+        if (builder->archived != archived) {
+            b_inode_set_destroy(builder->archived);
+            builder->archived = archived;
+        }
+
+        /*
+         * Warnings raised during the dry run are not to fail the real one.
+         */
+        if (!warned) {
+            b_error_clear(err);
+        }
+
+        results = newHV();
+
+        hv_stores(results, "size",  newSVuv(size));
+        hv_stores(results, "files", newSVuv(estimate.files));
+        hv_stores(results, "dirs",  newSVuv(estimate.dirs));
+
+        RETVAL = newRV_noinc((SV *)results);
+
+    OUTPUT:
+        RETVAL
+
+Archive::Tar::Builder::Manifest
+builder_plan(builder, ...)
+    Archive::Tar::Builder builder
+
+    CODE:
+        enum b_builder_options options = b_builder_get_options(builder);
+        b_manifest *manifest;
+
+        size_t i;
+
+        if ((items - 1) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'path' => 'member_name' format");
+        }
+
+        if ((manifest = b_manifest_new()) == NULL) {
+            croak("%s: %s", "b_manifest_new()", strerror(errno));
+        }
+
+        builder->manifest = manifest;
+
+        for (i=1; i<items; i+=2) {
+            int flags = find_flags(options) | B_FIND_STAT_ONLY;
+            int ret;
+
+            b_string *path        = b_string_new(SvPV_nolen(ST(i)));
+            b_string *member_name = b_string_new(SvPV_nolen(ST(i+1)));
+
+            ret = b_find(builder, path, member_name, B_FIND_CALLBACK(b_builder_plan_file), flags);
+
+            if (ret < 0) {
+                b_error * err         = b_builder_get_error(builder);
+                b_string * error_path = b_error_path(err);
+
+                if (error_path == NULL) {
+                    error_path = path;
+                }
+
+                builder->manifest = NULL;
+                b_manifest_destroy(manifest);
+
+                croak("%s: %s: %s\n", "b_find()", error_path->str, strerror(errno));
+            }
+
+            b_string_free(path);
+            b_string_free(member_name);
+        }
+
+        builder->manifest = NULL;
+
+        RETVAL = manifest;
+
+    OUTPUT:
+        RETVAL
+
+size_t
+builder_archive_manifest(builder, manifest, ...)
+    Archive::Tar::Builder builder
+    Archive::Tar::Builder::Manifest manifest
+
+    CODE:
+        b_buffer *buf     = b_builder_get_buffer(builder);
+        uint64_t prefetch = 0;
+        SV *progress      = NULL;
+        I32 i;
+
+        if ((items - 2) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'key' => 'value' format");
+        }
+
+        if (b_buffer_get_fd(buf) == 0) {
+            croak("No file handle set");
+        }
+
+        for (i=2; i<items; i+=2) {
+            char *key = SvPV_nolen(ST(i));
+            SV *value = ST(i+1);
+
+            if (strcmp(key, "prefetch") == 0) {
+                prefetch = SvUV(value);
+            } else if (strcmp(key, "progress") == 0) {
+                if (!SvROK(value) || SvTYPE(SvRV(value)) != SVt_PVCV) {
+                    croak("Option 'progress' must be a code reference");
+                }
+
+                progress = value;
+            } else {
+                croak("Unknown option '%s'", key);
+            }
+        }
+
+        if (b_builder_write_manifest(builder, manifest, prefetch, progress? (b_builder_progress)manifest_progress: NULL, progress) < 0) {
+            b_error * err         = b_builder_get_error(builder);
+            b_string * error_path = b_error_path(err);
+
+            croak("%s: %s: %s\n", "b_builder_write_manifest()", error_path? error_path->str: "", strerror(errno));
+        }
+
+        RETVAL = builder->total;
+
+    OUTPUT:
+        RETVAL
+
+size_t
+builder_archive_journal(builder, journal, ...)
+    Archive::Tar::Builder builder
+    char *journal
+
+    CODE:
+        enum b_builder_options options = b_builder_get_options(builder);
+        b_buffer *buf = b_builder_get_buffer(builder);
+        b_stack *changes;
+        off_t len;
+        int overflowed;
+
+        size_t i;
+
+        if ((items - 2) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'path' => 'member_name' format");
+        }
+
+        if (b_buffer_get_fd(buf) == 0) {
+            croak("No file handle set");
+        }
+
+        if ((changes = b_journal_read(journal, &len, &overflowed)) == NULL) {
+            croak("%s: %s: %s", "b_journal_read()", journal, strerror(errno));
+        }
+
+        /*
+         * When events were lost, every path must be walked as usual.
+         */
+        if (!overflowed && builder->snapshot) {
+            b_snapshot_set_partial(builder->snapshot);
+        }
+
+        for (i=2; i<items; i+=2) {
+            int flags = find_flags(options) | (builder->snapshot? B_FIND_STAT_ONLY: 0);
+            int ret;
+
+            b_string *path        = b_string_new(SvPV_nolen(ST(i)));
+            b_string *member_name = b_string_new(SvPV_nolen(ST(i+1)));
+
+            if (overflowed) {
+                ret = b_find(builder, path, member_name, B_FIND_CALLBACK(b_builder_write_file), flags);
+            } else {
+                ret = b_find_changes(builder, changes, path, member_name, B_FIND_CALLBACK(b_builder_write_file), flags);
+            }
+
+            if (ret < 0) {
+                b_error * err         = b_builder_get_error(builder);
+                b_string * error_path = b_error_path(err);
+
+                if (error_path == NULL) {
+                    error_path = path;
+                }
+
+                b_stack_destroy(changes);
+
+                croak("%s: %s: %s\n", "b_find()", error_path->str, strerror(errno));
+            }
+
+            b_string_free(path);
+            b_string_free(member_name);
+        }
+
+        b_stack_destroy(changes);
+
+        if (b_builder_set_journal(builder, journal, len) < 0) {
+            croak("%s: %s", "b_builder_set_journal()", strerror(errno));
+        }
+
+        RETVAL = builder->total;
+
+    OUTPUT:
+        RETVAL
+
+size_t
+builder_archive_handle(builder, fh, ...)
+    Archive::Tar::Builder builder
+    PerlIO *fh
+
+    CODE:
+        b_buffer *buf = b_builder_get_buffer(builder);
+        b_error *err  = b_builder_get_error(builder);
+        b_reader *reader;
+        b_reader_entry *entry;
+        int ret;
+
+        if ((items - 2) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'member_name' => 'new_member_name' format");
+        }
+
+        if (b_buffer_get_fd(buf) == 0) {
+            croak("No file handle set");
+        }
+
+        if ((reader = b_reader_new(0)) == NULL) {
+            croak("%s: %s", "b_reader_new()", strerror(errno));
+        }
+
+        if (b_reader_set_fd(reader, PerlIO_fileno(fh)) < 0) {
+            b_reader_destroy(reader);
+
+            croak("%s: %s", "b_reader_set_fd()", strerror(errno));
+        }
+
+        while ((ret = b_reader_next(reader, &entry)) > 0) {
+            b_string *member_name, *linkdest = NULL;
+
+            if (builder->match != NULL && b_builder_is_excluded(builder, entry->path->str)) {
+                continue;
+            }
+
+            if ((member_name = rename_member(entry->path, &ST(2), items - 2)) == NULL) {
+                ret = -1;
+                break;
+            }
+
+            /*
+             * Hardlinks name another member of the archive, which is renamed
+             * in turn; symlinks are left pointing where they did.
+             */
+            if (entry->header->linktype == '1' && entry->header->linkdest) {
+                if ((linkdest = rename_member(entry->header->linkdest, &ST(2), items - 2)) == NULL) {
+                    b_string_free(member_name);
+
+                    ret = -1;
+                    break;
+                }
+            }
+
+            ret = b_builder_write_member(builder, reader, entry, member_name, linkdest);
+
+            b_string_free(member_name);
+            b_string_free(linkdest);
+
+            /*
+             * Members which cannot be written for want of extensions to the
+             * format are skipped, as when archiving files.
+             */
+            if (ret < 0 && !b_error_fatal(err)) {
+                continue;
+            }
+
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        if (ret < 0) {
+            int _errno = errno;
+
+            b_reader_destroy(reader);
+
+            croak("%s: %s", "b_builder_write_member()", strerror(_errno));
+        }
+
+        b_reader_destroy(reader);
+
+        RETVAL = builder->total;
+
+    OUTPUT:
+        RETVAL
+
+ssize_t
+builder_flush(builder)
+    Archive::Tar::Builder builder
+
+    CODE:
+        ssize_t ret;
+
+        b_buffer *buf = b_builder_get_buffer(builder);
+
+        if (b_buffer_get_fd(buf) == 0) {
+            croak("No file handle set");
+        }
+
+        if ((ret = b_buffer_flush(buf)) < 0) {
+            croak("%s: %s", "b_buffer_flush()", strerror(errno));
+        }
+
+        if (b_buffer_sync(buf) < 0) {
+            croak("%s: %s", "b_buffer_sync()", strerror(errno));
+        }
+
+        RETVAL = ret;
+
+    OUTPUT:
+        RETVAL
+
+ssize_t
+builder_finish(builder)
+    Archive::Tar::Builder builder
+
+    CODE:
+        ssize_t ret;
+
+        b_buffer *buf = b_builder_get_buffer(builder);
+        b_error *err  = b_builder_get_error(builder);
+
+        enum b_builder_options options = b_builder_get_options(builder);
+
+        if (b_buffer_get_fd(buf) == 0) {
+            croak("No file handle set");
+        }
+
+        if ((ret = b_builder_finish(builder)) < 0) {
+            croak("%s: %s", "b_builder_finish()", strerror(errno));
+        }
+
+        if (b_error_warn(err) && !(options & B_BUILDER_IGNORE_ERRORS)) {
+            croak("Delayed nonzero exit status");
+        }
+
+        b_error_reset(err);
+
+        RETVAL = ret;
+
+    OUTPUT:
+        RETVAL
+
+MODULE = Archive::Tar::Builder PACKAGE = Archive::Tar::Builder::Reader PREFIX = reader_
+
+Archive::Tar::Builder::Reader
+reader_new(klass, ...)
+    char *klass
+
+    CODE:
+        b_reader *reader;
+        I32 i;
+        enum b_reader_options options = B_READER_NONE;
+        size_t block_factor = B_BUFFER_DEFAULT_FACTOR;
+        size_t threads      = 1;
+
+        if ((items - 1) % 2 != 0) {
+            croak("Uneven number of arguments passed; must be in 'key' => 'value' format");
+        }
+
+        /*
+         * As with tar(1), ownership and permissions are restored verbatim by
+         * default only when running as root.
+         */
+        if (geteuid() == 0) {
+            options |= B_READER_SAME_OWNER | B_READER_SAME_PERMISSIONS;
+        }
+
+        for (i=1; i<items; i+=2) {
+            char *key = SvPV_nolen(ST(i));
+            SV *value = ST(i+1);
+
+            if (strcmp(key, "quiet")            == 0 && SvIV(value)) options |= B_READER_QUIET;
+            if (strcmp(key, "ignore_errors")    == 0 && SvIV(value)) options |= B_READER_IGNORE_ERRORS;
+            if (strcmp(key, "block_factor")     == 0 && SvIV(value)) block_factor = SvIV(value);
+            if (strcmp(key, "threads")          == 0 && SvIV(value)) threads      = SvIV(value);
+
+            if (strcmp(key, "same_owner") == 0) {
+                if (SvIV(value)) options |=  B_READER_SAME_OWNER;
+                else             options &= ~B_READER_SAME_OWNER;
+            }
+
+            if (strcmp(key, "same_permissions") == 0) {
+                if (SvIV(value)) options |=  B_READER_SAME_PERMISSIONS;
+                else             options &= ~B_READER_SAME_PERMISSIONS;
+            }
+        }
+
+        if ((reader = b_reader_new(block_factor)) == NULL) {
+            croak("%s: %s", "b_reader_new()", strerror(errno));
+        }
+
+        b_reader_set_options(reader, options);
+        b_reader_set_threads(reader, threads);
+
+        if (!(options & B_READER_QUIET)) {
+            b_error_set_callback(b_reader_get_error(reader), B_ERROR_CALLBACK(builder_warn));
+        }
+
+        RETVAL = reader;
+
+    OUTPUT:
+        RETVAL
+
+void
+reader_DESTROY(reader)
+    Archive::Tar::Builder::Reader reader
+
+    CODE:
+        b_reader_destroy(reader);
+
+void
+reader_include(reader, pattern)
+    Archive::Tar::Builder::Reader reader
+    const char *pattern
+
+    CODE:
+        if (b_reader_include(reader, pattern) < 0) {
+            croak("Cannot add inclusion pattern '%s' to list of inclusions: %s", pattern, strerror(errno));
+        }
+
+void
+reader_include_from_file(reader, file)
+    Archive::Tar::Builder::Reader reader
+    const char *file
+
+    CODE:
+        if (b_reader_include_from_file(reader, file) < 0) {
+            croak("Cannot add items to inclusion list from file %s: %s", file, strerror(errno));
+        }
+
+void
+reader_exclude(reader, pattern)
+    Archive::Tar::Builder::Reader reader
+    const char *pattern
+
+    CODE:
+        if (b_reader_exclude(reader, pattern) < 0) {
+            croak("Cannot add exclusion pattern '%s' to list of exclusions: %s", pattern, strerror(errno));
+        }
+
+void
+reader_exclude_from_file(reader, file)
+    Archive::Tar::Builder::Reader reader
+    const char *file
+
+    CODE:
+        if (b_reader_exclude_from_file(reader, file) < 0) {
+            croak("Cannot add items to exclusion list from file %s: %s", file, strerror(errno));
+        }
+
+int
+reader_is_excluded(reader, path)
+    Archive::Tar::Builder::Reader reader
+    const char *path
+
+    CODE:
+        RETVAL = b_reader_is_excluded(reader, path);
+
+    OUTPUT:
+        RETVAL
+
+void
+reader_set_handle(reader, fh)
+    Archive::Tar::Builder::Reader reader
+    PerlIO *fh
+
+    CODE:
+        if (b_reader_set_fd(reader, PerlIO_fileno(fh)) < 0) {
+            croak("%s: %s", "b_reader_set_fd()", strerror(errno));
+        }
+
+void
+reader_list(reader)
+    Archive::Tar::Builder::Reader reader
+
+    PPCODE:
+        b_reader_entry *entry;
+        int ret;
+
+        if (reader->fd == 0) {
+            croak("No file handle set");
+        }
+
+        while ((ret = b_reader_next(reader, &entry)) > 0) {
+            if (b_reader_is_excluded(reader, entry->path->str)) {
+                continue;
+            }
+
+            XPUSHs(sv_2mortal(entry_hash(entry)));
+        }
+
+        if (ret < 0) {
+            croak("%s: %s", "b_reader_next()", strerror(errno));
+        }
+
+ssize_t
+reader_write_index(reader, fh)
+    Archive::Tar::Builder::Reader reader
+    PerlIO *fh
+
+    CODE:
+        if (reader->fd == 0) {
+            croak("No file handle set");
+        }
+
+        PerlIO_flush(fh);
+
+        if ((RETVAL = b_reader_write_index(reader, PerlIO_fileno(fh))) < 0) {
+            croak("%s: %s", "b_reader_write_index()", strerror(errno));
+        }
+
+    OUTPUT:
+        RETVAL
+
+ssize_t
+reader_extract(reader, dest)
+    Archive::Tar::Builder::Reader reader
+    const char *dest
+
+    CODE:
+        b_error *err = b_reader_get_error(reader);
+        ssize_t ret;
+
+        if (reader->fd == 0) {
+            croak("No file handle set");
+        }
+
+        reader->warnings = 0;
+
+        if ((ret = b_reader_extract(reader, dest)) < 0) {
+            croak("%s: %s", "b_reader_extract()", strerror(errno));
+        }
+
+        if (reader->warnings && !(reader->options & B_READER_IGNORE_ERRORS)) {
+            croak("Delayed nonzero exit status");
+        }
 
         b_error_reset(err);
 
@@ -418,3 +1513,136 @@ builder_finish(builder)
 
     OUTPUT:
         RETVAL
+
+MODULE = Archive::Tar::Builder PACKAGE = Archive::Tar::Builder::Journal PREFIX = journal_
+
+Archive::Tar::Builder::Journal
+journal_new(klass, file)
+    char *klass
+    const char *file
+
+    CODE:
+        b_journal *journal;
+
+        if ((journal = b_journal_open(file)) == NULL) {
+            croak("Unable to open journal %s: %s", file, strerror(errno));
+        }
+
+        RETVAL = journal;
+
+    OUTPUT:
+        RETVAL
+
+void
+journal_DESTROY(journal)
+    Archive::Tar::Builder::Journal journal
+
+    CODE:
+        b_journal_destroy(journal);
+
+void
+journal_watch(journal, path)
+    Archive::Tar::Builder::Journal journal
+    const char *path
+
+    CODE:
+        if (b_journal_watch(journal, path) < 0) {
+            croak("Unable to watch %s: %s", path, strerror(errno));
+        }
+
+size_t
+journal_record(journal, timeout = -1)
+    Archive::Tar::Builder::Journal journal
+    int timeout
+
+    CODE:
+        ssize_t ret;
+
+        if ((ret = b_journal_record(journal, timeout)) < 0) {
+            croak("%s: %s", "b_journal_record()", strerror(errno));
+        }
+
+        RETVAL = ret;
+
+    OUTPUT:
+        RETVAL
+
+MODULE = Archive::Tar::Builder PACKAGE = Archive::Tar::Builder::Manifest PREFIX = manifest_
+
+Archive::Tar::Builder::Manifest
+manifest_load(klass, file)
+    char *klass
+    const char *file
+
+    CODE:
+        b_manifest *manifest;
+
+        if ((manifest = b_manifest_load(file)) == NULL) {
+            croak("Unable to load manifest %s: %s", file, strerror(errno));
+        }
+
+        RETVAL = manifest;
+
+    OUTPUT:
+        RETVAL
+
+void
+manifest_DESTROY(manifest)
+    Archive::Tar::Builder::Manifest manifest
+
+    CODE:
+        b_manifest_destroy(manifest);
+
+void
+manifest_save(manifest, file)
+    Archive::Tar::Builder::Manifest manifest
+    const char *file
+
+    CODE:
+        if (b_manifest_save(manifest, file) < 0) {
+            croak("Unable to save manifest %s: %s", file, strerror(errno));
+        }
+
+UV
+manifest_count(manifest)
+    Archive::Tar::Builder::Manifest manifest
+
+    CODE:
+        RETVAL = manifest->count;
+
+    OUTPUT:
+        RETVAL
+
+UV
+manifest_total_size(manifest)
+    Archive::Tar::Builder::Manifest manifest
+
+    CODE:
+        RETVAL = manifest->total;
+
+    OUTPUT:
+        RETVAL
+
+void
+manifest_sort(manifest, order)
+    Archive::Tar::Builder::Manifest manifest
+    const char *order
+
+    CODE:
+        enum b_manifest_order value;
+
+        if (strcmp(order, "walk") == 0) {
+            value = B_MANIFEST_ORDER_WALK;
+        } else if (strcmp(order, "name") == 0) {
+            value = B_MANIFEST_ORDER_NAME;
+        } else if (strcmp(order, "inode") == 0) {
+            value = B_MANIFEST_ORDER_INODE;
+        } else if (strcmp(order, "physical") == 0) {
+            value = B_MANIFEST_ORDER_PHYSICAL;
+        } else {
+            croak("Unknown order '%s'", order);
+        }
+
+        if (b_manifest_sort(manifest, value) < 0) {
+            croak("%s: %s", "b_manifest_sort()", strerror(errno));
+        }
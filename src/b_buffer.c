@@ -8,6 +8,7 @@
 #include <stdio.h>
 #endif
 #include "b_buffer.h"
+#include "b_util.h"
 
 b_buffer *b_buffer_new(size_t factor) {
     b_buffer *buf;
@@ -20,6 +21,9 @@ b_buffer *b_buffer_new(size_t factor) {
     buf->can_splice = 0;
     buf->size       = factor? factor * B_BUFFER_BLOCK_SIZE: B_BUFFER_DEFAULT_FACTOR * B_BUFFER_BLOCK_SIZE;
     buf->unused     = buf->size;
+    buf->read_size  = 0;
+    buf->read_data  = NULL;
+    buf->compress   = NULL;
 
     if ((buf->data = malloc(buf->size)) == NULL) {
         goto error_malloc_buf;
@@ -60,7 +64,10 @@ void b_buffer_set_fd(b_buffer *buf, int fd) {
     buf->fd         = fd;
     buf->can_splice = 0;
 #ifdef __linux__
-    if (fstat(fd, &st) == 0) {
+    /*
+     * Data spliced to the output file descriptor would bypass the compressor.
+     */
+    if (buf->compress == NULL && fstat(fd, &st) == 0) {
         if (S_ISFIFO(st.st_mode)) {
             uname_ok = uname(&unameData);
             if (uname_ok != -1) {
@@ -83,6 +90,58 @@ void b_buffer_set_fd(b_buffer *buf, int fd) {
     return;
 }
 
+/*
+ * Allocate a separate, page-aligned buffer of the given size for reading file
+ * contents, so that reads from the filesystem need not be capped at the space
+ * left in the output buffer.  The size is rounded up to a multiple of the tar
+ * block size so that each full read lands on a block boundary in the output
+ * stream.  A size of zero releases the read buffer.
+ */
+int b_buffer_set_read_size(b_buffer *buf, size_t size) {
+    void *data = NULL;
+
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (size % B_BUFFER_BLOCK_SIZE) {
+        size += B_BUFFER_BLOCK_SIZE - (size % B_BUFFER_BLOCK_SIZE);
+    }
+
+    if (size) {
+        int ret;
+
+        if ((ret = posix_memalign(&data, B_BUFFER_READ_ALIGN, size)) != 0) {
+            errno = ret;
+            return -1;
+        }
+    }
+
+    free(buf->read_data);
+
+    buf->read_data = data;
+    buf->read_size = size;
+
+    return 0;
+}
+
+/*
+ * Pass all buffer contents through the compressor given, which the buffer
+ * assumes ownership of, on their way to the output file descriptor.
+ */
+void b_buffer_set_compress(b_buffer *buf, b_compress *compress) {
+    if (buf == NULL) return;
+
+    b_compress_destroy(buf->compress);
+
+    buf->compress = compress;
+
+    if (compress) {
+        buf->can_splice = 0;
+    }
+}
+
 size_t b_buffer_size(b_buffer *buf) {
     if (buf == NULL) return 0;
 
@@ -205,6 +264,14 @@ ssize_t b_buffer_flush(b_buffer *buf) {
     if (buf->size == 0)           return 0;
     if (buf->unused == buf->size) return 0;
 
+    if (buf->compress) {
+        if ((ret = b_compress_write(buf->compress, buf->fd, buf->data, buf->size)) < 0) {
+            return ret;
+        }
+
+        off = buf->size;
+    }
+
     while ((off < buf->size) || (ret < 0 && errno == EINTR)) {
         if ((ret = write(buf->fd, buf->data + off, buf->size - off)) < 0) {
             if (errno != EINTR)
@@ -225,6 +292,70 @@ ssize_t b_buffer_flush(b_buffer *buf) {
     return ret;
 }
 
+/*
+ * Write only the portion of the buffer filled thus far, rather than the whole
+ * of it as b_buffer_flush() does, so that the output can be cut at a member
+ * boundary without zero padding appearing mid-archive.
+ */
+ssize_t b_buffer_drain(b_buffer *buf) {
+    size_t used;
+
+    if (buf == NULL || buf->data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buf->fd == 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((used = buf->size - buf->unused) == 0) return 0;
+
+    if (buf->compress) {
+        if (b_compress_write(buf->compress, buf->fd, buf->data, used) < 0) {
+            return -1;
+        }
+    } else if (b_write_all(buf->fd, buf->data, used) < 0) {
+        return -1;
+    }
+
+    memset(buf->data, 0x00, used);
+
+    buf->unused = buf->size;
+
+    return used;
+}
+
+/*
+ * Cause any data held within the compressor, if any, to be written to the
+ * output file descriptor.  The buffer itself should be flushed beforehand.
+ */
+int b_buffer_sync(b_buffer *buf) {
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buf->compress == NULL) return 0;
+
+    return b_compress_flush(buf->compress, buf->fd);
+}
+
+/*
+ * As above, but also end the current compressed stream.
+ */
+int b_buffer_finish(b_buffer *buf) {
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buf->compress == NULL) return 0;
+
+    return b_compress_finish(buf->compress, buf->fd);
+}
+
 void b_buffer_reset(b_buffer *buf) {
     if (buf == NULL) return;
 
@@ -244,9 +375,20 @@ void b_buffer_destroy(b_buffer *buf) {
         buf->data = NULL;
     }
 
-    buf->fd     = 0;
-    buf->size   = 0;
-    buf->unused = 0;
+    if (buf->read_data) {
+        free(buf->read_data);
+        buf->read_data = NULL;
+    }
+
+    if (buf->compress) {
+        b_compress_destroy(buf->compress);
+        buf->compress = NULL;
+    }
+
+    buf->fd        = 0;
+    buf->size      = 0;
+    buf->unused    = 0;
+    buf->read_size = 0;
 
     free(buf);
 }
@@ -13,26 +13,39 @@
 
 #define B_BUFFER_DEFAULT_FACTOR 20
 #define B_BUFFER_BLOCK_SIZE     512
+#define B_BUFFER_READ_ALIGN     4096
+
+#define B_BUFFER_PADDED_SIZE(size) \
+    (((off_t)(size) + B_BUFFER_BLOCK_SIZE - 1) & ~(off_t)(B_BUFFER_BLOCK_SIZE - 1))
 
 #include <sys/types.h>
+#include "b_compress.h"
 
 typedef struct _b_buffer {
-    int    fd;
-    int    can_splice;
-    size_t size;
-    size_t unused;
-    void * data;
+    int          fd;
+    int          can_splice;
+    size_t       size;
+    size_t       unused;
+    void *       data;
+    size_t       read_size;
+    void *       read_data;
+    b_compress * compress;
 } b_buffer;
 
 b_buffer * b_buffer_new(size_t factor);
 int        b_buffer_get_fd(b_buffer *buf);
 void       b_buffer_set_fd(b_buffer *buf, int fd);
+int        b_buffer_set_read_size(b_buffer *buf, size_t size);
+void       b_buffer_set_compress(b_buffer *buf, b_compress *compress);
 size_t     b_buffer_size(b_buffer *buf);
 size_t     b_buffer_unused(b_buffer *buf);
 int        b_buffer_full(b_buffer *buf);
 off_t      b_buffer_reclaim(b_buffer *buf, size_t used, size_t given);
 void *     b_buffer_get_block(b_buffer *buf, size_t len, off_t *given);
 ssize_t    b_buffer_flush(b_buffer *buf);
+ssize_t    b_buffer_drain(b_buffer *buf);
+int        b_buffer_sync(b_buffer *buf);
+int        b_buffer_finish(b_buffer *buf);
 void       b_buffer_reset(b_buffer *buf);
 void       b_buffer_destroy(b_buffer *buf);
 
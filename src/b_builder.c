@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -6,6 +7,8 @@
 #include <sys/sysmacros.h>
 #endif /* __GLIBC__ */
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <errno.h>
 #include "match_engine.h"
 #include "b_util.h"
@@ -15,6 +18,16 @@
 #include "b_header.h"
 #include "b_stack.h"
 #include "b_buffer.h"
+#include "b_pread.h"
+#include "b_index.h"
+#include "b_reader.h"
+#include "b_snapshot.h"
+#include "b_previous.h"
+#include "b_journal.h"
+#include "b_filter.h"
+#include "b_mount.h"
+#include "b_inode_set.h"
+#include "b_manifest.h"
 #include "b_builder.h"
 
 struct path_data {
@@ -60,14 +73,36 @@ b_builder *b_builder_new(size_t block_factor) {
         goto error_error_new;
     }
 
-    builder->total           = 0;
-    builder->match           = NULL;
-    builder->options         = B_BUILDER_NONE;
-    builder->user_lookup     = NULL;
-    builder->user_cache      = NULL;
-    builder->hardlink_lookup = NULL;
-    builder->hardlink_cache  = NULL;
-    builder->data            = NULL;
+    builder->pread_pool       = NULL;
+    builder->total            = 0;
+    builder->match            = NULL;
+    builder->filter           = NULL;
+    builder->tags             = NULL;
+    builder->archived         = NULL;
+    builder->max_open_dirs    = 0;
+    builder->mounts           = NULL;
+    builder->options          = B_BUILDER_NONE;
+    builder->user_lookup      = NULL;
+    builder->user_cache       = NULL;
+    builder->hardlink_lookup  = NULL;
+    builder->hardlink_cache   = NULL;
+    builder->frame_size       = 0;
+    builder->frame_index_fd   = 0;
+    builder->frame_count      = 0;
+    builder->frame_offset     = 0;
+    builder->frame_raw_offset = 0;
+    builder->frame_members    = 0;
+    builder->frame_first      = NULL;
+    builder->index            = NULL;
+    builder->index_member     = NULL;
+    builder->snapshot         = NULL;
+    builder->deletions_fd     = 0;
+    builder->previous         = NULL;
+    builder->journal          = NULL;
+    builder->journal_len      = 0;
+    builder->estimate         = NULL;
+    builder->manifest         = NULL;
+    builder->data             = NULL;
 
     return builder;
 
@@ -110,402 +145,1759 @@ void b_builder_set_data(b_builder *builder, void *data) {
 }
 
 /*
- * The caller should assume responsibility for initializing and destroying the
- * user lookup service as appropriate.
+ * Enable reading the contents of files larger than chunk_size bytes in
+ * parallel, using the given number of threads.  A thread count of zero
+ * returns to reading all files sequentially.
  */
-void b_builder_set_user_lookup(b_builder *builder, b_user_lookup service, void *ctx) {
-    builder->user_lookup = service;
-    builder->user_cache     = ctx;
+int b_builder_set_read_threads(b_builder *builder, size_t threads, size_t chunk_size) {
+    b_pread_pool *pool = NULL;
+
+    if (builder == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (threads && (pool = b_pread_pool_new(threads, chunk_size)) == NULL) {
+        return -1;
+    }
+
+    b_pread_pool_destroy(builder->pread_pool);
+
+    builder->pread_pool = pool;
+
+    return 0;
 }
 
-void b_builder_set_hardlink_cache(b_builder *builder, b_hardlink_lookup lookup, void *cache) {
-    builder->hardlink_lookup = lookup;
-    builder->hardlink_cache  = cache;
+/*
+ * Begin a new compressed frame at the first member boundary after each
+ * frame_size bytes of archive data, so that any member can be extracted by
+ * decompressing from the start of the frame holding it.  Requires that a
+ * compressor has already been installed on the buffer.
+ */
+int b_builder_set_frame_size(b_builder *builder, size_t frame_size) {
+    b_compress *compress;
+
+    if (builder == NULL || (compress = builder->buf->compress) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (frame_size && b_compress_log_frames(compress) < 0) {
+        return -1;
+    }
+
+    builder->frame_size       = frame_size;
+    builder->frame_offset     = compress->out_total;
+    builder->frame_raw_offset = compress->in_total;
+
+    return 0;
 }
 
-int b_builder_is_excluded(b_builder *builder, const char *path) {
-    return lafe_excluded(builder->match, path);
+/*
+ * Write one line of JSON to the file descriptor given describing each frame
+ * as it is completed.
+ */
+void b_builder_set_frame_index_fd(b_builder *builder, int fd) {
+    if (builder == NULL) return;
+
+    builder->frame_index_fd = fd;
 }
 
-int b_builder_include(b_builder *builder, const char *pattern) {
-    return lafe_include(&builder->match, pattern);
+static int frame_index_write(b_builder *builder) {
+    b_compress *compress = builder->buf->compress;
+    b_string *line;
+    char numbers[160];
+    int ret = -1;
+
+    if (builder->frame_index_fd == 0) return 0;
+
+    snprintf(numbers, sizeof(numbers),
+        "{\"frame\":%llu,\"offset\":%llu,\"size\":%llu,\"raw_offset\":%llu,\"raw_size\":%llu,\"first_member\":",
+        (unsigned long long)builder->frame_count,
+        (unsigned long long)builder->frame_offset,
+        (unsigned long long)(compress->out_total - builder->frame_offset),
+        (unsigned long long)builder->frame_raw_offset,
+        (unsigned long long)(compress->in_total - builder->frame_raw_offset)
+    );
+
+    if ((line = b_string_new(numbers)) == NULL) {
+        goto error_string_new;
+    }
+
+    if (builder->frame_first) {
+        if (b_string_append_json(line, builder->frame_first) == NULL) {
+            goto error_append;
+        }
+    } else if (b_string_append_str(line, "null") == NULL) {
+        goto error_append;
+    }
+
+    snprintf(numbers, sizeof(numbers), ",\"members\":%llu}\n",
+        (unsigned long long)builder->frame_members
+    );
+
+    if (b_string_append_str(line, numbers) == NULL) {
+        goto error_append;
+    }
+
+    ret = b_write_all(builder->frame_index_fd, line->str, line->len);
+
+error_append:
+    b_string_free(line);
+
+error_string_new:
+    return ret;
 }
 
-int b_builder_include_from_file(b_builder *builder, const char *file) {
-    return lafe_include_from_file(&builder->match, file, 0);
+/*
+ * End the current compressed frame, describing it in the frame index, and
+ * begin the next one at the current position in the archive.
+ */
+static int frame_end(b_builder *builder) {
+    b_compress *compress = builder->buf->compress;
+
+    if (b_compress_finish(compress, builder->buf->fd) < 0) {
+        return -1;
+    }
+
+    if (compress->in_total > builder->frame_raw_offset) {
+        if (frame_index_write(builder) < 0) {
+            return -1;
+        }
+
+        builder->frame_count++;
+    }
+
+    b_string_free(builder->frame_first);
+
+    builder->frame_first      = NULL;
+    builder->frame_members    = 0;
+    builder->frame_offset     = compress->out_total;
+    builder->frame_raw_offset = compress->in_total;
+
+    return 0;
 }
 
-int b_builder_exclude(b_builder *builder, const char *pattern) {
-    return lafe_exclude(&builder->match, pattern);
+/*
+ * Called prior to writing each member: if the current frame has grown past
+ * the frame size, cut it here, then count the member towards the frame.
+ */
+static int frame_member(b_builder *builder, b_string *member_name) {
+    b_buffer *buf = builder->buf;
+    uint64_t raw_size = buf->compress->in_total + (buf->size - buf->unused) - builder->frame_raw_offset;
+
+    if (raw_size >= builder->frame_size) {
+        if (b_buffer_drain(buf) < 0) {
+            return -1;
+        }
+
+        if (frame_end(builder) < 0) {
+            return -1;
+        }
+    }
+
+    if (builder->frame_first == NULL) {
+        if ((builder->frame_first = b_string_dup(member_name)) == NULL) {
+            return -1;
+        }
+    }
+
+    builder->frame_members++;
+
+    return 0;
 }
 
-int b_builder_exclude_from_file(b_builder *builder, const char *file) {
-    return lafe_exclude_from_file(&builder->match, file);
+static b_index *builder_index(b_builder *builder) {
+    if (builder->index == NULL) {
+        builder->index = b_index_new();
+    }
+
+    return builder->index;
 }
 
-static int encode_longlink(b_builder *builder, b_header_block *block, b_string *path, int type, off_t *wrlen) {
-    b_buffer *buf = builder->buf;
-    b_error *err  = builder->err;
+/*
+ * Write an index line for each member to the file descriptor given, listing
+ * the offsets of its header and data within the uncompressed tar stream.
+ */
+int b_builder_set_index_fd(b_builder *builder, int fd) {
+    b_index *index;
 
-    if (path == NULL) {
-        return 0;
+    if (builder == NULL) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if (b_header_encode_longlink_block(block, path, type) == NULL) {
+    if ((index = builder_index(builder)) == NULL) {
         return -1;
     }
 
-    builder->total += *wrlen;
+    b_index_set_fd(index, fd);
 
-    if ((*wrlen = b_file_write_path_blocks(buf, path)) < 0) {
-        if (err) {
-            b_error_set(err, B_ERROR_FATAL, errno, "Cannot write long filename header", path);
-        }
+    return 0;
+}
+
+/*
+ * Collect the member index in a temporary file as the archive is written, and
+ * append it to the archive as a final member of the name given upon finish.
+ */
+int b_builder_set_index_member(b_builder *builder, const char *name) {
+    b_index *index;
+    b_string *member;
+
+    if (builder == NULL || name == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((index = builder_index(builder)) == NULL) {
+        return -1;
+    }
+
+    if (b_index_open_tmp(index) < 0) {
+        return -1;
+    }
 
+    if ((member = b_string_new((char *)name)) == NULL) {
         return -1;
     }
 
-    builder->total += *wrlen;
+    b_string_free(builder->index_member);
+
+    builder->index_member = member;
 
     return 0;
 }
 
-static struct path_data *path_split(b_string *path, struct stat *st) {
-    struct path_data *data;
+/*
+ * Archive only those members which are new or have changed since the snapshot
+ * at the path given was taken, if it exists, and replace it with a snapshot
+ * of this run upon finish.
+ */
+int b_builder_set_snapshot(b_builder *builder, const char *path) {
+    b_snapshot *snapshot;
 
-    b_stack *prefix_items, *suffix_items;
-    size_t prefix_size = 0, suffix_size = 0;
-    int add_to_prefix = 0;
+    if (builder == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    b_stack *parts;
-    b_string *item;
+    if ((snapshot = b_snapshot_open(path)) == NULL) {
+        return -1;
+    }
 
-    if ((data = malloc(sizeof(*data))) == NULL) {
-        goto error_data_malloc;
+    b_snapshot_destroy(builder->snapshot);
+
+    builder->snapshot = snapshot;
+
+    return 0;
+}
+
+/*
+ * Upon finish, list the members of the previous snapshot which were not seen
+ * in this run, one per line, on the file descriptor given.
+ */
+void b_builder_set_deletions_fd(b_builder *builder, int fd) {
+    if (builder == NULL) return;
+
+    builder->deletions_fd = fd;
+}
+
+/*
+ * Forget a member found deleted in a partial run, such that it is listed as
+ * deleted, and no longer recorded in the next snapshot.
+ */
+int b_builder_forget_member(b_builder *builder, b_string *member_name) {
+    if (builder->snapshot == NULL) return 0;
+
+    return b_snapshot_remove(builder->snapshot, member_name);
+}
+
+/*
+ * Consume the first len bytes of the journal at the path given upon finish,
+ * once the changes they record have been archived.
+ */
+int b_builder_set_journal(b_builder *builder, const char *path, off_t len) {
+    b_string *journal;
+
+    if ((journal = b_string_new((char *)path)) == NULL) {
+        return -1;
     }
 
-    if ((parts = b_path_new(path)) == NULL) {
-        goto error_path_new;
+    b_string_free(builder->journal);
+
+    builder->journal     = journal;
+    builder->journal_len = len;
+
+    return 0;
+}
+
+/*
+ * Copy regular files found unchanged since the previous, uncompressed archive
+ * open on the file descriptor given was written straight from that archive,
+ * rather than reading them anew.  The member index written alongside the
+ * previous archive is read in full from index_fd.
+ */
+int b_builder_set_previous(b_builder *builder, int fd, int index_fd) {
+    b_previous *previous;
+
+    if (builder == NULL) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if ((prefix_items = b_stack_new(0)) == NULL) {
-        goto error_prefix_items;
+    if ((previous = b_previous_open(fd, index_fd)) == NULL) {
+        return -1;
     }
 
-    if ((suffix_items = b_stack_new(0)) == NULL) {
-        goto error_suffix_items;
+    b_previous_destroy(builder->previous);
+
+    builder->previous = previous;
+
+    return 0;
+}
+
+/*
+ * Prepare to add members to the existing, uncompressed archive open for
+ * reading and writing on the file descriptor given.  The end-of-archive marker
+ * is located by reading member headers alone, seeking over their contents, and
+ * the archive is truncated there, so that new members follow the last.
+ */
+int b_builder_open_for_append(b_builder *builder, int fd) {
+    b_reader *reader;
+    b_reader_entry *entry;
+    off_t end;
+    int ret;
+
+    if (builder == NULL || builder->buf->compress) {
+        errno = EINVAL;
+        return -1;
     }
 
-    b_stack_set_destructor(parts,        B_STACK_DESTRUCTOR(b_string_free));
-    b_stack_set_destructor(prefix_items, B_STACK_DESTRUCTOR(b_string_free));
-    b_stack_set_destructor(suffix_items, B_STACK_DESTRUCTOR(b_string_free));
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        goto error_lseek;
+    }
 
-    data->truncated = 0;
+    if ((reader = b_reader_new(1)) == NULL) {
+        goto error_reader_new;
+    }
 
-    if (b_stack_count(parts) == 0) {
-        goto error_empty_stack;
+    if (b_reader_set_fd(reader, fd) < 0) {
+        goto error_reader;
     }
 
-    /*
-     * Strip the leading / from the path, if present.
-     */
-    if (b_string_len(b_stack_item_at(parts, 0)) == 0) {
-        b_string *leading = b_stack_shift(parts);
+    if (!reader->seekable) {
+        errno = ESPIPE;
+        goto error_reader;
+    }
 
-        b_string_free(leading);
+    reader->headers_only = 1;
+
+    while ((ret = b_reader_next(reader, &entry)) > 0) {}
+
+    if (ret < 0) {
+        goto error_reader;
     }
 
-    while ((item = b_stack_pop(parts)) != NULL) {
-        if (suffix_size && suffix_size + item->len >= B_HEADER_SUFFIX_SIZE) {
-            add_to_prefix = 1;
-        }
+    end = reader->pos;
 
-        /* directory will have a / added to the end */
-        if ( ( (st->st_mode & S_IFMT) == S_IFDIR ) && ( suffix_size + item->len + 1 >= B_HEADER_SUFFIX_SIZE ) ) {
-            add_to_prefix = 1;
-        }
+    b_reader_destroy(reader);
 
-        if (add_to_prefix) {
-            if (prefix_size) prefix_size++; /* Add 1 to make room for path separator */
-            prefix_size += item->len;
-        } else {
-            if (suffix_size) suffix_size++; /* ^-- Ditto */
-            suffix_size += item->len;
-        }
+    if (ftruncate(fd, end) < 0) {
+        goto error_lseek;
+    }
 
-        if (b_stack_push(add_to_prefix? prefix_items: suffix_items, item) == NULL) {
-            goto error_item;
-        }
+    if (lseek(fd, end, SEEK_SET) < 0) {
+        goto error_lseek;
     }
 
-    b_stack_destroy(parts);
+    b_buffer_set_fd(builder->buf, fd);
 
-    /*
-     * Assemble the prefix and suffix strings.
-     */
-    if ((data->prefix = b_string_join("/", b_stack_reverse(prefix_items))) == NULL) {
-        goto error_prefix;
+    builder->total = end;
+
+    return 0;
+
+error_reader:
+    b_reader_destroy(reader);
+
+error_reader_new:
+error_lseek:
+    return -1;
+}
+
+/*
+ * Append the member index collected thus far to the archive.  The index
+ * itself is detached from the builder in the meantime, so that the index
+ * member is not listed within itself.
+ */
+static int write_index_member(b_builder *builder) {
+    b_index *index       = builder->index;
+    b_snapshot *snapshot = builder->snapshot;
+    struct stat st;
+    off_t size;
+    int ret;
+
+    if (b_index_flush(index) < 0) {
+        return -1;
     }
 
-    if ((data->suffix = b_string_join("/", b_stack_reverse(suffix_items))) == NULL) {
-        goto error_suffix;
+    if ((size = lseek(index->tmp_fd, 0, SEEK_END)) < 0) {
+        return -1;
     }
 
-    /*
-     * If the item we are dealing with is a directory, then always consider the
-     * trailing slash in its representation.
-     */
-    if ((st->st_mode & S_IFMT) == S_IFDIR) {
-        suffix_size++;
-        b_string_append_str(data->suffix, "/");
+    if (lseek(index->tmp_fd, 0, SEEK_SET) < 0) {
+        return -1;
     }
 
-    /*
-     * If either of these cases are true, then in normal circumstances the path
-     * prefix or suffix MUST be truncated to fix into a tar header's corresponding
-     * fields.
-     *
-     * Note that this calculation MUST happen after any other path suffix or prefix
-     * size calculations are complete.
-     */
-    if (suffix_size > B_HEADER_SUFFIX_SIZE || prefix_size > B_HEADER_PREFIX_SIZE) {
-        data->truncated = 1;
+    memset(&st, 0x00, sizeof(st));
+
+    st.st_mode  = S_IFREG | 0644;
+    st.st_nlink = 1;
+    st.st_uid   = getuid();
+    st.st_gid   = getgid();
+    st.st_size  = size;
+    st.st_mtime = time(NULL);
+
+    builder->index    = NULL;
+    builder->snapshot = NULL;
+
+    ret = b_builder_write_file(builder, builder->index_member, builder->index_member, &st, index->tmp_fd);
+
+    builder->index    = index;
+    builder->snapshot = snapshot;
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    return b_index_truncate_tmp(index);
+}
+
+/*
+ * Called prior to writing each regular file, to store rather than compress the
+ * member if its contents appear incompressible.  The compressor is switched at
+ * the member boundary, so only on transitions between compressible and
+ * incompressible members.  Files too small to be worth probing are always
+ * compressed, rather than left under whichever setting the last file larger
+ * than them happened to choose.
+ */
+static int compress_member(b_builder *builder, b_string *path, off_t size, int fd) {
+    b_buffer *buf = builder->buf;
+    int store;
+
+    store = size < B_FILE_PROBE_MIN_SIZE? 0: b_file_is_incompressible(path, fd, size);
+
+    if (store == buf->compress->store) return 0;
+
+    if (b_buffer_drain(buf) < 0) {
+        return -1;
+    }
+
+    /*
+     * zstd only changes level at the start of a frame, so when frames are
+     * being indexed, end the current one here such that it is recorded.
+     */
+    if (builder->frame_size && buf->compress->codec == B_COMPRESS_ZSTD && buf->compress->pool == NULL) {
+        if (frame_end(builder) < 0) {
+            return -1;
+        }
+    }
+
+    return b_compress_set_store(buf->compress, buf->fd, store);
+}
+
+/*
+ * The caller should assume responsibility for initializing and destroying the
+ * user lookup service as appropriate.
+ */
+void b_builder_set_user_lookup(b_builder *builder, b_user_lookup service, void *ctx) {
+    builder->user_lookup = service;
+    builder->user_cache     = ctx;
+}
+
+void b_builder_set_hardlink_cache(b_builder *builder, b_hardlink_lookup lookup, void *cache) {
+    builder->hardlink_lookup = lookup;
+    builder->hardlink_cache  = cache;
+}
+
+void b_builder_set_max_open_dirs(b_builder *builder, size_t max) {
+    builder->max_open_dirs = max;
+}
+
+/*
+ * Install a filter to be applied to each item found while walking a tree,
+ * replacing any installed previously.  The builder takes ownership of it.
+ */
+void b_builder_set_filter(b_builder *builder, b_filter *filter) {
+    b_filter_destroy(builder->filter);
+
+    builder->filter = filter;
+}
+
+/*
+ * Install the set of filesystem types whose mounts are not to be descended
+ * into, replacing any installed previously.  The builder takes ownership of
+ * it.
+ */
+void b_builder_set_mounts(b_builder *builder, b_mounts *mounts) {
+    b_mounts_destroy(builder->mounts);
+
+    builder->mounts = mounts;
+}
+
+/*
+ * When deduplicating, every inode archived by b_find() is noted, across all
+ * the paths given to it and for as long as the builder lives, so that an
+ * inode reached again is not archived twice.
+ */
+int b_builder_set_dedupe(b_builder *builder, int dedupe) {
+    if (!dedupe) {
+        b_inode_set_destroy(builder->archived);
+        builder->archived = NULL;
+
+        return 0;
+    }
+
+    if (builder->archived == NULL && (builder->archived = b_inode_set_new()) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int b_builder_is_excluded(b_builder *builder, const char *path) {
+    return lafe_excluded(builder->match, path);
+}
+
+int b_builder_include(b_builder *builder, const char *pattern) {
+    return lafe_include(&builder->match, pattern);
+}
+
+int b_builder_include_from_file(b_builder *builder, const char *file) {
+    return lafe_include_from_file(&builder->match, file, 0);
+}
+
+int b_builder_exclude(b_builder *builder, const char *pattern) {
+    return lafe_exclude(&builder->match, pattern);
+}
+
+int b_builder_exclude_from_file(b_builder *builder, const char *file) {
+    return lafe_exclude_from_file(&builder->match, file);
+}
+
+static void b_builder_tag_destroy(b_builder_tag *tag) {
+    if (tag == NULL) return;
+
+    b_string_free(tag->name);
+    tag->name = NULL;
+
+    free(tag);
+}
+
+/*
+ * Exclude the contents of any directory holding a file of the name given,
+ * which b_find() looks for as each directory is reached, before reading it.
+ */
+int b_builder_exclude_tag(b_builder *builder, const char *name, enum b_builder_tag_type type) {
+    b_builder_tag *tag;
+
+    if (name[0] == '\0' || strchr(name, '/') != NULL) {
+        errno = EINVAL;
+
+        goto error_name;
+    }
+
+    if (builder->tags == NULL) {
+        if ((builder->tags = b_stack_new(0)) == NULL) {
+            goto error_stack_new;
+        }
+
+        b_stack_set_destructor(builder->tags, B_STACK_DESTRUCTOR(b_builder_tag_destroy));
+    }
+
+    if ((tag = malloc(sizeof(*tag))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((tag->name = b_string_new((char *)name)) == NULL) {
+        goto error_string_new;
+    }
+
+    tag->type = type;
+
+    if (b_stack_push(builder->tags, tag) == NULL) {
+        goto error_stack_push;
+    }
+
+    return 0;
+
+error_stack_push:
+    b_string_free(tag->name);
+
+error_string_new:
+    free(tag);
+
+error_malloc:
+error_stack_new:
+error_name:
+    return -1;
+}
+
+static int encode_longlink(b_builder *builder, b_string *path, int type) {
+    b_buffer *buf = builder->buf;
+    b_error *err  = builder->err;
+
+    b_header_block *block;
+    off_t wrlen = 0;
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    if ((block = b_buffer_get_block(buf, B_HEADER_SIZE, &wrlen)) == NULL) {
+        return -1;
+    }
+
+    if (b_header_encode_longlink_block(block, path, type) == NULL) {
+        return -1;
+    }
+
+    builder->total += wrlen;
+
+    if ((wrlen = b_file_write_path_blocks(buf, path)) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot write long filename header", path);
+        }
+
+        return -1;
+    }
+
+    builder->total += wrlen;
+
+    return 0;
+}
+
+static struct path_data *path_split(b_string *path, struct stat *st) {
+    struct path_data *data;
+
+    b_stack *prefix_items, *suffix_items;
+    size_t prefix_size = 0, suffix_size = 0;
+    int add_to_prefix = 0;
+
+    b_stack *parts;
+    b_string *item;
+
+    if ((data = malloc(sizeof(*data))) == NULL) {
+        goto error_data_malloc;
+    }
+
+    if ((parts = b_path_new(path)) == NULL) {
+        goto error_path_new;
+    }
+
+    if ((prefix_items = b_stack_new(0)) == NULL) {
+        goto error_prefix_items;
+    }
+
+    if ((suffix_items = b_stack_new(0)) == NULL) {
+        goto error_suffix_items;
+    }
+
+    b_stack_set_destructor(parts,        B_STACK_DESTRUCTOR(b_string_free));
+    b_stack_set_destructor(prefix_items, B_STACK_DESTRUCTOR(b_string_free));
+    b_stack_set_destructor(suffix_items, B_STACK_DESTRUCTOR(b_string_free));
+
+    data->truncated = 0;
+
+    if (b_stack_count(parts) == 0) {
+        goto error_empty_stack;
+    }
+
+    /*
+     * Strip the leading / from the path, if present.
+     */
+    if (b_string_len(b_stack_item_at(parts, 0)) == 0) {
+        b_string *leading = b_stack_shift(parts);
+
+        b_string_free(leading);
+    }
+
+    while ((item = b_stack_pop(parts)) != NULL) {
+        if (suffix_size && suffix_size + item->len >= B_HEADER_SUFFIX_SIZE) {
+            add_to_prefix = 1;
+        }
+
+        /* directory will have a / added to the end */
+        if ( ( (st->st_mode & S_IFMT) == S_IFDIR ) && ( suffix_size + item->len + 1 >= B_HEADER_SUFFIX_SIZE ) ) {
+            add_to_prefix = 1;
+        }
+
+        if (add_to_prefix) {
+            if (prefix_size) prefix_size++; /* Add 1 to make room for path separator */
+            prefix_size += item->len;
+        } else {
+            if (suffix_size) suffix_size++; /* ^-- Ditto */
+            suffix_size += item->len;
+        }
+
+        if (b_stack_push(add_to_prefix? prefix_items: suffix_items, item) == NULL) {
+            goto error_item;
+        }
+    }
+
+    b_stack_destroy(parts);
+
+    /*
+     * Assemble the prefix and suffix strings.
+     */
+    if ((data->prefix = b_string_join("/", b_stack_reverse(prefix_items))) == NULL) {
+        goto error_prefix;
+    }
+
+    if ((data->suffix = b_string_join("/", b_stack_reverse(suffix_items))) == NULL) {
+        goto error_suffix;
+    }
+
+    /*
+     * If the item we are dealing with is a directory, then always consider the
+     * trailing slash in its representation.
+     */
+    if ((st->st_mode & S_IFMT) == S_IFDIR) {
+        suffix_size++;
+        b_string_append_str(data->suffix, "/");
+    }
+
+    /*
+     * If either of these cases are true, then in normal circumstances the path
+     * prefix or suffix MUST be truncated to fix into a tar header's corresponding
+     * fields.
+     *
+     * Note that this calculation MUST happen after any other path suffix or prefix
+     * size calculations are complete.
+     */
+    if (suffix_size > B_HEADER_SUFFIX_SIZE || prefix_size > B_HEADER_PREFIX_SIZE) {
+        data->truncated = 1;
+    }
+
+    b_stack_destroy(prefix_items);
+    b_stack_destroy(suffix_items);
+
+    return data;
+
+error_suffix:
+    b_string_free(data->prefix);
+
+error_prefix:
+error_item:
+error_empty_stack:
+    b_stack_destroy(suffix_items);
+
+error_suffix_items:
+    b_stack_destroy(prefix_items);
+
+error_prefix_items:
+    b_stack_destroy(parts);
+
+error_path_new:
+    free(data);
+
+error_data_malloc:
+    return NULL;
+}
+
+/*
+ * When deduplicating, any file may turn out to be reached again by another
+ * path, and so is remembered as if it had other links.
+ */
+static inline int is_hardlink(b_builder *builder, struct stat *st) {
+    return (st->st_mode & S_IFMT) == S_IFREG && (st->st_nlink > 1 || builder->archived);
+}
+
+static b_header *header_for_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st) {
+    b_header *ret;
+
+    struct path_data *path_data;
+
+    if ((ret = malloc(sizeof(*ret))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((path_data = path_split(member_name, st)) == NULL) {
+        goto error_path_data;
+    }
+
+    ret->truncated = path_data->truncated;
+    ret->prefix    = path_data->prefix;
+    ret->suffix    = path_data->suffix;
+    ret->mode      = st->st_mode;
+    ret->uid       = st->st_uid;
+    ret->gid       = st->st_gid;
+    ret->size      = (st->st_mode & S_IFMT) == S_IFREG? st->st_size: 0;
+    ret->mtime     = st->st_mtime;
+    ret->major     = major(st->st_dev);
+    ret->minor     = minor(st->st_dev);
+    ret->linktype  = inode_linktype(st);
+    ret->linkdest  = NULL;
+    ret->user      = NULL;
+    ret->group     = NULL;
+
+    ret->truncated_link = 0;
+
+    if ((st->st_mode & S_IFMT) == S_IFLNK) {
+        if ((ret->linkdest = b_readlink(path, st)) == NULL) {
+            goto error_readlink;
+        }
+    } else if (is_hardlink(builder, st) && builder->hardlink_lookup) {
+        b_string *linkdest;
+
+        if (linkdest = builder->hardlink_lookup(builder->hardlink_cache, st->st_dev, st->st_ino, member_name)) {
+            ret->linktype = '0' + S_IF_HARDLINK;
+            ret->linkdest = linkdest;
+        }
+    }
+
+    if (ret->linkdest && b_string_len(ret->linkdest) > B_HEADER_LINKDEST_SIZE) {
+        ret->truncated_link = 1;
+    }
+
+    /*
+     * free() path_data, but keep its prefix and suffix with us, as we will free() those
+     * ourselves b_header_destroy()
+     */
+    free(path_data);
+
+    return ret;
+
+error_readlink:
+    b_string_free(path_data->prefix);
+    b_string_free(path_data->suffix);
+
+    free(path_data);
+
+error_path_data:
+    free(ret);
+
+error_malloc:
+    return NULL;
+}
+
+/*
+ * Write the header of a member, preceded by a GNU LongLink or PAX extended
+ * header if its name or link destination do not fit within it.
+ */
+static int write_header(b_builder *builder, b_header *header, b_string *member_name, int is_dir) {
+    b_buffer *buf = builder->buf;
+    b_error *err  = builder->err;
+
+    b_header_block *block;
+    b_string *longlink_path = NULL;
+    off_t wrlen = 0;
+
+    /*
+     * If the header is marked to contain truncated paths, then write a GNU
+     * longlink header, followed by the blocks containing the path name to be
+     * assigned.
+     */
+    if (header->truncated || header->truncated_link) {
+        /*
+         * GNU extensions must be explicitly enabled to encode GNU LongLink
+         * headers.
+         */
+        if (!(builder->options & B_BUILDER_EXTENSIONS_MASK)) {
+            errno = ENAMETOOLONG;
+
+            if (err) {
+                b_error_set(err, B_ERROR_WARN, errno, "File name too long", member_name);
+            }
+
+            goto error_path_toolong;
+        }
+
+        if ((longlink_path = b_string_dup(member_name)) == NULL) {
+            goto error_longlink_path_dup;
+        }
+
+        if (is_dir) {
+            if ((b_string_append_str(longlink_path, "/")) == NULL) {
+                goto error_longlink_path;
+            }
+        }
+
+        if (builder->options & B_BUILDER_GNU_EXTENSIONS) {
+            if (header->truncated && encode_longlink(builder, longlink_path, B_HEADER_LONGLINK_TYPE) < 0) {
+                goto error_longlink_path;
+            }
+
+            if (header->truncated_link && encode_longlink(builder, header->linkdest, B_HEADER_LONGDEST_TYPE) < 0) {
+                goto error_longlink_path;
+            }
+        } else if (builder->options & B_BUILDER_PAX_EXTENSIONS) {
+            if ((block = b_buffer_get_block(buf, B_HEADER_SIZE, &wrlen)) == NULL) {
+                goto error_longlink_path;
+            }
+
+            if (b_header_encode_pax_block(block, header, longlink_path) == NULL) {
+                goto error_longlink_path;
+            }
+
+            builder->total += wrlen;
+
+            if ((wrlen = b_file_write_pax_path_blocks(buf, longlink_path, header->linkdest)) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_FATAL, errno, "Cannot write long filename header", member_name);
+                }
+
+                goto error_longlink_path;
+            }
+
+            builder->total += wrlen;
+        }
+
+        b_string_free(longlink_path);
+    }
+
+    /*
+     * Then, of course, encode and write the real file header block.
+     */
+    if ((block = b_buffer_get_block(buf, B_HEADER_SIZE, &wrlen)) == NULL) {
+        goto error_get_header_block;
+    }
+
+    if (b_header_encode_block(block, header) == NULL) {
+        goto error_header_encode;
+    }
+
+    builder->total += wrlen;
+
+    return 0;
+
+error_longlink_path:
+    b_string_free(longlink_path);
+
+error_longlink_path_dup:
+error_get_header_block:
+error_header_encode:
+error_path_toolong:
+    return -1;
+}
+
+/*
+ * Return the number of bytes write_header() would write for the header given,
+ * or -1 if it would refuse to write it at all.
+ */
+static off_t header_size(b_builder *builder, b_header *header, b_string *member_name, int is_dir) {
+    size_t len  = b_string_len(member_name) + (is_dir? 1: 0);
+    off_t  size = B_HEADER_SIZE;
+
+    if (!header->truncated && !header->truncated_link) {
+        return size;
+    }
+
+    if (!(builder->options & B_BUILDER_EXTENSIONS_MASK)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (builder->options & B_BUILDER_GNU_EXTENSIONS) {
+        if (header->truncated) {
+            size += B_HEADER_SIZE + B_BUFFER_PADDED_SIZE(len);
+        }
+
+        if (header->truncated_link) {
+            size += B_HEADER_SIZE + B_BUFFER_PADDED_SIZE(b_string_len(header->linkdest));
+        }
+    } else if (builder->options & B_BUILDER_PAX_EXTENSIONS) {
+        b_string *longlink_path;
+        size_t pax_len;
+
+        if ((longlink_path = b_string_dup(member_name)) == NULL) {
+            return -1;
+        }
+
+        if (is_dir && b_string_append_str(longlink_path, "/") == NULL) {
+            b_string_free(longlink_path);
+            return -1;
+        }
+
+        pax_len = b_header_compute_pax_length(longlink_path, "path");
+
+        if (header->linkdest) {
+            pax_len += b_header_compute_pax_length(header->linkdest, "linkpath");
+        }
+
+        b_string_free(longlink_path);
+
+        size += B_HEADER_SIZE + B_BUFFER_PADDED_SIZE(pax_len);
+    }
+
+    return size;
+}
+
+/*
+ * Find the member of the previous archive which may be copied in place of the
+ * file given, if any.  Beyond the size, modification time and inode of the
+ * file matching those recorded in the index, the header block which would be
+ * written for it must match that in the previous archive byte for byte, so
+ * that changes to ownership or permissions are not missed.
+ */
+static b_index_entry *previous_member(b_builder *builder, b_header *header, b_string *member_name, struct stat *st) {
+    b_index_entry *entry;
+    b_header_block old, new;
+
+    if (!B_HEADER_IS_IFREG(header)) {
+        return NULL;
+    }
+
+    if ((entry = b_previous_find(builder->previous, member_name)) == NULL) {
+        return NULL;
+    }
+
+    if (entry->size != st->st_size || entry->mtime != st->st_mtime || entry->ino != st->st_ino || entry->dev != st->st_dev) {
+        return NULL;
+    }
+
+    if (b_previous_read(builder->previous, entry->data_offset - B_HEADER_SIZE, &old, sizeof(old)) < 0) {
+        return NULL;
+    }
+
+    memset(&new, 0x00, sizeof(new));
+
+    if (b_header_encode_block(&new, header) == NULL) {
+        return NULL;
+    }
+
+    return memcmp(&old, &new, sizeof(old)) == 0? entry: NULL;
+}
+
+/*
+ * Copy a member of the previous archive, headers and all, to the archive.
+ * Members which would fill the buffer are copied straight from one file
+ * descriptor to the other, so long as they need not be compressed on the way;
+ * others are read into the buffer.
+ */
+static int write_previous_member(b_builder *builder, b_index_entry *entry) {
+    b_buffer *buf = builder->buf;
+    off_t size    = B_PREVIOUS_MEMBER_SIZE(entry);
+    off_t offset  = entry->offset;
+
+    if (buf->compress == NULL && size >= buf->size) {
+        off_t copied;
+
+        if (b_buffer_drain(buf) < 0) {
+            return -1;
+        }
+
+        if ((copied = b_previous_copy(builder->previous, entry, buf->fd)) < 0) {
+            return -1;
+        }
+
+        builder->total += copied;
+
+        return 0;
+    }
+
+    while (size > 0) {
+        void *block;
+        size_t len;
+        off_t given;
+
+        if (b_buffer_full(buf) && b_buffer_flush(buf) < 0) {
+            return -1;
+        }
+
+        len = b_buffer_unused(buf) < size? b_buffer_unused(buf): size;
+
+        if ((block = b_buffer_get_block(buf, len, &given)) == NULL) {
+            return -1;
+        }
+
+        if (b_previous_read(builder->previous, offset, block, len) < 0) {
+            return -1;
+        }
+
+        builder->total += given;
+        offset         += len;
+        size           -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Open a regular file found by a walk which only stat()ed it, and write it as
+ * found anew by fstat(), as its size may since have changed.
+ */
+static int write_unopened_file(b_builder *builder, b_string *path, b_string *member_name) {
+    b_error *err = builder->err;
+    int oflags   = O_RDONLY | O_NONBLOCK;
+    int ret      = -1;
+    int fd;
+
+    struct stat st;
+
+    if (!(builder->options & B_BUILDER_FOLLOW_SYMLINKS)) {
+        oflags |= O_NOFOLLOW;
+    }
+
+    if ((fd = open(path->str, oflags)) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_WARN, errno, "Cannot open file", path);
+        }
+
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, oflags & ~O_NONBLOCK) < 0 || fstat(fd, &st) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_WARN, errno, "Cannot fstat() file descriptor", path);
+        }
+
+        goto error_fstat;
+    }
+
+    ret = b_builder_write_file(builder, path, member_name, &st, S_ISREG(st.st_mode)? fd: 0);
+
+error_fstat:
+    close(fd);
+
+    return ret;
+}
+
+int b_builder_write_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st, int fd) {
+    b_buffer *buf = builder->buf;
+    b_error *err  = builder->err;
+
+    off_t wrlen = 0;
+    off_t offset, data_offset;
+
+    b_header *header;
+    b_index_entry *previous = NULL;
+
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (err) {
+        b_error_clear(err);
+    }
+
+    /*
+     * Members unchanged since the previous snapshot are passed over, though
+     * still recorded in the next.
+     */
+    if (builder->snapshot && !b_snapshot_changed(builder->snapshot, member_name, st)) {
+        if (b_snapshot_add(builder->snapshot, member_name, st) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_FATAL, errno, "Cannot record file in snapshot", path);
+            }
+
+            return -1;
+        }
+
+        return 1;
+    }
+
+    /*
+     * When walking with B_FIND_STAT_ONLY, regular files are only opened once
+     * found to have changed.
+     */
+    if (fd == 0 && S_ISREG(st->st_mode)) {
+        return write_unopened_file(builder, path, member_name);
+    }
+
+    if ((header = header_for_file(builder, path, member_name, st)) == NULL) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot build header for file", path);
+        }
+
+        goto error_header_for_file;
+    }
+
+    /*
+     * If there is a user lookup service installed, then resolve the user and
+     * group of the current filesystem object and supply them within the
+     * b_header object.
+     */
+    if (builder->user_lookup != NULL) {
+        b_string *user = NULL, *group = NULL;
+
+        if (builder->user_lookup(builder->user_cache, st->st_uid, st->st_gid, &user, &group) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_WARN, errno, "Cannot lookup user and group for file", path);
+            }
+
+            goto error_lookup;
+        }
+
+        if (b_header_set_usernames(header, user, group) < 0) {
+            goto error_lookup;
+        }
+    }
+
+    if ((builder->options & B_BUILDER_COMPRESSION_BYPASS) && buf->compress && B_HEADER_IS_IFREG(header) && fd > 0) {
+        if (compress_member(builder, path, header->size, fd) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_FATAL, errno, "Cannot change compression level", path);
+            }
+
+            goto error_frame;
+        }
+    }
+
+    if (builder->frame_size && frame_member(builder, member_name) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot start new compressed frame", path);
+        }
+
+        goto error_frame;
+    }
+
+    offset = builder->total;
+
+    /*
+     * Files unchanged since the previous archive are copied from it as they
+     * are, without being read at all.
+     */
+    if (builder->previous && (previous = previous_member(builder, header, member_name, st)) != NULL) {
+        if (write_previous_member(builder, previous) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_FATAL, errno, "Cannot copy member from previous archive", path);
+            }
+
+            goto error_write;
+        }
+
+        data_offset = offset + (previous->data_offset - previous->offset);
+    } else if (write_header(builder, header, member_name, (st->st_mode & S_IFMT) == S_IFDIR) < 0) {
+        goto error_write;
+    } else {
+        data_offset = builder->total;
+    }
+
+    /*
+     * Finally, end by writing the file contents.
+     */
+    if (B_HEADER_IS_IFREG(header) && fd > 0 && previous == NULL) {
+        if (b_pread_pool_wants(builder->pread_pool, header->size)) {
+            wrlen = b_pread_pool_write_contents(builder->pread_pool, buf, fd, header->size);
+        } else {
+            wrlen = b_file_write_contents(buf, fd, header->size);
+        }
+
+        if (wrlen < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_WARN, errno, "Cannot write file to archive", path);
+            }
+
+            goto error_write;
+        }
+
+        builder->total += wrlen;
+    }
+
+    if (builder->index) {
+        b_index_entry entry;
+
+        entry.name        = member_name;
+        entry.offset      = offset;
+        entry.data_offset = data_offset;
+        entry.size        = B_HEADER_IS_IFREG(header)? header->size: 0;
+        entry.mtime       = header->mtime;
+        entry.type        = header->linktype;
+        entry.dev         = st->st_dev;
+        entry.ino         = st->st_ino;
+
+        if (b_index_write(builder->index, &entry) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_FATAL, errno, "Cannot write member index", path);
+            }
+
+            goto error_write;
+        }
+    }
+
+    if (builder->snapshot && b_snapshot_add(builder->snapshot, member_name, st) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot record file in snapshot", path);
+        }
+
+        goto error_write;
+    }
+
+    b_header_destroy(header);
+
+    return 1;
+
+error_write:
+error_frame:
+error_lookup:
+    b_header_destroy(header);
+
+error_header_for_file:
+    return -1;
+}
+
+/*
+ * Begin a dry run, accounting for any data already held in the output buffer.
+ */
+void b_builder_estimate_begin(b_builder *builder, b_builder_estimate *estimate) {
+    b_buffer *buf = builder->buf;
+
+    estimate->written = 0;
+    estimate->fill    = buf->size - buf->unused;
+    estimate->files   = 0;
+    estimate->dirs    = 0;
+
+    builder->estimate = estimate;
+}
+
+/*
+ * Account for data passed through the output buffer, which is only ever
+ * written a whole buffer at a time.
+ */
+static void estimate_buffered(b_builder *builder, off_t len) {
+    b_builder_estimate *estimate = builder->estimate;
+    off_t size                   = builder->buf->size;
+
+    estimate->fill    += len;
+    estimate->written += estimate->fill - estimate->fill % size;
+    estimate->fill    %= size;
+}
+
+/*
+ * A callback for b_find() which, in place of b_builder_write_file(), accounts
+ * for the member it would write for the file given, without reading the file
+ * or writing anything.  The same decisions are made as to which members are
+ * written, and how, so that the estimate is exact for uncompressed output.
+ */
+int b_builder_estimate_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st, int fd) {
+    b_builder_estimate *estimate = builder->estimate;
+    b_buffer *buf                = builder->buf;
+    b_error *err                 = builder->err;
+
+    b_header *header;
+    b_index_entry *previous = NULL;
+    int is_dir = (st->st_mode & S_IFMT) == S_IFDIR;
+    off_t size;
+
+    if (estimate == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (err) {
+        b_error_clear(err);
+    }
+
+    if (builder->snapshot && !b_snapshot_peek(builder->snapshot, member_name, st)) {
+        return 1;
+    }
+
+    /*
+     * Files which b_builder_write_file() would be unable to open are left
+     * out, without opening them here.
+     */
+    if (S_ISREG(st->st_mode) && fd == 0 && faccessat(AT_FDCWD, path->str, R_OK, 0) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_WARN, errno, "Cannot open file", path);
+        }
+
+        return -1;
+    }
+
+    if ((header = header_for_file(builder, path, member_name, st)) == NULL) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot build header for file", path);
+        }
+
+        return -1;
+    }
+
+    if (builder->previous && (previous = previous_member(builder, header, member_name, st)) != NULL) {
+        size = B_PREVIOUS_MEMBER_SIZE(previous);
+
+        /*
+         * As in write_previous_member(), large members are copied around the
+         * buffer once it has been drained.
+         */
+        if (buf->compress == NULL && size >= buf->size) {
+            estimate->written += estimate->fill + size;
+            estimate->fill     = 0;
+        } else {
+            estimate_buffered(builder, size);
+        }
+    } else if ((size = header_size(builder, header, member_name, is_dir)) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_WARN, errno, "File name too long", member_name);
+        }
+
+        b_header_destroy(header);
+
+        return -1;
+    } else {
+        if (B_HEADER_IS_IFREG(header)) {
+            size += B_BUFFER_PADDED_SIZE(header->size);
+        }
+
+        estimate_buffered(builder, size);
+    }
+
+    if (is_dir) {
+        estimate->dirs++;
+    } else {
+        estimate->files++;
+    }
+
+    b_header_destroy(header);
+
+    return 1;
+}
+
+/*
+ * End a dry run, returning the number of bytes which would have been written
+ * once the archive is finished, including the remainder of the last buffer.
+ */
+off_t b_builder_estimate_end(b_builder *builder) {
+    b_builder_estimate *estimate = builder->estimate;
+
+    if (estimate == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (estimate->fill) {
+        estimate->written += builder->buf->size;
+        estimate->fill     = 0;
+    }
+
+    builder->estimate = NULL;
+
+    return estimate->written;
+}
+
+/*
+ * A callback for b_find() which records each file found in the manifest being
+ * planned, to be archived later by b_builder_write_manifest().
+ */
+int b_builder_plan_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st, int fd) {
+    b_error *err = builder->err;
+
+    if (builder->manifest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (b_manifest_add(builder->manifest, path, member_name, st) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot add file to manifest", path);
+        }
+
+        return -1;
+    }
+
+    return 1;
+}
+
+static int write_manifest_member(b_builder *builder, b_manifest *manifest, uint64_t index) {
+    b_error *err = builder->err;
+    int oflags   = O_RDONLY | O_NONBLOCK;
+    int fd       = 0;
+    int ret      = -1;
+
+    b_string *path, *member_name;
+    struct stat st;
+
+    if (!(builder->options & B_BUILDER_FOLLOW_SYMLINKS)) {
+        oflags |= O_NOFOLLOW;
+    }
+
+    if ((path = b_string_new(b_manifest_path(manifest, index))) == NULL) {
+        goto error_path;
+    }
+
+    if ((member_name = b_string_new(b_manifest_member(manifest, index))) == NULL) {
+        goto error_member_name;
+    }
+
+    b_manifest_stat(manifest, index, &st);
+
+    /*
+     * Only the contents of regular files are needed, and their sizes may have
+     * since changed, so they alone are examined anew.
+     */
+    if (S_ISREG(st.st_mode)) {
+        if ((fd = open(path->str, oflags)) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_WARN, errno, "Cannot open file", path);
+            }
+
+            goto error_open;
+        }
+
+        if (fcntl(fd, F_SETFL, oflags & ~O_NONBLOCK) < 0 || fstat(fd, &st) < 0) {
+            if (err) {
+                b_error_set(err, B_ERROR_WARN, errno, "Cannot fstat() file descriptor", path);
+            }
+
+            goto error_open;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+            close(fd);
+            fd = 0;
+        }
+    }
+
+    ret = b_builder_write_file(builder, path, member_name, &st, fd);
+
+error_open:
+    if (fd > 0) {
+        close(fd);
     }
 
-    b_stack_destroy(prefix_items);
-    b_stack_destroy(suffix_items);
+    b_string_free(member_name);
 
-    return data;
+error_member_name:
+    b_string_free(path);
 
-error_suffix:
-    b_string_free(data->prefix);
+error_path:
+    return ret;
+}
 
-error_prefix:
-error_item:
-error_empty_stack:
-    b_stack_destroy(suffix_items);
+/*
+ * Archive each member of a manifest in turn, in the order given therein,
+ * optionally prefetching the contents of those coming up next and reporting
+ * progress after each member.  As with b_find(), members which cannot be
+ * archived are passed over with a warning, unless the error is fatal.
+ */
+int b_builder_write_manifest(b_builder *builder, b_manifest *manifest, uint64_t prefetch, b_builder_progress progress, void *ctx) {
+    b_error *err   = builder->err;
+    uint64_t bytes = 0;
+    uint64_t pos;
 
-error_suffix_items:
-    b_stack_destroy(prefix_items);
+    manifest->prefetched = 0;
 
-error_prefix_items:
-    b_stack_destroy(parts);
+    for (pos=0; pos<manifest->count; pos++) {
+        uint64_t index = manifest->order[pos];
 
-error_path_new:
-    free(data);
+        if (prefetch) {
+            b_manifest_prefetch(manifest, pos + 1, prefetch);
+        }
 
-error_data_malloc:
-    return NULL;
-}
+        if (write_manifest_member(builder, manifest, index) < 0) {
+            if (err == NULL || b_error_fatal(err)) {
+                return -1;
+            }
+        }
+
+        if (S_ISREG(manifest->modes[index])) {
+            bytes += manifest->sizes[index];
+        }
 
-static inline int is_hardlink(struct stat *st) {
-    return (st->st_mode & S_IFMT) == S_IFREG && st->st_nlink > 1;
+        if (progress) {
+            progress(ctx, pos + 1, bytes);
+        }
+    }
+
+    return 0;
 }
 
-static b_header *header_for_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st) {
+static b_header *header_for_member(b_header *from, b_string *member_name, b_string *linkdest) {
     b_header *ret;
-
     struct path_data *path_data;
+    struct stat st;
 
-    if ((ret = malloc(sizeof(*ret))) == NULL) {
-        goto error_malloc;
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        goto error_calloc;
     }
 
-    if ((path_data = path_split(member_name, st)) == NULL) {
+    /*
+     * Only the type of the member is considered in splitting its name.
+     */
+    st.st_mode = from->linktype == '5'? S_IFDIR: S_IFREG;
+
+    if ((path_data = path_split(member_name, &st)) == NULL) {
         goto error_path_data;
     }
 
     ret->truncated = path_data->truncated;
     ret->prefix    = path_data->prefix;
     ret->suffix    = path_data->suffix;
-    ret->mode      = st->st_mode;
-    ret->uid       = st->st_uid;
-    ret->gid       = st->st_gid;
-    ret->size      = (st->st_mode & S_IFMT) == S_IFREG? st->st_size: 0;
-    ret->mtime     = st->st_mtime;
-    ret->major     = major(st->st_dev);
-    ret->minor     = minor(st->st_dev);
-    ret->linktype  = inode_linktype(st);
-    ret->linkdest  = NULL;
-    ret->user      = NULL;
-    ret->group     = NULL;
+    ret->mode      = from->mode;
+    ret->uid       = from->uid;
+    ret->gid       = from->gid;
+    ret->size      = from->size;
+    ret->mtime     = from->mtime;
+    ret->major     = from->major;
+    ret->minor     = from->minor;
+    ret->linktype  = from->linktype? from->linktype: '0';
 
-    ret->truncated_link = 0;
+    free(path_data);
 
-    if ((st->st_mode & S_IFMT) == S_IFLNK) {
-        if ((ret->linkdest = b_readlink(path, st)) == NULL) {
-            goto error_readlink;
-        }
-    } else if (is_hardlink(st) && builder->hardlink_lookup) {
-        b_string *linkdest;
+    if (linkdest == NULL) {
+        linkdest = from->linkdest;
+    }
 
-        if (linkdest = builder->hardlink_lookup(builder->hardlink_cache, st->st_dev, st->st_ino, member_name)) {
-            ret->linktype = '0' + S_IF_HARDLINK;
-            ret->linkdest = linkdest;
-        }
+    if (linkdest && (ret->linkdest = b_string_dup(linkdest)) == NULL) {
+        goto error_dup;
+    }
+
+    if (from->user && (ret->user = b_string_dup(from->user)) == NULL) {
+        goto error_dup;
+    }
+
+    if (from->group && (ret->group = b_string_dup(from->group)) == NULL) {
+        goto error_dup;
     }
 
     if (ret->linkdest && b_string_len(ret->linkdest) > B_HEADER_LINKDEST_SIZE) {
         ret->truncated_link = 1;
     }
 
-    /*
-     * free() path_data, but keep its prefix and suffix with us, as we will free() those
-     * ourselves b_header_destroy()
-     */
-    free(path_data);
-
     return ret;
 
-error_readlink:
-    b_string_free(path_data->prefix);
-    b_string_free(path_data->suffix);
+error_dup:
+    b_header_destroy(ret);
 
-    free(path_data);
+    return NULL;
 
 error_path_data:
     free(ret);
 
-error_malloc:
+error_calloc:
     return NULL;
 }
 
-int b_builder_write_file(b_builder *builder, b_string *path, b_string *member_name, struct stat *st, int fd) {
+/*
+ * Pass the contents of the member being read on to the archive.  Contents
+ * which would fill the buffer are copied straight from one file descriptor to
+ * the other, with copy_file_range() or splice() where possible, so long as
+ * they need not be compressed on the way.
+ */
+static int write_member_contents(b_builder *builder, b_reader *reader, off_t size) {
     b_buffer *buf = builder->buf;
-    b_error *err  = builder->err;
 
-    off_t wrlen = 0;
+    if (buf->compress == NULL && size >= buf->size) {
+        size_t padding = size % B_BUFFER_BLOCK_SIZE? B_BUFFER_BLOCK_SIZE - (size % B_BUFFER_BLOCK_SIZE): 0;
 
-    b_header *header;
-    b_header_block *block;
+        if (b_buffer_drain(buf) < 0) {
+            return -1;
+        }
 
-    if (buf == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+        if (b_reader_copy_data(reader, buf->fd) < size) {
+            if (errno == 0) errno = EIO;
 
-    if (err) {
-        b_error_clear(err);
-    }
+            return -1;
+        }
 
-    if ((header = header_for_file(builder, path, member_name, st)) == NULL) {
-        if (err) {
-            b_error_set(err, B_ERROR_FATAL, errno, "Cannot build header for file", path);
+        /*
+         * Having just been drained, the buffer holds nothing but zeroes.
+         */
+        if (padding && b_write_all(buf->fd, buf->data, padding) < 0) {
+            return -1;
         }
 
-        goto error_header_for_file;
+        builder->total += size + padding;
+
+        return 0;
     }
 
-    /*
-     * If there is a user lookup service installed, then resolve the user and
-     * group of the current filesystem object and supply them within the
-     * b_header object.
-     */
-    if (builder->user_lookup != NULL) {
-        b_string *user = NULL, *group = NULL;
+    while (size > 0) {
+        void *block;
+        size_t len;
+        off_t given;
 
-        if (builder->user_lookup(builder->user_cache, st->st_uid, st->st_gid, &user, &group) < 0) {
-            if (err) {
-                b_error_set(err, B_ERROR_WARN, errno, "Cannot lookup user and group for file", path);
-            }
+        if (b_buffer_full(buf) && b_buffer_flush(buf) < 0) {
+            return -1;
+        }
 
-            goto error_lookup;
+        len = b_buffer_unused(buf) < size? b_buffer_unused(buf): size;
+
+        if ((block = b_buffer_get_block(buf, len, &given)) == NULL) {
+            return -1;
         }
 
-        if (b_header_set_usernames(header, user, group) < 0) {
-            goto error_lookup;
+        if (b_reader_read_data(reader, block, len) < (ssize_t)len) {
+            if (errno == 0) errno = EIO;
+
+            return -1;
         }
+
+        builder->total += given;
+        size           -= len;
     }
 
-    /*
-     * If the header is marked to contain truncated paths, then write a GNU
-     * longlink header, followed by the blocks containing the path name to be
-     * assigned.
-     */
-    if (header->truncated || header->truncated_link) {
-        b_string *longlink_path;
+    return 0;
+}
 
-        /*
-         * GNU extensions must be explicitly enabled to encode GNU LongLink
-         * headers.
-         */
-        if (!(builder->options & B_BUILDER_EXTENSIONS_MASK)) {
-            errno = ENAMETOOLONG;
+/*
+ * Copy the current member of an archive being read to the archive being
+ * written, under the member name given, and with the link target given in
+ * place of its own if not NULL.  The member header is written anew, while the
+ * member contents are passed through untouched.
+ */
+int b_builder_write_member(b_builder *builder, b_reader *reader, b_reader_entry *entry, b_string *member_name, b_string *linkdest) {
+    b_error *err = builder->err;
+    b_header *header;
+    off_t offset, data_offset;
 
-            if (err) {
-                b_error_set(err, B_ERROR_WARN, errno, "File name too long", member_name);
-            }
+    if (err) {
+        b_error_clear(err);
+    }
 
-            goto error_path_toolong;
+    if ((header = header_for_member(entry->header, member_name, linkdest)) == NULL) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot build header for member", entry->path);
         }
 
-        if ((block = b_buffer_get_block(buf, B_HEADER_SIZE, &wrlen)) == NULL) {
-            goto error_get_header_block;
-        }
+        goto error_header_for_member;
+    }
 
-        if ((longlink_path = b_string_dup(member_name)) == NULL) {
-            goto error_longlink_path_dup;
-        }
+    header->size = entry->data_size;
 
-        if ((st->st_mode & S_IFMT) == S_IFDIR) {
-            if ((b_string_append_str(longlink_path, "/")) == NULL) {
-                goto error_longlink_path_append;
-            }
+    if (builder->frame_size && frame_member(builder, member_name) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot start new compressed frame", entry->path);
         }
 
-        if (builder->options & B_BUILDER_GNU_EXTENSIONS) {
-            if (header->truncated && encode_longlink(builder, block, longlink_path, B_HEADER_LONGLINK_TYPE, &wrlen) < 0) {
-                goto error_header_encode;
-            }
-
-            if (header->truncated_link && encode_longlink(builder, block, header->linkdest, B_HEADER_LONGDEST_TYPE, &wrlen) < 0) {
-                goto error_header_encode;
-            }
-        } else if (builder->options & B_BUILDER_PAX_EXTENSIONS) {
-            if (b_header_encode_pax_block(block, header, longlink_path) == NULL) {
-                goto error_header_encode;
-            }
+        goto error_write;
+    }
 
-            builder->total += wrlen;
+    offset = builder->total;
 
-            if ((wrlen = b_file_write_pax_path_blocks(buf, longlink_path, header->linkdest)) < 0) {
-                if (err) {
-                    b_error_set(err, B_ERROR_FATAL, errno, "Cannot write long filename header", member_name);
-                }
+    if (write_header(builder, header, member_name, header->linktype == '5') < 0) {
+        goto error_write;
+    }
 
-                goto error_write;
-            }
+    data_offset = builder->total;
 
-            builder->total += wrlen;
+    if (entry->data_size && write_member_contents(builder, reader, entry->data_size) < 0) {
+        if (err) {
+            b_error_set(err, B_ERROR_FATAL, errno, "Cannot copy member to archive", entry->path);
         }
-    }
 
-    /*
-     * Then, of course, encode and write the real file header block.
-     */
-    if ((block = b_buffer_get_block(buf, B_HEADER_SIZE, &wrlen)) == NULL) {
         goto error_write;
     }
 
-    if (b_header_encode_block(block, header) == NULL) {
-        goto error_header_encode;
-    }
+    if (builder->index) {
+        b_index_entry item;
 
-    builder->total += wrlen;
+        item.name        = member_name;
+        item.offset      = offset;
+        item.data_offset = data_offset;
+        item.size        = entry->data_size;
+        item.mtime       = header->mtime;
+        item.type        = header->linktype;
+        item.dev         = 0;
+        item.ino         = 0;
 
-    /*
-     * Finally, end by writing the file contents.
-     */
-    if (B_HEADER_IS_IFREG(header) && fd > 0) {
-        if ((wrlen = b_file_write_contents(buf, fd, header->size)) < 0) {
+        if (b_index_write(builder->index, &item) < 0) {
             if (err) {
-                b_error_set(err, B_ERROR_WARN, errno, "Cannot write file to archive", path);
+                b_error_set(err, B_ERROR_FATAL, errno, "Cannot write member index", entry->path);
             }
 
             goto error_write;
         }
-
-        builder->total += wrlen;
     }
 
     b_header_destroy(header);
@@ -513,18 +1905,90 @@ int b_builder_write_file(b_builder *builder, b_string *path, b_string *member_na
     return 1;
 
 error_write:
-error_longlink_path_append:
-error_longlink_path_dup:
-error_get_header_block:
-error_path_toolong:
-error_header_encode:
-error_lookup:
     b_header_destroy(header);
 
-error_header_for_file:
+error_header_for_member:
     return -1;
 }
 
+/*
+ * Append the member index as a final member if requested, write out the
+ * remainder of the archive, end the compressed stream if any, and when
+ * framing, describe the final frame and write the zstd seek table.
+ */
+ssize_t b_builder_finish(b_builder *builder) {
+    b_buffer *buf;
+    ssize_t ret;
+
+    if (builder == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    buf = builder->buf;
+
+    if (builder->index) {
+        if (builder->index_member && write_index_member(builder) < 0) {
+            return -1;
+        }
+
+        if (b_index_flush(builder->index) < 0) {
+            return -1;
+        }
+    }
+
+    if ((ret = b_buffer_flush(buf)) < 0) {
+        return ret;
+    }
+
+    if (builder->frame_size) {
+        if (frame_end(builder) < 0) {
+            return -1;
+        }
+
+        if (b_compress_write_seek_table(buf->compress, buf->fd) < 0) {
+            return -1;
+        }
+
+        builder->frame_count      = 0;
+        builder->frame_offset     = buf->compress->out_total;
+        builder->frame_raw_offset = buf->compress->in_total;
+    } else if (b_buffer_finish(buf) < 0) {
+        return -1;
+    }
+
+    /*
+     * The snapshot is only replaced once the archive is complete.
+     */
+    if (builder->snapshot) {
+        if (builder->deletions_fd && b_snapshot_write_deleted(builder->snapshot, builder->deletions_fd) < 0) {
+            return -1;
+        }
+
+        if (b_snapshot_save(builder->snapshot) < 0) {
+            return -1;
+        }
+
+        b_snapshot_destroy(builder->snapshot);
+        builder->snapshot = NULL;
+    }
+
+    /*
+     * Changes are left in the journal to be tried again next time should any
+     * member have failed to archive.
+     */
+    if (builder->journal) {
+        if (!(builder->err && b_error_warn(builder->err)) && b_journal_consume(builder->journal->str, builder->journal_len) < 0) {
+            return -1;
+        }
+
+        b_string_free(builder->journal);
+        builder->journal = NULL;
+    }
+
+    return ret;
+}
+
 void b_builder_destroy(b_builder *builder) {
     if (builder == NULL) return;
 
@@ -533,11 +1997,46 @@ void b_builder_destroy(b_builder *builder) {
         builder->buf = NULL;
     }
 
+    if (builder->pread_pool) {
+        b_pread_pool_destroy(builder->pread_pool);
+        builder->pread_pool = NULL;
+    }
+
     if (builder->err) {
         b_error_destroy(builder->err);
         builder->err = NULL;
     }
 
+    if (builder->frame_first) {
+        b_string_free(builder->frame_first);
+        builder->frame_first = NULL;
+    }
+
+    if (builder->index) {
+        b_index_destroy(builder->index);
+        builder->index = NULL;
+    }
+
+    if (builder->index_member) {
+        b_string_free(builder->index_member);
+        builder->index_member = NULL;
+    }
+
+    if (builder->snapshot) {
+        b_snapshot_destroy(builder->snapshot);
+        builder->snapshot = NULL;
+    }
+
+    if (builder->previous) {
+        b_previous_destroy(builder->previous);
+        builder->previous = NULL;
+    }
+
+    if (builder->journal) {
+        b_string_free(builder->journal);
+        builder->journal = NULL;
+    }
+
     builder->options = B_BUILDER_NONE;
     builder->total   = 0;
     builder->data    = NULL;
@@ -546,5 +2045,21 @@ void b_builder_destroy(b_builder *builder) {
 
     builder->match = NULL;
 
+    b_filter_destroy(builder->filter);
+
+    builder->filter = NULL;
+
+    b_mounts_destroy(builder->mounts);
+
+    builder->mounts = NULL;
+
+    b_stack_destroy(builder->tags);
+
+    builder->tags = NULL;
+
+    b_inode_set_destroy(builder->archived);
+
+    builder->archived = NULL;
+
     free(builder);
 }
@@ -11,16 +11,30 @@
 #ifndef _B_BUILDER_H
 #define _B_BUILDER_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include "b_stack.h"
 #include "b_string.h"
 #include "b_header.h"
 #include "b_buffer.h"
+#include "b_pread.h"
+#include "b_index.h"
 #include "b_error.h"
+#include "b_reader.h"
+#include "b_snapshot.h"
+#include "b_previous.h"
+#include "b_filter.h"
+#include "b_mount.h"
+#include "b_inode_set.h"
+#include "b_manifest.h"
 
 #define B_USER_LOOKUP(s) ((b_user_lookup)s)
 #define B_HARDLINK_LOOKUP(s) ((b_hardlink_lookup)s)
 
+#define B_BUILDER_CACHEDIR_TAG            "CACHEDIR.TAG"
+#define B_BUILDER_CACHEDIR_SIGNATURE      "Signature: 8a477f597d28d172789f06886806bc55"
+#define B_BUILDER_CACHEDIR_SIGNATURE_SIZE 43
+
 enum b_builder_options {
     B_BUILDER_NONE               = 0,
     B_BUILDER_QUIET              = 1 << 0,
@@ -30,10 +44,29 @@ enum b_builder_options {
     B_BUILDER_GNU_EXTENSIONS     = 1 << 4,
     B_BUILDER_PAX_EXTENSIONS     = 1 << 5,
     B_BUILDER_IGNORE_SOCKETS     = 1 << 6,
+    B_BUILDER_COMPRESSION_BYPASS = 1 << 7,
+    B_BUILDER_SORT_INODES        = 1 << 8,
+    B_BUILDER_ONE_FILE_SYSTEM    = 1 << 9,
     B_BUILDER_EXTENSIONS_MASK    = (B_BUILDER_GNU_EXTENSIONS |
                                     B_BUILDER_PAX_EXTENSIONS)
 };
 
+/*
+ * A file whose presence in a directory excludes the contents of that
+ * directory, save for the tag itself, or everything beneath it.  Cache
+ * directory tags only count when they begin with the expected signature.
+ */
+enum b_builder_tag_type {
+    B_BUILDER_TAG,
+    B_BUILDER_TAG_UNDER,
+    B_BUILDER_TAG_CACHEDIR
+};
+
+typedef struct _b_builder_tag {
+    b_string *              name;
+    enum b_builder_tag_type type;
+} b_builder_tag;
+
 typedef int (*b_user_lookup)(
     void *      ctx,
     uid_t       uid,
@@ -42,6 +75,12 @@ typedef int (*b_user_lookup)(
     b_string ** group
 );
 
+typedef void (*b_builder_progress)(
+    void *   ctx,
+    uint64_t members,
+    uint64_t bytes
+);
+
 typedef b_string * (*b_hardlink_lookup)(
     void *     ctx,
     dev_t      dev,
@@ -49,16 +88,49 @@ typedef b_string * (*b_hardlink_lookup)(
     b_string * path
 );
 
+/*
+ * The running totals of a dry run, which accounts for each member as it would
+ * be written to the output buffer without writing anything at all.
+ */
+typedef struct _b_builder_estimate {
+    off_t  written;
+    off_t  fill;
+    size_t files;
+    size_t dirs;
+} b_builder_estimate;
+
 typedef struct _b_builder {
     b_buffer *             buf;
+    b_pread_pool *         pread_pool;
     b_error *              err;
     size_t                 total;
     struct lafe_matching * match;
+    b_filter *             filter;
+    b_stack *              tags;
+    b_inode_set *          archived;
+    size_t                 max_open_dirs;
+    b_mounts *             mounts;
     enum b_builder_options options;
     b_user_lookup          user_lookup;
     void *                 user_cache;
     b_hardlink_lookup      hardlink_lookup;
     void *                 hardlink_cache;
+    size_t                 frame_size;
+    int                    frame_index_fd;
+    uint64_t               frame_count;
+    uint64_t               frame_offset;
+    uint64_t               frame_raw_offset;
+    uint64_t               frame_members;
+    b_string *             frame_first;
+    b_index *              index;
+    b_string *             index_member;
+    b_snapshot *           snapshot;
+    int                    deletions_fd;
+    b_previous *           previous;
+    b_string *             journal;
+    off_t                  journal_len;
+    b_builder_estimate *   estimate;
+    b_manifest *           manifest;
     void *                 data;
 } b_builder;
 
@@ -80,6 +152,64 @@ void b_builder_set_data(
     void *      data
 );
 
+int b_builder_set_read_threads(
+    b_builder * builder,
+    size_t      threads,
+    size_t      chunk_size
+);
+
+int b_builder_set_frame_size(
+    b_builder * builder,
+    size_t      frame_size
+);
+
+void b_builder_set_frame_index_fd(
+    b_builder * builder,
+    int         fd
+);
+
+int b_builder_set_index_fd(
+    b_builder * builder,
+    int         fd
+);
+
+int b_builder_set_index_member(
+    b_builder *  builder,
+    const char * name
+);
+
+int b_builder_set_snapshot(
+    b_builder *  builder,
+    const char * path
+);
+
+void b_builder_set_deletions_fd(
+    b_builder * builder,
+    int         fd
+);
+
+int b_builder_forget_member(
+    b_builder * builder,
+    b_string *  member_name
+);
+
+int b_builder_set_journal(
+    b_builder *  builder,
+    const char * path,
+    off_t        len
+);
+
+int b_builder_set_previous(
+    b_builder * builder,
+    int         fd,
+    int         index_fd
+);
+
+int b_builder_open_for_append(
+    b_builder * builder,
+    int         fd
+);
+
 void b_builder_set_user_lookup(
     b_builder *      builder,
     b_user_lookup service,
@@ -92,6 +222,26 @@ void b_builder_set_hardlink_cache(
     void *            cache
 );
 
+void b_builder_set_max_open_dirs(
+    b_builder * builder,
+    size_t      max
+);
+
+void b_builder_set_filter(
+    b_builder * builder,
+    b_filter *  filter
+);
+
+void b_builder_set_mounts(
+    b_builder * builder,
+    b_mounts *  mounts
+);
+
+int b_builder_set_dedupe(
+    b_builder * builder,
+    int         dedupe
+);
+
 int b_builder_is_excluded(
     b_builder *  builder,
     const char * path
@@ -117,6 +267,12 @@ int b_builder_exclude_from_file(
     const char * file
 );
 
+int b_builder_exclude_tag(
+    b_builder *             builder,
+    const char *            name,
+    enum b_builder_tag_type type
+);
+
 int b_builder_write_file(
     b_builder *   builder,
     b_string *    path,
@@ -125,6 +281,47 @@ int b_builder_write_file(
     int           fd
 );
 
+void b_builder_estimate_begin(
+    b_builder *          builder,
+    b_builder_estimate * estimate
+);
+
+int b_builder_estimate_file(
+    b_builder *   builder,
+    b_string *    path,
+    b_string *    member_name,
+    struct stat * st,
+    int           fd
+);
+
+off_t b_builder_estimate_end(b_builder *builder);
+
+int b_builder_plan_file(
+    b_builder *   builder,
+    b_string *    path,
+    b_string *    member_name,
+    struct stat * st,
+    int           fd
+);
+
+int b_builder_write_manifest(
+    b_builder *        builder,
+    b_manifest *       manifest,
+    uint64_t           prefetch,
+    b_builder_progress progress,
+    void *             ctx
+);
+
+int b_builder_write_member(
+    b_builder *      builder,
+    b_reader *       reader,
+    b_reader_entry * entry,
+    b_string *       member_name,
+    b_string *       linkdest
+);
+
+ssize_t b_builder_finish(b_builder *builder);
+
 void b_builder_destroy(b_builder *builder);
 
 #endif /* _B_BUILDER_H */
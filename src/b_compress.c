@@ -0,0 +1,1293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "b_compress.h"
+
+#define B_COMPRESS_LZ4_CHUNK (64 * 1024)
+
+#define B_COMPRESS_ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define B_COMPRESS_ZSTD_SEEKABLE_MAGIC  0x8F92EAB1
+#define B_COMPRESS_ZSTD_SEEKABLE_FOOTER 9
+
+static struct {
+    const char *          name;
+    enum b_compress_codec codec;
+} codec_names[] = {
+    { "none", B_COMPRESS_NONE },
+    { "gzip", B_COMPRESS_GZIP },
+    { "gz",   B_COMPRESS_GZIP },
+    { "zstd", B_COMPRESS_ZSTD },
+    { "lz4",  B_COMPRESS_LZ4  },
+    { NULL,   B_COMPRESS_NONE }
+};
+
+int b_compress_codec_by_name(const char *name, enum b_compress_codec *codec) {
+    int i;
+
+    for (i=0; codec_names[i].name; i++) {
+        if (strcmp(name, codec_names[i].name) == 0) {
+            *codec = codec_names[i].codec;
+
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+
+    return -1;
+}
+
+int b_compress_available(enum b_compress_codec codec) {
+    switch (codec) {
+        case B_COMPRESS_NONE: return 1;
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: return 1;
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:  return 1;
+#endif
+        default: break;
+    }
+
+    return 0;
+}
+
+static int write_out(b_compress *c, int fd, const unsigned char *data, size_t len) {
+    size_t off = 0;
+
+    while (off < len) {
+        ssize_t ret;
+
+        if ((ret = write(fd, data + off, len - off)) < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        }
+
+        off += ret;
+    }
+
+    c->out_total += len;
+
+    return 0;
+}
+
+/*
+ * Record the sizes of a frame just written, for the benefit of a seek table to
+ * be written later.
+ */
+static int log_frame(b_compress *c, uint64_t in_size, uint64_t out_size) {
+    if (!c->log_frames || in_size == 0) return 0;
+
+    if (c->frames_count == c->frames_size) {
+        size_t newsize = c->frames_size? c->frames_size * 2: 64;
+        b_compress_frame *frames;
+
+        if ((frames = realloc(c->frames, newsize * sizeof(*frames))) == NULL) {
+            return -1;
+        }
+
+        c->frames      = frames;
+        c->frames_size = newsize;
+    }
+
+    c->frames[c->frames_count].in_size  = (uint32_t)in_size;
+    c->frames[c->frames_count].out_size = (uint32_t)out_size;
+
+    c->frames_count++;
+
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+static inline int gzip_level(b_compress *c) {
+    return c->level == B_COMPRESS_DEFAULT_LEVEL? Z_DEFAULT_COMPRESSION: c->level;
+}
+
+static int gzip_init(b_compress *c) {
+    z_stream *strm;
+    int level = gzip_level(c);
+
+    if ((strm = calloc(1, sizeof(*strm))) == NULL) {
+        return -1;
+    }
+
+    /*
+     * A window size of 15 bits, plus 16, causes zlib to emit a gzip wrapper
+     * rather than a zlib one.
+     */
+    if (deflateInit2(strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(strm);
+
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    c->stream   = strm;
+    c->out_size = B_COMPRESS_OUT_SIZE;
+
+    return 0;
+}
+
+static int gzip_deflate(b_compress *c, int fd, const void *data, size_t len, int flush) {
+    z_stream *strm = c->stream;
+    int ret;
+
+    strm->next_in  = (Bytef *)data;
+    strm->avail_in = len;
+
+    do {
+        strm->next_out  = c->out;
+        strm->avail_out = c->out_size;
+
+        if ((ret = deflate(strm, flush)) == Z_STREAM_ERROR) {
+            errno = EIO;
+
+            return -1;
+        }
+
+        if (write_out(c, fd, c->out, c->out_size - strm->avail_out) < 0) {
+            return -1;
+        }
+    } while (strm->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    /*
+     * Prepare to start a new gzip member if any more data is written after
+     * the end of this one.
+     */
+    if (flush == Z_FINISH) {
+        deflateReset(strm);
+    }
+
+    return 0;
+}
+
+/*
+ * Finish the current deflate block, so that the compression level can be
+ * changed for the data to follow.
+ */
+static int gzip_set_level(b_compress *c, int fd, int level) {
+    z_stream *strm = c->stream;
+    size_t len;
+
+    if (c->pending && gzip_deflate(c, fd, NULL, 0, Z_BLOCK) < 0) {
+        return -1;
+    }
+
+    strm->next_out  = c->out;
+    strm->avail_out = c->out_size;
+
+    if (deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = EIO;
+
+        return -1;
+    }
+
+    /*
+     * Older versions of zlib may emit the gzip header here, in which case the
+     * member must be properly ended later on.
+     */
+    if ((len = c->out_size - strm->avail_out) > 0) {
+        c->pending = 1;
+    }
+
+    return write_out(c, fd, c->out, len);
+}
+
+static void gzip_destroy(b_compress *c) {
+    deflateEnd(c->stream);
+    free(c->stream);
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+static inline int zstd_level(b_compress *c) {
+    return c->level == B_COMPRESS_DEFAULT_LEVEL? ZSTD_CLEVEL_DEFAULT: c->level;
+}
+
+static int zstd_init(b_compress *c) {
+    ZSTD_CCtx *cctx;
+
+    if ((cctx = ZSTD_createCCtx()) == NULL) {
+        errno = ENOMEM;
+
+        return -1;
+    }
+
+    if (c->level != B_COMPRESS_DEFAULT_LEVEL) {
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, c->level))) {
+            ZSTD_freeCCtx(cctx);
+
+            errno = EINVAL;
+
+            return -1;
+        }
+    }
+
+    c->stream   = cctx;
+    c->out_size = ZSTD_CStreamOutSize();
+
+    return 0;
+}
+
+static int zstd_compress(b_compress *c, int fd, const void *data, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in = { data, len, 0 };
+    size_t remaining;
+
+    do {
+        ZSTD_outBuffer out = { c->out, c->out_size, 0 };
+
+        remaining = ZSTD_compressStream2(c->stream, &out, &in, mode);
+
+        if (ZSTD_isError(remaining)) {
+            errno = EIO;
+
+            return -1;
+        }
+
+        if (write_out(c, fd, c->out, out.pos) < 0) {
+            return -1;
+        }
+    } while (mode == ZSTD_e_continue? in.pos < in.size: remaining != 0);
+
+    return 0;
+}
+
+/*
+ * A single threaded zstd context only applies a new compression level at the
+ * start of a frame, so the current frame is ended first.
+ */
+static int zstd_set_level(b_compress *c, int fd, int level) {
+    if (c->pending && b_compress_finish(c, fd) < 0) {
+        return -1;
+    }
+
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(c->stream, ZSTD_c_compressionLevel, level))) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static void zstd_destroy(b_compress *c) {
+    ZSTD_freeCCtx(c->stream);
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+typedef struct _lz4_stream {
+    LZ4F_cctx *        cctx;
+    LZ4F_preferences_t prefs;
+    int                started;
+} lz4_stream;
+
+static int lz4_init(b_compress *c) {
+    lz4_stream *stream;
+    size_t bound;
+
+    if ((stream = calloc(1, sizeof(*stream))) == NULL) {
+        return -1;
+    }
+
+    if (LZ4F_isError(LZ4F_createCompressionContext(&stream->cctx, LZ4F_VERSION))) {
+        free(stream);
+
+        errno = ENOMEM;
+
+        return -1;
+    }
+
+    stream->prefs.compressionLevel = c->level == B_COMPRESS_DEFAULT_LEVEL? 0: c->level;
+
+    /*
+     * LZ4F_compressUpdate() insists upon an output buffer large enough to hold
+     * the worst case for the input given, so input is fed to it in chunks of a
+     * size known here.
+     */
+    bound = LZ4F_compressBound(B_COMPRESS_LZ4_CHUNK, &stream->prefs);
+
+    c->stream   = stream;
+    c->out_size = bound > B_COMPRESS_OUT_SIZE? bound: B_COMPRESS_OUT_SIZE;
+
+    return 0;
+}
+
+static int lz4_check(b_compress *c, int fd, size_t ret) {
+    if (LZ4F_isError(ret)) {
+        errno = EIO;
+
+        return -1;
+    }
+
+    return write_out(c, fd, c->out, ret);
+}
+
+static int lz4_write(b_compress *c, int fd, const void *data, size_t len) {
+    lz4_stream *stream = c->stream;
+    size_t off = 0;
+
+    if (!stream->started) {
+        if (lz4_check(c, fd, LZ4F_compressBegin(stream->cctx, c->out, c->out_size, &stream->prefs)) < 0) {
+            return -1;
+        }
+
+        stream->started = 1;
+    }
+
+    while (off < len) {
+        size_t chunk = len - off < B_COMPRESS_LZ4_CHUNK? len - off: B_COMPRESS_LZ4_CHUNK;
+
+        if (lz4_check(c, fd, LZ4F_compressUpdate(stream->cctx, c->out, c->out_size, (const char *)data + off, chunk, NULL)) < 0) {
+            return -1;
+        }
+
+        off += chunk;
+    }
+
+    return 0;
+}
+
+static int lz4_end(b_compress *c, int fd, int finish) {
+    lz4_stream *stream = c->stream;
+
+    if (!stream->started) {
+        return 0;
+    }
+
+    if (finish) {
+        stream->started = 0;
+
+        return lz4_check(c, fd, LZ4F_compressEnd(stream->cctx, c->out, c->out_size, NULL));
+    }
+
+    return lz4_check(c, fd, LZ4F_flush(stream->cctx, c->out, c->out_size, NULL));
+}
+
+static void lz4_destroy(b_compress *c) {
+    lz4_stream *stream = c->stream;
+
+    LZ4F_freeCompressionContext(stream->cctx);
+    free(stream);
+}
+#endif /* HAVE_LZ4 */
+
+/*
+ * Compression of independent frames, used by worker threads when compressing
+ * in parallel.  Each block of input becomes a complete gzip member, zstd frame
+ * or lz4 frame, the concatenation of which the usual decompressors treat as a
+ * single stream.
+ */
+static int frame_ctx_new(b_compress *c, void **ctx) {
+    *ctx = NULL;
+
+    switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: {
+            z_stream *strm;
+            int level = gzip_level(c);
+
+            if ((strm = calloc(1, sizeof(*strm))) == NULL) {
+                return -1;
+            }
+
+            if (deflateInit2(strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                free(strm);
+
+                errno = EINVAL;
+
+                return -1;
+            }
+
+            *ctx = strm;
+
+            return 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD:
+            if ((*ctx = ZSTD_createCCtx()) == NULL) {
+                errno = ENOMEM;
+
+                return -1;
+            }
+
+            return 0;
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:
+            return 0;
+#endif
+        default: break;
+    }
+
+    errno = ENOTSUP;
+
+    return -1;
+}
+
+static size_t frame_bound(b_compress *c, size_t len) {
+    switch (c->codec) {
+#ifdef HAVE_ZLIB
+        /*
+         * compressBound() accounts for the zlib wrapper; allow for the larger
+         * gzip wrapper as well.
+         */
+        case B_COMPRESS_GZIP: return compressBound(len) + 64;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4: {
+            LZ4F_preferences_t prefs;
+
+            memset(&prefs, 0x00, sizeof(prefs));
+
+            return LZ4F_compressFrameBound(len, &prefs);
+        }
+#endif
+        default: break;
+    }
+
+    return 0;
+}
+
+static int frame_compress(b_compress *c, void *ctx, b_compress_job *job, size_t out_size) {
+    switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: {
+            z_stream *strm = ctx;
+
+            if (deflateReset(strm) != Z_OK) {
+                break;
+            }
+
+            if (deflateParams(strm, job->store? B_COMPRESS_GZIP_STORE_LEVEL: gzip_level(c), Z_DEFAULT_STRATEGY) != Z_OK) {
+                break;
+            }
+
+            strm->next_in   = job->in;
+            strm->avail_in  = job->in_len;
+            strm->next_out  = job->out;
+            strm->avail_out = out_size;
+
+            if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
+                break;
+            }
+
+            job->out_len = out_size - strm->avail_out;
+
+            return 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: {
+            size_t ret;
+
+            if (ZSTD_isError(ret = ZSTD_compressCCtx(ctx, job->out, out_size, job->in, job->in_len, job->store? B_COMPRESS_ZSTD_STORE_LEVEL: zstd_level(c)))) {
+                break;
+            }
+
+            job->out_len = ret;
+
+            return 0;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4: {
+            LZ4F_preferences_t prefs;
+            size_t ret;
+
+            memset(&prefs, 0x00, sizeof(prefs));
+
+            prefs.compressionLevel = c->level == B_COMPRESS_DEFAULT_LEVEL? 0: c->level;
+
+            if (LZ4F_isError(ret = LZ4F_compressFrame(job->out, out_size, job->in, job->in_len, &prefs))) {
+                break;
+            }
+
+            job->out_len = ret;
+
+            return 0;
+        }
+#endif
+        default: break;
+    }
+
+    errno = EIO;
+
+    return -1;
+}
+
+static void frame_ctx_destroy(b_compress *c, void *ctx) {
+    if (ctx == NULL) return;
+
+    switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP:
+            deflateEnd(ctx);
+            free(ctx);
+            break;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD:
+            ZSTD_freeCCtx(ctx);
+            break;
+#endif
+        default: break;
+    }
+}
+
+/*
+ * Worker threads compress queued jobs in the order they were submitted; the
+ * thread writing the archive collects them, in that same order, as they are
+ * completed.
+ */
+static void *pool_worker(void *arg) {
+    b_compress *c         = arg;
+    b_compress_pool *pool = c->pool;
+    void *ctx;
+    int ctx_errno = 0;
+
+    if (frame_ctx_new(c, &ctx) < 0) {
+        ctx_errno = errno;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        b_compress_job *job;
+
+        while (!pool->stop && pool->claimed == pool->submitted) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        if (pool->claimed == pool->submitted) {
+            break;
+        }
+
+        job = &pool->jobs[pool->claimed++ % pool->depth];
+
+        job->state  = B_COMPRESS_JOB_WORKING;
+        job->_errno = ctx_errno;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if (ctx_errno == 0 && frame_compress(c, ctx, job, pool->out_size) < 0) {
+            job->_errno = errno;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        job->state = B_COMPRESS_JOB_DONE;
+
+        pthread_cond_broadcast(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    frame_ctx_destroy(c, ctx);
+
+    return NULL;
+}
+
+static void pool_destroy(b_compress_pool *pool) {
+    size_t i;
+
+    if (pool == NULL) return;
+
+    for (i=0; i<pool->depth; i++) {
+        free(pool->jobs[i].in);
+        free(pool->jobs[i].out);
+    }
+
+    free(pool->jobs);
+    free(pool->workers);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool);
+}
+
+static b_compress_pool *pool_new(b_compress *c, size_t threads, size_t block_size) {
+    b_compress_pool *pool;
+    size_t i;
+
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+        goto error_malloc;
+    }
+
+    pool->threads    = threads;
+    pool->block_size = block_size;
+    pool->out_size   = frame_bound(c, block_size);
+    pool->depth      = threads * 2;
+
+    if ((pool->jobs = calloc(pool->depth, sizeof(b_compress_job))) == NULL) {
+        goto error_jobs;
+    }
+
+    if ((pool->workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+        goto error_workers;
+    }
+
+    for (i=0; i<pool->depth; i++) {
+        if ((pool->jobs[i].in = malloc(block_size)) == NULL) {
+            goto error_job_buffers;
+        }
+
+        if ((pool->jobs[i].out = malloc(pool->out_size)) == NULL) {
+            goto error_job_buffers;
+        }
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        goto error_job_buffers;
+    }
+
+    if (pthread_cond_init(&pool->work, NULL) != 0) {
+        goto error_cond_work;
+    }
+
+    if (pthread_cond_init(&pool->done, NULL) != 0) {
+        goto error_cond_done;
+    }
+
+    return pool;
+
+error_cond_done:
+    pthread_cond_destroy(&pool->work);
+
+error_cond_work:
+    pthread_mutex_destroy(&pool->lock);
+
+error_job_buffers:
+    for (i=0; i<pool->depth; i++) {
+        free(pool->jobs[i].in);
+        free(pool->jobs[i].out);
+    }
+
+    free(pool->workers);
+
+error_workers:
+    free(pool->jobs);
+
+error_jobs:
+    free(pool);
+
+error_malloc:
+    return NULL;
+}
+
+/*
+ * Write the oldest submitted job to the output file descriptor, waiting for
+ * it to be completed if need be.  Returns 1 if a job was written, 0 if none
+ * were ready and waiting was not requested, or -1 on error.
+ */
+static int pool_collect(b_compress *c, int fd, int wait) {
+    b_compress_pool *pool = c->pool;
+    b_compress_job *job;
+
+    if (pool->written == pool->submitted) {
+        return 0;
+    }
+
+    job = &pool->jobs[pool->written % pool->depth];
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (job->state != B_COMPRESS_JOB_DONE) {
+        if (!wait) {
+            pthread_mutex_unlock(&pool->lock);
+
+            return 0;
+        }
+
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job->_errno) {
+        errno = job->_errno;
+
+        return -1;
+    }
+
+    if (write_out(c, fd, job->out, job->out_len) < 0) {
+        return -1;
+    }
+
+    if (log_frame(c, job->in_len, job->out_len) < 0) {
+        return -1;
+    }
+
+    job->state  = B_COMPRESS_JOB_EMPTY;
+    job->in_len = 0;
+
+    pool->written++;
+
+    return 1;
+}
+
+/*
+ * Hand the job currently being filled to the worker threads, starting them if
+ * they are not already running.  Threads are started lazily, and stopped
+ * whenever the stream is flushed, so that the compressor remains usable in a
+ * child process after fork().
+ */
+static int pool_submit(b_compress *c) {
+    b_compress_pool *pool = c->pool;
+    b_compress_job *job   = &pool->jobs[pool->submitted % pool->depth];
+    int ret;
+
+    /*
+     * Start the first worker before the job is published, so that a job is
+     * never left queued with no thread to take it.
+     */
+    if (pool->started == 0) {
+        if ((ret = pthread_create(&pool->workers[0], NULL, pool_worker, c)) != 0) {
+            errno = ret;
+
+            return -1;
+        }
+
+        pool->started++;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    job->state = B_COMPRESS_JOB_QUEUED;
+    pool->submitted++;
+
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pool->started < pool->threads && pool->started < pool->submitted - pool->written) {
+        if (pthread_create(&pool->workers[pool->started], NULL, pool_worker, c) != 0) {
+            break;
+        }
+
+        pool->started++;
+    }
+
+    return 0;
+}
+
+static void pool_stop(b_compress_pool *pool) {
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->stop = 1;
+
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->started; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pool->started = 0;
+    pool->stop    = 0;
+}
+
+static int pool_write(b_compress *c, int fd, const void *data, size_t len) {
+    b_compress_pool *pool = c->pool;
+    size_t off = 0;
+
+    while (off < len) {
+        b_compress_job *job = &pool->jobs[pool->submitted % pool->depth];
+        size_t copylen;
+
+        if (job->state != B_COMPRESS_JOB_FILLING) {
+            while (pool->submitted - pool->written >= pool->depth) {
+                if (pool_collect(c, fd, 1) < 0) {
+                    return -1;
+                }
+            }
+
+            job->state  = B_COMPRESS_JOB_FILLING;
+            job->store  = c->store;
+            job->in_len = 0;
+        }
+
+        copylen = len - off < pool->block_size - job->in_len? len - off: pool->block_size - job->in_len;
+
+        memcpy(job->in + job->in_len, (const unsigned char *)data + off, copylen);
+
+        job->in_len += copylen;
+        off         += copylen;
+
+        if (job->in_len == pool->block_size) {
+            if (pool_submit(c) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    /*
+     * Write out whatever happens to be finished already, without waiting.
+     */
+    while (1) {
+        int ret;
+
+        if ((ret = pool_collect(c, fd, 0)) < 0) {
+            return -1;
+        } else if (ret == 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Submit any partially filled job, and wait for all outstanding jobs to be
+ * written.
+ */
+static int pool_drain(b_compress *c, int fd) {
+    b_compress_pool *pool = c->pool;
+    b_compress_job *job   = &pool->jobs[pool->submitted % pool->depth];
+    int ret = 0;
+
+    if (job->state == B_COMPRESS_JOB_FILLING) {
+        if (job->in_len) {
+            if (pool_submit(c) < 0) {
+                ret = -1;
+            }
+        } else {
+            job->state = B_COMPRESS_JOB_EMPTY;
+        }
+    }
+
+    while (ret == 0 && pool->written < pool->submitted) {
+        if (pool_collect(c, fd, 1) < 0) {
+            ret = -1;
+        }
+    }
+
+    pool_stop(pool);
+
+    return ret;
+}
+
+int b_compress_set_threads(b_compress *c, size_t threads, size_t block_size) {
+    b_compress_pool *pool = NULL;
+
+    if (c == NULL || c->pending) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (threads > B_COMPRESS_MAX_THREADS) {
+        threads = B_COMPRESS_MAX_THREADS;
+    }
+
+    if (block_size == 0) {
+        block_size = B_COMPRESS_DEFAULT_BLOCK_SIZE;
+    } else if (block_size > B_COMPRESS_MAX_FRAME_SIZE) {
+        block_size = B_COMPRESS_MAX_FRAME_SIZE;
+    }
+
+    if (threads > 1 && (pool = pool_new(c, threads, block_size)) == NULL) {
+        return -1;
+    }
+
+    pool_destroy(c->pool);
+
+    c->pool = pool;
+
+    return 0;
+}
+
+b_compress *b_compress_new(enum b_compress_codec codec, int level) {
+    b_compress *c;
+    int ret = -1;
+
+    if (codec == B_COMPRESS_NONE || !b_compress_available(codec)) {
+        errno = ENOTSUP;
+
+        goto error_codec;
+    }
+
+    if ((c = malloc(sizeof(*c))) == NULL) {
+        goto error_malloc;
+    }
+
+    c->codec     = codec;
+    c->level     = level;
+    c->store     = 0;
+    c->pending   = 0;
+    c->stream    = NULL;
+    c->pool      = NULL;
+    c->out       = NULL;
+    c->out_size  = 0;
+    c->in_total  = 0;
+    c->out_total = 0;
+
+    c->log_frames   = 0;
+    c->frames       = NULL;
+    c->frames_count = 0;
+    c->frames_size  = 0;
+    c->frame_in     = 0;
+    c->frame_out    = 0;
+
+    switch (codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: ret = gzip_init(c); break;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: ret = zstd_init(c); break;
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:  ret = lz4_init(c);  break;
+#endif
+        default: break;
+    }
+
+    if (ret < 0) {
+        goto error_init;
+    }
+
+    if ((c->out = malloc(c->out_size)) == NULL) {
+        goto error_malloc_out;
+    }
+
+    return c;
+
+error_malloc_out:
+    c->out = NULL;
+
+    b_compress_destroy(c);
+
+    return NULL;
+
+error_init:
+    free(c);
+
+error_malloc:
+error_codec:
+    return NULL;
+}
+
+ssize_t b_compress_write(b_compress *c, int fd, const void *data, size_t len) {
+    int ret = -1;
+
+    if (c == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (len == 0) return 0;
+
+    /*
+     * Frames listed in a seek table must not exceed 4GiB in either size, so
+     * end the current frame before it grows too large to be described.
+     */
+    if (c->log_frames && c->pool == NULL) {
+        size_t room = B_COMPRESS_MAX_FRAME_SIZE - (c->in_total - c->frame_in);
+
+        if (len > room) {
+            if (b_compress_write(c, fd, data, room) < 0) {
+                return -1;
+            }
+
+            if (b_compress_finish(c, fd) < 0) {
+                return -1;
+            }
+
+            if (b_compress_write(c, fd, (const unsigned char *)data + room, len - room) < 0) {
+                return -1;
+            }
+
+            return len;
+        }
+    }
+
+    if (c->pool) {
+        ret = pool_write(c, fd, data, len);
+    } else switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: ret = gzip_deflate(c, fd, data, len, Z_NO_FLUSH); break;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: ret = zstd_compress(c, fd, data, len, ZSTD_e_continue); break;
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:  ret = lz4_write(c, fd, data, len); break;
+#endif
+        default: errno = ENOTSUP; break;
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    c->pending   = 1;
+    c->in_total += len;
+
+    return len;
+}
+
+/*
+ * Cause all data written to the compressor thus far to be emitted, so that a
+ * reader can decompress everything written up to this point, without ending
+ * the current compressed stream.
+ */
+int b_compress_flush(b_compress *c, int fd) {
+    if (c == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!c->pending) return 0;
+
+    /*
+     * Blocks compressed in parallel are always complete frames, so flushing
+     * amounts to the same thing as finishing.
+     */
+    if (c->pool) {
+        return b_compress_finish(c, fd);
+    }
+
+    switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: return gzip_deflate(c, fd, NULL, 0, Z_SYNC_FLUSH);
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: return zstd_compress(c, fd, NULL, 0, ZSTD_e_flush);
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:  return lz4_end(c, fd, 0);
+#endif
+        default: break;
+    }
+
+    errno = ENOTSUP;
+
+    return -1;
+}
+
+/*
+ * End the current compressed stream.  Any further data written will begin a
+ * new gzip member, zstd frame or lz4 frame, any sequence of which the usual
+ * decompressors treat as a single stream.
+ */
+int b_compress_finish(b_compress *c, int fd) {
+    int ret = -1;
+
+    if (c == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!c->pending) return 0;
+
+    if (c->pool) {
+        ret = pool_drain(c, fd);
+    } else switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: ret = gzip_deflate(c, fd, NULL, 0, Z_FINISH); break;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: ret = zstd_compress(c, fd, NULL, 0, ZSTD_e_end); break;
+#endif
+#ifdef HAVE_LZ4
+        case B_COMPRESS_LZ4:  ret = lz4_end(c, fd, 1); break;
+#endif
+        default: errno = ENOTSUP; break;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (c->pool == NULL && log_frame(c, c->in_total - c->frame_in, c->out_total - c->frame_out) < 0) {
+        return -1;
+    }
+
+    c->pending   = 0;
+    c->frame_in  = c->in_total;
+    c->frame_out = c->out_total;
+
+    return 0;
+}
+
+/*
+ * Switch between compressing data written from here on at the configured
+ * level, and merely storing it (or, for codecs without a stored mode,
+ * compressing at the fastest level) when the caller knows it to be
+ * incompressible.  lz4 is left as-is, as it already passes incompressible
+ * data through at close to memory speed.
+ */
+int b_compress_set_store(b_compress *c, int fd, int store) {
+    int ret = 0;
+
+    if (c == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (c->store == store) return 0;
+
+    if (c->pool) {
+        b_compress_pool *pool = c->pool;
+        b_compress_job *job   = &pool->jobs[pool->submitted % pool->depth];
+
+        /*
+         * Blocks are compressed as a whole, so cut the current one short if it
+         * holds any data written under the previous setting.
+         */
+        if (job->state == B_COMPRESS_JOB_FILLING) {
+            if (job->in_len) {
+                ret = pool_submit(c);
+            } else {
+                job->store = store;
+            }
+        }
+    } else switch (c->codec) {
+#ifdef HAVE_ZLIB
+        case B_COMPRESS_GZIP: ret = gzip_set_level(c, fd, store? B_COMPRESS_GZIP_STORE_LEVEL: gzip_level(c)); break;
+#endif
+#ifdef HAVE_ZSTD
+        case B_COMPRESS_ZSTD: ret = zstd_set_level(c, fd, store? B_COMPRESS_ZSTD_STORE_LEVEL: zstd_level(c)); break;
+#endif
+        default: break;
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    c->store = store;
+
+    return 0;
+}
+
+/*
+ * Keep a record of the size of each frame written from this point onward, so
+ * that a seek table can be written at the end of the stream.
+ */
+int b_compress_log_frames(b_compress *c) {
+    if (c == NULL || c->pending) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->log_frames   = 1;
+    c->frames_count = 0;
+    c->frame_in     = c->in_total;
+    c->frame_out    = c->out_total;
+
+    return 0;
+}
+
+static void put_le32(unsigned char *p, uint32_t value) {
+    p[0] = value         & 0xff;
+    p[1] = (value >> 8)  & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Write a seek table in the zstd seekable format, listing each frame logged
+ * since b_compress_log_frames() was called, as a skippable frame which plain
+ * zstd decompressors will ignore.  The current stream must have been finished
+ * beforehand.  Nothing is written for other codecs, for which the frame index
+ * kept by the caller serves the same purpose.
+ */
+int b_compress_write_seek_table(b_compress *c, int fd) {
+    unsigned char *table, *p;
+    size_t i, len;
+    int ret;
+
+    if (c == NULL || c->pending) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (c->codec != B_COMPRESS_ZSTD || !c->log_frames) return 0;
+
+    len = 8 + c->frames_count * 8 + B_COMPRESS_ZSTD_SEEKABLE_FOOTER;
+
+    if ((table = malloc(len)) == NULL) {
+        return -1;
+    }
+
+    p = table;
+
+    put_le32(p, B_COMPRESS_ZSTD_SKIPPABLE_MAGIC);             p += 4;
+    put_le32(p, (uint32_t)(len - 8));                         p += 4;
+
+    for (i=0; i<c->frames_count; i++) {
+        put_le32(p, c->frames[i].out_size);                   p += 4;
+        put_le32(p, c->frames[i].in_size);                    p += 4;
+    }
+
+    put_le32(p, (uint32_t)c->frames_count);                   p += 4;
+    *p++ = 0;
+    put_le32(p, B_COMPRESS_ZSTD_SEEKABLE_MAGIC);
+
+    ret = write_out(c, fd, table, len);
+
+    free(table);
+
+    c->frames_count = 0;
+    c->frame_out    = c->out_total;
+
+    return ret;
+}
+
+void b_compress_destroy(b_compress *c) {
+    if (c == NULL) return;
+
+    if (c->stream) {
+        switch (c->codec) {
+#ifdef HAVE_ZLIB
+            case B_COMPRESS_GZIP: gzip_destroy(c); break;
+#endif
+#ifdef HAVE_ZSTD
+            case B_COMPRESS_ZSTD: zstd_destroy(c); break;
+#endif
+#ifdef HAVE_LZ4
+            case B_COMPRESS_LZ4:  lz4_destroy(c);  break;
+#endif
+            default: break;
+        }
+
+        c->stream = NULL;
+    }
+
+    if (c->pool) {
+        pool_stop(c->pool);
+        pool_destroy(c->pool);
+        c->pool = NULL;
+    }
+
+    free(c->out);
+    c->out = NULL;
+
+    free(c->frames);
+    c->frames = NULL;
+
+    free(c);
+}
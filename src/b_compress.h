@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_COMPRESS_H
+#define _B_COMPRESS_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#define B_COMPRESS_DEFAULT_LEVEL      INT_MIN
+#define B_COMPRESS_OUT_SIZE           (128 * 1024)
+#define B_COMPRESS_DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define B_COMPRESS_MAX_THREADS        256
+#define B_COMPRESS_MAX_FRAME_SIZE     (1024 * 1024 * 1024)
+#define B_COMPRESS_GZIP_STORE_LEVEL   0
+#define B_COMPRESS_ZSTD_STORE_LEVEL   1
+
+enum b_compress_codec {
+    B_COMPRESS_NONE = 0,
+    B_COMPRESS_GZIP = 1,
+    B_COMPRESS_ZSTD = 2,
+    B_COMPRESS_LZ4  = 3
+};
+
+enum b_compress_job_state {
+    B_COMPRESS_JOB_EMPTY   = 0,
+    B_COMPRESS_JOB_FILLING = 1,
+    B_COMPRESS_JOB_QUEUED  = 2,
+    B_COMPRESS_JOB_WORKING = 3,
+    B_COMPRESS_JOB_DONE    = 4
+};
+
+typedef struct _b_compress_job {
+    enum b_compress_job_state state;
+    int                       _errno;
+    int                       store;
+    unsigned char *           in;
+    size_t                    in_len;
+    unsigned char *           out;
+    size_t                    out_len;
+} b_compress_job;
+
+typedef struct _b_compress_pool {
+    size_t           threads;
+    size_t           started;
+    size_t           block_size;
+    size_t           out_size;
+    size_t           depth;
+    b_compress_job * jobs;
+    pthread_t *      workers;
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    pthread_cond_t   done;
+    uint64_t         submitted;
+    uint64_t         claimed;
+    uint64_t         written;
+    int              stop;
+} b_compress_pool;
+
+typedef struct _b_compress_frame {
+    uint32_t out_size;
+    uint32_t in_size;
+} b_compress_frame;
+
+typedef struct _b_compress {
+    enum b_compress_codec codec;
+    int                   level;
+    int                   store;
+    int                   pending;
+    void *                stream;
+    b_compress_pool *     pool;
+    unsigned char *       out;
+    size_t                out_size;
+    uint64_t              in_total;
+    uint64_t              out_total;
+    int                   log_frames;
+    b_compress_frame *    frames;
+    size_t                frames_count;
+    size_t                frames_size;
+    uint64_t              frame_in;
+    uint64_t              frame_out;
+} b_compress;
+
+int          b_compress_codec_by_name(const char *name, enum b_compress_codec *codec);
+int          b_compress_available(enum b_compress_codec codec);
+b_compress * b_compress_new(enum b_compress_codec codec, int level);
+int          b_compress_set_threads(b_compress *c, size_t threads, size_t block_size);
+ssize_t      b_compress_write(b_compress *c, int fd, const void *data, size_t len);
+int          b_compress_flush(b_compress *c, int fd);
+int          b_compress_finish(b_compress *c, int fd);
+int          b_compress_set_store(b_compress *c, int fd, int store);
+int          b_compress_log_frames(b_compress *c);
+int          b_compress_write_seek_table(b_compress *c, int fd);
+void         b_compress_destroy(b_compress *c);
+
+#endif /* _B_COMPRESS_H */
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,12 +12,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <math.h>
 
 #include "b_builder.h"
 #include "b_header.h"
 #include "b_string.h"
 #include "b_buffer.h"
 #include "b_file.h"
+#include "b_util.h"
 
 #define MAX_CHUNK_SIZE (16 * 1024 * 1024)
 
@@ -103,6 +106,166 @@ error_mem:
     return -1;
 }
 
+/*
+ * Copy an arbitrary run of bytes into the output buffer, flushing as needed
+ * and padding the final block out to the tar block size.  Callers wishing to
+ * write a single logical stream in several calls must pass lengths which are
+ * multiples of the block size for every call but the last.
+ */
+off_t b_file_write_data(b_buffer *buf, const void *data, size_t len) {
+    size_t off = 0;
+    off_t blocklen = 0, total = 0;
+
+    while (off < len) {
+        size_t left = len - off, copylen;
+        unsigned char *block;
+
+        if (b_buffer_full(buf)) {
+            if (b_buffer_flush(buf) < 0) {
+                goto error_io;
+            }
+        }
+
+        if ((block = b_buffer_get_block(buf, b_buffer_unused(buf), &blocklen)) == NULL) {
+            goto error_io;
+        }
+
+        copylen = left < blocklen? left: blocklen;
+
+        memcpy(block, (const unsigned char *)data + off, copylen);
+
+        total += blocklen;
+
+        if (blocklen - copylen) {
+            total -= b_buffer_reclaim(buf, copylen, blocklen);
+        }
+
+        off += copylen;
+    }
+
+    return total;
+
+error_io:
+    return -1;
+}
+
+/*
+ * File name extensions of formats which are already compressed, and which are
+ * therefore not worth passing through a compressor again.
+ */
+static const char *incompressible_exts[] = {
+    "gz", "tgz", "bz2", "tbz2", "xz", "txz", "lz", "lzma", "lz4", "zst", "zstd",
+    "z", "zip", "7z", "rar", "jar", "war", "apk", "cab", "rpm", "deb", "cpgz",
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "avif", "jxl",
+    "mp3", "m4a", "aac", "ogg", "oga", "opus", "flac", "wma",
+    "mp4", "m4v", "mkv", "webm", "mov", "avi", "wmv", "flv", "mpg", "mpeg",
+    "woff", "woff2", "docx", "xlsx", "pptx", "odt", "ods", "odp", "epub",
+    NULL
+};
+
+static int has_incompressible_ext(b_string *path) {
+    char *ext = NULL;
+    size_t i;
+    int n;
+
+    for (i=path->len; i>0; i--) {
+        if (path->str[i-1] == '/') {
+            return 0;
+        } else if (path->str[i-1] == '.') {
+            ext = path->str + i;
+            break;
+        }
+    }
+
+    if (ext == NULL || *ext == '\0') return 0;
+
+    for (n=0; incompressible_exts[n]; n++) {
+        if (strcasecmp(ext, incompressible_exts[n]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Guess whether the contents of a file would not shrink when compressed,
+ * firstly by its name, then by the Shannon entropy of the bytes at its start,
+ * which are read with pread() so as not to disturb the file offset.  Files
+ * smaller than B_FILE_PROBE_MIN_SIZE are never judged incompressible, as they
+ * are not worth the trouble.
+ */
+int b_file_is_incompressible(b_string *path, int file_fd, off_t file_size) {
+    unsigned char data[B_FILE_PROBE_SIZE];
+    size_t counts[256];
+    double entropy = 0.0;
+    ssize_t len = 0;
+    int i;
+
+    if (file_size < B_FILE_PROBE_MIN_SIZE) return 0;
+
+    if (path && has_incompressible_ext(path)) return 1;
+
+    while (len < B_FILE_PROBE_SIZE) {
+        ssize_t rlen;
+
+        if ((rlen = pread(file_fd, data + len, B_FILE_PROBE_SIZE - len, len)) < 0) {
+            if (errno == EINTR) continue;
+
+            return 0;
+        } else if (rlen == 0) {
+            break;
+        }
+
+        len += rlen;
+    }
+
+    if (len < B_FILE_PROBE_SIZE) return 0;
+
+    memset(counts, 0x00, sizeof(counts));
+
+    for (i=0; i<len; i++) {
+        counts[data[i]]++;
+    }
+
+    for (i=0; i<256; i++) {
+        double p;
+
+        if (counts[i] == 0) continue;
+
+        p = (double)counts[i] / len;
+
+        entropy -= p * log2(p);
+    }
+
+    return entropy >= B_FILE_PROBE_ENTROPY;
+}
+
+/*
+ * Fill the buffer given with exactly len bytes, unless end-of-file is reached
+ * first.  Network filesystems are permitted to return short reads for large
+ * requests, so these must be retried rather than treated as truncation.
+ */
+static ssize_t read_full(int fd, void *data, size_t len) {
+    size_t off = 0;
+
+    while (off < len) {
+        ssize_t rlen;
+
+        if ((rlen = read(fd, (unsigned char *)data + off, len - off)) < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        } else if (rlen == 0) {
+            break;
+        }
+
+        off += rlen;
+    }
+
+    return off;
+}
+
 off_t b_file_write_contents(b_buffer *buf, int file_fd, off_t file_size) {
     ssize_t rlen = 0;
     off_t blocklen = 0, total = 0, real_total = 0, max_read = 0;
@@ -148,28 +311,49 @@ off_t b_file_write_contents(b_buffer *buf, int file_fd, off_t file_size) {
 #endif
             unsigned char *block;
 
-            if ((block = b_buffer_get_block(buf, b_buffer_unused(buf), &blocklen)) == NULL) {
-                goto error_io;
-            }
+            /*
+             * If a separate read buffer is present, then read as much as it
+             * will hold in one go, and copy that into the output buffer
+             * afterwards; otherwise, read directly into the output buffer.
+             */
+            if (buf->read_data) {
+                if (max_read > buf->read_size) {
+                    max_read = buf->read_size;
+                }
 
-            if (max_read > blocklen) {
-                max_read = blocklen;
-            }
+                if ((rlen = read_full(file_fd, buf->read_data, max_read)) < max_read) {
+                    goto error_io;
+                }
 
-           read_retry:
-            if ((rlen = read(file_fd, block, max_read)) < max_read) {
-                if (rlen < 0 && errno == EINTR) { goto read_retry; }
+                if ((blocklen = b_file_write_data(buf, buf->read_data, rlen)) < 0) {
+                    goto error_io;
+                }
 
-                goto error_io;
-            }
+                total += blocklen;
+            } else {
+                if ((block = b_buffer_get_block(buf, b_buffer_unused(buf), &blocklen)) == NULL) {
+                    goto error_io;
+                }
 
-            total += blocklen;
-            /*
-             * Reclaim any amount of bytes from the buffer that weren't used to
-             * store the chunk read() from the filesystem.
-             */
-            if (blocklen - rlen) {
-                total -= b_buffer_reclaim(buf, rlen, blocklen);
+                if (max_read > blocklen) {
+                    max_read = blocklen;
+                }
+
+               read_retry:
+                if ((rlen = read(file_fd, block, max_read)) < max_read) {
+                    if (rlen < 0 && errno == EINTR) { goto read_retry; }
+
+                    goto error_io;
+                }
+
+                total += blocklen;
+                /*
+                 * Reclaim any amount of bytes from the buffer that weren't used to
+                 * store the chunk read() from the filesystem.
+                 */
+                if (blocklen - rlen) {
+                    total -= b_buffer_reclaim(buf, rlen, blocklen);
+                }
             }
 #ifdef __linux__
         }
@@ -183,9 +367,13 @@ off_t b_file_write_contents(b_buffer *buf, int file_fd, off_t file_size) {
          * finished splice, now complete the block by writing out zeros to make
          * tar happy
          */
-        if ((write(buf->fd, buf->data, B_BUFFER_BLOCK_SIZE - (total % B_BUFFER_BLOCK_SIZE))) < 0) {
+        size_t padding = B_BUFFER_BLOCK_SIZE - (total % B_BUFFER_BLOCK_SIZE);
+
+        if (b_write_all(buf->fd, buf->data, padding) < 0) {
             goto error_io;
         }
+
+        total += padding;
     }
 #endif
 
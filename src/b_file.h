@@ -17,6 +17,12 @@
 #include "b_string.h"
 #include "b_buffer.h"
 
+#define B_FILE_PROBE_MIN_SIZE (64 * 1024)
+#define B_FILE_PROBE_SIZE     4096
+#define B_FILE_PROBE_ENTROPY  7.5
+
+int   b_file_is_incompressible(b_string *path, int file_fd, off_t file_size);
+off_t b_file_write_data(b_buffer *buf, const void *data, size_t len);
 off_t b_file_write_contents(b_buffer *buf, int file_fd, off_t file_size);
 off_t b_file_write_path_blocks(b_buffer *buf, b_string *path);
 off_t b_file_write_pax_path_blocks(b_buffer *buf, b_string *path, b_string *linkdest);
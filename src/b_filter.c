@@ -0,0 +1,249 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <sys/sysmacros.h>
+#endif /* __GLIBC__ */
+#include "b_string.h"
+#include "b_filter.h"
+
+/*
+ * A filter selects filesystem objects by the values returned by stat(), so
+ * that those not wanted can be passed over by b_find() without ever being
+ * opened.  Only the predicates given are evaluated, cheapest first.
+ */
+b_filter *b_filter_new() {
+    b_filter *filter;
+
+    if ((filter = calloc(1, sizeof(*filter))) == NULL) {
+        return NULL;
+    }
+
+    filter->max_size = -1;
+    filter->types    = B_FILTER_TYPE_ALL;
+
+    return filter;
+}
+
+/*
+ * Match regular files of at least min bytes, and of at most max bytes, unless
+ * max is negative.
+ */
+void b_filter_set_size(b_filter *filter, off_t min, off_t max) {
+    filter->min_size    = min;
+    filter->max_size    = max;
+    filter->predicates |= B_FILTER_SIZE;
+}
+
+/*
+ * Match objects modified at or after the time given as after, and before the
+ * time given as before; either may be zero to leave that end open.
+ */
+void b_filter_set_mtime(b_filter *filter, time_t after, time_t before) {
+    filter->mtime_after  = after;
+    filter->mtime_before = before;
+    filter->predicates  |= B_FILTER_MTIME;
+}
+
+void b_filter_set_ctime(b_filter *filter, time_t after, time_t before) {
+    filter->ctime_after  = after;
+    filter->ctime_before = before;
+    filter->predicates  |= B_FILTER_CTIME;
+}
+
+/*
+ * Match only objects of the types given, as a mask of B_FILTER_TYPE_* flags.
+ */
+void b_filter_set_types(b_filter *filter, int types) {
+    filter->types       = types;
+    filter->predicates |= B_FILTER_TYPES;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    unsigned long id_a = *(const unsigned long *)a;
+    unsigned long id_b = *(const unsigned long *)b;
+
+    return id_a < id_b? -1: id_a > id_b;
+}
+
+static int set_ids(b_filter_ids *set, unsigned long *ids, size_t count, int exclude) {
+    unsigned long *copy;
+
+    if ((copy = malloc((count? count: 1) * sizeof(*copy))) == NULL) {
+        return -1;
+    }
+
+    memcpy(copy, ids, count * sizeof(*copy));
+
+    qsort(copy, count, sizeof(*copy), compare_ids);
+
+    free(set->ids);
+
+    set->ids     = copy;
+    set->count   = count;
+    set->exclude = exclude;
+
+    return 0;
+}
+
+/*
+ * Match only objects owned by the user IDs given, or when exclude is set,
+ * only those not owned by them.
+ */
+int b_filter_set_uids(b_filter *filter, unsigned long *uids, size_t count, int exclude) {
+    if (set_ids(&filter->uids, uids, count, exclude) < 0) {
+        return -1;
+    }
+
+    filter->predicates |= B_FILTER_UIDS;
+
+    return 0;
+}
+
+int b_filter_set_gids(b_filter *filter, unsigned long *gids, size_t count, int exclude) {
+    if (set_ids(&filter->gids, gids, count, exclude) < 0) {
+        return -1;
+    }
+
+    filter->predicates |= B_FILTER_GIDS;
+
+    return 0;
+}
+
+/*
+ * Pass over objects bearing the nodump attribute, as set by chattr +d, along
+ * with the entire contents of directories bearing it, as dump(8) would.
+ */
+void b_filter_set_nodump(b_filter *filter) {
+    filter->predicates |= B_FILTER_NODUMP;
+}
+
+/*
+ * stat() or lstat() the path given, as b_find() would.  Where the nodump
+ * attribute is to be tested, statx() is used instead, so that the attribute
+ * is obtained without opening the object.
+ */
+int b_filter_stat(b_filter *filter, b_string *path, struct stat *st, int follow, int *nodump) {
+    *nodump = 0;
+
+#if defined(__linux__) && defined(STATX_ATTR_NODUMP)
+    if (filter->predicates & B_FILTER_NODUMP) {
+        struct statx stx;
+
+        if (statx(AT_FDCWD, path->str, follow? 0: AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0) {
+            return -1;
+        }
+
+        memset(st, 0x00, sizeof(*st));
+
+        st->st_dev           = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st->st_ino           = stx.stx_ino;
+        st->st_mode          = stx.stx_mode;
+        st->st_nlink         = stx.stx_nlink;
+        st->st_uid           = stx.stx_uid;
+        st->st_gid           = stx.stx_gid;
+        st->st_rdev          = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+        st->st_size          = stx.stx_size;
+        st->st_blksize       = stx.stx_blksize;
+        st->st_blocks        = stx.stx_blocks;
+        st->st_atim.tv_sec   = stx.stx_atime.tv_sec;
+        st->st_atim.tv_nsec  = stx.stx_atime.tv_nsec;
+        st->st_mtim.tv_sec   = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec  = stx.stx_mtime.tv_nsec;
+        st->st_ctim.tv_sec   = stx.stx_ctime.tv_sec;
+        st->st_ctim.tv_nsec  = stx.stx_ctime.tv_nsec;
+
+        *nodump = (stx.stx_attributes_mask & STATX_ATTR_NODUMP) && (stx.stx_attributes & STATX_ATTR_NODUMP);
+
+        return 0;
+    }
+#endif
+
+    return follow? stat(path->str, st): lstat(path->str, st);
+}
+
+static int type_flag(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG:  return B_FILTER_TYPE_FILE;
+        case S_IFDIR:  return B_FILTER_TYPE_DIR;
+        case S_IFLNK:  return B_FILTER_TYPE_SYMLINK;
+        case S_IFCHR:  return B_FILTER_TYPE_CHR;
+        case S_IFBLK:  return B_FILTER_TYPE_BLK;
+        case S_IFIFO:  return B_FILTER_TYPE_FIFO;
+        case S_IFSOCK: return B_FILTER_TYPE_SOCKET;
+    }
+
+    return 0;
+}
+
+static int has_id(b_filter_ids *set, unsigned long id) {
+    int found = bsearch(&id, set->ids, set->count, sizeof(*set->ids), compare_ids) != NULL;
+
+    return set->exclude? !found: found;
+}
+
+static inline int in_window(time_t t, time_t after, time_t before) {
+    return (after == 0 || t >= after) && (before == 0 || t < before);
+}
+
+/*
+ * Determine whether an object is to be archived, skipped, or in the case of
+ * directories, skipped along with all of their contents.  Directories not
+ * matching by type or owner are skipped, but still descended into; the size
+ * and time predicates do not apply to them at all, as with tar --newer.
+ */
+enum b_filter_result b_filter_test(b_filter *filter, struct stat *st, int nodump) {
+    enum b_filter_predicates predicates = filter->predicates;
+    int is_dir = (st->st_mode & S_IFMT) == S_IFDIR;
+
+    if ((predicates & B_FILTER_NODUMP) && nodump) {
+        return is_dir? B_FILTER_PRUNE: B_FILTER_SKIP;
+    }
+
+    if ((predicates & B_FILTER_TYPES) && !(filter->types & type_flag(st->st_mode))) {
+        return B_FILTER_SKIP;
+    }
+
+    if (!is_dir) {
+        if ((predicates & B_FILTER_SIZE) && (st->st_mode & S_IFMT) == S_IFREG) {
+            if (st->st_size < filter->min_size)                         return B_FILTER_SKIP;
+            if (filter->max_size >= 0 && st->st_size > filter->max_size) return B_FILTER_SKIP;
+        }
+
+        if ((predicates & B_FILTER_MTIME) && !in_window(st->st_mtime, filter->mtime_after, filter->mtime_before)) {
+            return B_FILTER_SKIP;
+        }
+
+        if ((predicates & B_FILTER_CTIME) && !in_window(st->st_ctime, filter->ctime_after, filter->ctime_before)) {
+            return B_FILTER_SKIP;
+        }
+    }
+
+    if ((predicates & B_FILTER_UIDS) && !has_id(&filter->uids, st->st_uid)) {
+        return B_FILTER_SKIP;
+    }
+
+    if ((predicates & B_FILTER_GIDS) && !has_id(&filter->gids, st->st_gid)) {
+        return B_FILTER_SKIP;
+    }
+
+    return B_FILTER_MATCH;
+}
+
+void b_filter_destroy(b_filter *filter) {
+    if (filter == NULL) return;
+
+    free(filter->uids.ids);
+    filter->uids.ids = NULL;
+
+    free(filter->gids.ids);
+    filter->gids.ids = NULL;
+
+    free(filter);
+}
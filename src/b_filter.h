@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_FILTER_H
+#define _B_FILTER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "b_string.h"
+
+#define B_FILTER_TYPE_FILE    (1 << 0)
+#define B_FILTER_TYPE_DIR     (1 << 1)
+#define B_FILTER_TYPE_SYMLINK (1 << 2)
+#define B_FILTER_TYPE_CHR     (1 << 3)
+#define B_FILTER_TYPE_BLK     (1 << 4)
+#define B_FILTER_TYPE_FIFO    (1 << 5)
+#define B_FILTER_TYPE_SOCKET  (1 << 6)
+#define B_FILTER_TYPE_ALL     0x7f
+
+enum b_filter_predicates {
+    B_FILTER_NONE   = 0,
+    B_FILTER_SIZE   = 1 << 0,
+    B_FILTER_MTIME  = 1 << 1,
+    B_FILTER_CTIME  = 1 << 2,
+    B_FILTER_TYPES  = 1 << 3,
+    B_FILTER_UIDS   = 1 << 4,
+    B_FILTER_GIDS   = 1 << 5,
+    B_FILTER_NODUMP = 1 << 6
+};
+
+enum b_filter_result {
+    B_FILTER_MATCH,
+    B_FILTER_SKIP,
+    B_FILTER_PRUNE
+};
+
+/*
+ * A sorted set of user or group IDs, either to be matched or to be excluded.
+ */
+typedef struct _b_filter_ids {
+    unsigned long * ids;
+    size_t          count;
+    int             exclude;
+} b_filter_ids;
+
+typedef struct _b_filter {
+    enum b_filter_predicates predicates;
+    off_t                    min_size;
+    off_t                    max_size;
+    time_t                   mtime_after;
+    time_t                   mtime_before;
+    time_t                   ctime_after;
+    time_t                   ctime_before;
+    int                      types;
+    b_filter_ids             uids;
+    b_filter_ids             gids;
+} b_filter;
+
+b_filter * b_filter_new();
+
+void b_filter_set_size(
+    b_filter * filter,
+    off_t      min,
+    off_t      max
+);
+
+void b_filter_set_mtime(
+    b_filter * filter,
+    time_t     after,
+    time_t     before
+);
+
+void b_filter_set_ctime(
+    b_filter * filter,
+    time_t     after,
+    time_t     before
+);
+
+void b_filter_set_types(
+    b_filter * filter,
+    int        types
+);
+
+int b_filter_set_uids(
+    b_filter *      filter,
+    unsigned long * uids,
+    size_t          count,
+    int             exclude
+);
+
+int b_filter_set_gids(
+    b_filter *      filter,
+    unsigned long * gids,
+    size_t          count,
+    int             exclude
+);
+
+void b_filter_set_nodump(b_filter *filter);
+
+int b_filter_stat(
+    b_filter *    filter,
+    b_string *    path,
+    struct stat * st,
+    int           follow,
+    int *         nodump
+);
+
+enum b_filter_result b_filter_test(
+    b_filter *    filter,
+    struct stat * st,
+    int           nodump
+);
+
+void b_filter_destroy(b_filter *filter);
+
+#endif /* _B_FILTER_H */
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -11,6 +12,9 @@
 #include "b_string.h"
 #include "b_stack.h"
 #include "b_path.h"
+#include "b_journal.h"
+#include "b_filter.h"
+#include "b_inode_set.h"
 #include "b_find.h"
 #include "b_error.h"
 
@@ -20,15 +24,99 @@ static inline int b_stat(b_string *path, struct stat *st, int flags) {
     return statfn(path->str, st);
 }
 
+/*
+ * An entry of a directory read in full ahead of time, its name given as an
+ * offset into the names read alongside it.
+ */
 typedef struct {
-    DIR *      dp;
-    b_string * path;
+    ino_t  ino;
+    size_t name;
+} b_dir_entry;
+
+typedef struct {
+    DIR *         dp;
+    b_string *    path;
+    dev_t         dev;
+    ino_t         ino;
+    b_dir_entry * entries;
+    char *        names;
+    size_t        count;
+    size_t        pos;
 } b_dir;
 
-b_dir *b_dir_open(b_string *path) {
+static int compare_dir_entries(const void *a, const void *b) {
+    const b_dir_entry *entry_a = a, *entry_b = b;
+
+    return entry_a->ino < entry_b->ino? -1: entry_a->ino > entry_b->ino? 1: 0;
+}
+
+/*
+ * Read every entry of a directory not yet read into memory, and close the
+ * directory stream, not to hold a file descriptor for every level of the
+ * tree.  When sorted by inode number, the inodes are then visited in roughly
+ * the order of the inode table rather than in the hash order in which many
+ * filesystems return entries.
+ */
+static int b_dir_read_all(b_dir *dir, int sort) {
+    struct dirent *entry;
+    size_t size = 0, names_size = 0, names_used = 0;
+
+    while ((entry = readdir(dir->dp)) != NULL) {
+        size_t len = strlen(entry->d_name) + 1;
+
+        if (dir->count == size) {
+            b_dir_entry *entries;
+
+            size = size? size * 2: 64;
+
+            if ((entries = realloc(dir->entries, size * sizeof(*entries))) == NULL) {
+                return -1;
+            }
+
+            dir->entries = entries;
+        }
+
+        if (names_used + len > names_size) {
+            char *names;
+
+            names_size = names_size? names_size * 2: 4096;
+
+            while (names_used + len > names_size) {
+                names_size *= 2;
+            }
+
+            if ((names = realloc(dir->names, names_size)) == NULL) {
+                return -1;
+            }
+
+            dir->names = names;
+        }
+
+        memcpy(dir->names + names_used, entry->d_name, len);
+
+        dir->entries[dir->count].ino  = entry->d_ino;
+        dir->entries[dir->count].name = names_used;
+
+        dir->count++;
+        names_used += len;
+    }
+
+    if (sort) {
+        qsort(dir->entries, dir->count, sizeof(*dir->entries), compare_dir_entries);
+    }
+
+    closedir(dir->dp);
+    dir->dp = NULL;
+
+    return 0;
+}
+
+static void b_dir_destroy(b_dir *item);
+
+b_dir *b_dir_open(b_string *path, int flags) {
     b_dir *dir;
 
-    if ((dir = malloc(sizeof(*dir))) == NULL) {
+    if ((dir = calloc(1, sizeof(*dir))) == NULL) {
         goto error_malloc;
     }
 
@@ -40,6 +128,12 @@ b_dir *b_dir_open(b_string *path) {
         goto error_string_dup;
     }
 
+    if ((flags & B_FIND_SORT_INODES) && b_dir_read_all(dir, 1) < 0) {
+        b_dir_destroy(dir);
+
+        return NULL;
+    }
+
     return dir;
 
 error_string_dup:
@@ -55,6 +149,7 @@ error_malloc:
 static void b_dir_close(b_dir *item) {
     if (item->dp) {
         closedir(item->dp);
+        item->dp = NULL;
     }
 }
 
@@ -66,9 +161,90 @@ static void b_dir_destroy(b_dir *item) {
     b_string_free(item->path);
     item->path = NULL;
 
+    free(item->entries);
+    free(item->names);
     free(item);
 }
 
+/*
+ * A directory holding only the exclusion tag found within it, so that the tag
+ * is archived just as it would be were the directory read, without reading
+ * the rest of it.
+ */
+static b_dir *b_dir_tagged(b_string *path, b_string *name) {
+    b_dir *dir;
+
+    if ((dir = calloc(1, sizeof(*dir))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((dir->path = b_string_dup(path)) == NULL) {
+        goto error_tagged;
+    }
+
+    if ((dir->entries = calloc(1, sizeof(*dir->entries))) == NULL) {
+        goto error_tagged;
+    }
+
+    if ((dir->names = strdup(name->str)) == NULL) {
+        goto error_tagged;
+    }
+
+    dir->count = 1;
+
+    return dir;
+
+error_tagged:
+    b_dir_destroy(dir);
+
+error_malloc:
+    return NULL;
+}
+
+/*
+ * Look within the directory at path, open as fd if fd is positive, for any
+ * tag marking its contents as not to be archived, before any of it is read.
+ * A cache directory tag counts only when it begins with the signature given
+ * by the Cache Directory Tagging Specification.
+ */
+static b_builder_tag *find_tag(b_builder *builder, b_string *path, int fd) {
+    b_builder_tag *found = NULL;
+    int dirfd = fd;
+    size_t i;
+
+    if (fd <= 0 && (dirfd = open(path->str, O_RDONLY | O_DIRECTORY)) < 0) {
+        return NULL;
+    }
+
+    for (i=0; found == NULL && i<b_stack_count(builder->tags); i++) {
+        b_builder_tag *tag = b_stack_item_at(builder->tags, i);
+
+        if (tag->type == B_BUILDER_TAG_CACHEDIR) {
+            char signature[B_BUILDER_CACHEDIR_SIGNATURE_SIZE];
+            int tagfd;
+
+            if ((tagfd = openat(dirfd, tag->name->str, O_RDONLY | O_NONBLOCK)) < 0) {
+                continue;
+            }
+
+            if (read(tagfd, signature, sizeof(signature)) == sizeof(signature)
+              && memcmp(signature, B_BUILDER_CACHEDIR_SIGNATURE, sizeof(signature)) == 0) {
+                found = tag;
+            }
+
+            close(tagfd);
+        } else if (faccessat(dirfd, tag->name->str, F_OK, 0) == 0) {
+            found = tag;
+        }
+    }
+
+    if (dirfd != fd) {
+        close(dirfd);
+    }
+
+    return found;
+}
+
 typedef struct {
     b_string * path;
     b_string * name;
@@ -76,14 +252,26 @@ typedef struct {
 
 static b_dir_item *b_dir_read(b_dir *dir, int flags) {
     b_dir_item *item;
-    struct dirent *entry;
+    const char *name;
 
     /*
-     * If readdir() returns null, then don't bother with setting up any other
-     * state.
+     * If there are no entries left, then don't bother with setting up any
+     * other state.
      */
-    if ((entry = readdir(dir->dp)) == NULL) {
-        goto error_readdir;
+    if (dir->dp == NULL) {
+        if (dir->pos == dir->count) {
+            goto error_readdir;
+        }
+
+        name = dir->names + dir->entries[dir->pos++].name;
+    } else {
+        struct dirent *entry;
+
+        if ((entry = readdir(dir->dp)) == NULL) {
+            goto error_readdir;
+        }
+
+        name = entry->d_name;
     }
 
     if ((item = malloc(sizeof(*item))) == NULL) {
@@ -94,7 +282,7 @@ static b_dir_item *b_dir_read(b_dir *dir, int flags) {
         goto error_string_dup;
     }
 
-    if ((item->name = b_string_new(entry->d_name)) == NULL) {
+    if ((item->name = b_string_new((char *)name)) == NULL) {
         goto error_string_new;
     }
 
@@ -107,7 +295,7 @@ static b_dir_item *b_dir_read(b_dir *dir, int flags) {
         }
     }
 
-    if (b_string_append_str(item->path, entry->d_name) == NULL) {
+    if (b_string_append_str(item->path, (char *)name) == NULL) {
         goto error_string_append;
     }
 
@@ -127,6 +315,44 @@ error_readdir:
     return NULL;
 }
 
+/*
+ * Keep no more than the given number of directory streams open, by reading
+ * the entries left in the shallowest of those open into memory and closing
+ * them.  Directories below the one given by 'drained' are known to be closed
+ * already.
+ */
+static int limit_open_dirs(b_stack *dirs, size_t max, size_t *drained) {
+    size_t count = b_stack_count(dirs);
+    size_t open  = 0;
+    size_t i;
+
+    if (*drained > count) {
+        *drained = count;
+    }
+
+    for (i=*drained; i<count; i++) {
+        b_dir *dir = b_stack_item_at(dirs, i);
+
+        if (dir->dp) open++;
+    }
+
+    for (i=*drained; i<count && open > max; i++) {
+        b_dir *dir = b_stack_item_at(dirs, i);
+
+        if (dir->dp == NULL) continue;
+
+        if (b_dir_read_all(dir, 0) < 0) {
+            return -1;
+        }
+
+        open--;
+    }
+
+    *drained = i;
+
+    return 0;
+}
+
 static void b_dir_item_free(b_dir_item *item) {
     if (item == NULL) return;
 
@@ -165,6 +391,111 @@ error_string_dup:
     return NULL;
 }
 
+/*
+ * Determine whether the object at path lies across a mount boundary not to be
+ * crossed: on a device other than that of the root of the walk, or at the
+ * root of any other mount when walking one filesystem, or on a filesystem of
+ * a type to be skipped.  Returns 1 if so, 0 if not, or -1 on error.
+ */
+static int is_mount_boundary(b_builder *builder, b_string *path, struct stat *st, dev_t root_dev, int fd, int flags) {
+    if (flags & B_FIND_ONE_FILE_SYSTEM) {
+        if (st->st_dev != root_dev) {
+            return 1;
+        }
+
+#ifdef STATX_ATTR_MOUNT_ROOT
+        /*
+         * Bind mounts share the device of the filesystem they are taken from,
+         * and so can only be told apart by the kernel.
+         */
+        if ((st->st_mode & S_IFMT) == S_IFDIR) {
+            struct statx stx;
+            int ret;
+
+            if (fd > 0) {
+                ret = statx(fd, "", AT_EMPTY_PATH, 0, &stx);
+            } else {
+                ret = statx(AT_FDCWD, path->str, (flags & B_FIND_FOLLOW_SYMLINKS)? 0: AT_SYMLINK_NOFOLLOW, 0, &stx);
+            }
+
+            if (ret == 0 && (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) && (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT)) {
+                return 1;
+            }
+        }
+#endif /* STATX_ATTR_MOUNT_ROOT */
+    }
+
+    if (builder->mounts) {
+        return b_mounts_skipped(builder->mounts, path, st->st_dev, fd);
+    }
+
+    return 0;
+}
+
+/*
+ * Determine whether a directory is one of those being walked at present, in
+ * which case walking it again would never end.
+ */
+static int is_walking(b_stack *dirs, struct stat *st) {
+    size_t i;
+
+    for (i=0; i<b_stack_count(dirs); i++) {
+        b_dir *dir = b_stack_item_at(dirs, i);
+
+        if (dir->dev == st->st_dev && dir->ino == st->st_ino) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Determine whether an inode archived already is to be passed over, rather
+ * than given to the callback again to be written as a hardlink to the member
+ * first archived for it.
+ */
+static int is_duplicate(b_builder *builder, struct stat *st) {
+    if (builder->archived == NULL || !b_inode_set_has(builder->archived, st->st_dev, st->st_ino)) {
+        return 0;
+    }
+
+    return (st->st_mode & S_IFMT) != S_IFREG || builder->hardlink_lookup == NULL;
+}
+
+/*
+ * Determine, without opening it, whether an item could be opened as b_find()
+ * would otherwise open it, raising the same warning when it could not.  The
+ * callback, which opens regular files itself if need be, is left to judge
+ * those.
+ */
+static int is_openable(b_string *path, struct stat *st, b_error *err, int flags) {
+    switch (st->st_mode & S_IFMT) {
+        case S_IFSOCK:
+            if (err && !(flags & B_FIND_IGNORE_SOCKETS)) {
+                b_error_set(err, B_ERROR_WARN, ENXIO, "Cannot open file", path);
+            }
+
+            return 0;
+
+        case S_IFDIR:
+            if (faccessat(AT_FDCWD, path->str, R_OK, 0) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_WARN, errno, "Cannot open file", path);
+                }
+
+                return 0;
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    return 1;
+}
+
 /*
  * callback() should return a 0 or 1; 0 to indicate that traversal at the current
  * level should halt, or 1 that it should continue.
@@ -172,10 +503,13 @@ error_string_dup:
 int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_callback callback, int flags) {
     b_stack *dirs;
     b_dir *dir;
+    b_inode_set *visited = NULL;
     struct stat st, item_st;
     int fd = 0, res, oflags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK;
+    size_t drained = 0;
 
     b_error *err = b_builder_get_error(builder);
+    b_builder_tag *tag = NULL;
 
     b_string *clean_path;
     b_string *clean_member_name;
@@ -198,17 +532,56 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
 
     b_stack_set_destructor(dirs, B_STACK_DESTRUCTOR(b_dir_destroy));
 
+    /*
+     * When following symlinks, the same directory may be reached by more
+     * than one path, so note each directory walked.
+     */
+    if ((flags & B_FIND_FOLLOW_SYMLINKS) && (visited = b_inode_set_new()) == NULL) {
+        goto error_stat;
+    }
+
     if (b_stat(clean_path, &st, flags) < 0) {
         goto error_stat;
     }
 
+    /*
+     * The filter applies to the root item as it would to any item beneath it.
+     */
+    if (builder->filter) {
+        struct stat filter_st;
+        int nodump;
+
+        if (b_filter_stat(builder->filter, clean_path, &filter_st, flags & B_FIND_FOLLOW_SYMLINKS, &nodump) < 0) {
+            goto error_stat;
+        }
+
+        switch (b_filter_test(builder->filter, &filter_st, nodump)) {
+            case B_FILTER_PRUNE:
+                goto cleanup;
+
+            case B_FILTER_SKIP:
+                if ((st.st_mode & S_IFMT) != S_IFDIR) {
+                    goto cleanup;
+                }
+
+                flags |= B_FIND_SKIP_ROOT;
+
+            default:
+                break;
+        }
+    }
+
+    if (is_duplicate(builder, &st)) {
+        goto cleanup;
+    }
+
     /*
      * If the item we're dealing with is not a directory, or is not wanted by
      * the callback, then do not bother with traversal code.  Otherwise, all
      * code after these guard clauses pertains to the case of 'path' being a
      * directory.
      */
-    if ((st.st_mode & S_IFMT) == S_IFREG) {
+    if ((st.st_mode & S_IFMT) == S_IFREG && !(flags & B_FIND_STAT_ONLY)) {
         if ((fd = open(clean_path->str, oflags)) < 0) {
             goto error_open;
         }
@@ -216,7 +589,7 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
             goto error_open;
     }
 
-    res = callback(builder, clean_path, clean_member_name, &st, fd);
+    res = (flags & B_FIND_SKIP_ROOT)? 1: callback(builder, clean_path, clean_member_name, &st, fd);
 
     if (fd > 0) {
         close(fd);
@@ -230,10 +603,47 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
     }
 
     if ((st.st_mode & S_IFMT) != S_IFDIR) {
-        return 0;
+        if (builder->archived && !(flags & B_FIND_SKIP_ROOT) && b_inode_set_add(builder->archived, st.st_dev, st.st_ino) < 0) {
+            goto error_callback;
+        }
+
+        goto cleanup;
+    }
+
+    if (flags & B_FIND_NO_RECURSE) {
+        goto cleanup;
     }
 
-    if ((dir = b_dir_open(clean_path)) == NULL) {
+    /*
+     * The root is not descended into if it lies on a filesystem of a type to
+     * be skipped, as any other directory would not be.
+     */
+    if (builder->mounts) {
+        switch (b_mounts_skipped(builder->mounts, clean_path, st.st_dev, 0)) {
+            case 0:
+                break;
+
+            case 1:
+                goto cleanup;
+
+            default:
+                if (err) {
+                    b_error_set(err, B_ERROR_WARN, errno, "Cannot statfs() directory", clean_path);
+                }
+
+                goto error_mounts;
+        }
+    }
+
+    /*
+     * A tagged directory is not read at all; if its tag is to be archived,
+     * then it alone is visited.
+     */
+    if (builder->tags && (tag = find_tag(builder, clean_path, 0)) != NULL && tag->type == B_BUILDER_TAG_UNDER) {
+        goto cleanup;
+    }
+
+    if ((dir = tag? b_dir_tagged(clean_path, tag->name): b_dir_open(clean_path, flags)) == NULL) {
         if (err) {
             b_error_set(err, B_ERROR_WARN, errno, "Unable to open directory", clean_path);
         }
@@ -241,17 +651,28 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
         goto error_dir_open;
     }
 
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+
     if (b_stack_push(dirs, dir) == NULL) {
         b_dir_destroy(dir);
 
         goto error_stack_push;
     }
 
+    if (visited && b_inode_set_add(visited, st.st_dev, st.st_ino) < 0) {
+        goto error_stack_push;
+    }
+
+    if (builder->archived && b_inode_set_add(builder->archived, st.st_dev, st.st_ino) < 0) {
+        goto error_stack_push;
+    }
+
     while (1) {
         b_dir_item *item;
         b_string *new_member_name;
         b_dir *cwd = b_stack_top(dirs);
-        int item_fd = 0;
+        int item_fd = 0, skip_callback, boundary, revisit;
 
         if (cwd == NULL) {
             break;
@@ -280,7 +701,58 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
             goto cleanup_item;
         }
 
-        if ((item_fd = open(item->path->str, oflags)) < 0) {
+        /*
+         * With a filter in place, the item is examined before it is opened,
+         * so that those not wanted cost no more than the stat() itself.
+         */
+        skip_callback = 0;
+
+        if (builder->filter) {
+            int nodump;
+
+            if (b_filter_stat(builder->filter, item->path, &item_st, flags & B_FIND_FOLLOW_SYMLINKS, &nodump) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_WARN, errno, "Cannot stat() file", item->path);
+                }
+
+                goto cleanup_item;
+            }
+
+            switch (b_filter_test(builder->filter, &item_st, nodump)) {
+                case B_FILTER_MATCH:
+                    break;
+
+                case B_FILTER_SKIP:
+                    if ((item_st.st_mode & S_IFMT) != S_IFDIR) {
+                        goto cleanup_item;
+                    }
+
+                    skip_callback = 1;
+
+                    break;
+
+                case B_FILTER_PRUNE:
+                    goto cleanup_item;
+            }
+        }
+
+        /*
+         * When only the results of stat() are wanted, nothing is opened, and
+         * regular files are left for the callback to open if it needs to.
+         */
+        if (flags & B_FIND_STAT_ONLY) {
+            if (builder->filter == NULL && b_stat(item->path, &item_st, flags) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_WARN, errno, "Cannot stat() file", item->path);
+                }
+
+                goto cleanup_item;
+            }
+
+            if (!is_openable(item->path, &item_st, err, flags)) {
+                goto cleanup_item;
+            }
+        } else if ((item_fd = open(item->path->str, oflags)) < 0) {
             /*
              * If O_NOFOLLOW is used (which is default) to open() the current
              * item, then check for ELOOP; this condition will occur when
@@ -335,15 +807,77 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
             }
         }
 
+        /*
+         * Objects across a mount boundary are passed over, save for the
+         * directories at which other filesystems are mounted, which are
+         * archived but not descended into.
+         */
+        boundary = 0;
+
+        if ((flags & B_FIND_ONE_FILE_SYSTEM) || builder->mounts) {
+            if ((boundary = is_mount_boundary(builder, item->path, &item_st, st.st_dev, item_fd, flags)) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_WARN, errno, "Cannot statfs() file", item->path);
+                }
+
+                goto cleanup_item;
+            }
+
+            if (boundary && (item_st.st_mode & S_IFMT) != S_IFDIR) {
+                goto cleanup_item;
+            }
+        }
+
+        /*
+         * A directory being walked already, or walked before by way of another
+         * symlink, is not walked again.  Symlinks to it are archived as they
+         * are, while the same directory reached anew through a bind mount is
+         * archived but not descended into.
+         */
+        revisit = 0;
+
+        if ((item_st.st_mode & S_IFMT) == S_IFDIR) {
+            int cycle = is_walking(dirs, &item_st);
+
+            if (cycle || (visited && b_inode_set_has(visited, item_st.st_dev, item_st.st_ino))) {
+                struct stat link_st;
+
+                if (cycle && err) {
+                    b_error_set(err, B_ERROR_WARN, ELOOP, "Directory cycle detected", item->path);
+                }
+
+                if (skip_callback) {
+                    goto cleanup_item;
+                }
+
+                revisit = 1;
+
+                if (visited && lstat(item->path->str, &link_st) == 0 && (link_st.st_mode & S_IFMT) == S_IFLNK) {
+                    item_st = link_st;
+
+                    close(item_fd);
+                    item_fd = 0;
+                }
+            }
+        }
+
+        if (is_duplicate(builder, &item_st)) {
+            goto cleanup_item;
+        }
+
         /*
          * Attempt to obtain and use a substituted member name based on the
          * real path, and use it, if possible.
          */
-        new_member_name = subst_member_name(clean_path, clean_member_name, item->path);
+        if (skip_callback) {
+            res = 1;
+        } else {
+            new_member_name = subst_member_name(clean_path, clean_member_name, item->path);
 
-        res = callback(builder, item->path, new_member_name? new_member_name: item->path, &item_st, item_fd);
+            res = callback(builder, item->path, new_member_name? new_member_name: item->path, &item_st, item_fd);
 
-        b_string_free(new_member_name);
+            b_string_free(new_member_name);
+        }
 
         if (res == 0) {
             goto cleanup_item;
@@ -355,10 +889,34 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
             }
         }
 
+        if ((item_st.st_mode & S_IFMT) != S_IFDIR && builder->archived && b_inode_set_add(builder->archived, item_st.st_dev, item_st.st_ino) < 0) {
+            goto error_item;
+        }
+
         if ((item_st.st_mode & S_IFMT) == S_IFDIR) {
             b_dir *newdir;
 
-            if ((newdir = b_dir_open(item->path)) == NULL) {
+            if (boundary || revisit) {
+                goto cleanup_item;
+            }
+
+            if (builder->tags && (tag = find_tag(builder, item->path, item_fd)) != NULL && tag->type == B_BUILDER_TAG_UNDER) {
+                goto cleanup_item;
+            }
+
+            /*
+             * Make room for the new directory within the budget of open
+             * directories, if any.
+             */
+            if (builder->max_open_dirs && limit_open_dirs(dirs, builder->max_open_dirs - 1, &drained) < 0) {
+                if (err) {
+                    b_error_set(err, B_ERROR_FATAL, errno, "Unable to read directory", item->path);
+                }
+
+                goto error_item;
+            }
+
+            if ((newdir = tag? b_dir_tagged(item->path, tag->name): b_dir_open(item->path, flags)) == NULL) {
                 if (err) {
                     b_error_set(err, B_ERROR_WARN, errno, "Unable to open directory", item->path);
                 }
@@ -370,11 +928,22 @@ int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_cal
                 }
             }
 
+            newdir->dev = item_st.st_dev;
+            newdir->ino = item_st.st_ino;
+
             if (b_stack_push(dirs, newdir) == NULL) {
                 b_dir_destroy(newdir);
 
                 goto error_stack_push;
             }
+
+            if (visited && b_inode_set_add(visited, item_st.st_dev, item_st.st_ino) < 0) {
+                goto error_item;
+            }
+
+            if (builder->archived && b_inode_set_add(builder->archived, item_st.st_dev, item_st.st_ino) < 0) {
+                goto error_item;
+            }
         }
 
 cleanup_item:
@@ -399,6 +968,7 @@ error_item:
     }
 
 cleanup:
+    b_inode_set_destroy(visited);
     b_stack_destroy(dirs);
     b_string_free(clean_path);
     b_string_free(clean_member_name);
@@ -408,6 +978,7 @@ cleanup:
 error_cleanup:
 error_stack_push:
 error_dir_open:
+error_mounts:
 error_callback:
     if (fd > 0) {
         close(fd);
@@ -416,6 +987,7 @@ error_callback:
 
 error_open:
 error_stat:
+    b_inode_set_destroy(visited);
     b_stack_destroy(dirs);
 
 error_stack_new:
@@ -427,3 +999,275 @@ error_path_clean_member_name:
 error_path_clean:
     return -1;
 }
+
+static int is_beneath(b_string *path, b_string *dir) {
+    if (dir->len == 1 && dir->str[0] == '/') {
+        return path->str[0] == '/';
+    }
+
+    if (path->len < dir->len || memcmp(path->str, dir->str, dir->len) != 0) {
+        return 0;
+    }
+
+    return path->len == dir->len || path->str[dir->len] == '/';
+}
+
+static int is_pruned(b_builder *builder, b_string *path) {
+    struct stat st;
+    int nodump;
+
+    if (b_filter_stat(builder->filter, path, &st, 0, &nodump) < 0) {
+        return 0;
+    }
+
+    return b_filter_test(builder->filter, &st, nodump) == B_FILTER_PRUNE;
+}
+
+/*
+ * Determine whether the path given, or any directory between it and root,
+ * is excluded, or any such directory pruned by the filter, as it would never
+ * have been reached by walking from root.
+ */
+static int is_excluded_beneath(b_builder *builder, b_string *root, b_string *path) {
+    int prune  = builder->filter && (builder->filter->predicates & B_FILTER_NODUMP);
+    size_t len = path->len, i;
+
+    for (i=root->len + 1; i<path->len; i++) {
+        int excluded;
+
+        if (path->str[i] != '/') continue;
+
+        path->str[i] = '\0';
+        path->len    = i;
+
+        excluded = (builder->match && lafe_excluded(builder->match, path->str)) || (prune && is_pruned(builder, path));
+
+        path->str[i] = '/';
+        path->len    = len;
+
+        if (excluded) return 1;
+    }
+
+    return builder->match && lafe_excluded(builder->match, path->str);
+}
+
+/*
+ * Determine whether any directory between root and the path given lies
+ * across a mount boundary, as the path would then never have been reached by
+ * walking from root.
+ */
+static int is_mounted_beneath(b_builder *builder, b_string *root, dev_t root_dev, b_string *path, int flags) {
+    size_t len = path->len, i;
+
+    for (i=root->len + 1; i<path->len; i++) {
+        struct stat st;
+        int boundary;
+
+        if (path->str[i] != '/') continue;
+
+        path->str[i] = '\0';
+        path->len    = i;
+
+        boundary = b_stat(path, &st, flags) == 0 && is_mount_boundary(builder, path, &st, root_dev, 0, flags) == 1;
+
+        path->str[i] = '/';
+        path->len    = len;
+
+        if (boundary) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Determine whether any directory from root down to the parent of the path
+ * given holds an exclusion tag, as the path would then never have been
+ * reached by walking from root, unless it is the tag itself.
+ */
+static int is_tagged_beneath(b_builder *builder, b_string *root, b_string *path) {
+    size_t len = path->len, i;
+
+    for (i=(root->len == 1? 0: root->len); i<len; i++) {
+        b_builder_tag *tag;
+
+        if (path->str[i] != '/') continue;
+
+        if (i == 0) {
+            tag = find_tag(builder, root, 0);
+        } else {
+            path->str[i] = '\0';
+            path->len    = i;
+
+            tag = find_tag(builder, path, 0);
+
+            path->str[i] = '/';
+            path->len    = len;
+        }
+
+        if (tag == NULL) continue;
+
+        return tag->type == B_BUILDER_TAG_UNDER || strcmp(path->str + i + 1, tag->name->str) != 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Rather than walk the entire tree at path, visit only those paths beneath it
+ * named in the changes read from a journal.  Paths changed in place are given
+ * to the callback alone, while directories added anew, and paths deleted and
+ * since recreated, are walked in full; paths beneath those are then passed
+ * over, having been visited already.  Deleted paths are forgotten by the
+ * builder.
+ */
+int b_find_changes(b_builder *builder, b_stack *changes, b_string *path, b_string *member_name, b_find_callback callback, int flags) {
+    char real[PATH_MAX];
+    b_string *root, *tree = NULL, *change_member_name;
+    struct stat root_st;
+    int mounts = (flags & B_FIND_ONE_FILE_SYSTEM) || builder->mounts;
+    size_t i;
+
+    if (realpath(path->str, real) == NULL) {
+        goto error_realpath;
+    }
+
+    if ((root = b_string_new(real)) == NULL) {
+        goto error_realpath;
+    }
+
+    if (mounts && b_stat(root, &root_st, flags) < 0) {
+        goto error_change;
+    }
+
+    for (i=0; i<b_stack_count(changes); i++) {
+        b_journal_change *change = b_stack_item_at(changes, i);
+        b_string rest;
+        struct stat st;
+        int change_flags = flags;
+
+        if (!is_beneath(change->path, root)) continue;
+        if (tree && is_beneath(change->path, tree)) continue;
+
+        if ((builder->match || builder->filter) && is_excluded_beneath(builder, root, change->path)) {
+            continue;
+        }
+
+        if (builder->tags && is_tagged_beneath(builder, root, change->path)) {
+            continue;
+        }
+
+        rest.str = change->path->str + (root->len == 1? 0: root->len);
+        rest.len = change->path->len - (root->len == 1? 0: root->len);
+
+        if ((change_member_name = b_string_dup(member_name)) == NULL) {
+            goto error_change;
+        }
+
+        if (b_string_append(change_member_name, &rest) == NULL) {
+            goto error_member_name;
+        }
+
+        if (change->type == B_JOURNAL_DELETED && b_builder_forget_member(builder, change_member_name) < 0) {
+            goto error_member_name;
+        }
+
+        /*
+         * Paths since deleted, or beneath directories since moved, are gone.
+         */
+        if (b_stat(change->path, &st, flags) < 0) {
+            b_string_free(change_member_name);
+
+            if (errno == ENOENT || errno == ENOTDIR) continue;
+
+            goto error_change;
+        }
+
+        /*
+         * Paths at a mount boundary are not descended into, and those beneath
+         * one passed over, just as when walking from root.
+         */
+        if (mounts && change->path->len > root->len) {
+            int boundary;
+
+            if (is_mounted_beneath(builder, root, root_st.st_dev, change->path, flags)) {
+                b_string_free(change_member_name);
+
+                continue;
+            }
+
+            if ((boundary = is_mount_boundary(builder, change->path, &st, root_st.st_dev, 0, flags)) < 0) {
+                b_string_free(change_member_name);
+
+                goto error_change;
+            }
+
+            if (boundary) {
+                if ((st.st_mode & S_IFMT) != S_IFDIR) {
+                    b_string_free(change_member_name);
+
+                    continue;
+                }
+
+                change_flags |= B_FIND_NO_RECURSE;
+            }
+        }
+
+        if (builder->filter && change->path->len > root->len) {
+            enum b_filter_result result;
+            int nodump;
+
+            if (b_filter_stat(builder->filter, change->path, &st, flags & B_FIND_FOLLOW_SYMLINKS, &nodump) < 0) {
+                b_string_free(change_member_name);
+
+                if (errno == ENOENT || errno == ENOTDIR) continue;
+
+                goto error_change;
+            }
+
+            result = b_filter_test(builder->filter, &st, nodump);
+
+            if (result == B_FILTER_PRUNE || (result == B_FILTER_SKIP && ((st.st_mode & S_IFMT) != S_IFDIR || change->type == B_JOURNAL_CHANGED))) {
+                if (result == B_FILTER_PRUNE) {
+                    tree = change->path;
+                }
+
+                b_string_free(change_member_name);
+
+                continue;
+            }
+
+            /*
+             * Directories not matching are still walked when added anew, as
+             * they would be by b_find(), but not archived themselves.
+             */
+            if (result == B_FILTER_SKIP) {
+                change_flags |= B_FIND_SKIP_ROOT;
+            }
+        }
+
+        if (change->type == B_JOURNAL_CHANGED) {
+            change_flags |= B_FIND_NO_RECURSE;
+        } else {
+            tree = change->path;
+        }
+
+        if (b_find(builder, change->path, change_member_name, callback, change_flags) < 0) {
+            goto error_member_name;
+        }
+
+        b_string_free(change_member_name);
+    }
+
+    b_string_free(root);
+
+    return 0;
+
+error_member_name:
+    b_string_free(change_member_name);
+
+error_change:
+    b_string_free(root);
+
+error_realpath:
+    return -1;
+}
@@ -16,13 +16,20 @@
 #include <unistd.h>
 #include "b_builder.h"
 #include "b_string.h"
+#include "b_stack.h"
 
 #define B_FIND_FOLLOW_SYMLINKS (1 << 0)
 #define B_FIND_IGNORE_SOCKETS  (1 << 1)
+#define B_FIND_NO_RECURSE      (1 << 2)
+#define B_FIND_SKIP_ROOT       (1 << 3)
+#define B_FIND_SORT_INODES     (1 << 4)
+#define B_FIND_ONE_FILE_SYSTEM (1 << 5)
+#define B_FIND_STAT_ONLY       (1 << 6)
 #define B_FIND_CALLBACK(c)     ((b_find_callback)c)
 
 typedef int (*b_find_callback)(b_builder *builder, b_string *path, b_string *member_name, struct stat *st, int fd);
 
 int b_find(b_builder *builder, b_string *path, b_string *member_name, b_find_callback callback, int flags);
+int b_find_changes(b_builder *builder, b_stack *changes, b_string *path, b_string *member_name, b_find_callback callback, int flags);
 
 #endif /* _B_FIND_H */
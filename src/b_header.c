@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include "b_header.h"
 #include "b_stack.h"
 #include "b_path.h"
@@ -148,6 +149,158 @@ b_header_block *b_header_encode_pax_block(b_header_block *block, b_header *heade
     return block;
 }
 
+/*
+ * Parse a numeric header field, which is either octal digits padded with
+ * spaces or NULs, or a base-256 value flagged by the uppermost bit of the
+ * first byte, as written by encode_base256_value().
+ */
+static int decode_number(const char *field, size_t len, uint64_t *value) {
+    const unsigned char *p = (const unsigned char *)field;
+    uint64_t ret = 0;
+    size_t i = 0;
+
+    if (p[0] & 0x80) {
+        ret = p[0] & 0x3f;
+
+        for (i=1; i<len; i++) {
+            ret = (ret << 8) | p[i];
+        }
+
+        *value = ret;
+
+        return 0;
+    }
+
+    while (i < len && p[i] == ' ') i++;
+
+    for (; i<len && p[i] >= '0' && p[i] <= '7'; i++) {
+        ret = (ret << 3) | (p[i] - '0');
+    }
+
+    if (i < len && p[i] != ' ' && p[i] != '\0') {
+        return -1;
+    }
+
+    *value = ret;
+
+    return 0;
+}
+
+static b_string *decode_string(const char *field, size_t len) {
+    return b_string_new_len((char *)field, strnlen(field, len));
+}
+
+int b_header_block_is_empty(b_header_block *block) {
+    const uint64_t *words = (const uint64_t *)block;
+    size_t i;
+
+    for (i=0; i<B_HEADER_SIZE / sizeof(*words); i++) {
+        if (words[i]) return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Decode a header block read from an archive, verifying its checksum.  The
+ * prefix field is only honoured in POSIX ustar headers, as GNU headers store
+ * other data there.  Returns NULL, setting errno to EINVAL, if the block is not
+ * a valid header.
+ */
+b_header *b_header_decode_block(b_header_block *block) {
+    b_header *header;
+    uint64_t sum, expected, signed_sum = 0, value;
+    int i;
+
+    if (decode_number(block->checksum, B_HEADER_CHECKSUM_SIZE, &expected) < 0) {
+        goto error_invalid;
+    }
+
+    sum = checksum(block);
+
+    for (i=0; i<B_HEADER_CHECKSUM_SIZE; i++) {
+        sum -= (uint8_t)block->checksum[i];
+        sum += ' ';
+    }
+
+    for (i=0; i<B_HEADER_SIZE; i++) {
+        signed_sum += (int8_t)((char *)block)[i];
+    }
+
+    for (i=0; i<B_HEADER_CHECKSUM_SIZE; i++) {
+        signed_sum -= (int8_t)block->checksum[i];
+        signed_sum += ' ';
+    }
+
+    if (sum != expected && signed_sum != expected) {
+        goto error_invalid;
+    }
+
+    if ((header = calloc(1, sizeof(*header))) == NULL) {
+        goto error_malloc;
+    }
+
+    if (decode_number(block->mode, B_HEADER_MODE_SIZE, &value) < 0) goto error_decode;
+    header->mode = value;
+
+    if (decode_number(block->uid, B_HEADER_UID_SIZE, &value) < 0) goto error_decode;
+    header->uid = value;
+
+    if (decode_number(block->gid, B_HEADER_GID_SIZE, &value) < 0) goto error_decode;
+    header->gid = value;
+
+    if (decode_number(block->size, B_HEADER_SIZE_SIZE, &value) < 0) goto error_decode;
+    header->size = value;
+
+    if (decode_number(block->mtime, B_HEADER_MTIME_SIZE, &value) < 0) goto error_decode;
+    header->mtime = value;
+
+    if (decode_number(block->major, B_HEADER_MAJOR_SIZE, &value) < 0) goto error_decode;
+    header->major = value;
+
+    if (decode_number(block->minor, B_HEADER_MINOR_SIZE, &value) < 0) goto error_decode;
+    header->minor = value;
+
+    header->linktype = block->linktype;
+
+    if ((header->suffix = decode_string(block->suffix, B_HEADER_SUFFIX_SIZE)) == NULL) {
+        goto error_decode;
+    }
+
+    if (block->linkdest[0]) {
+        if ((header->linkdest = decode_string(block->linkdest, B_HEADER_LINKDEST_SIZE)) == NULL) {
+            goto error_decode;
+        }
+    }
+
+    if (memcmp(block->magic, "ustar", 5) == 0) {
+        if ((header->user = decode_string(block->user, B_HEADER_USER_SIZE)) == NULL) {
+            goto error_decode;
+        }
+
+        if ((header->group = decode_string(block->group, B_HEADER_GROUP_SIZE)) == NULL) {
+            goto error_decode;
+        }
+    }
+
+    if (memcmp(block->magic, B_HEADER_MAGIC, B_HEADER_MAGIC_SIZE) == 0 && block->prefix[0]) {
+        if ((header->prefix = decode_string(block->prefix, B_HEADER_PREFIX_SIZE)) == NULL) {
+            goto error_decode;
+        }
+    }
+
+    return header;
+
+error_decode:
+    b_header_destroy(header);
+
+error_invalid:
+    errno = EINVAL;
+
+error_malloc:
+    return NULL;
+}
+
 int b_header_set_usernames(b_header *header, b_string *user, b_string *group) {
     header->user  = user;
     header->group = group;
@@ -108,6 +108,8 @@ typedef struct _b_header_block {
 
 b_header *       b_header_for_file(b_string *path, b_string *member_name, struct stat *st);
 int              b_header_set_usernames(b_header *header, b_string *user, b_string *group);
+b_header *       b_header_decode_block(b_header_block *block);
+int              b_header_block_is_empty(b_header_block *block);
 b_header_block * b_header_encode_block(b_header_block *block, b_header *header);
 b_header_block * b_header_encode_longlink_block(b_header_block *block, b_string *path, int type);
 b_header_block * b_header_encode_pax_block(b_header_block *block, b_header *header, b_string *path);
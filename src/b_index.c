@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "b_string.h"
+#include "b_util.h"
+#include "b_index.h"
+
+/*
+ * A member index lists, one line of JSON per member, the name of each member
+ * along with the offsets of its header and data within the uncompressed tar
+ * stream, so that any member may be read with a single pread() rather than a
+ * scan of the whole archive.  Lines are written to a file descriptor given by
+ * the caller, to an unlinked temporary file to be appended to the archive as a
+ * final member, or both.
+ */
+b_index *b_index_new() {
+    b_index *index;
+
+    if ((index = malloc(sizeof(*index))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((index->buf = malloc(B_INDEX_BUFFER_SIZE)) == NULL) {
+        goto error_malloc_buf;
+    }
+
+    index->fd     = 0;
+    index->tmp_fd = -1;
+    index->len    = 0;
+
+    return index;
+
+error_malloc_buf:
+    free(index);
+
+error_malloc:
+    return NULL;
+}
+
+void b_index_set_fd(b_index *index, int fd) {
+    if (index == NULL) return;
+
+    index->fd = fd;
+}
+
+int b_index_open_tmp(b_index *index) {
+    b_string *template;
+    char *tmpdir;
+    int fd;
+
+    if (index == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (index->tmp_fd >= 0) return index->tmp_fd;
+
+    if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0') {
+        tmpdir = "/tmp";
+    }
+
+    if ((template = b_string_new(tmpdir)) == NULL) {
+        goto error_string_new;
+    }
+
+    if (b_string_append_str(template, "/.tar-index-XXXXXX") == NULL) {
+        goto error_string_append;
+    }
+
+    if ((fd = mkstemp(template->str)) < 0) {
+        goto error_mkstemp;
+    }
+
+    unlink(template->str);
+
+    b_string_free(template);
+
+    return index->tmp_fd = fd;
+
+error_mkstemp:
+error_string_append:
+    b_string_free(template);
+
+error_string_new:
+    return -1;
+}
+
+int b_index_flush(b_index *index) {
+    if (index == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (index->len == 0) return 0;
+
+    if (index->fd > 0 && b_write_all(index->fd, index->buf, index->len) < 0) {
+        return -1;
+    }
+
+    if (index->tmp_fd >= 0 && b_write_all(index->tmp_fd, index->buf, index->len) < 0) {
+        return -1;
+    }
+
+    index->len = 0;
+
+    return 0;
+}
+
+int b_index_write(b_index *index, b_index_entry *entry) {
+    b_string *line;
+    char numbers[224];
+    int ret = -1;
+
+    if (index == NULL || entry == NULL || entry->name == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((line = b_string_new("{\"name\":")) == NULL) {
+        goto error_string_new;
+    }
+
+    if (b_string_append_json(line, entry->name) == NULL) {
+        goto error_append;
+    }
+
+    snprintf(numbers, sizeof(numbers),
+        ",\"offset\":%llu,\"data_offset\":%llu,\"size\":%llu,\"mtime\":%lld,\"type\":\"%c\"",
+        (unsigned long long)entry->offset,
+        (unsigned long long)entry->data_offset,
+        (unsigned long long)entry->size,
+        (long long)entry->mtime,
+        entry->type
+    );
+
+    if (b_string_append_str(line, numbers) == NULL) {
+        goto error_append;
+    }
+
+    /*
+     * Archives scanned after the fact carry no inode numbers to record.
+     */
+    if (entry->ino) {
+        snprintf(numbers, sizeof(numbers), ",\"dev\":%llu,\"ino\":%llu",
+            (unsigned long long)entry->dev,
+            (unsigned long long)entry->ino
+        );
+
+        if (b_string_append_str(line, numbers) == NULL) {
+            goto error_append;
+        }
+    }
+
+    if (b_string_append_str(line, "}\n") == NULL) {
+        goto error_append;
+    }
+
+    if (index->len + line->len > B_INDEX_BUFFER_SIZE) {
+        if (b_index_flush(index) < 0) {
+            goto error_flush;
+        }
+    }
+
+    if (line->len > B_INDEX_BUFFER_SIZE) {
+        if (index->fd > 0 && b_write_all(index->fd, line->str, line->len) < 0) {
+            goto error_flush;
+        }
+
+        if (index->tmp_fd >= 0 && b_write_all(index->tmp_fd, line->str, line->len) < 0) {
+            goto error_flush;
+        }
+    } else {
+        memcpy(index->buf + index->len, line->str, line->len);
+
+        index->len += line->len;
+    }
+
+    ret = 0;
+
+error_flush:
+error_append:
+    b_string_free(line);
+
+error_string_new:
+    return ret;
+}
+
+/*
+ * Parse a single line of a member index, as written by b_index_write(), into
+ * the entry given, which holds a newly allocated name upon success.  Keys not
+ * known are passed over.
+ */
+int b_index_parse(b_index_entry *entry, char *line) {
+    char *p = line;
+
+    memset(entry, 0x00, sizeof(*entry));
+
+    if (*p++ != '{') {
+        goto error_invalid;
+    }
+
+    while (*p && *p != '}') {
+        b_string *key, *value = NULL;
+
+        if ((p = b_string_parse_json(p, &key)) == NULL) {
+            goto error_invalid;
+        }
+
+        if (*p++ != ':') {
+            b_string_free(key);
+            goto error_invalid;
+        }
+
+        if (*p == '"') {
+            if ((p = b_string_parse_json(p, &value)) == NULL) {
+                b_string_free(key);
+                goto error_invalid;
+            }
+
+            if (strcmp(key->str, "name") == 0) {
+                b_string_free(entry->name);
+                entry->name = value;
+                value = NULL;
+            } else if (strcmp(key->str, "type") == 0 && value->len == 1) {
+                entry->type = value->str[0];
+            }
+
+            b_string_free(value);
+        } else {
+            unsigned long long number;
+            char *end;
+
+            errno  = 0;
+            number = strtoull(p, &end, 10);
+
+            if (end == p || errno) {
+                b_string_free(key);
+                goto error_invalid;
+            }
+
+            p = end;
+
+            if      (strcmp(key->str, "offset")      == 0) entry->offset      = number;
+            else if (strcmp(key->str, "data_offset") == 0) entry->data_offset = number;
+            else if (strcmp(key->str, "size")        == 0) entry->size        = number;
+            else if (strcmp(key->str, "mtime")       == 0) entry->mtime       = number;
+            else if (strcmp(key->str, "dev")         == 0) entry->dev         = number;
+            else if (strcmp(key->str, "ino")         == 0) entry->ino         = number;
+        }
+
+        b_string_free(key);
+
+        if (*p == ',') p++;
+    }
+
+    if (*p != '}' || entry->name == NULL) {
+        goto error_invalid;
+    }
+
+    return 0;
+
+error_invalid:
+    b_string_free(entry->name);
+    entry->name = NULL;
+
+    errno = EINVAL;
+
+    return -1;
+}
+
+/*
+ * Empty the temporary file once its contents have been appended to an
+ * archive, so that it may be reused for the next.
+ */
+int b_index_truncate_tmp(b_index *index) {
+    if (index == NULL || index->tmp_fd < 0) return 0;
+
+    if (ftruncate(index->tmp_fd, 0) < 0) {
+        return -1;
+    }
+
+    return lseek(index->tmp_fd, 0, SEEK_SET) < 0? -1: 0;
+}
+
+void b_index_destroy(b_index *index) {
+    if (index == NULL) return;
+
+    if (index->tmp_fd >= 0) {
+        close(index->tmp_fd);
+        index->tmp_fd = -1;
+    }
+
+    free(index->buf);
+    index->buf = NULL;
+
+    free(index);
+}
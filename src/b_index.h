@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_INDEX_H
+#define _B_INDEX_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "b_string.h"
+
+#define B_INDEX_BUFFER_SIZE (64 * 1024)
+
+typedef struct _b_index_entry {
+    b_string * name;
+    off_t      offset;
+    off_t      data_offset;
+    off_t      size;
+    time_t     mtime;
+    char       type;
+    dev_t      dev;
+    ino_t      ino;
+} b_index_entry;
+
+typedef struct _b_index {
+    int    fd;
+    int    tmp_fd;
+    char * buf;
+    size_t len;
+} b_index;
+
+b_index * b_index_new();
+void      b_index_set_fd(b_index *index, int fd);
+int       b_index_open_tmp(b_index *index);
+int       b_index_write(b_index *index, b_index_entry *entry);
+int       b_index_flush(b_index *index);
+int       b_index_parse(b_index_entry *entry, char *line);
+int       b_index_truncate_tmp(b_index *index);
+void      b_index_destroy(b_index *index);
+
+#endif /* _B_INDEX_H */
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "b_inode_set.h"
+
+static inline size_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t hash = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (size_t)hash;
+}
+
+b_inode_set *b_inode_set_new() {
+    b_inode_set *set;
+
+    if ((set = malloc(sizeof(*set))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((set->entries = calloc(B_INODE_SET_DEFAULT_SIZE, sizeof(*set->entries))) == NULL) {
+        goto error_calloc;
+    }
+
+    set->count = 0;
+    set->size  = B_INODE_SET_DEFAULT_SIZE;
+
+    return set;
+
+error_calloc:
+    free(set);
+
+error_malloc:
+    return NULL;
+}
+
+/*
+ * Return the slot holding the inode given, or the empty slot where it would
+ * be placed.  The table is never allowed to fill, so an empty slot is always
+ * found.
+ */
+static b_inode_set_entry *find_slot(b_inode_set_entry *entries, size_t size, uint64_t dev, uint64_t ino) {
+    size_t mask = size - 1;
+    size_t i    = inode_hash(dev, ino) & mask;
+
+    while (entries[i].ino != 0 && (entries[i].ino != ino || entries[i].dev != dev)) {
+        i = (i + 1) & mask;
+    }
+
+    return &entries[i];
+}
+
+static int grow(b_inode_set *set) {
+    size_t size = set->size * 2, i;
+    b_inode_set_entry *entries;
+
+    if ((entries = calloc(size, sizeof(*entries))) == NULL) {
+        return -1;
+    }
+
+    for (i=0; i<set->size; i++) {
+        if (set->entries[i].ino == 0) continue;
+
+        *find_slot(entries, size, set->entries[i].dev, set->entries[i].ino) = set->entries[i];
+    }
+
+    free(set->entries);
+
+    set->entries = entries;
+    set->size    = size;
+
+    return 0;
+}
+
+/*
+ * Add an inode to the set.  Returns 1 if it was added, 0 if it was present
+ * already, or -1 on error.
+ */
+int b_inode_set_add(b_inode_set *set, dev_t dev, ino_t ino) {
+    b_inode_set_entry *slot;
+
+    if (ino == 0) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    /*
+     * Keep the table no more than three quarters full, so that probes stay
+     * short.
+     */
+    if ((set->count + 1) * 4 > set->size * 3 && grow(set) < 0) {
+        return -1;
+    }
+
+    slot = find_slot(set->entries, set->size, dev, ino);
+
+    if (slot->ino != 0) {
+        return 0;
+    }
+
+    slot->dev = dev;
+    slot->ino = ino;
+
+    set->count++;
+
+    return 1;
+}
+
+int b_inode_set_has(b_inode_set *set, dev_t dev, ino_t ino) {
+    if (ino == 0) {
+        return 0;
+    }
+
+    return find_slot(set->entries, set->size, dev, ino)->ino != 0;
+}
+
+b_inode_set *b_inode_set_dup(b_inode_set *set) {
+    b_inode_set *dup;
+
+    if ((dup = malloc(sizeof(*dup))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((dup->entries = malloc(set->size * sizeof(*dup->entries))) == NULL) {
+        goto error_entries_malloc;
+    }
+
+    memcpy(dup->entries, set->entries, set->size * sizeof(*dup->entries));
+
+    dup->count = set->count;
+    dup->size  = set->size;
+
+    return dup;
+
+error_entries_malloc:
+    free(dup);
+
+error_malloc:
+    return NULL;
+}
+
+void b_inode_set_clear(b_inode_set *set) {
+    memset(set->entries, '\0', set->size * sizeof(*set->entries));
+
+    set->count = 0;
+}
+
+void b_inode_set_destroy(b_inode_set *set) {
+    if (set == NULL) return;
+
+    free(set->entries);
+    set->entries = NULL;
+
+    free(set);
+}
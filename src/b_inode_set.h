@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_INODE_SET_H
+#define _B_INODE_SET_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define B_INODE_SET_DEFAULT_SIZE 256
+
+typedef struct _b_inode_set_entry {
+    uint64_t dev;
+    uint64_t ino;
+} b_inode_set_entry;
+
+/*
+ * A set of inodes, identified by device and inode number, kept in a hash
+ * table with open addressing.  Slots holding inode number zero, which no
+ * filesystem hands out for files it stores, are empty.
+ */
+typedef struct _b_inode_set {
+    b_inode_set_entry * entries;
+    size_t              count;
+    size_t              size;
+} b_inode_set;
+
+b_inode_set * b_inode_set_new();
+
+int b_inode_set_add(
+    b_inode_set * set,
+    dev_t         dev,
+    ino_t         ino
+);
+
+int b_inode_set_has(
+    b_inode_set * set,
+    dev_t         dev,
+    ino_t         ino
+);
+
+b_inode_set * b_inode_set_dup(b_inode_set *set);
+
+void b_inode_set_clear(b_inode_set *set);
+
+void b_inode_set_destroy(b_inode_set *set);
+
+#endif /* _B_INODE_SET_H */
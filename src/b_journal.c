@@ -0,0 +1,710 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#endif
+#include "b_string.h"
+#include "b_stack.h"
+#include "b_util.h"
+#include "b_journal.h"
+
+/*
+ * A journal lists, one line of JSON per event, the paths changed beneath the
+ * filesystems being watched, so that an archive need only visit those paths
+ * rather than walk entire trees in search of them.  Events are gathered with
+ * fanotify, which reports changes across a whole filesystem from a single
+ * mark, and appended to the journal file under an exclusive lock, which the
+ * archiver takes in turn to consume the events it has acted upon.
+ */
+static void mark_destroy(b_journal_mark *mark) {
+    if (mark == NULL) return;
+
+    if (mark->fd >= 0) {
+        close(mark->fd);
+        mark->fd = -1;
+    }
+
+    b_string_free(mark->path);
+    mark->path = NULL;
+
+    free(mark);
+}
+
+b_journal *b_journal_open(const char *path) {
+    b_journal *journal;
+
+#ifndef __linux__
+    errno = ENOSYS;
+
+    return NULL;
+#else
+    if ((journal = calloc(1, sizeof(*journal))) == NULL) {
+        goto error_calloc;
+    }
+
+    journal->fd          = -1;
+    journal->fanotify_fd = -1;
+
+    if ((journal->path = b_string_new((char *)path)) == NULL) {
+        goto error;
+    }
+
+    if ((journal->marks = b_stack_new(0)) == NULL) {
+        goto error;
+    }
+
+    b_stack_set_destructor(journal->marks, B_STACK_DESTRUCTOR(mark_destroy));
+
+    if ((journal->events = malloc(B_JOURNAL_EVENTS_SIZE)) == NULL) {
+        goto error;
+    }
+
+    if ((journal->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0) {
+        goto error;
+    }
+
+    if ((journal->fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK, O_RDONLY)) < 0) {
+        goto error;
+    }
+
+    return journal;
+
+error:
+    b_journal_destroy(journal);
+
+error_calloc:
+    return NULL;
+#endif
+}
+
+/*
+ * Record changes made anywhere beneath the directory given, by marking the
+ * entire filesystem holding it.  Events elsewhere on that filesystem are
+ * passed over.
+ */
+int b_journal_watch(b_journal *journal, const char *path) {
+#ifndef __linux__
+    errno = ENOSYS;
+
+    return -1;
+#else
+    b_journal_mark *mark;
+    char real[PATH_MAX];
+    struct statfs fs;
+
+    if (journal == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (realpath(path, real) == NULL) {
+        goto error_realpath;
+    }
+
+    if ((mark = calloc(1, sizeof(*mark))) == NULL) {
+        goto error_realpath;
+    }
+
+    if ((mark->fd = open(real, O_RDONLY | O_DIRECTORY)) < 0) {
+        goto error_open;
+    }
+
+    if (fstatfs(mark->fd, &fs) < 0) {
+        goto error_watch;
+    }
+
+    memcpy(mark->fsid, &fs.f_fsid, sizeof(mark->fsid));
+
+    if ((mark->path = b_string_new(real)) == NULL) {
+        goto error_watch;
+    }
+
+    if (fanotify_mark(journal->fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+      FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR,
+      AT_FDCWD, real) < 0) {
+        goto error_watch;
+    }
+
+    if (b_stack_push(journal->marks, mark) == NULL) {
+        goto error_watch;
+    }
+
+    return 0;
+
+error_watch:
+    b_string_free(mark->path);
+    close(mark->fd);
+
+error_open:
+    free(mark);
+
+error_realpath:
+    return -1;
+#endif
+}
+
+#ifdef __linux__
+static b_journal_mark *find_mark(b_journal *journal, void *fsid) {
+    size_t i;
+
+    for (i=0; i<b_stack_count(journal->marks); i++) {
+        b_journal_mark *mark = b_stack_item_at(journal->marks, i);
+
+        if (memcmp(mark->fsid, fsid, sizeof(mark->fsid)) == 0) {
+            return mark;
+        }
+    }
+
+    return NULL;
+}
+
+static int is_beneath(b_string *path, b_string *dir) {
+    if (path->len < dir->len || memcmp(path->str, dir->str, dir->len) != 0) {
+        return 0;
+    }
+
+    return path->len == dir->len || path->str[dir->len] == '/' || strcmp(dir->str, "/") == 0;
+}
+
+static int is_watched(b_journal *journal, b_string *path) {
+    size_t i;
+
+    for (i=0; i<b_stack_count(journal->marks); i++) {
+        b_journal_mark *mark = b_stack_item_at(journal->marks, i);
+
+        if (is_beneath(path, mark->path)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve the directory handle given by fanotify to its current path.  NULL
+ * is returned when the directory no longer exists.
+ */
+static b_string *handle_path(b_journal_mark *mark, struct file_handle *handle) {
+    char link[64], path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    if ((fd = open_by_handle_at(mark->fd, handle, O_PATH)) < 0) {
+        return NULL;
+    }
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+    len = readlink(link, path, sizeof(path) - 1);
+
+    close(fd);
+
+    if (len < 0) {
+        return NULL;
+    }
+
+    path[len] = '\0';
+
+    return b_string_new(path);
+}
+
+static int append_change(b_string *lines, char type, b_string *path) {
+    char prefix[16];
+
+    snprintf(prefix, sizeof(prefix), "{\"type\":\"%c\"", type);
+
+    if (b_string_append_str(lines, prefix) == NULL) {
+        return -1;
+    }
+
+    if (path) {
+        if (b_string_append_str(lines, ",\"path\":") == NULL) {
+            return -1;
+        }
+
+        if (b_string_append_json(lines, path) == NULL) {
+            return -1;
+        }
+    }
+
+    return b_string_append_str(lines, "}\n") == NULL? -1: 0;
+}
+
+/*
+ * Describe a single fanotify event in the lines given, returning the number
+ * of changes described.
+ */
+static int describe_event(b_journal *journal, struct fanotify_event_metadata *meta, b_string *lines) {
+    struct fanotify_event_info_fid *info = (struct fanotify_event_info_fid *)(meta + 1);
+    struct file_handle *handle;
+    b_journal_mark *mark;
+    b_string *dir, *path;
+    const char *name;
+    char type;
+    int ret = 0;
+
+    if (meta->mask & FAN_Q_OVERFLOW) {
+        return append_change(lines, B_JOURNAL_OVERFLOW, NULL) < 0? -1: 1;
+    }
+
+    if (meta->event_len < sizeof(*meta) + sizeof(*info)) {
+        return 0;
+    }
+
+    if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+        return 0;
+    }
+
+    if ((mark = find_mark(journal, &info->fsid)) == NULL) {
+        return 0;
+    }
+
+    handle = (struct file_handle *)info->handle;
+    name   = info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME? (const char *)handle->f_handle + handle->handle_bytes: ".";
+
+    if ((dir = handle_path(mark, handle)) == NULL) {
+        return 0;
+    }
+
+    if (!is_watched(journal, dir)) {
+        goto done;
+    }
+
+    if ((path = b_string_dup(dir)) == NULL) {
+        goto error;
+    }
+
+    if (strcmp(name, ".") != 0) {
+        if ((strcmp(dir->str, "/") != 0 && b_string_append_str(path, "/") == NULL) || b_string_append_str(path, (char *)name) == NULL) {
+            b_string_free(path);
+            goto error;
+        }
+    }
+
+    if (meta->mask & (FAN_DELETE | FAN_MOVED_FROM)) {
+        type = B_JOURNAL_DELETED;
+    } else if ((meta->mask & FAN_ONDIR) && (meta->mask & (FAN_CREATE | FAN_MOVED_TO))) {
+        type = B_JOURNAL_TREE;
+    } else {
+        type = B_JOURNAL_CHANGED;
+    }
+
+    if (append_change(lines, type, path) < 0) {
+        b_string_free(path);
+        goto error;
+    }
+
+    b_string_free(path);
+
+    ret++;
+
+    /*
+     * Adding or removing an entry changes the directory holding it as well.
+     */
+    if (meta->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)) {
+        if (append_change(lines, B_JOURNAL_CHANGED, dir) < 0) {
+            goto error;
+        }
+
+        ret++;
+    }
+
+done:
+    b_string_free(dir);
+
+    return ret;
+
+error:
+    b_string_free(dir);
+
+    return -1;
+}
+#endif
+
+/*
+ * Wait up to timeout milliseconds for events, and append the changes they
+ * describe to the journal, returning the number of changes recorded.
+ */
+ssize_t b_journal_record(b_journal *journal, int timeout) {
+#ifndef __linux__
+    errno = ENOSYS;
+
+    return -1;
+#else
+    struct fanotify_event_metadata *meta;
+    struct pollfd pfd;
+    b_string *lines;
+    ssize_t len, count = 0;
+    int ret;
+
+    pfd.fd      = journal->fanotify_fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    if ((ret = poll(&pfd, 1, timeout)) < 0) {
+        return errno == EINTR? 0: -1;
+    } else if (ret == 0) {
+        return 0;
+    }
+
+    if ((len = read(journal->fanotify_fd, journal->events, B_JOURNAL_EVENTS_SIZE)) < 0) {
+        return errno == EAGAIN || errno == EINTR? 0: -1;
+    }
+
+    if ((lines = b_string_new("")) == NULL) {
+        goto error_lines;
+    }
+
+    for (meta = (struct fanotify_event_metadata *)journal->events; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+        int described;
+
+        if (meta->vers != FANOTIFY_METADATA_VERSION) {
+            errno = EINVAL;
+            goto error_describe;
+        }
+
+        if (meta->fd >= 0) {
+            close(meta->fd);
+        }
+
+        if ((described = describe_event(journal, meta, lines)) < 0) {
+            goto error_describe;
+        }
+
+        count += described;
+    }
+
+    if (lines->len) {
+        if (flock(journal->fd, LOCK_EX) < 0) {
+            goto error_describe;
+        }
+
+        ret = b_write_all(journal->fd, lines->str, lines->len);
+
+        flock(journal->fd, LOCK_UN);
+
+        if (ret < 0) {
+            goto error_describe;
+        }
+    }
+
+    b_string_free(lines);
+
+    return count;
+
+error_describe:
+    b_string_free(lines);
+
+error_lines:
+    return -1;
+#endif
+}
+
+void b_journal_destroy(b_journal *journal) {
+    if (journal == NULL) return;
+
+    if (journal->fanotify_fd >= 0) {
+        close(journal->fanotify_fd);
+        journal->fanotify_fd = -1;
+    }
+
+    if (journal->fd >= 0) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+
+    b_stack_destroy(journal->marks);
+    journal->marks = NULL;
+
+    b_string_free(journal->path);
+    journal->path = NULL;
+
+    free(journal->events);
+    journal->events = NULL;
+
+    free(journal);
+}
+
+void b_journal_change_destroy(b_journal_change *change) {
+    if (change == NULL) return;
+
+    b_string_free(change->path);
+    change->path = NULL;
+
+    free(change);
+}
+
+/*
+ * Order changes such that every path is immediately followed by those beneath
+ * it, and changes to the same path by the order in which they were recorded.
+ */
+static int compare_changes(const void *a, const void *b) {
+    const b_journal_change *change_a = *(b_journal_change **)a;
+    const b_journal_change *change_b = *(b_journal_change **)b;
+    size_t i;
+
+    for (i=0; i<change_a->path->len && i<change_b->path->len; i++) {
+        unsigned char c_a = change_a->path->str[i] == '/'? 0: change_a->path->str[i];
+        unsigned char c_b = change_b->path->str[i] == '/'? 0: change_b->path->str[i];
+
+        if (c_a != c_b) return c_a < c_b? -1: 1;
+    }
+
+    if (change_a->path->len != change_b->path->len) {
+        return change_a->path->len < change_b->path->len? -1: 1;
+    }
+
+    return change_a->seq < change_b->seq? -1: change_a->seq > change_b->seq;
+}
+
+static b_journal_change *parse_change(char *line, size_t seq) {
+    b_journal_change *change;
+    char *p;
+
+    if (strncmp(line, "{\"type\":\"", 9) != 0 || line[9] == '\0' || line[10] != '"') {
+        goto error_invalid;
+    }
+
+    if ((change = calloc(1, sizeof(*change))) == NULL) {
+        return NULL;
+    }
+
+    change->type = line[9];
+    change->seq  = seq;
+
+    p = line + 11;
+
+    if (strncmp(p, ",\"path\":", 8) == 0) {
+        if ((p = b_string_parse_json(p + 8, &change->path)) == NULL) {
+            goto error_change;
+        }
+    }
+
+    if (*p != '}') {
+        goto error_change;
+    }
+
+    return change;
+
+error_change:
+    b_journal_change_destroy(change);
+
+error_invalid:
+    errno = EINVAL;
+
+    return NULL;
+}
+
+/*
+ * Read the changes recorded in the journal file given, returning them in the
+ * order given by compare_changes(), with only the last change to each path
+ * kept; a path added as a whole tree and changed since remains a tree.  The
+ * length of the journal read is stored in len, so that only those changes
+ * may later be consumed.  If the journal does not exist, or records that
+ * events were lost, overflowed is set, and the caller must fall back to
+ * walking every path instead.
+ */
+b_stack *b_journal_read(const char *path, off_t *len, int *overflowed) {
+    b_stack *changes, *ret;
+    FILE *fh;
+    char *line = NULL;
+    size_t size = 0, seq = 0, i;
+    ssize_t linelen;
+    int fd;
+
+    *len        = 0;
+    *overflowed = 0;
+
+    if ((changes = b_stack_new(0)) == NULL) {
+        goto error_stack_new;
+    }
+
+    b_stack_set_destructor(changes, B_STACK_DESTRUCTOR(b_journal_change_destroy));
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            goto error_open;
+        }
+
+        *overflowed = 1;
+
+        return changes;
+    }
+
+    if (flock(fd, LOCK_SH) < 0 || (fh = fdopen(fd, "r")) == NULL) {
+        close(fd);
+
+        goto error_open;
+    }
+
+    while ((linelen = getline(&line, &size, fh)) > 0) {
+        b_journal_change *change;
+
+        if (line[linelen - 1] != '\n') {
+            break;
+        }
+
+        line[linelen - 1] = '\0';
+
+        if ((change = parse_change(line, seq++)) == NULL) {
+            goto error_read;
+        }
+
+        *len += linelen;
+
+        if (change->type == B_JOURNAL_OVERFLOW || change->path == NULL) {
+            *overflowed = 1;
+
+            b_journal_change_destroy(change);
+
+            continue;
+        }
+
+        if (b_stack_push(changes, change) == NULL) {
+            b_journal_change_destroy(change);
+            goto error_read;
+        }
+    }
+
+    if (ferror(fh)) {
+        goto error_read;
+    }
+
+    free(line);
+    fclose(fh);
+
+    qsort(changes->items, changes->count, sizeof(void *), compare_changes);
+
+    if ((ret = b_stack_new(0)) == NULL) {
+        goto error_sort;
+    }
+
+    b_stack_set_destructor(ret, B_STACK_DESTRUCTOR(b_journal_change_destroy));
+
+    for (i=0; i<changes->count; i++) {
+        b_journal_change *change = changes->items[i];
+        b_journal_change *last   = b_stack_top(ret);
+
+        if (last && last->path->len == change->path->len && memcmp(last->path->str, change->path->str, change->path->len) == 0) {
+            if (change->type == B_JOURNAL_DELETED || last->type != B_JOURNAL_TREE) {
+                last->type = change->type;
+            }
+
+            b_journal_change_destroy(change);
+        } else if (b_stack_push(ret, change) == NULL) {
+            b_journal_change_destroy(change);
+            changes->items[i] = NULL;
+
+            goto error_push;
+        }
+
+        changes->items[i] = NULL;
+    }
+
+    b_stack_destroy(changes);
+
+    return ret;
+
+error_push:
+    for (i++; i<changes->count; i++) {
+        b_journal_change_destroy(changes->items[i]);
+        changes->items[i] = NULL;
+    }
+
+    b_stack_destroy(ret);
+
+error_sort:
+    b_stack_destroy(changes);
+
+    return NULL;
+
+error_read:
+    free(line);
+    fclose(fh);
+
+error_open:
+    b_stack_destroy(changes);
+
+error_stack_new:
+    return NULL;
+}
+
+/*
+ * Remove the first len bytes, previously read, from the journal, keeping any
+ * changes recorded since.
+ */
+int b_journal_consume(const char *path, off_t len) {
+    char *rest = NULL;
+    off_t size;
+    int fd;
+
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return errno == ENOENT? 0: -1;
+    }
+
+    if (flock(fd, LOCK_EX) < 0) {
+        goto error;
+    }
+
+    if ((size = lseek(fd, 0, SEEK_END)) < 0) {
+        goto error;
+    }
+
+    if (size > len) {
+        size_t i = 0;
+
+        if ((rest = malloc(size - len)) == NULL) {
+            goto error;
+        }
+
+        while (i < size - len) {
+            ssize_t ret;
+
+            if ((ret = pread(fd, rest + i, size - len - i, len + i)) < 0) {
+                if (errno == EINTR) continue;
+
+                goto error;
+            } else if (ret == 0) {
+                break;
+            }
+
+            i += ret;
+        }
+
+        size = i;
+
+        if (lseek(fd, 0, SEEK_SET) < 0 || b_write_all(fd, rest, size) < 0) {
+            goto error;
+        }
+    } else {
+        size = 0;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        goto error;
+    }
+
+    free(rest);
+    close(fd);
+
+    return 0;
+
+error:
+    free(rest);
+    close(fd);
+
+    return -1;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_JOURNAL_H
+#define _B_JOURNAL_H
+
+#include <sys/types.h>
+#include "b_string.h"
+#include "b_stack.h"
+
+#define B_JOURNAL_CHANGED     'M'
+#define B_JOURNAL_TREE        'T'
+#define B_JOURNAL_DELETED     'D'
+#define B_JOURNAL_OVERFLOW    'O'
+#define B_JOURNAL_EVENTS_SIZE (256 * 1024)
+
+/*
+ * A filesystem watched for changes, along with a file descriptor beneath it
+ * through which the directory handles given by fanotify may be opened.
+ */
+typedef struct _b_journal_mark {
+    b_string * path;
+    int        fd;
+    int        fsid[2];
+} b_journal_mark;
+
+typedef struct _b_journal {
+    b_string * path;
+    int        fd;
+    int        fanotify_fd;
+    b_stack *  marks;
+    char *     events;
+} b_journal;
+
+/*
+ * A path found in a journal, and the manner in which it changed.
+ */
+typedef struct _b_journal_change {
+    char       type;
+    b_string * path;
+    size_t     seq;
+} b_journal_change;
+
+b_journal * b_journal_open(const char *path);
+
+int b_journal_watch(
+    b_journal *  journal,
+    const char * path
+);
+
+ssize_t b_journal_record(
+    b_journal * journal,
+    int         timeout
+);
+
+void b_journal_destroy(b_journal *journal);
+
+b_stack * b_journal_read(
+    const char * path,
+    off_t *      len,
+    int *        overflowed
+);
+
+int b_journal_consume(
+    const char * path,
+    off_t        len
+);
+
+void b_journal_change_destroy(b_journal_change *change);
+
+#endif /* _B_JOURNAL_H */
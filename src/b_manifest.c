@@ -0,0 +1,521 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif /* __linux__ */
+#include "b_string.h"
+#include "b_manifest.h"
+
+#ifdef __linux__
+#define B_MANIFEST_MTIME(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+#define B_MANIFEST_CTIME(st) ((int64_t)(st)->st_ctim.tv_sec * 1000000000 + (st)->st_ctim.tv_nsec)
+#else
+#define B_MANIFEST_MTIME(st) ((int64_t)(st)->st_mtime * 1000000000)
+#define B_MANIFEST_CTIME(st) ((int64_t)(st)->st_ctime * 1000000000)
+#endif
+
+/*
+ * The parallel arrays making up a manifest, in the order in which they are
+ * saved, along with the size of each of their values.
+ */
+static const struct {
+    size_t offset;
+    size_t size;
+} fields[] = {
+    { offsetof(b_manifest, paths),   sizeof(uint64_t) },
+    { offsetof(b_manifest, members), sizeof(uint64_t) },
+    { offsetof(b_manifest, modes),   sizeof(uint32_t) },
+    { offsetof(b_manifest, nlinks),  sizeof(uint32_t) },
+    { offsetof(b_manifest, uids),    sizeof(uint32_t) },
+    { offsetof(b_manifest, gids),    sizeof(uint32_t) },
+    { offsetof(b_manifest, devs),    sizeof(uint64_t) },
+    { offsetof(b_manifest, inos),    sizeof(uint64_t) },
+    { offsetof(b_manifest, sizes),   sizeof(int64_t)  },
+    { offsetof(b_manifest, mtimes),  sizeof(int64_t)  },
+    { offsetof(b_manifest, ctimes),  sizeof(int64_t)  },
+    { offsetof(b_manifest, order),   sizeof(uint64_t) }
+};
+
+#define B_MANIFEST_FIELDS (sizeof(fields) / sizeof(fields[0]))
+
+#define FIELD(manifest, n) ((void **)((char *)(manifest) + fields[n].offset))
+
+static int grow(b_manifest *manifest, uint64_t size) {
+    size_t i;
+
+    for (i=0; i<B_MANIFEST_FIELDS; i++) {
+        void *array;
+
+        if ((array = realloc(*FIELD(manifest, i), size * fields[i].size)) == NULL) {
+            return -1;
+        }
+
+        *FIELD(manifest, i) = array;
+    }
+
+    manifest->size = size;
+
+    return 0;
+}
+
+b_manifest *b_manifest_new() {
+    b_manifest *manifest;
+
+    if ((manifest = calloc(1, sizeof(*manifest))) == NULL) {
+        goto error_calloc;
+    }
+
+    if (grow(manifest, B_MANIFEST_DEFAULT_SIZE) < 0) {
+        goto error_grow;
+    }
+
+    return manifest;
+
+error_grow:
+    b_manifest_destroy(manifest);
+
+error_calloc:
+    return NULL;
+}
+
+/*
+ * Append a name to the arena, NUL terminated, returning its offset therein.
+ */
+static int append_name(b_manifest *manifest, b_string *name, uint64_t *offset) {
+    size_t len = b_string_len(name) + 1;
+
+    if (manifest->names_used + len > manifest->names_size) {
+        uint64_t size = manifest->names_size? manifest->names_size: B_MANIFEST_DEFAULT_SIZE * 64;
+        char *names;
+
+        while (manifest->names_used + len > size) {
+            size *= 2;
+        }
+
+        if ((names = realloc(manifest->names, size)) == NULL) {
+            return -1;
+        }
+
+        manifest->names      = names;
+        manifest->names_size = size;
+    }
+
+    memcpy(manifest->names + manifest->names_used, name->str, len);
+
+    *offset = manifest->names_used;
+
+    manifest->names_used += len;
+
+    return 0;
+}
+
+int b_manifest_add(b_manifest *manifest, b_string *path, b_string *member_name, struct stat *st) {
+    uint64_t index = manifest->count;
+
+    if (index == manifest->size && grow(manifest, manifest->size * 2) < 0) {
+        return -1;
+    }
+
+    if (append_name(manifest, path, &manifest->paths[index]) < 0) {
+        return -1;
+    }
+
+    /*
+     * Most members are named for their paths, and so share their names.
+     */
+    if (b_string_len(member_name) == b_string_len(path) && memcmp(member_name->str, path->str, path->len) == 0) {
+        manifest->members[index] = manifest->paths[index];
+    } else if (append_name(manifest, member_name, &manifest->members[index]) < 0) {
+        return -1;
+    }
+
+    manifest->modes[index]  = st->st_mode;
+    manifest->nlinks[index] = st->st_nlink;
+    manifest->uids[index]   = st->st_uid;
+    manifest->gids[index]   = st->st_gid;
+    manifest->devs[index]   = st->st_dev;
+    manifest->inos[index]   = st->st_ino;
+    manifest->sizes[index]  = st->st_size;
+    manifest->mtimes[index] = B_MANIFEST_MTIME(st);
+    manifest->ctimes[index] = B_MANIFEST_CTIME(st);
+    manifest->order[index]  = index;
+
+    if (S_ISREG(st->st_mode)) {
+        manifest->total += st->st_size;
+    }
+
+    manifest->count++;
+
+    return 0;
+}
+
+void b_manifest_stat(b_manifest *manifest, uint64_t index, struct stat *st) {
+    memset(st, 0x00, sizeof(*st));
+
+    st->st_mode  = manifest->modes[index];
+    st->st_nlink = manifest->nlinks[index];
+    st->st_uid   = manifest->uids[index];
+    st->st_gid   = manifest->gids[index];
+    st->st_dev   = manifest->devs[index];
+    st->st_ino   = manifest->inos[index];
+    st->st_size  = manifest->sizes[index];
+
+#ifdef __linux__
+    st->st_mtim.tv_sec  = manifest->mtimes[index] / 1000000000;
+    st->st_mtim.tv_nsec = manifest->mtimes[index] % 1000000000;
+    st->st_ctim.tv_sec  = manifest->ctimes[index] / 1000000000;
+    st->st_ctim.tv_nsec = manifest->ctimes[index] % 1000000000;
+#else
+    st->st_mtime = manifest->mtimes[index] / 1000000000;
+    st->st_ctime = manifest->ctimes[index] / 1000000000;
+#endif
+}
+
+typedef struct _b_manifest_key {
+    uint64_t     key[3];
+    const char * name;
+    uint64_t     index;
+} b_manifest_key;
+
+static int compare_keys(const void *a, const void *b) {
+    const b_manifest_key *key_a = a, *key_b = b;
+    size_t i;
+
+    for (i=0; i<3; i++) {
+        if (key_a->key[i] != key_b->key[i]) {
+            return key_a->key[i] < key_b->key[i]? -1: 1;
+        }
+    }
+
+    if (key_a->name && key_b->name) {
+        int cmp = strcmp(key_a->name, key_b->name);
+
+        if (cmp) return cmp;
+    }
+
+    return key_a->index < key_b->index? -1: key_a->index > key_b->index? 1: 0;
+}
+
+/*
+ * Return the physical location on disk of the first extent of the file given,
+ * or 0 if it has none, or it cannot be known.
+ */
+static uint64_t first_extent(const char *path) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    struct {
+        struct fiemap        map;
+        struct fiemap_extent extent;
+    } fiemap;
+
+    uint64_t physical = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) < 0) {
+        return 0;
+    }
+
+    memset(&fiemap, 0x00, sizeof(fiemap));
+
+    fiemap.map.fm_start        = 0;
+    fiemap.map.fm_length       = FIEMAP_MAX_OFFSET;
+    fiemap.map.fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.map) == 0 && fiemap.map.fm_mapped_extents > 0) {
+        if (!(fiemap.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC))) {
+            physical = fiemap.extent.fe_physical;
+        }
+    }
+
+    close(fd);
+
+    return physical;
+#else
+    return 0;
+#endif /* __linux__ && FS_IOC_FIEMAP */
+}
+
+/*
+ * Change the order in which members are to be archived.  Sorting by inode
+ * reads members in roughly the order in which filesystems lay them out, while
+ * sorting by the physical location of the first extent of each regular file
+ * does so exactly, at the cost of opening each file once more beforehand.
+ * Members whose location cannot be known, including all but regular files,
+ * come first, by inode.
+ */
+int b_manifest_sort(b_manifest *manifest, enum b_manifest_order order) {
+    b_manifest_key *keys;
+    uint64_t i;
+
+    if (order == B_MANIFEST_ORDER_WALK) {
+        for (i=0; i<manifest->count; i++) {
+            manifest->order[i] = i;
+        }
+
+        return 0;
+    }
+
+    if ((keys = calloc(manifest->count + 1, sizeof(*keys))) == NULL) {
+        return -1;
+    }
+
+    for (i=0; i<manifest->count; i++) {
+        keys[i].index = i;
+
+        if (order == B_MANIFEST_ORDER_NAME) {
+            keys[i].name = b_manifest_member(manifest, i);
+        } else {
+            keys[i].key[0] = manifest->devs[i];
+            keys[i].key[2] = manifest->inos[i];
+
+            if (order == B_MANIFEST_ORDER_PHYSICAL && S_ISREG(manifest->modes[i]) && manifest->sizes[i] > 0) {
+                keys[i].key[1] = first_extent(b_manifest_path(manifest, i));
+            }
+        }
+    }
+
+    qsort(keys, manifest->count, sizeof(*keys), compare_keys);
+
+    for (i=0; i<manifest->count; i++) {
+        manifest->order[i] = keys[i].index;
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+/*
+ * Ask the kernel to start reading the contents of the members due to be
+ * archived within the next window of members from the position given, up to
+ * a limit for each, so that reads of one member overlap with writes of those
+ * before it.
+ */
+void b_manifest_prefetch(b_manifest *manifest, uint64_t pos, uint64_t window) {
+    uint64_t end = pos + window;
+
+    if (end > manifest->count) {
+        end = manifest->count;
+    }
+
+    if (manifest->prefetched < pos) {
+        manifest->prefetched = pos;
+    }
+
+    for (; manifest->prefetched < end; manifest->prefetched++) {
+        uint64_t index = manifest->order[manifest->prefetched];
+        int fd;
+
+        if (!S_ISREG(manifest->modes[index]) || manifest->sizes[index] == 0) {
+            continue;
+        }
+
+        if ((fd = open(b_manifest_path(manifest, index), O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) < 0) {
+            continue;
+        }
+
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, 0, manifest->sizes[index] < B_MANIFEST_PREFETCH_SIZE? manifest->sizes[index]: B_MANIFEST_PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+#endif
+
+        close(fd);
+    }
+}
+
+int b_manifest_save(b_manifest *manifest, const char *path) {
+    b_manifest_header header;
+    b_string *tmp;
+    FILE *fh;
+    size_t i;
+
+    if ((tmp = b_string_new((char *)path)) == NULL) {
+        goto error_tmp;
+    }
+
+    if (b_string_append_str(tmp, ".tmp") == NULL) {
+        goto error_fopen;
+    }
+
+    if ((fh = fopen(tmp->str, "w")) == NULL) {
+        goto error_fopen;
+    }
+
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, B_MANIFEST_MAGIC, B_MANIFEST_MAGIC_SIZE);
+
+    header.count      = manifest->count;
+    header.names_size = manifest->names_used;
+
+    if (fwrite(&header, sizeof(header), 1, fh) != 1) {
+        goto error_write;
+    }
+
+    for (i=0; i<B_MANIFEST_FIELDS; i++) {
+        if (manifest->count && fwrite(*FIELD(manifest, i), fields[i].size, manifest->count, fh) != manifest->count) {
+            goto error_write;
+        }
+    }
+
+    if (manifest->names_used && fwrite(manifest->names, manifest->names_used, 1, fh) != 1) {
+        goto error_write;
+    }
+
+    if (fflush(fh) != 0 || fsync(fileno(fh)) < 0) {
+        goto error_write;
+    }
+
+    if (fclose(fh) != 0) {
+        goto error_fclose;
+    }
+
+    if (rename(tmp->str, path) < 0) {
+        goto error_fclose;
+    }
+
+    b_string_free(tmp);
+
+    return 0;
+
+error_write:
+    fclose(fh);
+
+error_fclose:
+    unlink(tmp->str);
+
+error_fopen:
+    b_string_free(tmp);
+
+error_tmp:
+    return -1;
+}
+
+/*
+ * Ensure every name and position in a manifest read from a file lies within
+ * it, so that it may be used without further checks.
+ */
+static int manifest_valid(b_manifest *manifest) {
+    uint64_t i;
+
+    if (manifest->count && (manifest->names_used == 0 || manifest->names[manifest->names_used - 1] != '\0')) {
+        return 0;
+    }
+
+    for (i=0; i<manifest->count; i++) {
+        if (manifest->paths[i] >= manifest->names_used || manifest->members[i] >= manifest->names_used) {
+            return 0;
+        }
+
+        if (manifest->order[i] >= manifest->count) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+b_manifest *b_manifest_load(const char *path) {
+    b_manifest *manifest;
+    b_manifest_header header;
+    struct stat st;
+    FILE *fh;
+    uint64_t i, expected = sizeof(header);
+
+    if ((fh = fopen(path, "r")) == NULL) {
+        goto error_fopen;
+    }
+
+    if ((manifest = calloc(1, sizeof(*manifest))) == NULL) {
+        goto error_calloc;
+    }
+
+    if (fstat(fileno(fh), &st) < 0) {
+        goto error_read;
+    }
+
+    if (fread(&header, sizeof(header), 1, fh) != 1 || memcmp(header.magic, B_MANIFEST_MAGIC, B_MANIFEST_MAGIC_SIZE) != 0) {
+        goto error_invalid;
+    }
+
+    for (i=0; i<B_MANIFEST_FIELDS; i++) {
+        if (header.count > (st.st_size - expected) / fields[i].size) {
+            goto error_invalid;
+        }
+
+        expected += header.count * fields[i].size;
+    }
+
+    if (header.names_size != st.st_size - expected) {
+        goto error_invalid;
+    }
+
+    if (grow(manifest, header.count? header.count: 1) < 0) {
+        goto error_read;
+    }
+
+    for (i=0; i<B_MANIFEST_FIELDS; i++) {
+        if (header.count && fread(*FIELD(manifest, i), fields[i].size, header.count, fh) != header.count) {
+            goto error_invalid;
+        }
+    }
+
+    if ((manifest->names = malloc(header.names_size + 1)) == NULL) {
+        goto error_read;
+    }
+
+    if (header.names_size && fread(manifest->names, header.names_size, 1, fh) != 1) {
+        goto error_invalid;
+    }
+
+    manifest->names_used = header.names_size;
+    manifest->names_size = header.names_size + 1;
+    manifest->count      = header.count;
+
+    if (!manifest_valid(manifest)) {
+        goto error_invalid;
+    }
+
+    for (i=0; i<manifest->count; i++) {
+        if (S_ISREG(manifest->modes[i])) {
+            manifest->total += manifest->sizes[i];
+        }
+    }
+
+    fclose(fh);
+
+    return manifest;
+
+error_invalid:
+    errno = EINVAL;
+
+error_read:
+    b_manifest_destroy(manifest);
+
+error_calloc:
+    fclose(fh);
+
+error_fopen:
+    return NULL;
+}
+
+void b_manifest_destroy(b_manifest *manifest) {
+    size_t i;
+
+    if (manifest == NULL) return;
+
+    for (i=0; i<B_MANIFEST_FIELDS; i++) {
+        free(*FIELD(manifest, i));
+    }
+
+    free(manifest->names);
+    free(manifest);
+}
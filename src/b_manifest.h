@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_MANIFEST_H
+#define _B_MANIFEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "b_string.h"
+
+#define B_MANIFEST_MAGIC         "ATBMANI1"
+#define B_MANIFEST_MAGIC_SIZE    8
+#define B_MANIFEST_DEFAULT_SIZE  1024
+#define B_MANIFEST_PREFETCH_SIZE (1024 * 1024)
+
+enum b_manifest_order {
+    B_MANIFEST_ORDER_WALK,
+    B_MANIFEST_ORDER_NAME,
+    B_MANIFEST_ORDER_INODE,
+    B_MANIFEST_ORDER_PHYSICAL
+};
+
+/*
+ * A manifest file holds a header followed by each of the arrays below in
+ * turn, and finally the names themselves.  Values are stored in native byte
+ * order.
+ */
+typedef struct _b_manifest_header {
+    char     magic[B_MANIFEST_MAGIC_SIZE];
+    uint64_t count;
+    uint64_t names_size;
+} b_manifest_header;
+
+/*
+ * The members to be archived, as found by a walk of the filesystem, with the
+ * values of each member kept in parallel arrays, and the paths and member
+ * names of all members kept in a single arena.  Members are archived in the
+ * order given by the order array, leaving the others in the order found.
+ */
+typedef struct _b_manifest {
+    char *     names;
+    uint64_t   names_used;
+    uint64_t   names_size;
+    uint64_t * paths;
+    uint64_t * members;
+    uint32_t * modes;
+    uint32_t * nlinks;
+    uint32_t * uids;
+    uint32_t * gids;
+    uint64_t * devs;
+    uint64_t * inos;
+    int64_t *  sizes;
+    int64_t *  mtimes;
+    int64_t *  ctimes;
+    uint64_t * order;
+    uint64_t   count;
+    uint64_t   size;
+    uint64_t   total;
+    uint64_t   prefetched;
+} b_manifest;
+
+b_manifest * b_manifest_new();
+
+int b_manifest_add(
+    b_manifest *  manifest,
+    b_string *    path,
+    b_string *    member_name,
+    struct stat * st
+);
+
+void b_manifest_stat(
+    b_manifest *  manifest,
+    uint64_t      index,
+    struct stat * st
+);
+
+#define b_manifest_path(manifest, index) \
+    ((manifest)->names + (manifest)->paths[index])
+
+#define b_manifest_member(manifest, index) \
+    ((manifest)->names + (manifest)->members[index])
+
+int b_manifest_sort(
+    b_manifest *          manifest,
+    enum b_manifest_order order
+);
+
+void b_manifest_prefetch(
+    b_manifest * manifest,
+    uint64_t     pos,
+    uint64_t     window
+);
+
+int b_manifest_save(
+    b_manifest * manifest,
+    const char * path
+);
+
+b_manifest * b_manifest_load(const char *path);
+
+void b_manifest_destroy(b_manifest *manifest);
+
+#endif /* _B_MANIFEST_H */
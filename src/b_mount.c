@@ -0,0 +1,230 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#else
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif /* __linux__ */
+#include "b_string.h"
+#include "b_mount.h"
+
+#define B_MOUNTS_DEFAULT_SIZE 16
+
+#ifdef __linux__
+/*
+ * Linux reports only the magic number of a filesystem, so the names by which
+ * types are given must be looked up here.  Some types share a number with
+ * others, as devtmpfs does with tmpfs, and cannot be told apart.
+ */
+static const struct {
+    const char *  name;
+    unsigned long magic;
+} fstypes[] = {
+    { "autofs",     0x00000187 },
+    { "bpf",        0xcafe4a11 },
+    { "btrfs",      0x9123683e },
+    { "ceph",       0x00c36400 },
+    { "cgroup",     0x0027e0eb },
+    { "cgroup2",    0x63677270 },
+    { "cifs",       0xff534d42 },
+    { "configfs",   0x62656570 },
+    { "debugfs",    0x64626720 },
+    { "devpts",     0x00001cd1 },
+    { "devtmpfs",   0x01021994 },
+    { "ext2",       0x0000ef53 },
+    { "ext3",       0x0000ef53 },
+    { "ext4",       0x0000ef53 },
+    { "fuse",       0x65735546 },
+    { "fuseblk",    0x65735546 },
+    { "fusectl",    0x65735543 },
+    { "hugetlbfs",  0x958458f6 },
+    { "iso9660",    0x00009660 },
+    { "mqueue",     0x19800202 },
+    { "nfs",        0x00006969 },
+    { "nfs4",       0x00006969 },
+    { "nsfs",       0x6e736673 },
+    { "overlay",    0x794c7630 },
+    { "proc",       0x00009fa0 },
+    { "pstore",     0x6165676c },
+    { "ramfs",      0x858458f6 },
+    { "securityfs", 0x73636673 },
+    { "smb2",       0xfe534d42 },
+    { "squashfs",   0x73717368 },
+    { "sysfs",      0x62656572 },
+    { "tmpfs",      0x01021994 },
+    { "tracefs",    0x74726163 },
+    { "vfat",       0x00004d44 },
+    { "xfs",        0x58465342 },
+    { "zfs",        0x2fc12fc1 },
+    { NULL,         0 }
+};
+
+static int fstype_magic(const char *name, unsigned long *magic) {
+    size_t i;
+
+    for (i=0; fstypes[i].name; i++) {
+        if (strcmp(fstypes[i].name, name) == 0) {
+            *magic = fstypes[i].magic;
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+#endif /* __linux__ */
+
+b_mounts *b_mounts_new() {
+    b_mounts *mounts;
+
+    if ((mounts = calloc(1, sizeof(*mounts))) == NULL) {
+        return NULL;
+    }
+
+    return mounts;
+}
+
+/*
+ * Add a filesystem type, by the name given in mount(8), whose mounts are not
+ * to be descended into.  Names not known are refused with EINVAL, rather than
+ * silently matching nothing.
+ */
+int b_mounts_skip_type(b_mounts *mounts, const char *type) {
+    char **types, *copy;
+
+#ifdef __linux__
+    unsigned long magic;
+
+    if (fstype_magic(type, &magic) < 0) {
+        errno = EINVAL;
+
+        goto error_type;
+    }
+#endif /* __linux__ */
+
+    if ((types = realloc(mounts->types, (mounts->types_count + 1) * sizeof(*types))) == NULL) {
+        goto error_realloc;
+    }
+
+    mounts->types = types;
+
+    if ((copy = strdup(type)) == NULL) {
+        goto error_strdup;
+    }
+
+    mounts->types[mounts->types_count++] = copy;
+
+    /*
+     * Devices already seen must be examined anew against the types given.
+     */
+    mounts->cache_count = 0;
+    mounts->last        = 0;
+
+    return 0;
+
+error_strdup:
+error_realloc:
+#ifdef __linux__
+error_type:
+#endif /* __linux__ */
+    return -1;
+}
+
+static int is_skipped_type(b_mounts *mounts, struct statfs *sfs) {
+    size_t i;
+
+    for (i=0; i<mounts->types_count; i++) {
+#ifdef __linux__
+        unsigned long magic;
+
+        if (fstype_magic(mounts->types[i], &magic) == 0 && ((unsigned long)sfs->f_type & 0xffffffff) == magic) {
+            return 1;
+        }
+#else
+        if (strcmp(sfs->f_fstypename, mounts->types[i]) == 0) {
+            return 1;
+        }
+#endif /* __linux__ */
+    }
+
+    return 0;
+}
+
+/*
+ * Determine whether the object at path, open as fd if fd is positive, lies on
+ * a filesystem of a type to be skipped.  The filesystem is examined only the
+ * first time its device is seen, as every object beneath one mount point
+ * shares the same device; the answer is kept for those found after.
+ */
+int b_mounts_skipped(b_mounts *mounts, b_string *path, dev_t dev, int fd) {
+    struct statfs sfs;
+    size_t i;
+
+    if (mounts->types_count == 0) {
+        return 0;
+    }
+
+    if (mounts->cache_count && mounts->cache[mounts->last].dev == dev) {
+        return mounts->cache[mounts->last].skip;
+    }
+
+    for (i=0; i<mounts->cache_count; i++) {
+        if (mounts->cache[i].dev == dev) {
+            mounts->last = i;
+
+            return mounts->cache[i].skip;
+        }
+    }
+
+    if ((fd > 0? fstatfs(fd, &sfs): statfs(path->str, &sfs)) < 0) {
+        goto error_statfs;
+    }
+
+    if (mounts->cache_count == mounts->cache_size) {
+        size_t size = mounts->cache_size? mounts->cache_size * 2: B_MOUNTS_DEFAULT_SIZE;
+        b_mount *cache;
+
+        if ((cache = realloc(mounts->cache, size * sizeof(*cache))) == NULL) {
+            goto error_realloc;
+        }
+
+        mounts->cache      = cache;
+        mounts->cache_size = size;
+    }
+
+    mounts->last = mounts->cache_count++;
+
+    mounts->cache[mounts->last].dev  = dev;
+    mounts->cache[mounts->last].skip = is_skipped_type(mounts, &sfs);
+
+    return mounts->cache[mounts->last].skip;
+
+error_realloc:
+error_statfs:
+    return -1;
+}
+
+void b_mounts_destroy(b_mounts *mounts) {
+    size_t i;
+
+    if (mounts == NULL) return;
+
+    for (i=0; i<mounts->types_count; i++) {
+        free(mounts->types[i]);
+        mounts->types[i] = NULL;
+    }
+
+    free(mounts->types);
+    mounts->types = NULL;
+
+    free(mounts->cache);
+    mounts->cache = NULL;
+
+    free(mounts);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_MOUNT_H
+#define _B_MOUNT_H
+
+#include <sys/types.h>
+#include "b_string.h"
+
+/*
+ * Whether the filesystem holding a given device is of a type to be skipped,
+ * as determined the first time the device is seen.
+ */
+typedef struct _b_mount {
+    dev_t dev;
+    int   skip;
+} b_mount;
+
+typedef struct _b_mounts {
+    char **   types;
+    size_t    types_count;
+    b_mount * cache;
+    size_t    cache_count;
+    size_t    cache_size;
+    size_t    last;
+} b_mounts;
+
+b_mounts * b_mounts_new();
+
+int b_mounts_skip_type(
+    b_mounts *   mounts,
+    const char * type
+);
+
+int b_mounts_skipped(
+    b_mounts * mounts,
+    b_string * path,
+    dev_t      dev,
+    int        fd
+);
+
+void b_mounts_destroy(b_mounts *mounts);
+
+#endif /* _B_MOUNT_H */
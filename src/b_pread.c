@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "b_buffer.h"
+#include "b_file.h"
+#include "b_pread.h"
+
+b_pread_pool *b_pread_pool_new(size_t threads, size_t chunk_size) {
+    b_pread_pool *pool;
+    size_t i;
+
+    if (threads == 0) {
+        threads = 1;
+    } else if (threads > B_PREAD_MAX_THREADS) {
+        threads = B_PREAD_MAX_THREADS;
+    }
+
+    if (chunk_size == 0) {
+        chunk_size = B_PREAD_DEFAULT_CHUNK_SIZE;
+    }
+
+    /*
+     * Each chunk but the last is written to the archive as-is, so it must end
+     * on a block boundary.
+     */
+    if (chunk_size % B_BUFFER_BLOCK_SIZE) {
+        chunk_size += B_BUFFER_BLOCK_SIZE - (chunk_size % B_BUFFER_BLOCK_SIZE);
+    }
+
+    if ((pool = malloc(sizeof(*pool))) == NULL) {
+        goto error_malloc;
+    }
+
+    pool->threads    = threads;
+    pool->chunk_size = chunk_size;
+    pool->depth      = threads * 2;
+    pool->fd         = 0;
+    pool->size       = 0;
+    pool->chunks     = 0;
+    pool->next       = 0;
+    pool->consumed   = 0;
+    pool->stop       = 0;
+
+    if ((pool->slots = calloc(pool->depth, sizeof(b_pread_slot))) == NULL) {
+        goto error_slots;
+    }
+
+    for (i=0; i<pool->depth; i++) {
+        if (posix_memalign(&pool->slots[i].data, B_BUFFER_READ_ALIGN, chunk_size) != 0) {
+            goto error_slot_data;
+        }
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        goto error_slot_data;
+    }
+
+    if (pthread_cond_init(&pool->work, NULL) != 0) {
+        goto error_cond_work;
+    }
+
+    if (pthread_cond_init(&pool->ready, NULL) != 0) {
+        goto error_cond_ready;
+    }
+
+    return pool;
+
+error_cond_ready:
+    pthread_cond_destroy(&pool->work);
+
+error_cond_work:
+    pthread_mutex_destroy(&pool->lock);
+
+error_slot_data:
+    for (i=0; i<pool->depth; i++) {
+        free(pool->slots[i].data);
+    }
+
+    free(pool->slots);
+
+error_slots:
+    free(pool);
+
+error_malloc:
+    return NULL;
+}
+
+int b_pread_pool_wants(b_pread_pool *pool, off_t file_size) {
+    if (pool == NULL) return 0;
+
+    return file_size > pool->chunk_size;
+}
+
+/*
+ * Worker threads claim the next unread chunk of the current file, so long as
+ * doing so would not overrun the ring of slots the writer has yet to consume,
+ * and pread() it into the slot corresponding to that chunk.
+ */
+static void *worker(void *ctx) {
+    b_pread_pool *pool = ctx;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        b_pread_slot *slot;
+        size_t chunk, len, got = 0;
+        off_t offset;
+
+        while (!pool->stop && pool->next < pool->chunks && pool->next >= pool->consumed + pool->depth) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        if (pool->stop || pool->next == pool->chunks) {
+            break;
+        }
+
+        chunk  = pool->next++;
+        slot   = &pool->slots[chunk % pool->depth];
+        offset = (off_t)chunk * pool->chunk_size;
+        len    = pool->size - offset < pool->chunk_size? pool->size - offset: pool->chunk_size;
+
+        slot->state  = B_PREAD_SLOT_READING;
+        slot->_errno = 0;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        while (got < len) {
+            ssize_t rlen;
+
+            if ((rlen = pread(pool->fd, (unsigned char *)slot->data + got, len - got, offset + got)) < 0) {
+                if (errno == EINTR) continue;
+
+                slot->_errno = errno;
+
+                break;
+            } else if (rlen == 0) {
+                break;
+            }
+
+            got += rlen;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        slot->len   = got;
+        slot->state = B_PREAD_SLOT_READY;
+
+        pthread_cond_broadcast(&pool->ready);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * Read the file given in chunks of pool->chunk_size bytes, in parallel, and
+ * write each chunk to the buffer strictly in file order.  Threads are started
+ * anew for each file, so that a builder survives fork() intact.
+ */
+off_t b_pread_pool_write_contents(b_pread_pool *pool, b_buffer *buf, int file_fd, off_t file_size) {
+    pthread_t *workers;
+    size_t i, started = 0;
+    off_t total = 0, blocklen = 0;
+    int _errno = 0;
+
+    if ((workers = calloc(pool->threads, sizeof(pthread_t))) == NULL) {
+        goto error_malloc;
+    }
+
+    pool->fd       = file_fd;
+    pool->size     = file_size;
+    pool->chunks   = (file_size + pool->chunk_size - 1) / pool->chunk_size;
+    pool->next     = 0;
+    pool->consumed = 0;
+    pool->stop     = 0;
+
+    for (i=0; i<pool->depth; i++) {
+        pool->slots[i].state = B_PREAD_SLOT_EMPTY;
+    }
+
+    for (i=0; i<pool->threads && i<pool->chunks; i++) {
+        if ((_errno = pthread_create(&workers[i], NULL, worker, pool)) != 0) {
+            if (started == 0) {
+                goto error_pthread_create;
+            }
+
+            break;
+        }
+
+        started++;
+    }
+
+    for (i=0; i<pool->chunks; i++) {
+        b_pread_slot *slot = &pool->slots[i % pool->depth];
+        off_t offset       = (off_t)i * pool->chunk_size;
+        size_t expected    = file_size - offset < pool->chunk_size? file_size - offset: pool->chunk_size;
+
+        pthread_mutex_lock(&pool->lock);
+
+        while (slot->state != B_PREAD_SLOT_READY) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        /*
+         * As with sequential reads, treat a file which has shrunk since its
+         * header was written as an error, rather than produce an archive with
+         * mismatched member sizes.
+         */
+        if (slot->len < expected) {
+            _errno = slot->_errno? slot->_errno: EINVAL;
+
+            goto error_io;
+        }
+
+        if ((blocklen = b_file_write_data(buf, slot->data, slot->len)) < 0) {
+            _errno = errno;
+
+            goto error_io;
+        }
+
+        total += blocklen;
+
+        pthread_mutex_lock(&pool->lock);
+
+        slot->state = B_PREAD_SLOT_EMPTY;
+        pool->consumed++;
+
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    for (i=0; i<started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+
+    return total;
+
+error_io:
+    pthread_mutex_lock(&pool->lock);
+
+    pool->stop = 1;
+
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+error_pthread_create:
+    free(workers);
+
+    errno = _errno;
+
+error_malloc:
+    return -1;
+}
+
+void b_pread_pool_destroy(b_pread_pool *pool) {
+    size_t i;
+
+    if (pool == NULL) return;
+
+    for (i=0; i<pool->depth; i++) {
+        free(pool->slots[i].data);
+        pool->slots[i].data = NULL;
+    }
+
+    free(pool->slots);
+    pool->slots = NULL;
+
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_PREAD_H
+#define _B_PREAD_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "b_buffer.h"
+
+#define B_PREAD_DEFAULT_CHUNK_SIZE (8 * 1024 * 1024)
+#define B_PREAD_MAX_THREADS        256
+
+enum b_pread_slot_state {
+    B_PREAD_SLOT_EMPTY   = 0,
+    B_PREAD_SLOT_READING = 1,
+    B_PREAD_SLOT_READY   = 2
+};
+
+typedef struct _b_pread_slot {
+    enum b_pread_slot_state state;
+    size_t                  len;
+    int                     _errno;
+    void *                  data;
+} b_pread_slot;
+
+typedef struct _b_pread_pool {
+    size_t          threads;
+    size_t          chunk_size;
+    size_t          depth;
+    b_pread_slot *  slots;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  ready;
+    int             fd;
+    off_t           size;
+    size_t          chunks;
+    size_t          next;
+    size_t          consumed;
+    int             stop;
+} b_pread_pool;
+
+b_pread_pool * b_pread_pool_new(size_t threads, size_t chunk_size);
+int            b_pread_pool_wants(b_pread_pool *pool, off_t file_size);
+off_t          b_pread_pool_write_contents(b_pread_pool *pool, b_buffer *buf, int file_fd, off_t file_size);
+void           b_pread_pool_destroy(b_pread_pool *pool);
+
+#endif /* _B_PREAD_H */
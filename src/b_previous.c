@@ -0,0 +1,325 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "b_string.h"
+#include "b_index.h"
+#include "b_buffer.h"
+#include "b_util.h"
+#include "b_previous.h"
+
+static int compare_entries(const void *a, const void *b) {
+    const b_index_entry *entry_a = a;
+    const b_index_entry *entry_b = b;
+    size_t len = entry_a->name->len < entry_b->name->len? entry_a->name->len: entry_b->name->len;
+    int ret;
+
+    if ((ret = memcmp(entry_a->name->str, entry_b->name->str, len)) != 0) {
+        return ret;
+    }
+
+    if (entry_a->name->len != entry_b->name->len) {
+        return entry_a->name->len < entry_b->name->len? -1: 1;
+    }
+
+    return entry_a->offset < entry_b->offset? -1: entry_a->offset > entry_b->offset;
+}
+
+static int add_line(b_previous *previous, char *line) {
+    b_index_entry entry;
+
+    if (b_index_parse(&entry, line) < 0) {
+        return -1;
+    }
+
+    /*
+     * Only regular files recorded along with their inode numbers could ever
+     * be found unchanged.
+     */
+    if (entry.type != '0' || entry.ino == 0 || entry.data_offset < entry.offset + B_BUFFER_BLOCK_SIZE) {
+        b_string_free(entry.name);
+
+        return 0;
+    }
+
+    if (previous->count == previous->size) {
+        size_t size = previous->size? previous->size * 2: 1024;
+        b_index_entry *entries;
+
+        if ((entries = realloc(previous->entries, size * sizeof(*entries))) == NULL) {
+            b_string_free(entry.name);
+
+            return -1;
+        }
+
+        previous->entries = entries;
+        previous->size    = size;
+    }
+
+    previous->entries[previous->count++] = entry;
+
+    return 0;
+}
+
+/*
+ * Read the member index of the previous archive in full, keeping the regular
+ * files it lists sorted by name.  Where a name was archived more than once,
+ * only the last member of that name is kept, as tar would extract it.
+ */
+static int read_index(b_previous *previous, int index_fd) {
+    size_t size = B_PREVIOUS_READ_SIZE, len = 0, i, count = 0;
+    char *buf;
+
+    if ((buf = malloc(size + 1)) == NULL) {
+        goto error_malloc;
+    }
+
+    while (1) {
+        char *line, *end;
+        ssize_t rlen;
+
+        if (len == size) {
+            char *grown;
+
+            if ((grown = realloc(buf, size * 2 + 1)) == NULL) {
+                goto error_read;
+            }
+
+            buf   = grown;
+            size *= 2;
+        }
+
+        if ((rlen = read(index_fd, buf + len, size - len)) < 0) {
+            if (errno == EINTR) continue;
+
+            goto error_read;
+        }
+
+        if (rlen == 0) {
+            break;
+        }
+
+        len      += rlen;
+        buf[len]  = '\0';
+
+        for (line = buf; (end = memchr(line, '\n', len - (line - buf))) != NULL; line = end + 1) {
+            *end = '\0';
+
+            if (add_line(previous, line) < 0) {
+                goto error_read;
+            }
+        }
+
+        len -= line - buf;
+
+        memmove(buf, line, len);
+    }
+
+    if (len) {
+        buf[len] = '\0';
+
+        if (add_line(previous, buf) < 0) {
+            goto error_read;
+        }
+    }
+
+    free(buf);
+
+    qsort(previous->entries, previous->count, sizeof(b_index_entry), compare_entries);
+
+    for (i=0; i<previous->count; i++) {
+        b_index_entry *entry = &previous->entries[i];
+
+        if (i + 1 < previous->count && b_string_len(entry->name) == b_string_len(entry[1].name)
+          && memcmp(entry->name->str, entry[1].name->str, entry->name->len) == 0) {
+            b_string_free(entry->name);
+
+            continue;
+        }
+
+        previous->entries[count++] = *entry;
+    }
+
+    previous->count = count;
+
+    return 0;
+
+error_read:
+    free(buf);
+
+error_malloc:
+    return -1;
+}
+
+b_previous *b_previous_open(int fd, int index_fd) {
+    b_previous *previous;
+
+    if ((previous = calloc(1, sizeof(*previous))) == NULL) {
+        goto error_calloc;
+    }
+
+    previous->fd = fd;
+
+    if (read_index(previous, index_fd) < 0) {
+        goto error_read_index;
+    }
+
+    return previous;
+
+error_read_index:
+    b_previous_destroy(previous);
+
+error_calloc:
+    return NULL;
+}
+
+b_index_entry *b_previous_find(b_previous *previous, b_string *name) {
+    size_t low = 0, high = previous->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        b_index_entry *entry = &previous->entries[mid];
+        size_t len = name->len < entry->name->len? name->len: entry->name->len;
+        int cmp;
+
+        if ((cmp = memcmp(name->str, entry->name->str, len)) == 0) {
+            cmp = name->len < entry->name->len? -1: name->len > entry->name->len;
+        }
+
+        if (cmp == 0) {
+            return entry;
+        } else if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read exactly len bytes of the previous archive at the offset given.
+ */
+int b_previous_read(b_previous *previous, off_t offset, void *data, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret;
+
+        if ((ret = pread(previous->fd, (char *)data + done, len - done, offset + done)) < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        } else if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the header blocks, contents and padding of a member of the previous
+ * archive to the file descriptor given, returning the number of bytes copied.
+ * The copy is made within the kernel with copy_file_range() where possible,
+ * so that filesystems able to share extents between files need not copy the
+ * data at all; otherwise splice() is used when writing to a pipe, before
+ * falling back to plain reads and writes.
+ */
+off_t b_previous_copy(b_previous *previous, b_index_entry *entry, int fd) {
+    off_t offset = entry->offset;
+    off_t left   = B_PREVIOUS_MEMBER_SIZE(entry);
+    off_t total  = left;
+    char *buf;
+
+#ifdef __linux__
+    while (left) {
+        ssize_t ret;
+
+        if ((ret = copy_file_range(previous->fd, &offset, fd, NULL, left, 0)) <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret == 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            break;
+        }
+
+        left -= ret;
+    }
+
+    while (left) {
+        ssize_t ret;
+
+        if ((ret = splice(previous->fd, &offset, fd, NULL, left, SPLICE_F_MOVE)) <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret == 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            break;
+        }
+
+        left -= ret;
+    }
+#endif
+
+    if (left == 0) {
+        return total;
+    }
+
+    if ((buf = malloc(B_PREVIOUS_READ_SIZE)) == NULL) {
+        goto error_malloc;
+    }
+
+    while (left) {
+        size_t len = left < B_PREVIOUS_READ_SIZE? left: B_PREVIOUS_READ_SIZE;
+
+        if (b_previous_read(previous, offset, buf, len) < 0) {
+            goto error_io;
+        }
+
+        if (b_write_all(fd, buf, len) < 0) {
+            goto error_io;
+        }
+
+        offset += len;
+        left   -= len;
+    }
+
+    free(buf);
+
+    return total;
+
+error_io:
+    free(buf);
+
+error_malloc:
+    return -1;
+}
+
+void b_previous_destroy(b_previous *previous) {
+    size_t i;
+
+    if (previous == NULL) return;
+
+    for (i=0; i<previous->count; i++) {
+        b_string_free(previous->entries[i].name);
+    }
+
+    free(previous->entries);
+    previous->entries = NULL;
+
+    free(previous);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_PREVIOUS_H
+#define _B_PREVIOUS_H
+
+#include <sys/types.h>
+#include "b_string.h"
+#include "b_index.h"
+
+#define B_PREVIOUS_READ_SIZE (1024 * 1024)
+
+/*
+ * The length of a member of the previous archive, from its first header block
+ * to the end of the padding following its contents.
+ */
+#define B_PREVIOUS_MEMBER_SIZE(entry) \
+    ((entry)->data_offset - (entry)->offset + (((entry)->size + 511) & ~(off_t)511))
+
+/*
+ * A previous, uncompressed archive, along with the member index written
+ * alongside it, from which unchanged members may be copied as they are.
+ */
+typedef struct _b_previous {
+    int             fd;
+    b_index_entry * entries;
+    size_t          count;
+    size_t          size;
+} b_previous;
+
+b_previous * b_previous_open(int fd, int index_fd);
+
+b_index_entry * b_previous_find(
+    b_previous * previous,
+    b_string *   name
+);
+
+int b_previous_read(
+    b_previous * previous,
+    off_t        offset,
+    void *       data,
+    size_t       len
+);
+
+off_t b_previous_copy(
+    b_previous *    previous,
+    b_index_entry * entry,
+    int             fd
+);
+
+void b_previous_destroy(b_previous *previous);
+
+#endif /* _B_PREVIOUS_H */
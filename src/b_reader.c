@@ -0,0 +1,1893 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <sys/sysmacros.h>
+#endif /* __GLIBC__ */
+#include "match_engine.h"
+#include "b_string.h"
+#include "b_stack.h"
+#include "b_header.h"
+#include "b_buffer.h"
+#include "b_error.h"
+#include "b_util.h"
+#include "b_index.h"
+#include "b_reader.h"
+
+/*
+ * Metadata of directories and links, which is applied, or which are created,
+ * once all other members have been extracted.  Directories are given their
+ * final permissions and timestamps last, so that extracting their contents
+ * neither fails nor disturbs them; links are created last, so that no member
+ * can be extracted through a symlink planted earlier in the same archive.
+ */
+typedef struct _b_reader_deferred {
+    b_string * path;
+    b_string * linkdest;
+    char       linktype;
+    mode_t     mode;
+    uid_t      uid;
+    gid_t      gid;
+    time_t     mtime;
+} b_reader_deferred;
+
+static void deferred_destroy(b_reader_deferred *deferred) {
+    if (deferred == NULL) return;
+
+    b_string_free(deferred->path);
+    b_string_free(deferred->linkdest);
+
+    free(deferred);
+}
+
+static void entry_destroy(b_reader_entry *entry) {
+    if (entry == NULL) return;
+
+    b_header_destroy(entry->header);
+    b_string_free(entry->path);
+
+    free(entry);
+}
+
+b_reader *b_reader_new(size_t block_factor) {
+    b_reader *reader;
+
+    if ((reader = malloc(sizeof(*reader))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((reader->buf = b_buffer_new(block_factor? block_factor: B_BUFFER_DEFAULT_FACTOR)) == NULL) {
+        goto error_buffer_new;
+    }
+
+    if ((reader->err = b_error_new()) == NULL) {
+        goto error_error_new;
+    }
+
+    reader->fd             = 0;
+    reader->seekable       = 0;
+    reader->can_splice     = 0;
+    reader->buf_off        = 0;
+    reader->buf_len        = 0;
+    reader->pos            = 0;
+    reader->data_left      = 0;
+    reader->remaining      = 0;
+    reader->eof            = 0;
+    reader->headers_only   = 0;
+    reader->entry          = NULL;
+    reader->match          = NULL;
+    reader->options        = B_READER_NONE;
+    reader->warnings       = 0;
+    reader->dest_fd        = -1;
+    reader->parent.path    = NULL;
+    reader->parent.fd      = -1;
+    reader->threads        = 1;
+    reader->deferred_dirs  = NULL;
+    reader->deferred_links = NULL;
+
+    /*
+     * There is no way to read the umask without setting it.
+     */
+    reader->umask = umask(022);
+    umask(reader->umask);
+
+    return reader;
+
+error_error_new:
+    b_buffer_destroy(reader->buf);
+
+error_buffer_new:
+    free(reader);
+
+error_malloc:
+    return NULL;
+}
+
+void b_reader_set_options(b_reader *reader, enum b_reader_options options) {
+    reader->options = options;
+}
+
+b_error *b_reader_get_error(b_reader *reader) {
+    if (reader == NULL) return NULL;
+
+    return reader->err;
+}
+
+void b_reader_set_threads(b_reader *reader, size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    } else if (threads > B_READER_MAX_THREADS) {
+        threads = B_READER_MAX_THREADS;
+    }
+
+    reader->threads = threads;
+}
+
+int b_reader_set_fd(b_reader *reader, int fd) {
+    struct stat st;
+
+    if (reader == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    entry_destroy(reader->entry);
+
+    reader->fd         = fd;
+    reader->seekable   = S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) >= 0;
+    reader->can_splice = S_ISFIFO(st.st_mode);
+    reader->buf_off    = 0;
+    reader->buf_len    = 0;
+    reader->pos        = 0;
+    reader->data_left  = 0;
+    reader->remaining  = 0;
+    reader->eof        = 0;
+    reader->entry      = NULL;
+
+    return 0;
+}
+
+int b_reader_is_excluded(b_reader *reader, const char *path) {
+    return lafe_excluded(reader->match, path);
+}
+
+int b_reader_include(b_reader *reader, const char *pattern) {
+    return lafe_include(&reader->match, pattern);
+}
+
+int b_reader_include_from_file(b_reader *reader, const char *file) {
+    return lafe_include_from_file(&reader->match, file, 0);
+}
+
+int b_reader_exclude(b_reader *reader, const char *pattern) {
+    return lafe_exclude(&reader->match, pattern);
+}
+
+int b_reader_exclude_from_file(b_reader *reader, const char *file) {
+    return lafe_exclude_from_file(&reader->match, file);
+}
+
+static inline off_t padded_size(off_t size) {
+    if (size % B_BUFFER_BLOCK_SIZE == 0) {
+        return size;
+    }
+
+    return size + (B_BUFFER_BLOCK_SIZE - (size % B_BUFFER_BLOCK_SIZE));
+}
+
+static inline size_t buffered(b_reader *reader) {
+    return reader->buf_len - reader->buf_off;
+}
+
+static inline unsigned char *buffer_at(b_reader *reader) {
+    return (unsigned char *)reader->buf->data + reader->buf_off;
+}
+
+static inline void consume(b_reader *reader, size_t len) {
+    reader->buf_off += len;
+    reader->pos     += len;
+
+    if (reader->buf_off == reader->buf_len) {
+        reader->buf_off = 0;
+        reader->buf_len = 0;
+    }
+}
+
+/*
+ * Ensure at least len bytes are held in the buffer, reading more from the
+ * archive as needed.  Returns 1 on success, 0 if end-of-file was reached
+ * first, or -1 on error.
+ */
+static int fill(b_reader *reader, size_t len) {
+    unsigned char *data = reader->buf->data;
+
+    if (buffered(reader) >= len) return 1;
+
+    if (reader->buf_off) {
+        memmove(data, data + reader->buf_off, buffered(reader));
+
+        reader->buf_len = buffered(reader);
+        reader->buf_off = 0;
+    }
+
+    while (reader->buf_len < len) {
+        size_t want = reader->buf->size - reader->buf_len;
+        ssize_t rlen;
+
+        /*
+         * When only headers are wanted from a seekable archive, read no more
+         * than asked for, so that member contents are seeked over instead.
+         */
+        if (reader->headers_only && reader->seekable) {
+            want = len - reader->buf_len;
+        }
+
+        if ((rlen = read(reader->fd, data + reader->buf_len, want)) < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        } else if (rlen == 0) {
+            return 0;
+        }
+
+        reader->buf_len += rlen;
+    }
+
+    return 1;
+}
+
+/*
+ * Pass over len bytes of the archive, seeking over whatever is not already
+ * buffered when reading from a regular file.
+ */
+static int skip(b_reader *reader, off_t len) {
+    size_t from_buffer = buffered(reader) < len? buffered(reader): len;
+
+    consume(reader, from_buffer);
+
+    len -= from_buffer;
+
+    if (len == 0) return 0;
+
+    if (reader->seekable) {
+        if (lseek(reader->fd, len, SEEK_CUR) < 0) {
+            return -1;
+        }
+
+        reader->pos += len;
+
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t amount;
+        int ret;
+
+        if ((ret = fill(reader, 1)) <= 0) {
+            if (ret == 0) errno = EIO;
+
+            return -1;
+        }
+
+        amount = buffered(reader) < len? buffered(reader): len;
+
+        consume(reader, amount);
+
+        len -= amount;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the contents of a GNU LongLink or PAX extended header into a string,
+ * and pass over the padding following it.
+ */
+static b_string *read_extended(b_reader *reader, uint64_t size) {
+    b_string *ret;
+    size_t off = 0;
+
+    if (size > B_READER_MAX_EXTENDED_SIZE) {
+        errno = EFBIG;
+        goto error_size;
+    }
+
+    if ((ret = malloc(sizeof(*ret))) == NULL) {
+        goto error_malloc;
+    }
+
+    if ((ret->str = malloc(size + 1)) == NULL) {
+        goto error_malloc_str;
+    }
+
+    /*
+     * Ask for the rest of the body and its padding at once, so that reading
+     * only headers does not read extended headers a byte at a time.
+     */
+    while (off < size) {
+        size_t want = padded_size(size) - off;
+        size_t amount;
+        int status;
+
+        if (want > reader->buf->size) {
+            want = reader->buf->size;
+        }
+
+        if ((status = fill(reader, want)) <= 0) {
+            if (status == 0) errno = EIO;
+
+            goto error_fill;
+        }
+
+        amount = buffered(reader) < size - off? buffered(reader): size - off;
+
+        memcpy(ret->str + off, buffer_at(reader), amount);
+        consume(reader, amount);
+
+        off += amount;
+    }
+
+    ret->str[size] = '\0';
+    ret->len       = strlen(ret->str);
+
+    if (skip(reader, padded_size(size) - size) < 0) {
+        goto error_fill;
+    }
+
+    return ret;
+
+error_fill:
+    free(ret->str);
+
+error_malloc_str:
+    free(ret);
+
+error_malloc:
+error_size:
+    return NULL;
+}
+
+struct pax_values {
+    b_string * path;
+    b_string * linkpath;
+    b_string * uname;
+    b_string * gname;
+    int        has_size;
+    uint64_t   size;
+    int        has_mtime;
+    time_t     mtime;
+    int        has_uid;
+    uid_t      uid;
+    int        has_gid;
+    gid_t      gid;
+};
+
+static void pax_values_clear(struct pax_values *values) {
+    b_string_free(values->path);
+    b_string_free(values->linkpath);
+    b_string_free(values->uname);
+    b_string_free(values->gname);
+
+    memset(values, 0x00, sizeof(*values));
+}
+
+static int pax_replace(b_string **value, const char *str, size_t len) {
+    b_string *tmp;
+
+    if ((tmp = b_string_new_len((char *)str, len)) == NULL) {
+        return -1;
+    }
+
+    b_string_free(*value);
+
+    *value = tmp;
+
+    return 0;
+}
+
+/*
+ * Parse the records of a PAX extended header, each of the form
+ * "<length> <key>=<value>\n", retaining those values which bear upon
+ * extraction.
+ */
+static int pax_parse(b_string *data, struct pax_values *values) {
+    char *p   = data->str;
+    char *end = data->str + data->len;
+
+    while (p < end) {
+        char *record = p, *key, *value, *eq;
+        unsigned long len;
+
+        len = strtoul(p, &key, 10);
+
+        if (len == 0 || key == p || *key != ' ' || len > (unsigned long)(end - record)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        key++;
+
+        if ((eq = memchr(key, '=', record + len - key)) == NULL || record[len - 1] != '\n') {
+            errno = EINVAL;
+            return -1;
+        }
+
+        value = eq + 1;
+
+        *eq = '\0';
+
+        if (strcmp(key, "path") == 0) {
+            if (pax_replace(&values->path, value, record + len - 1 - value) < 0) return -1;
+        } else if (strcmp(key, "linkpath") == 0) {
+            if (pax_replace(&values->linkpath, value, record + len - 1 - value) < 0) return -1;
+        } else if (strcmp(key, "uname") == 0) {
+            if (pax_replace(&values->uname, value, record + len - 1 - value) < 0) return -1;
+        } else if (strcmp(key, "gname") == 0) {
+            if (pax_replace(&values->gname, value, record + len - 1 - value) < 0) return -1;
+        } else if (strcmp(key, "size") == 0) {
+            values->has_size = 1;
+            values->size     = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "mtime") == 0) {
+            values->has_mtime = 1;
+            values->mtime     = strtoll(value, NULL, 10);
+        } else if (strcmp(key, "uid") == 0) {
+            values->has_uid = 1;
+            values->uid     = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "gid") == 0) {
+            values->has_gid = 1;
+            values->gid     = strtoul(value, NULL, 10);
+        }
+
+        p = record + len;
+    }
+
+    return 0;
+}
+
+static b_string *header_path(b_header *header) {
+    b_string *path;
+
+    if (header->prefix == NULL) {
+        return b_string_dup(header->suffix);
+    }
+
+    if ((path = b_string_dup(header->prefix)) == NULL) {
+        goto error_dup;
+    }
+
+    if (b_string_append_str(path, "/") == NULL) {
+        goto error_append;
+    }
+
+    if (b_string_append(path, header->suffix) == NULL) {
+        goto error_append;
+    }
+
+    return path;
+
+error_append:
+    b_string_free(path);
+
+error_dup:
+    return NULL;
+}
+
+/*
+ * Member types which never carry any data, regardless of the size field.
+ */
+static inline int type_has_data(char linktype) {
+    switch (linktype) {
+        case '1': case '2': case '3': case '4': case '5': case '6':
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Read the next member header from the archive, along with any GNU LongLink or
+ * PAX extended headers preceding it, passing over whatever contents of the
+ * previous member were not read.  Returns 1 if a member was read, 0 upon
+ * reaching the end of the archive, or -1 on error.  The entry returned remains
+ * valid until the next call.
+ */
+int b_reader_next(b_reader *reader, b_reader_entry **entryp) {
+    b_reader_entry *entry;
+    b_header *header = NULL;
+    b_string *longname = NULL, *longlink = NULL;
+    struct pax_values pax;
+    off_t offset;
+    int ret;
+
+    memset(&pax, 0x00, sizeof(pax));
+
+    entry_destroy(reader->entry);
+    reader->entry = NULL;
+
+    if (reader->eof) return 0;
+
+    if (reader->remaining) {
+        if (skip(reader, reader->remaining) < 0) {
+            goto error_io;
+        }
+
+        reader->remaining = 0;
+        reader->data_left = 0;
+    }
+
+    offset = reader->pos;
+
+    while (1) {
+        b_string *data;
+
+        if ((ret = fill(reader, B_HEADER_SIZE)) < 0) {
+            goto error_io;
+        } else if (ret == 0) {
+            /*
+             * Tolerate archives missing their end-of-archive marker, but not
+             * those ending partway through a member.
+             */
+            if (buffered(reader) || longname || longlink || pax.path || pax.linkpath) {
+                errno = EIO;
+                goto error_io;
+            }
+
+            reader->eof = 1;
+
+            return 0;
+        }
+
+        if (b_header_block_is_empty((b_header_block *)buffer_at(reader))) {
+            if (longname || longlink || pax.path || pax.linkpath) {
+                errno = EINVAL;
+                goto error_io;
+            }
+
+            reader->eof = 1;
+
+            return 0;
+        }
+
+        if ((header = b_header_decode_block((b_header_block *)buffer_at(reader))) == NULL) {
+            goto error_io;
+        }
+
+        consume(reader, B_HEADER_SIZE);
+
+        switch (header->linktype) {
+            case B_HEADER_LONGLINK_TYPE:
+            case B_HEADER_LONGDEST_TYPE:
+            case B_HEADER_PAX_TYPE:
+            case 'g':
+                if ((data = read_extended(reader, header->size)) == NULL) {
+                    goto error_io;
+                }
+
+                if (header->linktype == B_HEADER_LONGLINK_TYPE) {
+                    b_string_free(longname);
+                    longname = data;
+                } else if (header->linktype == B_HEADER_LONGDEST_TYPE) {
+                    b_string_free(longlink);
+                    longlink = data;
+                } else {
+                    /*
+                     * Global PAX headers are parsed for validity, but their
+                     * values are not carried over to later members.
+                     */
+                    struct pax_values global;
+
+                    memset(&global, 0x00, sizeof(global));
+
+                    ret = pax_parse(data, header->linktype == 'g'? &global: &pax);
+
+                    pax_values_clear(&global);
+                    b_string_free(data);
+
+                    if (ret < 0) {
+                        goto error_io;
+                    }
+                }
+
+                b_header_destroy(header);
+                header = NULL;
+
+                continue;
+        }
+
+        break;
+    }
+
+    if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+        goto error_io;
+    }
+
+    entry->header = header;
+    entry->offset = offset;
+
+    if (longname) {
+        entry->path = longname;
+        longname    = NULL;
+    } else if (pax.path) {
+        entry->path = pax.path;
+        pax.path    = NULL;
+    } else if ((entry->path = header_path(header)) == NULL) {
+        goto error_entry;
+    }
+
+    if (longlink || pax.linkpath) {
+        b_string_free(header->linkdest);
+
+        header->linkdest = longlink? longlink: pax.linkpath;
+
+        if (longlink) longlink     = NULL;
+        else          pax.linkpath = NULL;
+    }
+
+    if (pax.uname) {
+        b_string_free(header->user);
+        header->user = pax.uname;
+        pax.uname    = NULL;
+    }
+
+    if (pax.gname) {
+        b_string_free(header->group);
+        header->group = pax.gname;
+        pax.gname     = NULL;
+    }
+
+    if (pax.has_size)  header->size  = pax.size;
+    if (pax.has_mtime) header->mtime = pax.mtime;
+    if (pax.has_uid)   header->uid   = pax.uid;
+    if (pax.has_gid)   header->gid   = pax.gid;
+
+    entry->data_offset = reader->pos;
+    entry->data_size   = type_has_data(header->linktype)? header->size: 0;
+
+    reader->data_left = entry->data_size;
+    reader->remaining = padded_size(entry->data_size);
+    reader->entry     = entry;
+
+    pax_values_clear(&pax);
+
+    *entryp = entry;
+
+    return 1;
+
+error_entry:
+    entry_destroy(entry);
+    header = NULL;
+
+error_io:
+    b_header_destroy(header);
+    b_string_free(longname);
+    b_string_free(longlink);
+    pax_values_clear(&pax);
+
+    return -1;
+}
+
+/*
+ * Write the contents of the current member to the file descriptor given.
+ * Whatever is already buffered is written first; the remainder is copied
+ * within the kernel with copy_file_range() when reading from a regular file,
+ * or with splice() when reading from a pipe, before falling back to plain
+ * reads and writes.
+ */
+off_t b_reader_copy_data(b_reader *reader, int fd) {
+    off_t total = 0;
+
+    if (reader->entry == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buffered(reader) && reader->data_left) {
+        size_t amount = buffered(reader) < reader->data_left? buffered(reader): reader->data_left;
+
+        if (b_write_all(fd, buffer_at(reader), amount) < 0) {
+            return -1;
+        }
+
+        consume(reader, amount);
+
+        reader->data_left -= amount;
+        reader->remaining -= amount;
+        total             += amount;
+    }
+
+#ifdef __linux__
+    while (reader->data_left && reader->seekable) {
+        ssize_t ret;
+
+        if ((ret = copy_file_range(reader->fd, NULL, fd, NULL, reader->data_left, 0)) <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret == 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            break;
+        }
+
+        reader->pos       += ret;
+        reader->data_left -= ret;
+        reader->remaining -= ret;
+        total             += ret;
+    }
+
+    while (reader->data_left && reader->can_splice) {
+        ssize_t ret;
+
+        if ((ret = splice(reader->fd, NULL, fd, NULL, reader->data_left, SPLICE_F_MOVE)) <= 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret == 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            break;
+        }
+
+        reader->pos       += ret;
+        reader->data_left -= ret;
+        reader->remaining -= ret;
+        total             += ret;
+    }
+#endif
+
+    while (reader->data_left) {
+        size_t amount;
+        int ret;
+
+        if ((ret = fill(reader, 1)) <= 0) {
+            if (ret == 0) errno = EIO;
+
+            return -1;
+        }
+
+        amount = buffered(reader) < reader->data_left? buffered(reader): reader->data_left;
+
+        if (b_write_all(fd, buffer_at(reader), amount) < 0) {
+            return -1;
+        }
+
+        consume(reader, amount);
+
+        reader->data_left -= amount;
+        reader->remaining -= amount;
+        total             += amount;
+    }
+
+    if (b_reader_skip_data(reader) < 0) {
+        return -1;
+    }
+
+    return total;
+}
+
+/*
+ * Pass over the remaining contents of the current member, and its padding.
+ */
+int b_reader_skip_data(b_reader *reader) {
+    if (reader->remaining && skip(reader, reader->remaining) < 0) {
+        return -1;
+    }
+
+    reader->remaining = 0;
+    reader->data_left = 0;
+
+    return 0;
+}
+
+/*
+ * Read up to len bytes of the contents of the current member into the memory
+ * given, returning the number of bytes read, which is less than len only when
+ * the end of the member contents is reached.
+ */
+ssize_t b_reader_read_data(b_reader *reader, void *data, size_t len) {
+    unsigned char *dest = data;
+    size_t got = 0;
+
+    if (len > reader->data_left) {
+        len = reader->data_left;
+    }
+
+    while (got < len) {
+        size_t amount;
+        int ret;
+
+        /*
+         * Read large amounts directly into place, rather than by way of the
+         * buffer.
+         */
+        if (buffered(reader) == 0 && len - got >= reader->buf->size) {
+            ssize_t rlen;
+
+            if ((rlen = read(reader->fd, dest + got, len - got)) < 0) {
+                if (errno == EINTR) continue;
+
+                return -1;
+            } else if (rlen == 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            reader->pos += rlen;
+            got         += rlen;
+
+            continue;
+        }
+
+        if ((ret = fill(reader, 1)) <= 0) {
+            if (ret == 0) errno = EIO;
+
+            return -1;
+        }
+
+        amount = buffered(reader) < len - got? buffered(reader): len - got;
+
+        memcpy(dest + got, buffer_at(reader), amount);
+        consume(reader, amount);
+
+        got += amount;
+    }
+
+    reader->data_left -= len;
+    reader->remaining -= len;
+
+    return len;
+}
+
+static void warn_path(b_reader *reader, int _errno, char *message, b_string *path) {
+    reader->warnings++;
+
+    b_error_set(reader->err, B_ERROR_WARN, _errno, message, path);
+}
+
+static void dir_close(b_reader_dir *dir) {
+    if (dir->fd >= 0) {
+        close(dir->fd);
+    }
+
+    b_string_free(dir->path);
+
+    dir->path = NULL;
+    dir->fd   = -1;
+}
+
+/*
+ * Turn a member name into a path relative to the destination directory:
+ * leading slashes and "." components are dropped, as is any trailing slash,
+ * and names containing ".." components are refused outright.
+ */
+static b_string *safe_path(b_string *name) {
+    b_string *ret;
+    char *p = name->str;
+
+    if ((ret = b_string_new("")) == NULL) {
+        return NULL;
+    }
+
+    while (*p) {
+        char *end;
+        size_t len;
+        b_string component;
+
+        while (*p == '/') p++;
+
+        if (*p == '\0') break;
+
+        end = strchr(p, '/');
+        len = end? end - p: strlen(p);
+
+        if (len == 1 && p[0] == '.') {
+            p += len;
+            continue;
+        }
+
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            b_string_free(ret);
+
+            errno = EINVAL;
+
+            return NULL;
+        }
+
+        component.str = p;
+        component.len = len;
+
+        if ((ret->len && b_string_append_str(ret, "/") == NULL) || b_string_append(ret, &component) == NULL) {
+            b_string_free(ret);
+
+            return NULL;
+        }
+
+        p += len;
+    }
+
+    return ret;
+}
+
+/*
+ * Return a descriptor for the directory holding the path given, relative to
+ * the destination, creating any missing directories along the way, and set
+ * *name to the last component of the path.  The most recently used directory
+ * is kept open in the cache given, as members of the same directory tend to be
+ * adjacent.  When nofollow is set, no symlinks are followed in resolving the
+ * directory, and the cache is not used.
+ */
+static int open_parent(b_reader *reader, b_reader_dir *cache, b_string *path, const char **name, int nofollow) {
+    char *slash = strrchr(path->str, '/');
+    size_t len  = slash? slash - path->str: 0;
+    char *dir, *p, *save;
+    int fd;
+
+    *name = slash? slash + 1: path->str;
+
+    if (len == 0) {
+        return reader->dest_fd;
+    }
+
+    if (!nofollow) {
+        if (cache->path && cache->path->len == len && memcmp(cache->path->str, path->str, len) == 0) {
+            return cache->fd;
+        }
+
+        dir_close(cache);
+    }
+
+    if ((dir = strndup(path->str, len)) == NULL) {
+        return -1;
+    }
+
+    if ((fd = dup(reader->dest_fd)) < 0) {
+        goto error_dup;
+    }
+
+    for (p = strtok_r(dir, "/", &save); p; p = strtok_r(NULL, "/", &save)) {
+        int next;
+
+        if (mkdirat(fd, p, 0777) < 0 && errno != EEXIST) {
+            goto error_open;
+        }
+
+        if ((next = openat(fd, p, O_RDONLY | O_DIRECTORY | (nofollow? O_NOFOLLOW: 0))) < 0) {
+            goto error_open;
+        }
+
+        close(fd);
+
+        fd = next;
+    }
+
+    free(dir);
+
+    if (!nofollow) {
+        cache->path = b_string_new_len(path->str, len);
+        cache->fd   = fd;
+    }
+
+    return fd;
+
+error_open:
+    close(fd);
+
+error_dup:
+    free(dir);
+
+    return -1;
+}
+
+static void close_parent(b_reader *reader, b_reader_dir *cache, int fd) {
+    if (fd != reader->dest_fd && fd != cache->fd) {
+        close(fd);
+    }
+}
+
+static inline mode_t entry_mode(b_reader *reader, b_header *header) {
+    if (reader->options & B_READER_SAME_PERMISSIONS) {
+        return header->mode & 07777;
+    }
+
+    return header->mode & 0777 & ~reader->umask;
+}
+
+static int set_metadata(b_reader *reader, int dirfd, const char *name, int fd, char linktype, mode_t mode, uid_t uid, gid_t gid, time_t mtime) {
+    struct timespec times[2];
+    int ret = 0;
+
+    times[0].tv_sec  = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec  = mtime;
+    times[1].tv_nsec = 0;
+
+    if (reader->options & B_READER_SAME_OWNER) {
+        if (fd >= 0) {
+            ret |= fchown(fd, uid, gid);
+        } else {
+            ret |= fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+
+    if (linktype != '2') {
+        if (fd >= 0) {
+            ret |= fchmod(fd, mode);
+        } else {
+            ret |= fchmodat(dirfd, name, mode, 0);
+        }
+    }
+
+    if (fd >= 0) {
+        ret |= futimens(fd, times);
+    } else {
+        ret |= utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    return ret? -1: 0;
+}
+
+static int defer(b_reader *reader, b_stack *stack, b_string *path, b_reader_entry *entry) {
+    b_reader_deferred *deferred;
+    b_header *header = entry->header;
+
+    if ((deferred = calloc(1, sizeof(*deferred))) == NULL) {
+        goto error_calloc;
+    }
+
+    if ((deferred->path = b_string_dup(path)) == NULL) {
+        goto error_dup;
+    }
+
+    if (header->linkdest && (deferred->linkdest = b_string_dup(header->linkdest)) == NULL) {
+        goto error_dup;
+    }
+
+    deferred->linktype = header->linktype;
+    deferred->mode     = entry_mode(reader, header);
+    deferred->uid      = header->uid;
+    deferred->gid      = header->gid;
+    deferred->mtime    = header->mtime;
+
+    if (b_stack_push(stack, deferred) == NULL) {
+        goto error_dup;
+    }
+
+    return 0;
+
+error_dup:
+    deferred_destroy(deferred);
+
+error_calloc:
+    return -1;
+}
+
+/*
+ * Write a regular file, either from the contents given, as read ahead of time
+ * by the extraction thread, or straight from the archive.
+ */
+static int extract_file(b_reader *reader, b_reader_entry *entry, int dirfd, const char *name, void *data) {
+    b_header *header = entry->header;
+    int fd;
+
+    if (unlinkat(dirfd, name, 0) < 0 && errno != ENOENT) {
+        return -1;
+    }
+
+    if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0) {
+        return -1;
+    }
+
+    if (data) {
+        if (b_write_all(fd, data, entry->data_size) < 0) {
+            close(fd);
+
+            return -1;
+        }
+    } else if (b_reader_copy_data(reader, fd) < 0) {
+        /*
+         * Errors reading the archive cannot be recovered from, so they are
+         * flagged as such to the caller.
+         */
+        close(fd);
+
+        return -2;
+    }
+
+    if (set_metadata(reader, dirfd, name, fd, header->linktype, entry_mode(reader, header), header->uid, header->gid, header->mtime) < 0) {
+        close(fd);
+
+        return -1;
+    }
+
+    return close(fd);
+}
+
+static int extract_dir(int dirfd, const char *name) {
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (!S_ISDIR(st.st_mode) && unlinkat(dirfd, name, 0) < 0) {
+            return -1;
+        }
+    }
+
+    if (mkdirat(dirfd, name, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int extract_special(b_reader *reader, b_reader_entry *entry, int dirfd, const char *name) {
+    b_header *header = entry->header;
+    mode_t mode      = entry_mode(reader, header);
+
+    if (unlinkat(dirfd, name, 0) < 0 && errno != ENOENT) {
+        return -1;
+    }
+
+    switch (header->linktype) {
+        case '3': mode |= S_IFCHR; break;
+        case '4': mode |= S_IFBLK; break;
+        case '6': mode |= S_IFIFO; break;
+    }
+
+    if (mknodat(dirfd, name, mode, makedev(header->major, header->minor)) < 0) {
+        return -1;
+    }
+
+    return set_metadata(reader, dirfd, name, -1, header->linktype, mode & 07777, header->uid, header->gid, header->mtime);
+}
+
+/*
+ * Create a symlink or hardlink whose creation was deferred until all other
+ * members were extracted.  No symlinks are followed in locating the directory
+ * to hold it, lest a symlink created just prior redirect it.
+ */
+static int extract_link(b_reader *reader, b_reader_deferred *deferred) {
+    const char *name;
+    int dirfd, ret = -1;
+
+    if ((dirfd = open_parent(reader, &reader->parent, deferred->path, &name, 1)) < 0) {
+        return -1;
+    }
+
+    if (unlinkat(dirfd, name, 0) < 0 && errno != ENOENT) {
+        goto error;
+    }
+
+    if (deferred->linktype == '2') {
+        if (symlinkat(deferred->linkdest->str, dirfd, name) < 0) {
+            goto error;
+        }
+
+        ret = set_metadata(reader, dirfd, name, -1, '2', 0, deferred->uid, deferred->gid, deferred->mtime);
+    } else {
+        b_string *target, tmp;
+
+        tmp.str = deferred->linkdest->str;
+        tmp.len = deferred->linkdest->len;
+
+        if ((target = safe_path(&tmp)) == NULL) {
+            goto error;
+        }
+
+        ret = linkat(reader->dest_fd, target->str, dirfd, name, 0);
+
+        b_string_free(target);
+    }
+
+error:
+    close_parent(reader, &reader->parent, dirfd);
+
+    return ret;
+}
+
+/*
+ * Write a member index of the remainder of the archive to the file descriptor
+ * given, in the same format as that written by a builder, reading only member
+ * headers and seeking over their contents where possible.  Returns the number
+ * of members indexed, or -1 on error.
+ */
+ssize_t b_reader_write_index(b_reader *reader, int fd) {
+    b_reader_entry *entry;
+    b_index *index;
+    ssize_t count = 0;
+    int ret;
+
+    if (reader == NULL || reader->fd == 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((index = b_index_new()) == NULL) {
+        goto error_index_new;
+    }
+
+    b_index_set_fd(index, fd);
+
+    reader->headers_only = 1;
+
+    while ((ret = b_reader_next(reader, &entry)) > 0) {
+        b_header *header = entry->header;
+        b_index_entry item;
+        b_string name;
+
+        /*
+         * Builders index directories without the trailing slash their
+         * headers carry.
+         */
+        name.str = entry->path->str;
+        name.len = entry->path->len;
+
+        while (name.len > 1 && name.str[name.len-1] == '/') {
+            name.len--;
+        }
+
+        item.name        = &name;
+        item.offset      = entry->offset;
+        item.data_offset = entry->data_offset;
+        item.size        = entry->data_size;
+        item.mtime       = header->mtime;
+        item.type        = header->linktype? header->linktype: '0';
+        item.dev         = 0;
+        item.ino         = 0;
+
+        if (b_index_write(index, &item) < 0) {
+            goto error_write;
+        }
+
+        count++;
+    }
+
+    if (ret < 0) {
+        goto error_write;
+    }
+
+    if (b_index_flush(index) < 0) {
+        goto error_write;
+    }
+
+    reader->headers_only = 0;
+
+    b_index_destroy(index);
+
+    return count;
+
+error_write:
+    reader->headers_only = 0;
+
+    b_index_destroy(index);
+
+error_index_new:
+    return -1;
+}
+
+/*
+ * Create a member other than a link, beneath the directory cached given.
+ */
+static int extract_member(b_reader *reader, b_reader_dir *cache, b_reader_entry *entry, b_string *path, void *data) {
+    const char *name;
+    int dirfd, ret;
+
+    if ((dirfd = open_parent(reader, cache, path, &name, 0)) < 0) {
+        return -1;
+    }
+
+    switch (entry->header->linktype) {
+        case '5':
+            ret = extract_dir(dirfd, name);
+            break;
+
+        case '3':
+        case '4':
+        case '6':
+            ret = extract_special(reader, entry, dirfd, name);
+            break;
+
+        default:
+            ret = extract_file(reader, entry, dirfd, name, data);
+            break;
+    }
+
+    close_parent(reader, cache, dirfd);
+
+    return ret;
+}
+
+/*
+ * A member handed off to an extraction thread, along with the contents of
+ * regular files, read ahead of time.  Members which cannot be extracted are
+ * handed back, with the error encountered, to be reported by the thread
+ * reading the archive.
+ */
+typedef struct _b_reader_job {
+    struct _b_reader_job * next;
+    b_reader_entry *       entry;
+    b_string *             path;
+    void *                 data;
+    int                    _errno;
+} b_reader_job;
+
+typedef struct _b_reader_worker {
+    struct _b_reader_pool * pool;
+    pthread_t               thread;
+    b_reader_job *          head;
+    b_reader_job *          tail;
+    size_t                  queued;
+    int                     busy;
+    b_reader_dir            parent;
+} b_reader_worker;
+
+typedef struct _b_reader_pool {
+    b_reader *        reader;
+    b_reader_worker * workers;
+    size_t            threads;
+    size_t            started;
+    size_t            bytes;
+    b_reader_job *    failed;
+    pthread_mutex_t   lock;
+    pthread_cond_t    work;
+    pthread_cond_t    done;
+    int               stop;
+} b_reader_pool;
+
+static void job_destroy(b_reader_job *job) {
+    if (job == NULL) return;
+
+    entry_destroy(job->entry);
+    b_string_free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static void *extract_worker(void *ctx) {
+    b_reader_worker *worker = ctx;
+    b_reader_pool *pool     = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        b_reader_job *job;
+        int ret;
+
+        while (!pool->stop && worker->head == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        if ((job = worker->head) == NULL || pool->stop) {
+            break;
+        }
+
+        if ((worker->head = job->next) == NULL) {
+            worker->tail = NULL;
+        }
+
+        worker->queued--;
+        worker->busy = 1;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        ret = extract_member(pool->reader, &worker->parent, job->entry, job->path, job->data);
+
+        job->_errno = errno;
+
+        pthread_mutex_lock(&pool->lock);
+
+        pool->bytes  -= job->data? job->entry->data_size: 0;
+        worker->busy  = 0;
+
+        if (ret < 0) {
+            job->next    = pool->failed;
+            pool->failed = job;
+        } else {
+            job_destroy(job);
+        }
+
+        pthread_cond_broadcast(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    dir_close(&worker->parent);
+
+    return NULL;
+}
+
+/*
+ * Report, from the thread reading the archive, any members the extraction
+ * threads failed to create.  Must be called with the pool locked.
+ */
+static void pool_report(b_reader_pool *pool) {
+    while (pool->failed) {
+        b_reader_job *job = pool->failed;
+
+        pool->failed = job->next;
+
+        warn_path(pool->reader, job->_errno, "Cannot extract member", job->entry->path);
+
+        job_destroy(job);
+    }
+}
+
+/*
+ * Threads are started anew for each extraction, so that a reader survives
+ * fork() intact.
+ */
+static b_reader_pool *pool_new(b_reader *reader) {
+    b_reader_pool *pool;
+    size_t i;
+    int _errno;
+
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+        goto error_calloc;
+    }
+
+    pool->reader  = reader;
+    pool->threads = reader->threads;
+
+    if ((pool->workers = calloc(pool->threads, sizeof(b_reader_worker))) == NULL) {
+        goto error_workers;
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        goto error_mutex;
+    }
+
+    if (pthread_cond_init(&pool->work, NULL) != 0) {
+        goto error_cond_work;
+    }
+
+    if (pthread_cond_init(&pool->done, NULL) != 0) {
+        goto error_cond_done;
+    }
+
+    for (i=0; i<pool->threads; i++) {
+        b_reader_worker *worker = &pool->workers[i];
+
+        worker->pool      = pool;
+        worker->parent.fd = -1;
+
+        if ((_errno = pthread_create(&worker->thread, NULL, extract_worker, worker)) != 0) {
+            errno = _errno;
+
+            goto error_pthread_create;
+        }
+
+        pool->started++;
+    }
+
+    return pool;
+
+error_pthread_create:
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+
+error_cond_done:
+    pthread_cond_destroy(&pool->work);
+
+error_cond_work:
+    pthread_mutex_destroy(&pool->lock);
+
+error_mutex:
+    free(pool->workers);
+
+error_workers:
+    free(pool);
+
+error_calloc:
+    return NULL;
+}
+
+/*
+ * Wait for all queued members to be extracted, or, when stop is set, only
+ * for those being extracted at present, then stop the threads.
+ */
+static void pool_destroy(b_reader_pool *pool, int stop) {
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (!stop) {
+        for (i=0; i<pool->threads; i++) {
+            while (pool->workers[i].head || pool->workers[i].busy) {
+                pthread_cond_wait(&pool->done, &pool->lock);
+            }
+        }
+    }
+
+    pool->stop = 1;
+
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pool_report(pool);
+
+    for (i=0; i<pool->threads; i++) {
+        b_reader_job *job = pool->workers[i].head;
+
+        while (job) {
+            b_reader_job *next = job->next;
+
+            job_destroy(job);
+
+            job = next;
+        }
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * Read the contents of the current member into the memory given, followed by
+ * its padding.
+ */
+static int read_data(b_reader *reader, unsigned char *data) {
+    if (b_reader_read_data(reader, data, reader->data_left) < 0) {
+        return -1;
+    }
+
+    return b_reader_skip_data(reader);
+}
+
+static inline size_t path_hash(b_string *path) {
+    size_t hash = 2166136261u;
+    size_t i;
+
+    for (i=0; i<path->len; i++) {
+        hash = (hash ^ (unsigned char)path->str[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Hand the current member off to an extraction thread.  Members are assigned
+ * to threads by name, so that any members of the same name are extracted in
+ * archive order.  Regular files too large to be read ahead of time are
+ * extracted by the calling thread, once the thread assigned that name is idle.
+ * Takes ownership of the path given.
+ */
+static int pool_extract(b_reader_pool *pool, b_reader_entry *entry, b_string *path) {
+    b_reader *reader        = pool->reader;
+    b_reader_worker *worker = &pool->workers[path_hash(path) % pool->threads];
+    b_reader_job *job;
+    size_t size = entry->data_size;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool_report(pool);
+
+    if (size > B_READER_MAX_JOB_SIZE) {
+        while (worker->head || worker->busy) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if ((ret = extract_member(reader, &reader->parent, entry, path, NULL)) == -1) {
+            warn_path(reader, errno, "Cannot extract member", entry->path);
+        }
+
+        b_string_free(path);
+
+        return ret == -2? -1: b_reader_skip_data(reader);
+    }
+
+    while (worker->queued >= B_READER_MAX_QUEUED_JOBS || (pool->bytes && pool->bytes + size > B_READER_MAX_QUEUED_SIZE)) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pool_report(pool);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if ((job = calloc(1, sizeof(*job))) == NULL) {
+        goto error_job;
+    }
+
+    job->path = path;
+
+    if (size) {
+        if ((job->data = malloc(size)) == NULL) {
+            goto error_data;
+        }
+
+        if (read_data(reader, job->data) < 0) {
+            goto error_data;
+        }
+    }
+
+    /*
+     * The entry now belongs to the job, rather than the reader.
+     */
+    job->entry    = entry;
+    reader->entry = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+
+    worker->tail   = job;
+    worker->queued++;
+    pool->bytes   += size;
+
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+
+error_data:
+    job->path = NULL;
+    job_destroy(job);
+
+error_job:
+    b_string_free(path);
+
+    return -1;
+}
+
+static int extract_entry(b_reader *reader, b_reader_pool *pool, b_reader_entry *entry) {
+    b_header *header = entry->header;
+    b_string *path;
+    int ret = -1;
+
+    if ((path = safe_path(entry->path)) == NULL) {
+        warn_path(reader, errno, "Refusing to extract member with '..' in its name", entry->path);
+
+        return b_reader_skip_data(reader);
+    }
+
+    if (path->len == 0) {
+        b_string_free(path);
+
+        return b_reader_skip_data(reader);
+    }
+
+    switch (header->linktype) {
+        case '1':
+        case '2':
+            if (header->linkdest == NULL) {
+                errno = EINVAL;
+                break;
+            }
+
+            ret = defer(reader, reader->deferred_links, path, entry);
+            break;
+
+        default:
+            if (header->linktype == '5' && defer(reader, reader->deferred_dirs, path, entry) < 0) {
+                break;
+            }
+
+            if (pool) {
+                /*
+                 * Errors extracting the member are reported later; any error
+                 * returned here is fatal.
+                 */
+                return pool_extract(pool, entry, path);
+            }
+
+            ret = extract_member(reader, &reader->parent, entry, path, NULL);
+            break;
+    }
+
+    if (ret == -2) {
+        b_string_free(path);
+
+        return -1;
+    }
+
+    if (ret < 0) {
+        warn_path(reader, errno, "Cannot extract member", entry->path);
+    }
+
+    b_string_free(path);
+
+    return b_reader_skip_data(reader);
+}
+
+/*
+ * Create the links, hardlinks first so that none may be made through a symlink
+ * from the archive, then apply the metadata of the directories, in reverse
+ * order so that setting the timestamps of one is not undone by changes within
+ * another.
+ */
+static void extract_deferred(b_reader *reader) {
+    size_t i, count;
+    int pass;
+
+    count = b_stack_count(reader->deferred_links);
+
+    for (pass=0; pass<2; pass++) {
+        for (i=0; i<count; i++) {
+            b_reader_deferred *deferred = b_stack_item_at(reader->deferred_links, i);
+
+            if ((deferred->linktype == '2') != pass) continue;
+
+            if (extract_link(reader, deferred) < 0) {
+                warn_path(reader, errno, "Cannot create link", deferred->path);
+            }
+        }
+    }
+
+    count = b_stack_count(reader->deferred_dirs);
+
+    for (i=count; i>0; i--) {
+        b_reader_deferred *deferred = b_stack_item_at(reader->deferred_dirs, i-1);
+        const char *name;
+        int dirfd;
+
+        if ((dirfd = open_parent(reader, &reader->parent, deferred->path, &name, 1)) < 0) {
+            warn_path(reader, errno, "Cannot set directory metadata", deferred->path);
+            continue;
+        }
+
+        if (set_metadata(reader, dirfd, name, -1, '5', deferred->mode, deferred->uid, deferred->gid, deferred->mtime) < 0) {
+            warn_path(reader, errno, "Cannot set directory metadata", deferred->path);
+        }
+
+        close_parent(reader, &reader->parent, dirfd);
+    }
+}
+
+static void extract_cleanup(b_reader *reader) {
+    dir_close(&reader->parent);
+
+    if (reader->dest_fd >= 0) {
+        close(reader->dest_fd);
+        reader->dest_fd = -1;
+    }
+
+    b_stack_destroy(reader->deferred_dirs);
+    b_stack_destroy(reader->deferred_links);
+
+    reader->deferred_dirs  = NULL;
+    reader->deferred_links = NULL;
+}
+
+/*
+ * Extract all members not excluded to the destination directory given.
+ * Members which cannot be extracted are reported as warnings; errors reading
+ * the archive itself are fatal.  Returns the number of members extracted, or
+ * -1 on error.
+ */
+ssize_t b_reader_extract(b_reader *reader, const char *dest) {
+    b_reader_entry *entry;
+    b_reader_pool *pool = NULL;
+    ssize_t count = 0;
+    int ret;
+
+    if (reader == NULL || reader->fd == 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((reader->dest_fd = open(dest, O_RDONLY | O_DIRECTORY)) < 0) {
+        goto error_open;
+    }
+
+    if ((reader->deferred_dirs = b_stack_new(0)) == NULL) {
+        goto error_stack_new;
+    }
+
+    if ((reader->deferred_links = b_stack_new(0)) == NULL) {
+        goto error_stack_new;
+    }
+
+    b_stack_set_destructor(reader->deferred_dirs,  B_STACK_DESTRUCTOR(deferred_destroy));
+    b_stack_set_destructor(reader->deferred_links, B_STACK_DESTRUCTOR(deferred_destroy));
+
+    if (reader->threads > 1 && (pool = pool_new(reader)) == NULL) {
+        goto error_pool_new;
+    }
+
+    while ((ret = b_reader_next(reader, &entry)) > 0) {
+        if (lafe_excluded(reader->match, entry->path->str)) {
+            continue;
+        }
+
+        if (extract_entry(reader, pool, entry) < 0) {
+            b_error_set(reader->err, B_ERROR_FATAL, errno, "Cannot read archive", entry->path);
+
+            goto error_extract;
+        }
+
+        count++;
+    }
+
+    if (ret < 0) {
+        goto error_extract;
+    }
+
+    /*
+     * Links and directory metadata are only seen to once every other member
+     * has been written.
+     */
+    if (pool) {
+        pool_destroy(pool, 0);
+    }
+
+    extract_deferred(reader);
+    extract_cleanup(reader);
+
+    return count;
+
+error_extract:
+    if (pool) {
+        int _errno = errno;
+
+        pool_destroy(pool, 1);
+
+        errno = _errno;
+    }
+
+error_pool_new:
+error_stack_new:
+    extract_cleanup(reader);
+
+error_open:
+    return -1;
+}
+
+void b_reader_destroy(b_reader *reader) {
+    if (reader == NULL) return;
+
+    entry_destroy(reader->entry);
+    reader->entry = NULL;
+
+    extract_cleanup(reader);
+
+    if (reader->buf) {
+        b_buffer_destroy(reader->buf);
+        reader->buf = NULL;
+    }
+
+    if (reader->err) {
+        b_error_destroy(reader->err);
+        reader->err = NULL;
+    }
+
+    lafe_cleanup_exclusions(&reader->match);
+
+    reader->match = NULL;
+
+    free(reader);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_READER_H
+#define _B_READER_H
+
+#include <sys/types.h>
+#include "b_string.h"
+#include "b_stack.h"
+#include "b_header.h"
+#include "b_buffer.h"
+#include "b_error.h"
+
+#define B_READER_MAX_EXTENDED_SIZE (16 * 1024 * 1024)
+#define B_READER_MAX_THREADS       256
+#define B_READER_MAX_JOB_SIZE      (1024 * 1024)
+#define B_READER_MAX_QUEUED_SIZE   (64 * 1024 * 1024)
+#define B_READER_MAX_QUEUED_JOBS   64
+
+enum b_reader_options {
+    B_READER_NONE             = 0,
+    B_READER_QUIET            = 1 << 0,
+    B_READER_IGNORE_ERRORS    = 1 << 1,
+    B_READER_SAME_OWNER       = 1 << 2,
+    B_READER_SAME_PERMISSIONS = 1 << 3
+};
+
+/*
+ * A member as read from an archive, with the name and any other values given
+ * by GNU LongLink or PAX extended headers preceding it already applied to the
+ * header.
+ */
+typedef struct _b_reader_entry {
+    b_header * header;
+    b_string * path;
+    off_t      offset;
+    off_t      data_offset;
+    off_t      data_size;
+} b_reader_entry;
+
+/*
+ * The directory most recently extracted into, kept open between members.
+ */
+typedef struct _b_reader_dir {
+    b_string * path;
+    int        fd;
+} b_reader_dir;
+
+typedef struct _b_reader {
+    int                    fd;
+    int                    seekable;
+    int                    can_splice;
+    b_buffer *             buf;
+    size_t                 buf_off;
+    size_t                 buf_len;
+    off_t                  pos;
+    off_t                  data_left;
+    off_t                  remaining;
+    int                    eof;
+    int                    headers_only;
+    b_reader_entry *       entry;
+    struct lafe_matching * match;
+    b_error *              err;
+    enum b_reader_options  options;
+    mode_t                 umask;
+    size_t                 warnings;
+    int                    dest_fd;
+    b_reader_dir           parent;
+    size_t                 threads;
+    b_stack *              deferred_dirs;
+    b_stack *              deferred_links;
+} b_reader;
+
+b_reader * b_reader_new(size_t block_factor);
+
+void b_reader_set_options(
+    b_reader *            reader,
+    enum b_reader_options options
+);
+
+b_error * b_reader_get_error(b_reader *reader);
+
+void b_reader_set_threads(
+    b_reader * reader,
+    size_t     threads
+);
+
+int b_reader_set_fd(
+    b_reader * reader,
+    int        fd
+);
+
+int b_reader_is_excluded(
+    b_reader *   reader,
+    const char * path
+);
+
+int b_reader_include(
+    b_reader *   reader,
+    const char * pattern
+);
+
+int b_reader_include_from_file(
+    b_reader *   reader,
+    const char * file
+);
+
+int b_reader_exclude(
+    b_reader *   reader,
+    const char * pattern
+);
+
+int b_reader_exclude_from_file(
+    b_reader *   reader,
+    const char * file
+);
+
+int b_reader_next(
+    b_reader *        reader,
+    b_reader_entry ** entry
+);
+
+off_t b_reader_copy_data(
+    b_reader * reader,
+    int        fd
+);
+
+ssize_t b_reader_read_data(
+    b_reader * reader,
+    void *     data,
+    size_t     len
+);
+
+int b_reader_skip_data(b_reader *reader);
+
+ssize_t b_reader_write_index(
+    b_reader * reader,
+    int        fd
+);
+
+ssize_t b_reader_extract(
+    b_reader *   reader,
+    const char * dest
+);
+
+void b_reader_destroy(b_reader *reader);
+
+#endif /* _B_READER_H */
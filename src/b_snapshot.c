@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "b_string.h"
+#include "b_stack.h"
+#include "b_util.h"
+#include "b_snapshot.h"
+
+#ifdef __linux__
+#define B_SNAPSHOT_MTIME(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+#define B_SNAPSHOT_CTIME(st) ((int64_t)(st)->st_ctim.tv_sec * 1000000000 + (st)->st_ctim.tv_nsec)
+#else
+#define B_SNAPSHOT_MTIME(st) ((int64_t)(st)->st_mtime * 1000000000)
+#define B_SNAPSHOT_CTIME(st) ((int64_t)(st)->st_ctime * 1000000000)
+#endif
+
+/*
+ * A snapshot records the device, inode number, size, modification and change
+ * times of each member archived in a run, so that the next run may archive
+ * only those members which are new or have changed since, and list those
+ * which have since gone.  The previous snapshot is mapped into memory and
+ * searched in place, as it may well describe tens of millions of members.
+ */
+static int map_snapshot(b_snapshot *snapshot) {
+    b_snapshot_header *header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(snapshot->path->str, O_RDONLY)) < 0) {
+        /*
+         * Without a previous snapshot, every member is new.
+         */
+        if (errno == ENOENT) return 0;
+
+        goto error_open;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        goto error_map;
+    }
+
+    if (st.st_size < sizeof(b_snapshot_header)) {
+        errno = EINVAL;
+        goto error_map;
+    }
+
+    if ((snapshot->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        snapshot->map = NULL;
+        goto error_map;
+    }
+
+    snapshot->map_size = st.st_size;
+
+    close(fd);
+
+    header = snapshot->map;
+
+    if (memcmp(header->magic, B_SNAPSHOT_MAGIC, B_SNAPSHOT_MAGIC_SIZE) != 0
+      || header->count > (st.st_size - sizeof(*header)) / sizeof(b_snapshot_record)
+      || header->names_offset < sizeof(*header) + header->count * sizeof(b_snapshot_record)
+      || header->names_offset > st.st_size
+      || header->names_size > st.st_size - header->names_offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    snapshot->records = (b_snapshot_record *)(header + 1);
+    snapshot->names   = (const char *)snapshot->map + header->names_offset;
+    snapshot->count   = header->count;
+
+    if ((snapshot->seen = calloc((snapshot->count + 7) / 8 + 1, 1)) == NULL) {
+        return -1;
+    }
+
+    if ((snapshot->removed = calloc((snapshot->count + 7) / 8 + 1, 1)) == NULL) {
+        return -1;
+    }
+
+    return 0;
+
+error_map:
+    close(fd);
+
+error_open:
+    return -1;
+}
+
+b_snapshot *b_snapshot_open(const char *path) {
+    b_snapshot *snapshot;
+
+    if ((snapshot = calloc(1, sizeof(*snapshot))) == NULL) {
+        goto error_calloc;
+    }
+
+    if ((snapshot->path = b_string_new((char *)path)) == NULL) {
+        goto error_path;
+    }
+
+    if ((snapshot->chunks = b_stack_new(0)) == NULL) {
+        goto error_snapshot;
+    }
+
+    b_stack_set_destructor(snapshot->chunks, B_STACK_DESTRUCTOR(free));
+
+    if (map_snapshot(snapshot) < 0) {
+        goto error_snapshot;
+    }
+
+    return snapshot;
+
+error_snapshot:
+    b_snapshot_destroy(snapshot);
+
+    return NULL;
+
+error_path:
+    free(snapshot);
+
+error_calloc:
+    return NULL;
+}
+
+static inline int compare_names(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int ret = memcmp(a, b, a_len < b_len? a_len: b_len);
+
+    if (ret) return ret;
+
+    return a_len < b_len? -1: a_len > b_len;
+}
+
+static inline int record_valid(b_snapshot *snapshot, b_snapshot_record *record) {
+    size_t names_size = snapshot->map_size - (snapshot->names - (const char *)snapshot->map);
+
+    return record->name_offset <= names_size && record->name_len <= names_size - record->name_offset;
+}
+
+/*
+ * Find the index of the first record whose name does not sort before that
+ * given.
+ */
+static uint64_t lower_bound(b_snapshot *snapshot, const char *name, size_t len) {
+    uint64_t low = 0, high = snapshot->count;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        b_snapshot_record *record = &snapshot->records[mid];
+
+        if (!record_valid(snapshot, record)) {
+            return snapshot->count;
+        }
+
+        if (compare_names(snapshot->names + record->name_offset, record->name_len, name, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static b_snapshot_record *find_record(b_snapshot *snapshot, b_string *name, uint64_t *index) {
+    uint64_t low = 0, high = snapshot->count;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        b_snapshot_record *record = &snapshot->records[mid];
+        int cmp;
+
+        if (!record_valid(snapshot, record)) {
+            return NULL;
+        }
+
+        cmp = compare_names(name->str, name->len, snapshot->names + record->name_offset, record->name_len);
+
+        if (cmp == 0) {
+            *index = mid;
+
+            return record;
+        } else if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Keep a copy of a member name for the next snapshot.  Names are packed into
+ * large chunks, rather than allocated one by one.
+ */
+static const char *keep_name(b_snapshot *snapshot, b_string *name) {
+    char *chunk = b_stack_count(snapshot->chunks)? b_stack_item_at(snapshot->chunks, b_stack_count(snapshot->chunks) - 1): NULL;
+
+    if (chunk == NULL || snapshot->chunk_used + name->len > B_SNAPSHOT_CHUNK_SIZE) {
+        size_t size = name->len > B_SNAPSHOT_CHUNK_SIZE? name->len: B_SNAPSHOT_CHUNK_SIZE;
+
+        if ((chunk = malloc(size)) == NULL) {
+            return NULL;
+        }
+
+        if (b_stack_push(snapshot->chunks, chunk) == NULL) {
+            free(chunk);
+            return NULL;
+        }
+
+        snapshot->chunk_used = 0;
+    }
+
+    memcpy(chunk + snapshot->chunk_used, name->str, name->len);
+
+    snapshot->chunk_used += name->len;
+
+    return chunk + snapshot->chunk_used - name->len;
+}
+
+/*
+ * Compare the file given with its record in the snapshot, if any.
+ */
+static int record_changed(b_snapshot_record *record, struct stat *st) {
+    return record->dev   != st->st_dev
+        || record->ino   != st->st_ino
+        || record->size  != st->st_size
+        || record->mtime != B_SNAPSHOT_MTIME(st)
+        || record->ctime != B_SNAPSHOT_CTIME(st)
+        || (record->mode & S_IFMT) != (st->st_mode & S_IFMT);
+}
+
+/*
+ * Determine whether a member is new or has changed since the previous
+ * snapshot, returning 1 if so, or 0 if not.
+ */
+int b_snapshot_changed(b_snapshot *snapshot, b_string *name, struct stat *st) {
+    b_snapshot_record *record;
+    uint64_t index;
+
+    if ((record = find_record(snapshot, name, &index)) == NULL) {
+        return 1;
+    }
+
+    snapshot->seen[index / 8] |= 1 << (index % 8);
+
+    return record_changed(record, st);
+}
+
+/*
+ * As b_snapshot_changed(), without marking the member as seen.
+ */
+int b_snapshot_peek(b_snapshot *snapshot, b_string *name, struct stat *st) {
+    b_snapshot_record *record;
+    uint64_t index;
+
+    if ((record = find_record(snapshot, name, &index)) == NULL) {
+        return 1;
+    }
+
+    return record_changed(record, st);
+}
+
+static b_snapshot_entry *new_entry(b_snapshot *snapshot) {
+    if (snapshot->entries_count == snapshot->entries_size) {
+        size_t size = snapshot->entries_size? snapshot->entries_size * 2: 1024;
+        b_snapshot_entry *entries;
+
+        if ((entries = realloc(snapshot->entries, size * sizeof(*entries))) == NULL) {
+            return NULL;
+        }
+
+        snapshot->entries      = entries;
+        snapshot->entries_size = size;
+    }
+
+    return &snapshot->entries[snapshot->entries_count];
+}
+
+/*
+ * Record a member in the next snapshot, once it has been archived, or found
+ * not to have changed.
+ */
+int b_snapshot_add(b_snapshot *snapshot, b_string *name, struct stat *st) {
+    b_snapshot_entry *entry;
+
+    if ((entry = new_entry(snapshot)) == NULL) {
+        return -1;
+    }
+
+    if ((entry->name = keep_name(snapshot, name)) == NULL) {
+        return -1;
+    }
+
+    entry->name_len = name->len;
+    entry->mode     = st->st_mode;
+    entry->dev      = st->st_dev;
+    entry->ino      = st->st_ino;
+    entry->size     = st->st_size;
+    entry->mtime    = B_SNAPSHOT_MTIME(st);
+    entry->ctime    = B_SNAPSHOT_CTIME(st);
+
+    snapshot->entries_count++;
+
+    return 0;
+}
+
+/*
+ * Mark a snapshot as partial, for runs which visit only those members known
+ * to have changed.  Members of the previous snapshot not seen are then carried
+ * over to the next, unless explicitly removed.
+ */
+void b_snapshot_set_partial(b_snapshot *snapshot) {
+    snapshot->partial = 1;
+}
+
+/*
+ * Remove the member given from the next snapshot of a partial run, along with
+ * any members beneath it.
+ */
+int b_snapshot_remove(b_snapshot *snapshot, b_string *name) {
+    b_string *prefix;
+    uint64_t i;
+
+    if ((prefix = b_string_dup(name)) == NULL) {
+        return -1;
+    }
+
+    if (b_string_append_str(prefix, "/") == NULL) {
+        b_string_free(prefix);
+        return -1;
+    }
+
+    i = lower_bound(snapshot, name->str, name->len);
+
+    if (i < snapshot->count && compare_names(snapshot->names + snapshot->records[i].name_offset, snapshot->records[i].name_len, name->str, name->len) == 0) {
+        snapshot->removed[i / 8] |= 1 << (i % 8);
+    }
+
+    /*
+     * Members beneath the one given sort together, immediately after the
+     * first name starting with it.
+     */
+    for (i = lower_bound(snapshot, prefix->str, prefix->len); i < snapshot->count; i++) {
+        b_snapshot_record *record = &snapshot->records[i];
+
+        if (!record_valid(snapshot, record) || record->name_len < prefix->len) break;
+        if (memcmp(snapshot->names + record->name_offset, prefix->str, prefix->len) != 0) break;
+
+        snapshot->removed[i / 8] |= 1 << (i % 8);
+    }
+
+    b_string_free(prefix);
+
+    return 0;
+}
+
+/*
+ * Carry the members of the previous snapshot neither seen nor removed in a
+ * partial run over to the next.
+ */
+static int carry_over(b_snapshot *snapshot) {
+    uint64_t i;
+
+    for (i=0; i<snapshot->count; i++) {
+        b_snapshot_record *record = &snapshot->records[i];
+        b_snapshot_entry *entry;
+
+        if (snapshot->seen[i / 8] & (1 << (i % 8)))    continue;
+        if (snapshot->removed[i / 8] & (1 << (i % 8))) continue;
+        if (!record_valid(snapshot, record))           continue;
+
+        if ((entry = new_entry(snapshot)) == NULL) {
+            return -1;
+        }
+
+        entry->name     = snapshot->names + record->name_offset;
+        entry->name_len = record->name_len;
+        entry->mode     = record->mode;
+        entry->dev      = record->dev;
+        entry->ino      = record->ino;
+        entry->size     = record->size;
+        entry->mtime    = record->mtime;
+        entry->ctime    = record->ctime;
+
+        snapshot->entries_count++;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the names of members in the previous snapshot which were not seen in
+ * this run, or in a partial run, those removed, one per line, to the file
+ * descriptor given.
+ */
+int b_snapshot_write_deleted(b_snapshot *snapshot, int fd) {
+    b_string *buf;
+    uint64_t i;
+
+    if ((buf = b_string_new("")) == NULL) {
+        return -1;
+    }
+
+    for (i=0; i<snapshot->count; i++) {
+        b_snapshot_record *record = &snapshot->records[i];
+        b_string name;
+
+        if (snapshot->partial && !(snapshot->removed[i / 8] & (1 << (i % 8)))) continue;
+        if (!snapshot->partial && (snapshot->seen[i / 8] & (1 << (i % 8))))   continue;
+        if (!record_valid(snapshot, record))                                 continue;
+
+        name.str = (char *)snapshot->names + record->name_offset;
+        name.len = record->name_len;
+
+        if (b_string_append(buf, &name) == NULL || b_string_append_str(buf, "\n") == NULL) {
+            goto error;
+        }
+
+        if (buf->len >= B_SNAPSHOT_CHUNK_SIZE) {
+            if (b_write_all(fd, buf->str, buf->len) < 0) {
+                goto error;
+            }
+
+            buf->len    = 0;
+            buf->str[0] = '\0';
+        }
+    }
+
+    if (buf->len && b_write_all(fd, buf->str, buf->len) < 0) {
+        goto error;
+    }
+
+    b_string_free(buf);
+
+    return 0;
+
+error:
+    b_string_free(buf);
+
+    return -1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const b_snapshot_entry *entry_a = a;
+    const b_snapshot_entry *entry_b = b;
+
+    return compare_names(entry_a->name, entry_a->name_len, entry_b->name, entry_b->name_len);
+}
+
+/*
+ * Replace the previous snapshot with one of the members seen in this run.  The
+ * new snapshot is written alongside, and renamed into place once complete.
+ */
+int b_snapshot_save(b_snapshot *snapshot) {
+    b_snapshot_header header;
+    b_string *tmp;
+    FILE *fh;
+    size_t i, count = 0;
+    uint64_t offset = 0;
+
+    if (snapshot->partial && carry_over(snapshot) < 0) {
+        goto error_tmp;
+    }
+
+    qsort(snapshot->entries, snapshot->entries_count, sizeof(b_snapshot_entry), compare_entries);
+
+    /*
+     * Members archived twice over are recorded only once.
+     */
+    for (i=0; i<snapshot->entries_count; i++) {
+        if (i && compare_entries(&snapshot->entries[i-1], &snapshot->entries[i]) == 0) continue;
+
+        snapshot->entries[count++] = snapshot->entries[i];
+    }
+
+    snapshot->entries_count = count;
+
+    if ((tmp = b_string_dup(snapshot->path)) == NULL) {
+        goto error_tmp;
+    }
+
+    if (b_string_append_str(tmp, ".tmp") == NULL) {
+        goto error_fopen;
+    }
+
+    if ((fh = fopen(tmp->str, "w")) == NULL) {
+        goto error_fopen;
+    }
+
+    memset(&header, 0x00, sizeof(header));
+    memcpy(header.magic, B_SNAPSHOT_MAGIC, B_SNAPSHOT_MAGIC_SIZE);
+
+    header.count        = count;
+    header.names_offset = sizeof(header) + count * sizeof(b_snapshot_record);
+
+    for (i=0; i<count; i++) {
+        header.names_size += snapshot->entries[i].name_len;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fh) != 1) {
+        goto error_write;
+    }
+
+    for (i=0; i<count; i++) {
+        b_snapshot_entry *entry = &snapshot->entries[i];
+        b_snapshot_record record;
+
+        memset(&record, 0x00, sizeof(record));
+
+        record.name_offset = offset;
+        record.name_len    = entry->name_len;
+        record.mode        = entry->mode;
+        record.dev         = entry->dev;
+        record.ino         = entry->ino;
+        record.size        = entry->size;
+        record.mtime       = entry->mtime;
+        record.ctime       = entry->ctime;
+
+        if (fwrite(&record, sizeof(record), 1, fh) != 1) {
+            goto error_write;
+        }
+
+        offset += entry->name_len;
+    }
+
+    for (i=0; i<count; i++) {
+        if (fwrite(snapshot->entries[i].name, snapshot->entries[i].name_len, 1, fh) != 1) {
+            goto error_write;
+        }
+    }
+
+    if (fflush(fh) != 0 || fsync(fileno(fh)) < 0) {
+        goto error_write;
+    }
+
+    if (fclose(fh) != 0) {
+        goto error_fclose;
+    }
+
+    if (rename(tmp->str, snapshot->path->str) < 0) {
+        goto error_fclose;
+    }
+
+    b_string_free(tmp);
+
+    return 0;
+
+error_write:
+    fclose(fh);
+
+error_fclose:
+    unlink(tmp->str);
+
+error_fopen:
+    b_string_free(tmp);
+
+error_tmp:
+    return -1;
+}
+
+void b_snapshot_destroy(b_snapshot *snapshot) {
+    if (snapshot == NULL) return;
+
+    if (snapshot->map) {
+        munmap(snapshot->map, snapshot->map_size);
+        snapshot->map = NULL;
+    }
+
+    b_string_free(snapshot->path);
+    snapshot->path = NULL;
+
+    free(snapshot->seen);
+    snapshot->seen = NULL;
+
+    free(snapshot->removed);
+    snapshot->removed = NULL;
+
+    free(snapshot->entries);
+    snapshot->entries = NULL;
+
+    b_stack_destroy(snapshot->chunks);
+    snapshot->chunks = NULL;
+
+    free(snapshot);
+}
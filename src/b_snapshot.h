@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2019, cPanel, L.L.C.
+ * All rights reserved.
+ * http://cpanel.net/
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * same terms as Perl itself.  See the Perl manual section 'perlartistic' for
+ * further information.
+ */
+
+#ifndef _B_SNAPSHOT_H
+#define _B_SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "b_string.h"
+#include "b_stack.h"
+
+#define B_SNAPSHOT_MAGIC      "ATBSNAP1"
+#define B_SNAPSHOT_MAGIC_SIZE 8
+#define B_SNAPSHOT_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * A snapshot file consists of a header, followed by an array of fixed size
+ * records sorted by member name, followed by the member names themselves,
+ * so that it may be searched in place once mapped into memory.  Values are
+ * stored in native byte order.
+ */
+typedef struct _b_snapshot_header {
+    char     magic[B_SNAPSHOT_MAGIC_SIZE];
+    uint64_t count;
+    uint64_t names_offset;
+    uint64_t names_size;
+} b_snapshot_header;
+
+typedef struct _b_snapshot_record {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t mode;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime;
+    int64_t  ctime;
+} b_snapshot_record;
+
+/*
+ * A member seen during the current run, to be recorded in the next snapshot.
+ */
+typedef struct _b_snapshot_entry {
+    const char * name;
+    size_t       name_len;
+    mode_t       mode;
+    dev_t        dev;
+    ino_t        ino;
+    off_t        size;
+    int64_t      mtime;
+    int64_t      ctime;
+} b_snapshot_entry;
+
+typedef struct _b_snapshot {
+    b_string *          path;
+    void *              map;
+    size_t              map_size;
+    b_snapshot_record * records;
+    const char *        names;
+    uint64_t            count;
+    unsigned char *     seen;
+    unsigned char *     removed;
+    int                 partial;
+    b_snapshot_entry *  entries;
+    size_t              entries_count;
+    size_t              entries_size;
+    b_stack *           chunks;
+    size_t              chunk_used;
+} b_snapshot;
+
+b_snapshot * b_snapshot_open(const char *path);
+
+int b_snapshot_changed(
+    b_snapshot *  snapshot,
+    b_string *    name,
+    struct stat * st
+);
+
+int b_snapshot_peek(
+    b_snapshot *  snapshot,
+    b_string *    name,
+    struct stat * st
+);
+
+int b_snapshot_add(
+    b_snapshot *  snapshot,
+    b_string *    name,
+    struct stat * st
+);
+
+void b_snapshot_set_partial(b_snapshot *snapshot);
+
+int b_snapshot_remove(
+    b_snapshot * snapshot,
+    b_string *   name
+);
+
+int b_snapshot_write_deleted(
+    b_snapshot * snapshot,
+    int          fd
+);
+
+int b_snapshot_save(b_snapshot *snapshot);
+
+void b_snapshot_destroy(b_snapshot *snapshot);
+
+#endif /* _B_SNAPSHOT_H */
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -123,3 +124,162 @@ error_readlink:
 error_malloc_buf:
     return NULL;
 }
+
+/*
+ * Append the value given to the string as a quoted JSON string, escaping any
+ * characters which JSON requires to be escaped.  Bytes which are not valid
+ * UTF-8 are passed through as-is, as file names are not guaranteed to be.
+ */
+b_string *b_string_append_json(b_string *string, b_string *value) {
+    size_t i, start = 0;
+
+    if (b_string_append_str(string, "\"") == NULL) {
+        return NULL;
+    }
+
+    for (i=0; i<=value->len; i++) {
+        unsigned char c = i < value->len? value->str[i]: '\0';
+        char escaped[8];
+        b_string run;
+
+        if (i < value->len && c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+
+        /*
+         * Append the run of characters preceding this one which need no
+         * escaping in one go.
+         */
+        run.str = value->str + start;
+        run.len = i - start;
+
+        if (b_string_append(string, &run) == NULL) {
+            return NULL;
+        }
+
+        start = i + 1;
+
+        if (i == value->len) {
+            break;
+        }
+
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        } else {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        }
+
+        if (b_string_append_str(string, escaped) == NULL) {
+            return NULL;
+        }
+    }
+
+    return b_string_append_str(string, "\"");
+}
+
+/*
+ * Parse the JSON string at p, as written by b_string_append_json(), into a
+ * newly allocated string, returning a pointer to the character following it.
+ */
+char *b_string_parse_json(char *p, b_string **value) {
+    b_string *ret;
+    char *start;
+
+    if (*p++ != '"') return NULL;
+
+    if ((ret = b_string_new("")) == NULL) {
+        return NULL;
+    }
+
+    while (*p != '"') {
+        b_string run;
+        char c;
+
+        for (start = p; *p && *p != '"' && *p != '\\'; p++);
+
+        run.str = start;
+        run.len = p - start;
+
+        if (b_string_append(ret, &run) == NULL) {
+            goto error;
+        }
+
+        if (*p == '\0') {
+            goto error;
+        } else if (*p == '"') {
+            break;
+        }
+
+        switch (*++p) {
+            case '"':  c = '"';  break;
+            case '\\': c = '\\'; break;
+            case '/':  c = '/';  break;
+            case 'b':  c = '\b'; break;
+            case 'f':  c = '\f'; break;
+            case 'n':  c = '\n'; break;
+            case 'r':  c = '\r'; break;
+            case 't':  c = '\t'; break;
+
+            case 'u': {
+                char hex[5];
+                long code;
+
+                if (strlen(p + 1) < 4) goto error;
+
+                memcpy(hex, p + 1, 4);
+                hex[4] = '\0';
+
+                /*
+                 * Only the control characters escaped by
+                 * b_string_append_json() are expected here.
+                 */
+                if ((code = strtol(hex, NULL, 16)) > 0x7f) goto error;
+
+                c  = (char)code;
+                p += 4;
+
+                break;
+            }
+
+            default:
+                goto error;
+        }
+
+        run.str = &c;
+        run.len = 1;
+
+        if (b_string_append(ret, &run) == NULL) {
+            goto error;
+        }
+
+        p++;
+    }
+
+    *value = ret;
+
+    return p + 1;
+
+error:
+    b_string_free(ret);
+    errno = EINVAL;
+
+    return NULL;
+}
+
+int b_write_all(int fd, const void *data, size_t len) {
+    size_t off = 0;
+
+    while (off < len) {
+        ssize_t ret;
+
+        if ((ret = write(fd, (const unsigned char *)data + off, len - off)) < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        }
+
+        off += ret;
+    }
+
+    return 0;
+}
@@ -17,5 +17,8 @@
 
 b_string * b_string_join(char *sep, b_stack *items);
 b_string * b_readlink(b_string *path, struct stat *st);
+b_string * b_string_append_json(b_string *string, b_string *value);
+char *     b_string_parse_json(char *p, b_string **value);
+int        b_write_all(int fd, const void *data, size_t len);
 
 #endif /* _B_UTIL_H */
@@ -0,0 +1,133 @@
+#!/usr/bin/perl
+
+# Copyright (c) 2019 cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the
+# same terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use ExtUtils::testlib;
+
+use File::Temp ();
+use File::Path ();
+use File::Copy ();
+
+use Archive::Tar::Builder          ();
+use Archive::Tar::Builder::Journal ();
+
+use Test::More tests => 5;
+
+my $tar = '/bin/tar';
+
+if ( !-x $tar ) {
+    $tar = '/usr/bin/tar';
+}
+
+sub write_file {
+    my ( $path, $data ) = @_;
+
+    open( my $fh, '>>', $path ) or die("Unable to open $path for writing: $!");
+    print {$fh} $data;
+    close $fh;
+
+    return;
+}
+
+sub read_file {
+    my ($path) = @_;
+
+    open( my $fh, '<', $path ) or die("Unable to open $path for reading: $!");
+    local $/;
+    my $data = readline($fh);
+    close $fh;
+
+    return $data;
+}
+
+#
+# Archive $src, either walking it in full or driven by a journal, and return
+# the sorted member listing and deletions.
+#
+sub run_archive {
+    my ( $src, $tarfile, %opts ) = @_;
+
+    open my $fh,  '>', $tarfile           or die "Unable to open $tarfile for writing: $!";
+    open my $del, '>', "$tarfile.deleted" or die "Unable to open $tarfile.deleted for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new( $opts{'snapshot'} ? ( 'snapshot' => $opts{'snapshot'} ) : () );
+    $builder->set_handle($fh);
+    $builder->set_deletions_handle($del) if $opts{'snapshot'};
+
+    if ( $opts{'journal'} ) {
+        $builder->archive_journal( $opts{'journal'}, $src => 'src' );
+    }
+    else {
+        $builder->archive_as( $src => 'src' );
+    }
+
+    $builder->finish;
+
+    close $del;
+    close $fh;
+
+    my @listing = -s $tarfile ? `$tar -tf $tarfile 2>&1` : ();
+    my @deleted = split /\n/, read_file("$tarfile.deleted");
+
+    chomp @listing;
+
+    return ( [ sort @listing ], [ sort @deleted ] );
+}
+
+my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+my $journal_file = "$dest/journal";
+
+my $journal = eval {
+    my $journal = Archive::Tar::Builder::Journal->new($journal_file);
+    $journal->watch($src);
+    $journal;
+};
+
+SKIP: {
+    skip "fanotify is not available: $@", 5 unless $journal;
+
+    File::Path::mkpath( [ "$src/sub", "$src/other" ] );
+
+    write_file( "$src/$_", "$_ meow\n" ) foreach qw(a b sub/c other/d);
+
+    run_archive( $src, "$dest/full.tar", 'snapshot' => "$dest/snapshot.walk" );
+
+    File::Copy::copy( "$dest/snapshot.walk", "$dest/snapshot.journal" ) or die "Unable to copy snapshot: $!";
+
+    1 while $journal->record(100);
+
+    truncate $journal_file, 0;
+
+    write_file( "$src/a", "more meow\n" );
+    unlink "$src/sub/c";
+    rename "$src/b", "$src/b2";
+
+    mkdir "$src/new";
+    write_file( "$src/new/e", "new meow\n" );
+
+    1 while $journal->record(100);
+
+    my ( $walk_listing,    $walk_deleted )    = run_archive( $src, "$dest/walk.tar",    'snapshot' => "$dest/snapshot.walk" );
+    my ( $journal_listing, $journal_deleted ) = run_archive( $src, "$dest/journal.tar", 'snapshot' => "$dest/snapshot.journal", 'journal' => $journal_file );
+
+    is_deeply( $journal_listing, $walk_listing, '$builder->archive_journal() archives the same members as a full incremental walk' );
+    is_deeply( $journal_deleted, $walk_deleted, '$builder->archive_journal() lists the same deletions as a full incremental walk' );
+    is( read_file("$dest/snapshot.journal"), read_file("$dest/snapshot.walk"), '$builder->archive_journal() writes the same snapshot as a full incremental walk' );
+    is( -s $journal_file, 0, '$builder->finish() consumes the changes archived from the journal' );
+
+    write_file( $journal_file, qq({"type":"O"}\n) );
+
+    my ($listing) = run_archive( $src, "$dest/overflow.tar", 'journal' => $journal_file );
+
+    is( scalar @{$listing}, 8, '$builder->archive_journal() walks every path when the journal overflowed' );
+}
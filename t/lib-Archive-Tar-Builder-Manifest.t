@@ -0,0 +1,130 @@
+#!/usr/bin/perl
+
+# Copyright (c) 2019 cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the
+# same terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use ExtUtils::testlib;
+
+use File::Temp ();
+use File::Path ();
+
+use Archive::Tar::Builder           ();
+use Archive::Tar::Builder::Manifest ();
+
+use Test::More tests => 7;
+
+my $tar = '/bin/tar';
+
+if ( !-x $tar ) {
+    $tar = '/usr/bin/tar';
+}
+
+sub read_file {
+    my ($path) = @_;
+
+    open( my $fh, '<', $path ) or die("Unable to open $path for reading: $!");
+    local $/;
+    my $data = readline($fh);
+    close $fh;
+
+    return $data;
+}
+
+#
+# Archive $src to $tarfile, either directly or by way of the manifest given,
+# and return the contents of the archive.
+#
+sub run_archive {
+    my ( $src, $tarfile, $manifest, %opts ) = @_;
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+
+    if ($manifest) {
+        $builder->archive_manifest( $manifest, %opts );
+    }
+    else {
+        $builder->archive_as( $src => 'src' );
+    }
+
+    $builder->finish;
+
+    close $fh;
+
+    return read_file($tarfile);
+}
+
+my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+File::Path::mkpath("$src/dir/sub");
+
+my %files = (
+    'b'           => 'x' x 100,
+    'a'           => 'y' x 70000,
+    'dir/c'       => 'z' x 512,
+    'dir/sub/d'   => '',
+    'dir/sub/e'   => 'w' x 3,
+);
+
+foreach my $file ( keys %files ) {
+    open my $fh, '>', "$src/$file" or die "Unable to open $src/$file for writing: $!";
+    print {$fh} $files{$file};
+    close $fh;
+}
+
+symlink 'b' => "$src/link" or die "Unable to symlink() $src/link: $!";
+
+my $builder  = Archive::Tar::Builder->new;
+my $manifest = $builder->plan( $src => 'src' );
+
+is_deeply( [ $manifest->count, $manifest->total_size ], [ 9, 70615 ], '$builder->plan() records every member and the size of their contents' );
+
+my $expected = run_archive( $src, "$dest/direct.tar" );
+
+is( run_archive( $src, "$dest/planned.tar", $manifest ), $expected, '$builder->archive_manifest() writes the same archive as $builder->archive_as()' );
+
+my @progress;
+
+run_archive(
+    $src, "$dest/progress.tar", $manifest,
+    'prefetch' => 2,
+    'progress' => sub { push @progress, [@_] }
+);
+
+is_deeply( $progress[-1], [ 9, 70615 ], 'Progress is reported up to the full count and size of the manifest' );
+
+$manifest->save("$dest/manifest");
+
+my $loaded = Archive::Tar::Builder::Manifest->load("$dest/manifest");
+
+is( run_archive( $src, "$dest/loaded.tar", $loaded ), $expected, 'A manifest saved and loaded again writes the same archive' );
+
+$loaded->sort('name');
+
+run_archive( $src, "$dest/sorted.tar", $loaded );
+
+my @members = map { chomp; $_ } `$tar -tf $dest/sorted.tar`;
+
+is_deeply( \@members, [ sort @members ], 'Members are archived in the order to which the manifest was sorted' );
+
+$loaded->sort('physical');
+
+run_archive( $src, "$dest/physical.tar", $loaded );
+
+is_deeply( [ sort map { chomp; $_ } `$tar -tf $dest/physical.tar` ], [ sort @members ], 'Sorting a manifest by physical location archives the same members' );
+
+open my $fh, '>', "$dest/bogus" or die "Unable to open $dest/bogus for writing: $!";
+print {$fh} 'ATBMANI1' . ( "\xff" x 16 );
+close $fh;
+
+ok( !eval { Archive::Tar::Builder::Manifest->load("$dest/bogus"); 1 }, 'Archive::Tar::Builder::Manifest->load() refuses a malformed manifest' );
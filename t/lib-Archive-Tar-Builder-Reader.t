@@ -0,0 +1,225 @@
+#!/usr/bin/perl
+
+# Copyright (c) 2019 cPanel, L.L.C.
+# All rights reserved.
+# http://cpanel.net/
+#
+# This is free software; you can redistribute it and/or modify it under the
+# same terms as Perl itself.  See the LICENSE file for further details.
+
+use strict;
+use warnings;
+
+use ExtUtils::testlib;
+
+use File::Temp ();
+use File::Path ();
+
+use Archive::Tar::Builder         ();
+use Archive::Tar::Builder::Reader ();
+
+use Test::More tests => 22;
+use Test::Exception;
+
+sub write_file {
+    my ( $path, $data ) = @_;
+
+    open( my $fh, '>', $path ) or die("Unable to open $path for writing: $!");
+    print {$fh} $data;
+    close $fh;
+
+    return;
+}
+
+sub read_file {
+    my ($path) = @_;
+
+    open( my $fh, '<', $path ) or die("Unable to open $path for reading: $!");
+    local $/;
+    my $data = readline($fh);
+    close $fh;
+
+    return $data;
+}
+
+sub build_archive {
+    my ( $file, $opts, %members ) = @_;
+
+    open( my $fh, '>', $file ) or die("Unable to open $file for writing: $!");
+
+    my $builder = Archive::Tar::Builder->new( %{$opts} );
+    $builder->set_handle($fh);
+    $builder->archive_as(%members);
+    $builder->finish;
+
+    close $fh;
+
+    return;
+}
+
+sub open_reader {
+    my ( $file, %opts ) = @_;
+
+    open( my $fh, '<', $file ) or die("Unable to open $file for reading: $!");
+
+    my $reader = Archive::Tar::Builder::Reader->new( 'quiet' => 1, %opts );
+    $reader->set_handle($fh);
+
+    return ( $reader, $fh );
+}
+
+my $tmpdir = File::Temp::tempdir( 'CLEANUP' => 1 );
+my $src    = "$tmpdir/src";
+my $long   = 'd' x 120;
+
+File::Path::mkpath( ["$src/foo/bar", "$src/$long"] );
+
+write_file( "$src/foo/a.txt",      "hello\n" );
+write_file( "$src/foo/bar/b.bin",  join( '', map { chr( $_ % 251 ) } 0 .. 300_000 ) );
+write_file( "$src/$long/c",         "long\n" );
+chmod( 0640, "$src/foo/a.txt" );
+symlink( 'a.txt', "$src/foo/link" ) or die("Unable to create symlink: $!");
+
+my $archive = "$tmpdir/test.tar";
+
+build_archive( $archive, { 'gnu_extensions' => 1 }, "$src/foo" => 'foo', "$src/$long" => $long );
+
+#
+# Test listing of an archive
+#
+{
+    my ( $reader, $fh ) = open_reader($archive);
+
+    my @entries = $reader->list;
+    my %by_name = map { $_->{'name'} => $_ } @entries;
+
+    ok( exists $by_name{"$long/c"}, '$reader->list() reports names given by GNU LongLink headers' );
+    is( $by_name{'foo/bar/b.bin'}->{'size'}, 300_001, '$reader->list() reports member sizes' );
+    is( $by_name{'foo/link'}->{'linkdest'},  'a.txt', '$reader->list() reports symlink destinations' );
+    is( $by_name{'foo/a.txt'}->{'mode'},     0640,    '$reader->list() reports member permissions' );
+
+    seek( $fh, $by_name{'foo/a.txt'}->{'data_offset'}, 0 );
+    read( $fh, my $data, 6 );
+
+    is( $data, "hello\n", '$reader->list() reports offsets of member data' );
+}
+
+#
+# Test indexing of an archive written without one
+#
+{
+    my $indexed = "$tmpdir/indexed.tar";
+
+    open( my $out,   '>', $indexed )            or die("Unable to open $indexed for writing: $!");
+    open( my $index, '>', "$tmpdir/builder.idx" ) or die("Unable to open $tmpdir/builder.idx for writing: $!");
+
+    my $builder = Archive::Tar::Builder->new( 'gnu_extensions' => 1 );
+    $builder->set_handle($out);
+    $builder->set_index_handle($index);
+    $builder->archive_as( "$src/foo" => 'foo', "$src/$long" => $long );
+    $builder->finish;
+
+    close $out;
+    close $index;
+
+    my ( $reader, $fh ) = open_reader($indexed);
+
+    open( $index, '>', "$tmpdir/reader.idx" ) or die("Unable to open $tmpdir/reader.idx for writing: $!");
+
+    my $count = $reader->write_index($index);
+
+    close $index;
+
+    my @expected = map { s/,"dev":\d+,"ino":\d+//; $_ } split /\n/, read_file("$tmpdir/builder.idx");
+    my @got      = split /\n/, read_file("$tmpdir/reader.idx");
+
+    is( $count, scalar @expected, '$reader->write_index() returns the number of members indexed' );
+    is_deeply( \@got, \@expected, '$reader->write_index() writes the same index as Archive::Tar::Builder' );
+}
+
+#
+# Test extraction of an archive
+#
+{
+    my ( $reader, $fh ) = open_reader($archive);
+    my $dest = "$tmpdir/dest";
+
+    mkdir $dest;
+
+    my $count = $reader->extract($dest);
+
+    is( $count, 7, '$reader->extract() returns the number of members extracted' );
+    is( read_file("$dest/foo/bar/b.bin"), read_file("$src/foo/bar/b.bin"), '$reader->extract() restores file contents' );
+    is( read_file("$dest/$long/c"),       "long\n",                          '$reader->extract() restores members with long names' );
+    is( readlink("$dest/foo/link"),       'a.txt',                           '$reader->extract() restores symlinks' );
+    is( ( stat "$dest/foo/a.txt" )[9], ( stat "$src/foo/a.txt" )[9], '$reader->extract() restores modification times' );
+}
+
+#
+# Test extraction with multiple threads
+#
+{
+    my ( $reader, $fh ) = open_reader( $archive, 'threads' => 4 );
+    my $dest = "$tmpdir/threaded";
+
+    mkdir $dest;
+
+    my $count = $reader->extract($dest);
+
+    is( $count, 7, '$reader->extract() with "threads" returns the number of members extracted' );
+    is( read_file("$dest/foo/bar/b.bin"), read_file("$src/foo/bar/b.bin"), '$reader->extract() with "threads" restores file contents' );
+    is( readlink("$dest/foo/link"),       'a.txt',                           '$reader->extract() with "threads" restores symlinks' );
+    is( ( stat "$dest/foo" )[9], ( stat "$src/foo" )[9], '$reader->extract() with "threads" restores directory modification times' );
+}
+
+#
+# Test extraction from a pipe, with exclusions
+#
+{
+    my $dest = "$tmpdir/piped";
+
+    mkdir $dest;
+
+    open( my $fh, '-|', 'cat', $archive ) or die("Unable to spawn cat: $!");
+
+    my $reader = Archive::Tar::Builder::Reader->new( 'quiet' => 1 );
+    $reader->set_handle($fh);
+    $reader->exclude('*.txt');
+
+    $reader->extract($dest);
+
+    close $fh;
+
+    ok( -f "$dest/foo/bar/b.bin", '$reader->extract() extracts members read from a pipe' );
+    is( read_file("$dest/foo/bar/b.bin"), read_file("$src/foo/bar/b.bin"), '$reader->extract() restores file contents read from a pipe' );
+    ok( !-e "$dest/foo/a.txt", '$reader->extract() honors exclusions' );
+}
+
+#
+# Test that member names may not escape the destination directory
+#
+{
+    my $evil = "$tmpdir/evil.tar";
+
+    build_archive( $evil, {}, "$src/foo/a.txt" => '../escaped.txt', "$src/foo/bar/b.bin" => 'ok.bin' );
+
+    my $dest = "$tmpdir/evil";
+
+    mkdir $dest;
+
+    my ( $reader, $fh ) = open_reader($evil);
+
+    throws_ok {
+        $reader->extract($dest);
+    }
+    qr/Delayed nonzero exit status/, '$reader->extract() dies when a member name contains ".."';
+
+    ok( !-e "$tmpdir/escaped.txt", '$reader->extract() does not write outside of the destination' );
+
+    ( $reader, $fh ) = open_reader( $evil, 'ignore_errors' => 1 );
+
+    lives_ok {
+        $reader->extract($dest);
+    }
+    '$reader->extract() does not die on refused members when "ignore_errors" is set';
+}
@@ -22,7 +22,7 @@ use Errno;
 
 use Archive::Tar::Builder ();
 
-use Test::More tests => 74;
+use Test::More tests => 138;
 use Test::Exception;
 
 sub find_tar {
@@ -831,6 +831,33 @@ for my $test_mode (
     close $fh;
 }
 
+#
+# Test archiving a symlink whose name and target both need a GNU LongLink
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my $name   = 'n' x 120;
+    my $target = 't' x 120;
+
+    symlink $target => "$src/$name" or die "Unable to symlink $src/$name to $target: $!";
+
+    open my $fh, '>', "$dest/file.tar" or die "Unable to open $dest/file.tar for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new( 'gnu_extensions' => 1 );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/$name" => $name );
+    $builder->finish;
+
+    close $fh;
+
+    my @lines = `$tar -tvf $dest/file.tar 2>&1`;
+
+    ok( $? == 0 && @lines == 1 && $lines[0] =~ /\Q$name -> $target\E$/, 'tar lists a symlink whose name and target both need a GNU LongLink' );
+}
+
 #
 # Test hardlink preservation support
 #
@@ -907,3 +934,1116 @@ for my $test_mode (
 
     is( $signal => 0, "\$builder->archive() exits with no signal when archiving large numbers of hardlinked files" );
 }
+
+#
+# Test reading file contents through a read buffer larger than the output
+# buffer
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    foreach my $name (qw(foo bar)) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} join( '', map { chr } 0 .. 250 ) x 12_000, $name;
+        close $fh;
+    }
+
+    my $tarfile = "$dest/file.tar";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'block_factor' => 4,
+        'read_size'    => 1_000_000
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/foo" => 'foo', "$src/bar" => 'bar' );
+    $builder->finish;
+
+    close $fh;
+
+    is( system( $tar, '-C', $dest, '-xf', $tarfile ) => 0, 'tar extracted archive written with a read_size larger than block_factor' );
+
+    foreach my $name (qw(foo bar)) {
+        is( system( 'cmp', '-s', "$src/$name", "$dest/$name" ) => 0, "Contents of $name preserved when read with read_size" );
+    }
+}
+
+#
+# Test reading large files in parallel ranges
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my %SIZES = (
+        'large' => 12_000,
+        'small' => 10
+    );
+
+    foreach my $name ( sort keys %SIZES ) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} join( '', map { chr } 0 .. 250 ) x $SIZES{$name}, $name;
+        close $fh;
+    }
+
+    my $tarfile = "$dest/file.tar";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'read_threads'    => 4,
+        'read_chunk_size' => 100_000
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( map { ( "$src/$_" => $_ ) } sort keys %SIZES );
+    $builder->finish;
+
+    close $fh;
+
+    is( system( $tar, '-C', $dest, '-xf', $tarfile ) => 0, 'tar extracted archive written with read_threads' );
+
+    foreach my $name ( sort keys %SIZES ) {
+        is( system( 'cmp', '-s', "$src/$name", "$dest/$name" ) => 0, "Contents of $name preserved when read with read_threads" );
+    }
+}
+
+#
+# Test in-process compression of the archive stream
+#
+SKIP: {
+    skip( 'Archive::Tar::Builder built without zlib', 3 ) unless eval { Archive::Tar::Builder->new( 'compression' => 'gzip' ) };
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath("$src/foo/bar");
+
+    open my $fh, '>', "$src/foo/bar/baz" or die "Unable to open $src/foo/bar/baz for writing: $!";
+    print {$fh} "meow\n" x 100_000;
+    close $fh;
+
+    my $tarfile = "$dest/file.tar.gz";
+
+    open $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'compression' => 'gzip',
+        'level'       => 6
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/foo" => 'foo' );
+    $builder->finish;
+
+    close $fh;
+
+    open $fh, '<', $tarfile or die "Unable to open $tarfile for reading: $!";
+    read $fh, my $magic, 2;
+    close $fh;
+
+    is( $magic => "\x1f\x8b", 'Archive written with "compression" => "gzip" begins with gzip magic' );
+    is( system( $tar, '-C', $dest, '-xzf', $tarfile ) => 0, 'tar extracted gzip compressed archive' );
+    is( system( 'cmp', '-s', "$src/foo/bar/baz", "$dest/foo/bar/baz" ) => 0, 'File contents preserved in gzip compressed archive' );
+}
+
+#
+# Test compression of the archive stream in parallel blocks
+#
+SKIP: {
+    skip( 'Archive::Tar::Builder built without zlib', 2 ) unless eval { Archive::Tar::Builder->new( 'compression' => 'gzip' ) };
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    foreach my $i ( 1 .. 20 ) {
+        open my $fh, '>', "$src/file-$i" or die "Unable to open $src/file-$i for writing: $!";
+        print {$fh} "$i meow\n" x ( $i * 10_000 );
+        close $fh;
+    }
+
+    my $tarfile = "$dest/file.tar.gz";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'compression'            => 'gzip',
+        'compression_threads'    => 4,
+        'compression_block_size' => 65536
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( $src => 'src' );
+    $builder->finish;
+
+    close $fh;
+
+    is( system( $tar, '-C', $dest, '-xzf', $tarfile ) => 0, 'tar extracted archive compressed in parallel blocks' );
+    is( system( 'diff', '-r', $src, "$dest/src" ) => 0, 'File contents preserved in archive compressed in parallel blocks' );
+}
+
+#
+# Test cutting the compressed stream into independent frames at member
+# boundaries, described by a frame index
+#
+SKIP: {
+    skip( 'Archive::Tar::Builder built without zlib', 4 ) unless eval { Archive::Tar::Builder->new( 'compression' => 'gzip' ) };
+
+    throws_ok {
+        Archive::Tar::Builder->new( 'frame_size' => 65536 );
+    }
+    qr/requires 'compression'/, 'Archive::Tar::Builder->new() dies when "frame_size" is given without "compression"';
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    foreach my $i ( 1 .. 10 ) {
+        open my $fh, '>', "$src/file-$i" or die "Unable to open $src/file-$i for writing: $!";
+        print {$fh} "$i meow\n" x ( $i * 5_000 );
+        close $fh;
+    }
+
+    my $tarfile   = "$dest/file.tar.gz";
+    my $indexfile = "$dest/file.tar.gz.index";
+
+    open my $fh,      '>', $tarfile   or die "Unable to open $tarfile for writing: $!";
+    open my $indexfh, '>', $indexfile or die "Unable to open $indexfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'compression' => 'gzip',
+        'frame_size'  => 65536
+    );
+
+    $builder->set_handle($fh);
+    $builder->set_frame_index_handle($indexfh);
+    $builder->archive_as( map { ( "$src/file-$_" => "file-$_" ) } 1 .. 10 );
+    $builder->finish;
+
+    close $fh;
+    close $indexfh;
+
+    open $indexfh, '<', $indexfile or die "Unable to open $indexfile for reading: $!";
+    my @frames = map { { /"(\w+)":"?([^",}]*)/g } } <$indexfh>;
+    close $indexfh;
+
+    cmp_ok( scalar @frames, '>', 1, 'Archive with "frame_size" was cut into multiple frames' );
+    is( system( $tar, '-C', $dest, '-xzf', $tarfile ) => 0, 'tar extracted archive cut into frames' );
+
+    open $fh, '<', $tarfile or die "Unable to open $tarfile for reading: $!";
+
+    my $ok = 1;
+
+    foreach my $frame (@frames) {
+        my $framefile = "$dest/frame.gz";
+
+        seek $fh, $frame->{'offset'}, 0;
+        read $fh, my $data, $frame->{'size'};
+
+        open my $framefh, '>', $framefile or die "Unable to open $framefile for writing: $!";
+        print {$framefh} $data;
+        close $framefh;
+
+        my ($first) = `gzip -dc < $framefile | $tar -tf - 2>/dev/null`;
+        chomp $first if defined $first;
+
+        $ok = 0 unless defined $first && $first eq $frame->{'first_member'};
+    }
+
+    close $fh;
+
+    ok( $ok, 'Each frame decompresses independently, beginning with the first member listed in the index' );
+}
+
+#
+# Test storing rather than compressing members which appear incompressible
+#
+SKIP: {
+    skip( 'Archive::Tar::Builder built without zlib', 4 ) unless eval { Archive::Tar::Builder->new( 'compression' => 'gzip' ) };
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    srand(1);
+
+    #
+    # photo.jpg is as compressible as the text files, but is judged by its name
+    # alone; random is judged by its contents.
+    #
+    foreach my $name (qw( photo.jpg random text-1 text-2 )) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+
+        if ( $name eq 'random' ) {
+            print {$fh} pack( 'C*', map { int rand 256 } 1 .. 262_144 );
+        }
+        else {
+            print {$fh} substr( "$name meow\n" x 50_000, 0, 262_144 );
+        }
+
+        close $fh;
+    }
+
+    my $tarfile = "$dest/file.tar.gz";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'compression'        => 'gzip',
+        'compression_bypass' => 1
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( $src => 'src' );
+    $builder->finish;
+
+    close $fh;
+
+    is( system( $tar, '-C', $dest, '-xzf', $tarfile ) => 0, 'tar extracted archive written with "compression_bypass"' );
+    is( system( 'diff', '-r', $src, "$dest/src" ) => 0, 'File contents preserved in archive written with "compression_bypass"' );
+
+    my $size = -s $tarfile;
+
+    ok( $size >= 2 * 262_144 && $size < 2 * 262_144 + 16_384, 'Only the members judged incompressible were stored uncompressed' );
+
+    #
+    # Files too small to be probed must not inherit the setting chosen for
+    # the incompressible member written before them.
+    #
+    File::Path::mkpath( ["$src/small"] );
+
+    foreach my $i ( 1 .. 50 ) {
+        open my $fh, '>', "$src/small/text-$i" or die "Unable to open $src/small/text-$i for writing: $!";
+        print {$fh} substr( "text-$i meow\n" x 3_000, 0, 30_720 );
+        close $fh;
+    }
+
+    open $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    $builder = Archive::Tar::Builder->new(
+        'compression'        => 'gzip',
+        'compression_bypass' => 1
+    );
+
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/random" => 'random', "$src/small" => 'small' );
+    $builder->finish;
+
+    close $fh;
+
+    $size = -s $tarfile;
+
+    ok( $size < 262_144 + 65_536, 'Small members following an incompressible one are compressed' );
+}
+
+#
+# Test that frames ended to change the zstd compression level for members
+# which appear incompressible are each described in the frame index
+#
+SKIP: {
+    skip( 'Archive::Tar::Builder built without zstd', 3 ) unless eval { Archive::Tar::Builder->new( 'compression' => 'zstd' ) };
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    srand(1);
+
+    foreach my $name (qw( text-1 random text-2 )) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+
+        if ( $name eq 'random' ) {
+            print {$fh} pack( 'C*', map { int rand 256 } 1 .. 262_144 );
+        }
+        else {
+            print {$fh} "$name meow\n" x 50_000;
+        }
+
+        close $fh;
+    }
+
+    my $tarfile   = "$dest/file.tar.zst";
+    my $indexfile = "$dest/file.tar.zst.index";
+
+    open my $fh,      '>', $tarfile   or die "Unable to open $tarfile for writing: $!";
+    open my $indexfh, '>', $indexfile or die "Unable to open $indexfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'compression'        => 'zstd',
+        'compression_bypass' => 1,
+        'frame_size'         => 1 << 30
+    );
+
+    $builder->set_handle($fh);
+    $builder->set_frame_index_handle($indexfh);
+    $builder->archive_as( map { ( "$src/$_" => $_ ) } qw( text-1 random text-2 ) );
+    $builder->finish;
+
+    close $fh;
+    close $indexfh;
+
+    open $indexfh, '<', $indexfile or die "Unable to open $indexfile for reading: $!";
+    my @frames = map { { /"(\w+)":"?([^",}]*)/g } } <$indexfh>;
+    close $indexfh;
+
+    is_deeply( [ map { $_->{'first_member'} } @frames ] => [qw( text-1 random text-2 )], 'Frame index lists each frame ended to change the compression level' );
+
+    open $fh, '<', $tarfile or die "Unable to open $tarfile for reading: $!";
+
+    my $ok = 1;
+
+    foreach my $frame (@frames) {
+        seek $fh, $frame->{'offset'}, 0;
+        read $fh, my $magic, 4;
+
+        $ok = 0 unless $magic eq "\x28\xb5\x2f\xfd";
+    }
+
+    close $fh;
+
+    ok( $ok, 'Each frame listed in the index begins with a zstd frame header' );
+
+    my ($random) = grep { $_->{'first_member'} eq 'random' } @frames;
+
+    ok( $random && $random->{'size'} < $random->{'raw_size'} + 1_024, 'Incompressible member was written at the fastest level without growing' );
+}
+
+#
+# Test writing a member index alongside the archive, and appending it to the
+# archive as a final member
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath("$src/foo");
+
+    foreach my $i ( 1 .. 5 ) {
+        open my $fh, '>', "$src/foo/file-$i" or die "Unable to open $src/foo/file-$i for writing: $!";
+        print {$fh} "$i meow\n" x ( $i * 1_000 );
+        close $fh;
+    }
+
+    my $tarfile   = "$dest/file.tar";
+    my $indexfile = "$dest/file.tar.index";
+
+    open my $fh,      '>', $tarfile   or die "Unable to open $tarfile for writing: $!";
+    open my $indexfh, '>', $indexfile or die "Unable to open $indexfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new(
+        'index_member' => '.index'
+    );
+
+    $builder->set_handle($fh);
+    $builder->set_index_handle($indexfh);
+    $builder->archive_as( "$src/foo" => 'foo' );
+    $builder->finish;
+
+    close $fh;
+    close $indexfh;
+
+    open $indexfh, '<', $indexfile or die "Unable to open $indexfile for reading: $!";
+    my @lines   = <$indexfh>;
+    my @members = map { { /"(\w+)":"?([^",}]*)/g } } @lines;
+    close $indexfh;
+
+    is( scalar @members => 6, 'Member index lists each member written' );
+
+    open $fh, '<', $tarfile or die "Unable to open $tarfile for reading: $!";
+
+    my $ok = 1;
+
+    foreach my $member (@members) {
+        next unless $member->{'type'} eq '0';
+
+        seek $fh, $member->{'data_offset'}, 0;
+        read $fh, my $data, $member->{'size'};
+
+        my ($i) = $member->{'name'} =~ /file-(\d+)$/;
+
+        $ok = 0 unless $data eq "$i meow\n" x ( $i * 1_000 );
+    }
+
+    close $fh;
+
+    ok( $ok, 'Member index gives the offset and size of each member\'s contents' );
+
+    my @listing = `$tar -tf $tarfile`;
+    chomp @listing;
+
+    is( $listing[-1] => '.index', 'Member index appended to the archive as its final member with "index_member"' );
+
+    is( system( $tar, '-C', $dest, '-xf', $tarfile, '.index' ) => 0, 'tar extracted index member' );
+    is( system( 'cmp', '-s', $indexfile, "$dest/.index" ) => 0, 'Index member matches the index written to the index handle' );
+}
+
+#
+# Test appending members to an existing archive
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    foreach my $name (qw(first second)) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} "$name meow\n" x 1_000;
+        close $fh;
+    }
+
+    my $tarfile = "$dest/file.tar";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/first" => 'first' );
+    $builder->finish;
+
+    close $fh;
+
+    open $fh, '+<', $tarfile or die "Unable to open $tarfile for appending: $!";
+
+    my $indexfile = "$dest/file.tar.index";
+
+    open my $indexfh, '>', $indexfile or die "Unable to open $indexfile for writing: $!";
+
+    $builder = Archive::Tar::Builder->new;
+    $builder->open_for_append($fh);
+    $builder->set_index_handle($indexfh);
+    $builder->archive_as( "$src/second" => 'second' );
+    $builder->finish;
+
+    close $fh;
+    close $indexfh;
+
+    my @listing = `$tar -tf $tarfile`;
+    chomp @listing;
+
+    is_deeply( \@listing, [qw(first second)], '$builder->open_for_append() adds members after those already present' );
+
+    is( system( $tar, '-C', $dest, '-xf', $tarfile ) => 0, 'tar extracted appended archive' );
+    is( system( 'cmp', '-s', "$src/second", "$dest/second" ) => 0, 'Appended member contents preserved' );
+
+    open $indexfh, '<', $indexfile or die "Unable to open $indexfile for reading: $!";
+    my ($offset) = readline($indexfh) =~ /"offset":(\d+)/;
+    close $indexfh;
+
+    is( $offset => 512 + 512 * 22, '$builder->open_for_append() continues member offsets from the end of the existing archive' );
+
+    open $fh, '+<', $tarfile or die "Unable to open $tarfile for appending: $!";
+
+    $builder = Archive::Tar::Builder->new( 'compression' => 'gzip' );
+
+    throws_ok {
+        $builder->open_for_append($fh);
+    }
+    qr/Cannot append to a compressed archive/, '$builder->open_for_append() dies when "compression" is in effect';
+
+    close $fh;
+}
+
+#
+# Test filtering and merging existing archives
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath( [ "$src/foo", "$src/bar" ] );
+
+    foreach my $name (qw(foo/small.txt foo/large bar/other)) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} "$name meow\n" x ( $name eq 'foo/large' ? 100_000 : 10 );
+        close $fh;
+    }
+
+    foreach my $name (qw(foo bar)) {
+        open my $fh, '>', "$dest/$name.tar" or die "Unable to open $dest/$name.tar for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new;
+        $builder->set_handle($fh);
+        $builder->archive_as( "$src/$name" => $name );
+        $builder->finish;
+
+        close $fh;
+    }
+
+    my $tarfile = "$dest/merged.tar";
+
+    open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+    $builder->exclude('*.txt');
+
+    foreach my $input ( [ 'foo' ], [ 'bar', 'bar' => 'baz/bar' ] ) {
+        my ( $name, %renames ) = @{$input};
+
+        open my $in, '<', "$dest/$name.tar" or die "Unable to open $dest/$name.tar for reading: $!";
+        $builder->archive_handle( $in, %renames );
+        close $in;
+    }
+
+    $builder->finish;
+
+    close $fh;
+
+    my @listing = `$tar -tf $tarfile 2>&1`;
+    chomp @listing;
+
+    is_deeply( [ sort @listing ], [ sort qw(foo/ foo/large baz/bar/ baz/bar/other) ], '$builder->archive_handle() merges archives, honoring exclusions and renames' );
+
+    my $out = "$dest/out";
+
+    mkdir $out;
+
+    is( system( $tar, '-C', $out, '-xf', $tarfile ) => 0, 'tar extracted merged archive' );
+    is( system( 'cmp', '-s', "$src/foo/large", "$out/foo/large" ) => 0, 'Contents of large members preserved in merged archive' );
+    is( system( 'cmp', '-s', "$src/bar/other", "$out/baz/bar/other" ) => 0, 'Contents of small members preserved in merged archive' );
+}
+
+#
+# Test that renaming members of an existing archive renames the targets of its
+# hardlinks along with them
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    mkdir "$src/a";
+
+    open my $fh, '>', "$src/a/x" or die "Unable to open $src/a/x for writing: $!";
+    print {$fh} "meow\n";
+    close $fh;
+
+    link "$src/a/x" => "$src/a/y" or die "Unable to link $src/a/x to $src/a/y: $!";
+
+    open $fh, '>', "$dest/a.tar" or die "Unable to open $dest/a.tar for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new( 'preserve_hardlinks' => 1 );
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/a" => 'a' );
+    $builder->finish;
+
+    close $fh;
+
+    open $fh, '>', "$dest/b.tar" or die "Unable to open $dest/b.tar for writing: $!";
+
+    $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+
+    open my $in, '<', "$dest/a.tar" or die "Unable to open $dest/a.tar for reading: $!";
+    $builder->archive_handle( $in, 'a' => 'b' );
+    close $in;
+
+    $builder->finish;
+
+    close $fh;
+
+    my $out = "$dest/out";
+
+    mkdir $out;
+
+    is( system( $tar, '-C', $out, '-xf', "$dest/b.tar" ) => 0, 'tar extracted renamed archive containing hardlinks' );
+    is( ( stat "$out/b/x" )[1], ( stat "$out/b/y" )[1], 'Hardlinks point to the renamed member' );
+}
+
+#
+# Test incremental archives driven by a snapshot file
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my $snapshot = "$dest/snapshot";
+
+    mkdir "$src/dir";
+
+    foreach my $name (qw(dir/a dir/b dir/c)) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} "$name meow\n";
+        close $fh;
+    }
+
+    my $run = sub {
+        my ($tarfile) = @_;
+
+        open my $fh,  '>', $tarfile           or die "Unable to open $tarfile for writing: $!";
+        open my $del, '>', "$tarfile.deleted" or die "Unable to open $tarfile.deleted for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new( 'snapshot' => $snapshot );
+        $builder->set_handle($fh);
+        $builder->set_deletions_handle($del);
+        $builder->archive_as( "$src/dir" => 'dir' );
+        $builder->finish;
+
+        close $del;
+        close $fh;
+
+        my @listing = -s $tarfile ? `$tar -tf $tarfile 2>&1` : ();
+        chomp @listing;
+
+        open $del, '<', "$tarfile.deleted" or die "Unable to open $tarfile.deleted for reading: $!";
+        my @deleted = <$del>;
+        close $del;
+        chomp @deleted;
+
+        return ( [ sort @listing ], \@deleted );
+    };
+
+    my ($listing) = $run->("$dest/full.tar");
+
+    is_deeply( $listing, [qw(dir/ dir/a dir/b dir/c)], 'First run against a missing snapshot archives every member' );
+
+    open my $fh, '>>', "$src/dir/b" or die "Unable to open $src/dir/b for appending: $!";
+    print {$fh} "more meow\n";
+    close $fh;
+
+    open $fh, '>', "$src/dir/d" or die "Unable to open $src/dir/d for writing: $!";
+    print {$fh} "new meow\n";
+    close $fh;
+
+    unlink "$src/dir/c";
+
+    my $deleted;
+
+    ( $listing, $deleted ) = $run->("$dest/incremental.tar");
+
+    is_deeply( $listing, [qw(dir/ dir/b dir/d)], 'Next run archives only new and changed members' );
+    is_deeply( $deleted, ['dir/c'], 'Members gone since the previous run are listed as deleted' );
+
+    ( $listing, $deleted ) = $run->("$dest/unchanged.tar");
+
+    is_deeply( [ @{$listing}, @{$deleted} ], [], 'Run against an unchanged tree archives and deletes nothing' );
+}
+
+#
+# Test reusing unchanged members from a previous archive
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my %contents = (
+        'large' => "large meow\n" x 10_000,
+        'small' => "small meow\n",
+        'perms' => "perms meow\n",
+    );
+
+    foreach my $name ( keys %contents ) {
+        open my $fh, '>', "$src/$name" or die "Unable to open $src/$name for writing: $!";
+        print {$fh} $contents{$name};
+        close $fh;
+
+        chmod 0644, "$src/$name";
+    }
+
+    open my $fh,       '>', "$dest/previous.tar"   or die "Unable to open $dest/previous.tar for writing: $!";
+    open my $index_fh, '>', "$dest/previous.index" or die "Unable to open $dest/previous.index for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+    $builder->set_index_handle($index_fh);
+    $builder->archive_as( $src => 'src' );
+    $builder->finish;
+
+    close $index_fh;
+    close $fh;
+
+    #
+    # Mark the contents of each member within the previous archive, so that
+    # those copied from it rather than read anew may be told apart.
+    #
+    open $index_fh, '<', "$dest/previous.index" or die "Unable to open $dest/previous.index for reading: $!";
+    open $fh,       '+<', "$dest/previous.tar"  or die "Unable to open $dest/previous.tar for writing: $!";
+
+    while ( my $line = readline $index_fh ) {
+        next unless $line =~ /"name":"src\/\w+".*"data_offset":(\d+)/;
+
+        seek $fh, $1, 0;
+        print {$fh} 'MARK';
+    }
+
+    close $fh;
+    close $index_fh;
+
+    chmod 0600, "$src/perms";
+
+    open my $previous_fh, '<', "$dest/previous.tar"   or die "Unable to open $dest/previous.tar for reading: $!";
+    open $index_fh,       '<', "$dest/previous.index" or die "Unable to open $dest/previous.index for reading: $!";
+    open $fh,             '>', "$dest/next.tar"       or die "Unable to open $dest/next.tar for writing: $!";
+
+    $builder = Archive::Tar::Builder->new;
+    $builder->set_handle($fh);
+    $builder->reuse_from( $previous_fh, $index_fh );
+    $builder->archive_as( $src => 'src' );
+    $builder->finish;
+
+    close $fh;
+    close $index_fh;
+    close $previous_fh;
+
+    my $out = "$dest/out";
+
+    mkdir $out;
+
+    is( system( $tar, '-C', $out, '-xf', "$dest/next.tar" ) => 0, 'tar extracted archive reusing members of a previous one' );
+
+    my %found = map {
+        open my $in, '<', "$out/src/$_" or die "Unable to open $out/src/$_ for reading: $!";
+        local $/;
+        ( $_ => substr( readline($in), 0, 4 ) );
+    } keys %contents;
+
+    is_deeply( [ @found{qw(large small)} ], [qw(MARK MARK)], '$builder->reuse_from() copies unchanged members from the previous archive' );
+    is_deeply( [ $found{'perms'}, ( stat "$out/src/perms" )[2] & 07777 ], [ 'perm', 0600 ], '$builder->reuse_from() reads members whose permissions changed anew' );
+}
+
+#
+# Test filtering items by their inode attributes
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    mkdir "$src/dir";
+
+    my %files = (
+        'small'     => 'x' x 16,
+        'large'     => 'x' x 65536,
+        'old'       => 'x' x 16,
+        'dir/small' => 'x' x 16
+    );
+
+    foreach my $file ( keys %files ) {
+        open my $fh, '>', "$src/$file" or die "Unable to open $src/$file for writing: $!";
+        print {$fh} $files{$file};
+        close $fh;
+    }
+
+    symlink 'small' => "$src/link" or die "Unable to symlink() $src/link: $!";
+
+    utime 86400, 86400, "$src/old" or die "Unable to utime() $src/old: $!";
+
+    my $list = sub {
+        my (%filter) = @_;
+
+        open my $fh, '>', "$dest/filtered.tar" or die "Unable to open $dest/filtered.tar for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new;
+        $builder->set_handle($fh);
+        $builder->set_filter(%filter);
+        $builder->archive_as( $src => 'src' );
+        $builder->finish;
+
+        close $fh;
+
+        return [] unless -s "$dest/filtered.tar";
+
+        return [ sort map { chomp; s{/$}{}; $_ } `$tar -tf $dest/filtered.tar` ];
+    };
+
+    is_deeply( $list->( 'max_size' => 1024 ), [qw(src src/dir src/dir/small src/link src/old src/small)], '$builder->set_filter() excludes regular files larger than max_size' );
+    is_deeply( $list->( 'mtime_after' => 86401 ), [qw(src src/dir src/dir/small src/large src/link src/small)], '$builder->set_filter() excludes items modified before mtime_after' );
+    is_deeply( $list->( 'types' => ['file'] ), [qw(src/dir/small src/large src/old src/small)], '$builder->set_filter() descends into directories whose type is filtered out' );
+}
+
+#
+# Test estimating the size of an archive without writing it
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my $long = join '/', ('a' x 60) x 4;
+
+    File::Path::mkpath("$src/$long");
+
+    foreach my $file ( 'empty', 'small', 'large', "$long/file" ) {
+        open my $fh, '>', "$src/$file" or die "Unable to open $src/$file for writing: $!";
+        print {$fh} 'x' x ( { 'empty' => 0, 'small' => 100, 'large' => 70000 }->{$file} // 513 );
+        close $fh;
+    }
+
+    link "$src/large" => "$src/hardlink" or die "Unable to link() $src/large: $!";
+    symlink $long => "$src/symlink"       or die "Unable to symlink() $src/symlink: $!";
+    symlink $long => "$src/$long/symlink" or die "Unable to symlink() $src/$long/symlink: $!";
+
+    foreach my $extensions (qw(gnu_extensions posix_extensions)) {
+        my %opts = ( $extensions => 1, 'preserve_hardlinks' => 1 );
+
+        my $builder  = Archive::Tar::Builder->new(%opts);
+        my $estimate = $builder->estimate_size( $src => 'src' );
+
+        open my $fh, '>', "$dest/$extensions.tar" or die "Unable to open $dest/$extensions.tar for writing: $!";
+
+        $builder->set_handle($fh);
+        $builder->archive_as( $src => 'src' );
+        $builder->finish;
+
+        close $fh;
+
+        is_deeply( $estimate, { 'size' => -s "$dest/$extensions.tar", 'files' => 7, 'dirs' => 5 }, "\$builder->estimate_size() gives the exact size of an archive with $extensions" );
+    }
+}
+
+#
+# Test visiting directory entries in order of inode number
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    mkdir "$src/dir";
+
+    foreach my $name ( map { sprintf 'file-%03d', $_ } 1 .. 100 ) {
+        open my $fh, '>', "$src/dir/$name" or die "Unable to open $src/dir/$name for writing: $!";
+        close $fh;
+    }
+
+    open my $fh, '>', "$dest/sorted.tar" or die "Unable to open $dest/sorted.tar for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new( 'sort_inodes' => 1 );
+    $builder->set_handle($fh);
+    $builder->archive_as( "$src/dir" => 'dir' );
+    $builder->finish;
+
+    close $fh;
+
+    opendir my $dh, "$src/dir" or die "Unable to open $src/dir: $!";
+    my @expected = map { "dir/$_" } sort { ( stat "$src/dir/$a" )[1] <=> ( stat "$src/dir/$b" )[1] } grep { !/^\./ } readdir $dh;
+    closedir $dh;
+
+    my @members = map { chomp; $_ } `$tar -tf $dest/sorted.tar`;
+
+    is_deeply( \@members, [ 'dir/', @expected ], 'sort_inodes archives the entries of each directory in order of inode number' );
+}
+
+#
+# Test walking trees deeper than the number of file descriptors available
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    my $deep = join '/', ('d') x 100;
+
+    File::Path::mkpath("$src/$deep");
+
+    for my $depth ( 1, 50, 100 ) {
+        my $dir = join '/', $src, ('d') x $depth;
+
+        open my $fh, '>', "$dir/file" or die "Unable to open $dir/file for writing: $!";
+        close $fh;
+    }
+
+    my $run = sub {
+        my ($max_open_dirs) = @_;
+
+        my $pid = fork;
+
+        if ( $pid == 0 ) {
+            open STDERR, '>', '/dev/null' unless $max_open_dirs;
+
+            exec 'sh', '-c', 'ulimit -n 32 && exec "$@"', 'sh', $^X, '-Mblib', '-MArchive::Tar::Builder', '-e', q{
+                my ( $src, $tarfile, $max_open_dirs ) = @ARGV;
+
+                open my $fh, '>', $tarfile or die "Unable to open $tarfile for writing: $!";
+
+                my $builder = Archive::Tar::Builder->new( 'quiet' => 1, 'gnu_extensions' => 1, 'max_open_dirs' => $max_open_dirs );
+                $builder->set_handle($fh);
+                $builder->archive_as( $src => 'src' );
+                $builder->finish;
+            }, $src, "$dest/deep-$max_open_dirs.tar", $max_open_dirs;
+
+            exit 1;
+        }
+
+        waitpid $pid, 0;
+
+        return $? == 0 ? [ sort map { chomp; $_ } `$tar -tf $dest/deep-$max_open_dirs.tar` ] : undef;
+    };
+
+    ok( !defined $run->(0), 'Walking a tree deeper than the file descriptors available fails without max_open_dirs' );
+    is( scalar @{ $run->(8) || [] }, 104, 'max_open_dirs allows walking a tree deeper than the file descriptors available' );
+}
+
+#
+# Test staying on one filesystem, and skipping filesystems by type
+#
+SKIP: {
+    skip( '/proc is not mounted', 2 ) unless -d '/proc/self';
+
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    open my $fh, '>', "$src/file" or die "Unable to open $src/file for writing: $!";
+    close $fh;
+
+    symlink '/proc', "$src/proc" or die "Unable to symlink $src/proc: $!";
+
+    my %cases = (
+        'one_file_system' => [ 'one_file_system' => 1 ],
+        'skip_fstypes'    => [ 'skip_fstypes' => ['proc'] ],
+    );
+
+    foreach my $name ( sort keys %cases ) {
+        open my $fh, '>', "$dest/$name.tar" or die "Unable to open $dest/$name.tar for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new( 'follow_symlinks' => 1, @{ $cases{$name} } );
+        $builder->set_handle($fh);
+        $builder->archive_as( $src => 'src' );
+        $builder->finish;
+
+        close $fh;
+
+        my @members = sort map { chomp; $_ } `$tar -tf $dest/$name.tar`;
+
+        is_deeply( \@members, [ 'src/', 'src/file', 'src/proc/' ], "$name archives a mount point without descending into it" );
+    }
+}
+
+throws_ok {
+    Archive::Tar::Builder->new( 'skip_fstypes' => ['nosuchfs'] );
+}
+qr/Unknown filesystem type 'nosuchfs'/, 'new() dies when given an unknown filesystem type to skip';
+
+#
+# Test excluding the contents of tagged directories
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath( [ map { "$src/$_" } qw( keep tagged/sub under/sub cache/sub fake ) ] );
+
+    my %files = (
+        'keep/file'           => 'data',
+        'tagged/.notar'       => '',
+        'tagged/file'         => 'data',
+        'tagged/sub/file'     => 'data',
+        'under/.notar-under'  => '',
+        'under/sub/file'      => 'data',
+        'cache/CACHEDIR.TAG'  => "Signature: 8a477f597d28d172789f06886806bc55\n# A cache directory tag\n",
+        'cache/sub/file'      => 'data',
+        'fake/CACHEDIR.TAG'   => "Not a signature\n",
+        'fake/file'           => 'data',
+    );
+
+    foreach my $file ( keys %files ) {
+        open my $fh, '>', "$src/$file" or die "Unable to open $src/$file for writing: $!";
+        print {$fh} $files{$file};
+        close $fh;
+    }
+
+    open my $fh, '>', "$dest/tagged.tar" or die "Unable to open $dest/tagged.tar for writing: $!";
+
+    my $builder = Archive::Tar::Builder->new;
+    $builder->exclude_tag('.notar');
+    $builder->exclude_tag_under('.notar-under');
+    $builder->exclude_caches;
+    $builder->set_handle($fh);
+    $builder->archive_as( $src => 'src' );
+    $builder->finish;
+
+    close $fh;
+
+    my @members = sort map { chomp; $_ } `$tar -tf $dest/tagged.tar`;
+
+    is_deeply(
+        \@members,
+        [
+            qw(
+              src/ src/cache/ src/cache/CACHEDIR.TAG src/fake/ src/fake/CACHEDIR.TAG src/fake/file
+              src/keep/ src/keep/file src/tagged/ src/tagged/.notar src/under/
+              )
+        ],
+        'exclude_tag(), exclude_tag_under() and exclude_caches() exclude the contents of tagged directories'
+    );
+
+    throws_ok {
+        $builder->exclude_tag('foo/bar');
+    }
+    qr/Cannot add exclusion tag 'foo\/bar'/, 'exclude_tag() dies when given a name with a slash';
+}
+
+#
+# Test that following symlinks walks each directory only once
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath( ["$src/dir/real"] );
+
+    open my $fh, '>', "$src/dir/real/file" or die "Unable to open $src/dir/real/file for writing: $!";
+    close $fh;
+
+    symlink 'real', "$src/dir/link" or die "Unable to symlink $src/dir/link: $!";
+    symlink '..',   "$src/dir/real/up" or die "Unable to symlink $src/dir/real/up: $!";
+
+    my @warnings;
+
+    {
+        local $SIG{'__WARN__'} = sub { push @warnings, @_ };
+
+        open my $fh, '>', "$dest/followed.tar" or die "Unable to open $dest/followed.tar for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new( 'follow_symlinks' => 1, 'ignore_errors' => 1 );
+        $builder->set_handle($fh);
+        $builder->archive_as( "$src/dir" => 'dir' );
+        $builder->finish;
+
+        close $fh;
+    }
+
+    like( join( '', @warnings ), qr{/up: Directory cycle detected}, 'Following a symlink to a directory being walked raises a warning' );
+
+    my @listing = map { chomp; $_ } `$tar -tvf $dest/followed.tar`;
+    my @files   = grep { m{/file$} } map { ( split /\s+/ )[-1] } grep { !/ -> / } @listing;
+    my @links   = map { ( split /\s+/ )[-3] } grep { / -> / } @listing;
+
+    my ($walked) = map { m{^(.*)/file$} } @files;
+
+    is( scalar @files, 1, 'Following symlinks archives the contents of a directory reached twice only once' );
+    is_deeply( [ sort @links ], [ sort( "$walked/up", $walked eq 'dir/real' ? 'dir/link' : 'dir/real' ) ], 'Directories reached again by way of symlinks are archived as symlinks' );
+}
+
+#
+# Test archiving each inode only once across overlapping paths
+#
+{
+    my $src  = File::Temp::tempdir( 'CLEANUP' => 1 );
+    my $dest = File::Temp::tempdir( 'CLEANUP' => 1 );
+
+    File::Path::mkpath( ["$src/sub"] );
+
+    foreach my $file (qw( file sub/file )) {
+        open my $fh, '>', "$src/$file" or die "Unable to open $src/$file for writing: $!";
+        print {$fh} 'data';
+        close $fh;
+    }
+
+    my $archive = sub {
+        my ( $name, $opts, @calls ) = @_;
+
+        open my $fh, '>', "$dest/$name.tar" or die "Unable to open $dest/$name.tar for writing: $!";
+
+        my $builder = Archive::Tar::Builder->new( 'dedupe' => 1, %{$opts} );
+        $builder->set_handle($fh);
+        $builder->archive_as( @{$_} ) foreach @calls;
+        $builder->finish;
+
+        close $fh;
+
+        return map { chomp; $_ } `$tar -tvf $dest/$name.tar`;
+    };
+
+    my @members = map { ( split /\s+/ )[-1] } $archive->( 'overlap', {}, [ $src => 'a', "$src/sub" => 'b' ], [ "$src/sub/file" => 'c' ] );
+
+    is_deeply( [ sort @members ], [qw( a/ a/file a/sub/ a/sub/file )], 'dedupe passes over paths archived already, in the same call or an earlier one' );
+
+    my @listing = $archive->( 'hardlink', { 'preserve_hardlinks' => 1 }, [ $src => 'a', "$src/file" => 'copy' ] );
+
+    ok( ( grep { m{^h.* copy link to a/file$} } @listing ), 'dedupe with preserve_hardlinks archives files reached again as hardlinks' );
+}